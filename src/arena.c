@@ -0,0 +1,181 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "include/arena.h"
+#include "include/render.h" /* DIE() */
+
+#define ALIGN_UP(N) (((N) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* The allocations start after the header of each chunk */
+#define CHUNK_HDR       ALIGN_UP(sizeof(ArenaChunk))
+#define CHUNK_DATA(C)   ((uint8_t*)(C) + CHUNK_HDR)
+#define CHUNK_FREE(C)   ((C)->size - (C)->used)
+
+static atomic_uint_fast64_t total_allocs, total_mallocs;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+/*----------------------------------------------------------------------------*/
+
+void arena_init(Arena* arena) {
+    arena->head    = NULL;
+    arena->spare   = NULL;
+    arena->allocs  = 0;
+    arena->mallocs = 0;
+}
+
+/* Keep the chunk as the spare if it's the biggest one, or free it */
+static void keep_chunk(Arena* arena, ArenaChunk* chunk) {
+    if (chunk->size > ARENA_KEEP_MAX) {
+        free(chunk);
+    } else if (!arena->spare) {
+        arena->spare = chunk;
+    } else if (chunk->size > arena->spare->size) {
+        free(arena->spare);
+        arena->spare = chunk;
+    } else {
+        free(chunk);
+    }
+}
+
+static void flush_stats(Arena* arena) {
+    atomic_fetch_add(&total_allocs, arena->allocs);
+    atomic_fetch_add(&total_mallocs, arena->mallocs);
+    arena->allocs  = 0;
+    arena->mallocs = 0;
+}
+
+void arena_destroy(Arena* arena) {
+    arena_rewind(arena, (ArenaMark){ NULL, 0 });
+    free(arena->spare);
+    arena->spare = NULL;
+}
+
+/* Make a chunk with at least `size' free bytes the head of the arena */
+static ArenaChunk* push_chunk(Arena* arena, size_t size) {
+    ArenaChunk* chunk = arena->spare;
+
+    if (chunk && chunk->size >= size) {
+        arena->spare = NULL;
+    } else {
+        size_t chunk_sz = arena->head ? 2 * arena->head->size : ARENA_MIN_CHUNK;
+        if (chunk_sz < size)
+            chunk_sz = size;
+
+        chunk = malloc(CHUNK_HDR + chunk_sz);
+        if (!chunk)
+            DIE("Can't allocate %zu bytes of scratch memory\n", chunk_sz);
+
+        chunk->size = chunk_sz;
+        arena->mallocs++;
+    }
+
+    chunk->used = 0;
+    chunk->prev = arena->head;
+    arena->head = chunk;
+    return chunk;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = ALIGN_UP(size);
+
+    ArenaChunk* chunk = arena->head;
+    if (!chunk || CHUNK_FREE(chunk) < size)
+        chunk = push_chunk(arena, size);
+
+    void* ret = CHUNK_DATA(chunk) + chunk->used;
+    chunk->used += size;
+    arena->allocs++;
+    return ret;
+}
+
+void* arena_grow(Arena* arena, void* ptr, size_t old_sz, size_t new_sz) {
+    if (!ptr)
+        return arena_alloc(arena, new_sz);
+
+    old_sz = ALIGN_UP(old_sz);
+    new_sz = ALIGN_UP(new_sz);
+
+    /* The last allocation ends where the free space of the head starts */
+    ArenaChunk* chunk = arena->head;
+    if ((uint8_t*)ptr + old_sz == CHUNK_DATA(chunk) + chunk->used &&
+        new_sz - old_sz <= CHUNK_FREE(chunk)) {
+        chunk->used += new_sz - old_sz;
+        arena->allocs++;
+        return ptr;
+    }
+
+    void* ret = arena_alloc(arena, new_sz);
+    memcpy(ret, ptr, old_sz);
+    return ret;
+}
+
+ArenaMark arena_mark(const Arena* arena) {
+    return (ArenaMark){
+        .chunk = arena->head,
+        .used  = arena->head ? arena->head->used : 0,
+    };
+}
+
+void arena_rewind(Arena* arena, ArenaMark mark) {
+    while (arena->head != mark.chunk) {
+        ArenaChunk* chunk = arena->head;
+        arena->head       = chunk->prev;
+        keep_chunk(arena, chunk);
+    }
+
+    if (arena->head)
+        arena->head->used = mark.used;
+
+    flush_stats(arena);
+}
+
+void arena_reset(Arena* arena) {
+    /* Usually there is a single chunk, which becomes the spare */
+    arena_rewind(arena, (ArenaMark){ NULL, 0 });
+
+    if (arena->spare) {
+        arena->head       = arena->spare;
+        arena->head->prev = NULL;
+        arena->head->used = 0;
+        arena->spare      = NULL;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void thread_arena_free(void* arg) {
+    arena_destroy(arg);
+    free(arg);
+}
+
+static void thread_key_init(void) {
+    if (pthread_key_create(&thread_key, thread_arena_free) != 0)
+        DIE("Can't create the thread arena key\n");
+}
+
+Arena* arena_thread(void) {
+    pthread_once(&thread_once, thread_key_init);
+
+    Arena* arena = pthread_getspecific(thread_key);
+    if (arena)
+        return arena;
+
+    arena = malloc(sizeof(Arena));
+    if (!arena || pthread_setspecific(thread_key, arena) != 0)
+        DIE("Can't allocate the thread arena\n");
+
+    arena_init(arena);
+    return arena;
+}
+
+void arena_totals(uint64_t* allocs, uint64_t* mallocs) {
+    *allocs  = atomic_load(&total_allocs);
+    *mallocs = atomic_load(&total_mallocs);
+}
@@ -0,0 +1,188 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "include/bandenc.h"
+#include "include/render.h" /* DIE() */
+
+/* Bytes of each RGBA pixel, used by the Sub filter */
+#define PIXEL_SZ 4
+
+/* PNG filter types */
+#define FILTER_SUB 1
+#define FILTER_UP  2
+
+/* Free space in the output before each call to deflate() */
+#define DEFLATE_CHUNK (64 * 1024)
+
+static const uint8_t png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+/*----------------------------------------------------------------------------*/
+
+void byte_buf_reserve(ByteBuf* buf, size_t extra) {
+    if (buf->size + extra <= buf->cap)
+        return;
+
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->size + extra)
+        cap *= 2;
+
+    uint8_t* data = realloc(buf->data, cap);
+    if (!data)
+        DIE("Can't grow the output buffer to %zu bytes\n", cap);
+
+    buf->data = data;
+    buf->cap  = cap;
+}
+
+void byte_buf_append(ByteBuf* buf, const void* data, size_t size) {
+    byte_buf_reserve(buf, size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void append_u32(ByteBuf* buf, uint32_t val) {
+    const uint8_t bytes[4] = { val >> 24, val >> 16, val >> 8, val };
+    byte_buf_append(buf, bytes, sizeof(bytes));
+}
+
+size_t png_chunk_begin(ByteBuf* buf, const char* type) {
+    const size_t start = buf->size;
+    append_u32(buf, 0);
+    byte_buf_append(buf, type, 4);
+    return start;
+}
+
+void png_chunk_end(ByteBuf* buf, size_t start) {
+    const uint32_t len = buf->size - start - 8;
+    uint8_t* p         = buf->data + start;
+    p[0]               = len >> 24;
+    p[1]               = len >> 16;
+    p[2]               = len >> 8;
+    p[3]               = len;
+
+    append_u32(buf, crc32(0, buf->data + start + 4, len + 4));
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool band_encoder_init(BandEncoder* enc, size_t row_sz) {
+    memset(&enc->zs, 0, sizeof(enc->zs));
+    if (deflateInit2(&enc->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    enc->row_sz   = row_sz;
+    enc->filtered = malloc(row_sz + 1);
+    enc->other    = malloc(row_sz + 1);
+    if (!enc->filtered || !enc->other) {
+        band_encoder_destroy(enc);
+        return false;
+    }
+
+    return true;
+}
+
+void band_encoder_destroy(BandEncoder* enc) {
+    deflateEnd(&enc->zs);
+    free(enc->filtered);
+    free(enc->other);
+    enc->filtered = NULL;
+    enc->other    = NULL;
+}
+
+/* Filter the row with Sub, and also with Up if there is a row above. Returns
+ * the one with the smallest sum of absolute values. */
+static const uint8_t* filter_row(BandEncoder* enc, const uint8_t* row,
+                                 const uint8_t* prev) {
+    uint8_t* sub      = enc->filtered + 1;
+    uint8_t* up       = enc->other + 1;
+    const size_t size = enc->row_sz;
+
+    enc->filtered[0] = FILTER_SUB;
+    enc->other[0]    = FILTER_UP;
+
+    memcpy(sub, row, PIXEL_SZ);
+    for (size_t i = PIXEL_SZ; i < size; i++)
+        sub[i] = row[i] - row[i - PIXEL_SZ];
+
+    if (!prev)
+        return enc->filtered;
+
+    /* The values are signed, see the filter heuristics of libpng */
+    uint64_t sub_sum = 0, up_sum = 0;
+    for (size_t i = 0; i < size; i++) {
+        up[i] = row[i] - prev[i];
+        sub_sum += abs((int8_t)sub[i]);
+        up_sum += abs((int8_t)up[i]);
+    }
+
+    return (up_sum < sub_sum) ? enc->other : enc->filtered;
+}
+
+/* Compress the data into the buffer */
+static void deflate_to(BandEncoder* enc, ByteBuf* out, const uint8_t* data,
+                       size_t size, int flush) {
+    enc->zs.next_in  = (Bytef*)data;
+    enc->zs.avail_in = size;
+
+    do {
+        byte_buf_reserve(out, DEFLATE_CHUNK);
+        enc->zs.next_out  = out->data + out->size;
+        enc->zs.avail_out = out->cap - out->size;
+
+        deflate(&enc->zs, flush);
+        out->size = out->cap - enc->zs.avail_out;
+    } while (enc->zs.avail_out == 0);
+}
+
+uint32_t band_encode(BandEncoder* enc, uint8_t* const* rows,
+                     uint32_t num_rows, ByteBuf* out) {
+    const size_t start = png_chunk_begin(out, "IDAT");
+    uint32_t adler     = adler32(0, NULL, 0);
+
+    /* Start from an empty window, without the bytes of other bands */
+    deflateReset(&enc->zs);
+
+    for (uint32_t y = 0; y < num_rows; y++) {
+        const uint8_t* filtered =
+          filter_row(enc, rows[y], y > 0 ? rows[y - 1] : NULL);
+        adler = adler32(adler, filtered, enc->row_sz + 1);
+
+        deflate_to(enc, out, filtered, enc->row_sz + 1,
+                   y + 1 == num_rows ? Z_FULL_FLUSH : Z_NO_FLUSH);
+    }
+
+    png_chunk_end(out, start);
+    return adler;
+}
+
+void png_start_image(ByteBuf* out, uint32_t w_px, uint32_t h_px) {
+    byte_buf_append(out, png_signature, sizeof(png_signature));
+
+    /* 8-bit RGBA, default compression and filtering, not interlaced */
+    size_t start = png_chunk_begin(out, "IHDR");
+    append_u32(out, w_px);
+    append_u32(out, h_px);
+    byte_buf_append(out, "\x08\x06\x00\x00\x00", 5);
+    png_chunk_end(out, start);
+
+    /* Deflate with a 32 KiB window and the default level */
+    start = png_chunk_begin(out, "IDAT");
+    byte_buf_append(out, "\x78\x9C", 2);
+    png_chunk_end(out, start);
+}
+
+void png_finish_image(ByteBuf* out, uint32_t adler) {
+    /* Empty final block with fixed codes */
+    size_t start = png_chunk_begin(out, "IDAT");
+    byte_buf_append(out, "\x03\x00", 2);
+    append_u32(out, adler);
+    png_chunk_end(out, start);
+
+    start = png_chunk_begin(out, "IEND");
+    png_chunk_end(out, start);
+}
@@ -0,0 +1,729 @@
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <malloc.h>
+
+#include "include/batch.h"
+#include "include/arena.h"
+#include "include/cache.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/sink.h"
+#include "include/budget.h"
+#include "include/fileio.h"
+#include "include/util.h"
+
+/* Allocations bigger than this use mmap() when there is a memory budget */
+#define MMAP_THRESHOLD (128 * 1024)
+
+/* Part of the memory budget used for the sources read ahead */
+#define PREFETCH_BUDGET_DIV 8
+
+/* Part of the memory budget used for the finished images waiting for the
+ * writer */
+#define SINK_BUDGET_DIV 8
+
+/* Bytes of finished images kept in memory for the writer without a budget */
+#define SINK_DEFAULT_PENDING_BYTES (64 * 1024 * 1024)
+
+/* A file that has been split in bands. The last band to finish encodes it */
+typedef struct {
+    Canvas canvas;
+    char* src;
+    uint64_t seq;
+    const char* name;
+    atomic_int bands_left;
+
+    /* Reserved in the memory budget, released by the last band */
+    size_t reserved;
+
+    /* Used if there is a cache */
+    Hash128 key;
+} SplitFile;
+
+enum EJobType {
+    JOB_FILE,
+    JOB_BAND,
+};
+
+typedef struct {
+    enum EJobType type;
+
+    /* JOB_FILE */
+    const BatchFile* file;
+    uint64_t seq;
+
+    /* JOB_BAND */
+    SplitFile* split;
+    size_t offset, size;
+    uint32_t first_line;
+    int state;
+} Job;
+
+/*
+ * Each worker owns a deque. The owner pushes and pops from the bottom, so it
+ * keeps working on the bands of the file it just split while they are hot,
+ * and idle workers steal from the top.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    Job* jobs;
+    size_t top, bottom, cap;
+} Deque;
+
+typedef struct {
+    Deque* deques;
+    int num_workers;
+    Sink* sink;
+
+    /* Can be NULL if there is no memory limit */
+    MemBudget* budget;
+
+    /* Reads the sources ahead of the workers, indexed by sequence number */
+    Prefetcher* prefetch;
+
+    /* Can be NULL if the images are not cached */
+    RenderCache* cache;
+
+    /* Jobs pushed but not finished yet. Jobs that push other jobs increase it
+     * before finishing, so it only reaches zero when everything is done. */
+    atomic_size_t jobs_left;
+
+    /* Idle workers sleep until the epoch changes or all jobs are done */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    uint64_t epoch;
+
+    atomic_int rendered, skipped, split, steals, banded;
+} Pool;
+
+typedef struct {
+    Pool* pool;
+    int id;
+} Worker;
+
+/*----------------------------------------------------------------------------*/
+
+static void deque_init(Deque* deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->jobs   = NULL;
+    deque->top    = 0;
+    deque->bottom = 0;
+    deque->cap    = 0;
+}
+
+static void deque_destroy(Deque* deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->jobs);
+}
+
+static void deque_push(Deque* deque, const Job* job) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom >= deque->cap) {
+        /* Move the jobs to the start before growing */
+        const size_t num = deque->bottom - deque->top;
+        if (deque->top > 0)
+            memmove(deque->jobs, deque->jobs + deque->top, num * sizeof(Job));
+        deque->top    = 0;
+        deque->bottom = num;
+
+        if (num >= deque->cap / 2) {
+            deque->cap  = deque->cap ? deque->cap * 2 : 64;
+            deque->jobs = realloc(deque->jobs, deque->cap * sizeof(Job));
+            if (!deque->jobs)
+                DIE("Can't grow the job queue\n");
+        }
+    }
+
+    deque->jobs[deque->bottom++] = *job;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool deque_pop(Deque* deque, Job* job) {
+    bool ret = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *job = deque->jobs[--deque->bottom];
+        ret  = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return ret;
+}
+
+static bool deque_steal(Deque* deque, Job* job) {
+    bool ret = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *job = deque->jobs[deque->top++];
+        ret  = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return ret;
+}
+
+/* Push a job to the deque of a worker, and wake up the idle ones */
+static void pool_push(Pool* pool, int worker, const Job* job) {
+    atomic_fetch_add(&pool->jobs_left, 1);
+    deque_push(&pool->deques[worker], job);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->epoch++;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/* Get a job from our deque or steal one from the others. Returns false when
+ * all the jobs are done */
+static bool pool_get(Pool* pool, int id, Job* job) {
+    for (;;) {
+        pthread_mutex_lock(&pool->idle_lock);
+        const uint64_t epoch = pool->epoch;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (deque_pop(&pool->deques[id], job))
+            return true;
+
+        /* Start with the next worker, so the thieves are spread out */
+        for (int i = 1; i < pool->num_workers; i++) {
+            const int victim = (id + i) % pool->num_workers;
+            if (deque_steal(&pool->deques[victim], job)) {
+                atomic_fetch_add(&pool->steals, 1);
+                return true;
+            }
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (pool->epoch == epoch && atomic_load(&pool->jobs_left) > 0)
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        const bool done = atomic_load(&pool->jobs_left) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (done)
+            return false;
+    }
+}
+
+static void pool_job_done(Pool* pool) {
+    if (atomic_fetch_sub(&pool->jobs_left, 1) != 1)
+        return;
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Split the file in bands of BAND_LINES lines, and push a job for each one.
+ * The lexer state at the start of each band is found with a quick scan. */
+static void split_file(Pool* pool, int id, const BatchFile* file,
+                       uint64_t seq, char* src, size_t src_sz,
+                       const Canvas* canvas, size_t reserved, Hash128 key) {
+    SplitFile* split = malloc(sizeof(SplitFile));
+    if (!split)
+        DIE("Can't allocate split file \"%s\"\n", file->path);
+
+    split->canvas = *canvas;
+    split->src    = src;
+    split->seq    = seq;
+    split->name     = file->name;
+    split->reserved = reserved;
+    split->key      = key;
+    canvas_alloc(&split->canvas);
+
+    /* Only lines ending in a newline are drawn, see source_to_png() */
+    const uint32_t num_bands = (canvas->h + BAND_LINES - 1) / BAND_LINES;
+    atomic_init(&split->bands_left, num_bands);
+
+    int state         = HL_DEFAULT;
+    size_t band_start = 0, pos = 0;
+    uint32_t line     = 0;
+
+    for (uint32_t band = 0; band < num_bands; band++) {
+        const uint32_t first_line = line;
+        const int first_state     = state;
+
+        while (line < canvas->h && line - first_line < BAND_LINES) {
+            pos = (const char*)memchr(src + pos, '\n', src_sz - pos) - src + 1;
+            line++;
+        }
+
+        state = highlight_text_state(src + band_start, pos - band_start, state);
+
+        const Job job = {
+            .type       = JOB_BAND,
+            .split      = split,
+            .offset     = band_start,
+            .size       = pos - band_start,
+            .first_line = first_line,
+            .state      = first_state,
+        };
+        pool_push(pool, id, &job);
+
+        band_start = pos;
+    }
+
+    atomic_fetch_add(&pool->split, 1);
+}
+
+static void release(Pool* pool, size_t size) {
+    if (pool->budget)
+        budget_release(pool->budget, size);
+}
+
+/* Add the image to the cache, if any, and hand it to the sink */
+static void submit_png(Pool* pool, uint64_t seq, const char* name,
+                       Hash128 key, void* png, size_t png_sz) {
+    if (pool->cache)
+        cache_store(pool->cache, key, png, png_sz);
+
+    sink_submit(pool->sink, seq, name, png, png_sz);
+}
+
+/* Render a file that would never fit in the memory budget, with as many rows
+ * in memory as half of the budget allows */
+static void run_banded(Pool* pool, const Job* job, char* src, size_t src_sz,
+                       Canvas* canvas, Hash128 key) {
+    MemBudget* budget = pool->budget;
+
+    const size_t fixed    = src_sz + canvas_mem_estimate(canvas, 0);
+    const size_t line_mem = canvas_mem_estimate(canvas, FONT_H + LINE_SPACING) -
+                            canvas_mem_estimate(canvas, 0);
+
+    uint32_t band_lines = 1;
+    if (budget->limit / 2 > fixed)
+        band_lines = (budget->limit / 2 - fixed) / line_mem;
+    if (band_lines < 1)
+        band_lines = 1;
+    if (band_lines > canvas->h)
+        band_lines = canvas->h;
+
+    /* Best effort if not even a single line fits */
+    size_t reserved = fixed + (band_lines + 2) * line_mem;
+    if (reserved > budget->limit)
+        reserved = budget->limit;
+
+    budget_reserve(budget, reserved);
+
+    size_t png_sz;
+    void* png = render_banded_to_mem(canvas, src, src_sz, band_lines, &png_sz);
+    free(src);
+
+    submit_png(pool, job->seq, job->file->name, key, png, png_sz);
+    budget_release(budget, reserved);
+
+    atomic_fetch_add(&pool->rendered, 1);
+    atomic_fetch_add(&pool->banded, 1);
+}
+
+static void run_file_job(Pool* pool, int id, const Job* job) {
+    const BatchFile* file = job->file;
+
+    size_t src_sz;
+    char* src = prefetch_take(pool->prefetch, job->seq, &src_sz);
+    if (!src || !is_text_data(src, src_sz)) {
+        fprintf(stderr, "Skipping \"%s\": %s\n", file->path,
+                src ? "binary file" : "can't read file");
+        sink_submit(pool->sink, job->seq, file->name, NULL, 0);
+        atomic_fetch_add(&pool->skipped, 1);
+        free(src);
+        return;
+    }
+
+    Hash128 key = { 0 };
+    if (pool->cache) {
+        key = cache_key(pool->cache, src, src_sz);
+
+        size_t png_sz;
+        void* png = cache_load(pool->cache, key, &png_sz);
+        if (png) {
+            free(src);
+            sink_submit(pool->sink, job->seq, file->name, png, png_sz);
+            return;
+        }
+    }
+
+    Canvas canvas;
+    canvas_init(&canvas);
+    input_get_dimensions(&canvas, src, src_sz);
+
+    /* Reserve the memory for the whole render before allocating it */
+    const size_t reserved = src_sz + canvas_mem_estimate(&canvas, canvas.h_px);
+    if (pool->budget) {
+        if (reserved > pool->budget->limit) {
+            run_banded(pool, job, src, src_sz, &canvas, key);
+            return;
+        }
+
+        budget_reserve(pool->budget, reserved);
+    }
+
+    /* Big files are split so they don't keep a single worker busy while the
+     * rest are idle. The source is freed by the last band. */
+    if (pool->num_workers > 1 && canvas.h >= SPLIT_MIN_LINES) {
+        split_file(pool, id, file, job->seq, src, src_sz, &canvas, reserved,
+                   key);
+        return;
+    }
+
+    /* Without a budget, the rows come from the arena of the worker, which
+     * keeps them warm for the next file. With a budget, they are returned to
+     * the system right away, see batch_render() */
+    if (!pool->budget)
+        canvas.arena = arena_thread();
+
+    canvas_alloc(&canvas);
+    source_to_png(&canvas, src, src_sz);
+    draw_border(&canvas);
+
+    size_t png_sz;
+    void* png = encode_png_mem(&canvas, &png_sz);
+    canvas_free(&canvas);
+    if (canvas.arena)
+        arena_reset(canvas.arena);
+    free(src);
+
+    submit_png(pool, job->seq, file->name, key, png, png_sz);
+    release(pool, reserved);
+    atomic_fetch_add(&pool->rendered, 1);
+}
+
+static void run_band_job(Pool* pool, const Job* job) {
+    SplitFile* split = job->split;
+
+    /* Each band has its own position, but they share the rows */
+    Canvas canvas = split->canvas;
+    source_lines_to_png(&canvas, split->src + job->offset, job->size,
+                        job->first_line, job->state);
+
+    if (atomic_fetch_sub(&split->bands_left, 1) != 1)
+        return;
+
+    /* Last band, the whole canvas is ready */
+    draw_border(&split->canvas);
+
+    size_t png_sz;
+    void* png = encode_png_mem(&split->canvas, &png_sz);
+    canvas_free(&split->canvas);
+
+    free(split->src);
+
+    submit_png(pool, split->seq, split->name, split->key, png, png_sz);
+    release(pool, split->reserved);
+    atomic_fetch_add(&pool->rendered, 1);
+
+    free(split);
+}
+
+static void* worker_thread(void* arg) {
+    Worker* worker = arg;
+    Pool* pool     = worker->pool;
+
+    Job job;
+    while (pool_get(pool, worker->id, &job)) {
+        if (job.type == JOB_FILE)
+            run_file_job(pool, worker->id, &job);
+        else
+            run_band_job(pool, &job);
+
+        pool_job_done(pool);
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int cmp_size_asc(const void* a, const void* b) {
+    const BatchFile* fa = *(const BatchFile* const*)a;
+    const BatchFile* fb = *(const BatchFile* const*)b;
+    return (fa->size > fb->size) - (fa->size < fb->size);
+}
+
+void batch_render(const BatchFile* files, size_t num_files, int num_threads,
+                  MemBudget* budget, bool use_uring, RenderCache* cache,
+                  Sink* sink, BatchStats* stats) {
+    if (num_threads < 1)
+        num_threads = 1;
+
+    /* Workers finish out of order, and a worker blocked in sink_submit() could
+     * be the one that has to render the image that the writer is waiting for,
+     * so the sink can't block them. The images it can't write yet are kept in
+     * memory up to a part of the budget, or a fixed size without one, and
+     * spilled to temporary files after that. */
+    sink->max_pending = 0;
+    if (budget) {
+        sink->max_pending_bytes = budget->limit / SINK_BUDGET_DIV;
+        budget->limit -= sink->max_pending_bytes;
+    } else {
+        sink->max_pending_bytes = SINK_DEFAULT_PENDING_BYTES;
+    }
+
+    /* Keep big blocks in mmap()'d memory, so freed canvases are returned to
+     * the system right away instead of staying in the heap of each thread,
+     * and the resident memory follows the budget. Setting the threshold also
+     * stops glibc from raising it after each free. */
+    if (budget)
+        mallopt(M_MMAP_THRESHOLD, MMAP_THRESHOLD);
+
+    Pool pool;
+    pool.num_workers = num_threads;
+    pool.sink        = sink;
+    pool.budget      = budget;
+    pool.cache       = cache;
+    pool.epoch       = 0;
+    pool.deques      = malloc(num_threads * sizeof(Deque));
+    if (!pool.deques)
+        DIE("Can't allocate the job queues\n");
+
+    atomic_init(&pool.jobs_left, 0);
+    atomic_init(&pool.rendered, 0);
+    atomic_init(&pool.skipped, 0);
+    atomic_init(&pool.split, 0);
+    atomic_init(&pool.steals, 0);
+    atomic_init(&pool.banded, 0);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+
+    for (int i = 0; i < num_threads; i++)
+        deque_init(&pool.deques[i]);
+
+    /* Deal the files in increasing size, so each owner pops its biggest files
+     * first and the small ones at the top are left for the thieves. The
+     * sequence numbers still follow the order of the list. */
+    const BatchFile** sorted = malloc(num_files * sizeof(BatchFile*));
+    if (num_files > 0 && !sorted)
+        DIE("Can't allocate the job list\n");
+
+    for (size_t i = 0; i < num_files; i++)
+        sorted[i] = &files[i];
+    qsort(sorted, num_files, sizeof(BatchFile*), cmp_size_asc);
+
+    for (size_t i = 0; i < num_files; i++) {
+        const Job job = {
+            .type = JOB_FILE,
+            .file = sorted[i],
+            .seq  = sorted[i] - files,
+        };
+        pool_push(&pool, i % num_threads, &job);
+    }
+
+    /* The workers pop the biggest files of their deques first, in turns, so
+     * the sources are read ahead in decreasing size */
+    const char** paths = malloc((num_files + 1) * sizeof(char*));
+    size_t* order      = malloc((num_files + 1) * sizeof(size_t));
+    if (!paths || !order)
+        DIE("Can't allocate the read ahead list\n");
+
+    for (size_t i = 0; i < num_files; i++) {
+        paths[i] = files[i].path;
+        order[i] = sorted[num_files - 1 - i] - files;
+    }
+    free(sorted);
+
+    /* The sources read ahead are not reserved by the jobs until they take
+     * them, so the window comes out of the memory budget */
+    size_t window = PREFETCH_BYTES;
+    if (budget) {
+        window = budget->limit / PREFETCH_BUDGET_DIV;
+        budget->limit -= window;
+    }
+
+    Prefetcher prefetch;
+    if (!prefetch_start(&prefetch, paths, order, num_files, window, use_uring))
+        DIE("Can't start reading the sources\n");
+    pool.prefetch = &prefetch;
+    free(order);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    Worker* workers    = malloc(num_threads * sizeof(Worker));
+    if (!threads || !workers)
+        DIE("Can't allocate the workers\n");
+
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].pool = &pool;
+        workers[i].id   = i;
+        if (pthread_create(&threads[i], NULL, worker_thread, &workers[i]) != 0)
+            DIE("Can't create worker thread\n");
+    }
+
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    stats->prefetched  = prefetch.hits;
+    stats->read_waits  = prefetch.waits;
+    stats->read_direct = prefetch.misses;
+    stats->io_uring    = prefetch.use_ring;
+    prefetch_stop(&prefetch);
+    free(paths);
+
+    if (budget)
+        budget->limit += window + sink->max_pending_bytes;
+
+    stats->rendered = atomic_load(&pool.rendered);
+    stats->skipped  = atomic_load(&pool.skipped);
+    stats->split    = atomic_load(&pool.split);
+    stats->steals   = atomic_load(&pool.steals);
+    stats->banded   = atomic_load(&pool.banded);
+
+    for (int i = 0; i < num_threads; i++)
+        deque_destroy(&pool.deques[i]);
+
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+    free(pool.deques);
+    free(threads);
+    free(workers);
+}
+
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    BatchFile* files;
+    size_t num, cap;
+} FileList;
+
+static bool has_ext(const char* name, char* const* exts, int num_exts) {
+    if (num_exts <= 0)
+        return true;
+
+    const char* dot = strrchr(name, '.');
+    if (!dot)
+        return false;
+
+    for (int i = 0; i < num_exts; i++)
+        if (!strcmp(dot + 1, exts[i]))
+            return true;
+
+    return false;
+}
+
+static bool is_ignored(const char* name, const char* rel,
+                       const WalkFilter* filter) {
+    for (int i = 0; i < filter->num_ignores; i++)
+        if (fnmatch(filter->ignores[i], name, 0) == 0 ||
+            fnmatch(filter->ignores[i], rel, 0) == 0)
+            return true;
+
+    return false;
+}
+
+static bool list_add(FileList* list, const char* path, const char* rel,
+                     uint64_t size) {
+    if (list->num >= list->cap) {
+        list->cap         = list->cap ? list->cap * 2 : 256;
+        BatchFile* files = realloc(list->files, list->cap * sizeof(BatchFile));
+        if (!files)
+            return false;
+        list->files = files;
+    }
+
+    BatchFile* file = &list->files[list->num];
+    file->path      = strdup(path);
+    file->name      = path_join("", rel, ".png");
+    file->size      = size;
+    if (!file->path || !file->name)
+        return false;
+
+    list->num++;
+    return true;
+}
+
+/* The relative path `rel' is empty for the root directory */
+static bool walk_dir(const char* dir, const char* rel, const WalkFilter* filter,
+                     FileList* list) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Can't open directory: \"%s\"\n", dir);
+        return true;
+    }
+
+    bool ret = true;
+    struct dirent* ent;
+    while (ret && (ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        char* path     = path_join(dir, ent->d_name, "");
+        char* rel_path = rel[0] ? path_join(rel, ent->d_name, "")
+                                : strdup(ent->d_name);
+        if (!path || !rel_path) {
+            free(path);
+            free(rel_path);
+            ret = false;
+            break;
+        }
+
+        /* Symbolic links to directories are not followed, to avoid loops */
+        struct stat st, lst;
+        if (is_ignored(ent->d_name, rel_path, filter) || stat(path, &st) != 0 ||
+            lstat(path, &lst) != 0) {
+            /* Ignored or broken link */
+        } else if (S_ISDIR(st.st_mode)) {
+            if (!S_ISLNK(lst.st_mode))
+                ret = walk_dir(path, rel_path, filter, list);
+        } else if (S_ISREG(st.st_mode) &&
+                   has_ext(ent->d_name, filter->exts, filter->num_exts) &&
+                   path_matches(rel_path, filter->filters,
+                                filter->num_filters)) {
+            ret = list_add(list, path, rel_path, st.st_size);
+        }
+
+        free(path);
+        free(rel_path);
+    }
+
+    closedir(d);
+    return ret;
+}
+
+static int cmp_name(const void* a, const void* b) {
+    return strcmp(((const BatchFile*)a)->name, ((const BatchFile*)b)->name);
+}
+
+bool walk_tree(const char* root, const WalkFilter* filter, BatchFile** files,
+               size_t* num_files) {
+    FileList list = { NULL, 0, 0 };
+
+    if (!walk_dir(root, "", filter, &list)) {
+        batch_files_free(list.files, list.num);
+        return false;
+    }
+
+    qsort(list.files, list.num, sizeof(BatchFile), cmp_name);
+
+    *files     = list.files;
+    *num_files = list.num;
+    return true;
+}
+
+bool walk_filter_accepts(const WalkFilter* filter, const char* name,
+                         const char* rel, bool is_dir) {
+    if (name[0] == '.' || is_ignored(name, rel, filter))
+        return false;
+
+    return is_dir || (has_ext(name, filter->exts, filter->num_exts) &&
+                      path_matches(rel, filter->filters, filter->num_filters));
+}
+
+void batch_files_free(BatchFile* files, size_t num_files) {
+    for (size_t i = 0; i < num_files; i++) {
+        free(files[i].path);
+        free(files[i].name);
+    }
+
+    free(files);
+}
@@ -0,0 +1,43 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "include/budget.h"
+
+void budget_init(MemBudget* budget, size_t limit) {
+    pthread_mutex_init(&budget->lock, NULL);
+    pthread_cond_init(&budget->cond, NULL);
+
+    budget->limit = limit;
+    budget->used  = 0;
+    budget->peak  = 0;
+    budget->waits = 0;
+}
+
+void budget_destroy(MemBudget* budget) {
+    pthread_mutex_destroy(&budget->lock);
+    pthread_cond_destroy(&budget->cond);
+}
+
+void budget_reserve(MemBudget* budget, size_t size) {
+    pthread_mutex_lock(&budget->lock);
+
+    if (budget->used + size > budget->limit)
+        budget->waits++;
+
+    while (budget->used + size > budget->limit)
+        pthread_cond_wait(&budget->cond, &budget->lock);
+
+    budget->used += size;
+    if (budget->peak < budget->used)
+        budget->peak = budget->used;
+
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void budget_release(MemBudget* budget, size_t size) {
+    pthread_mutex_lock(&budget->lock);
+    budget->used -= size;
+    pthread_cond_broadcast(&budget->cond);
+    pthread_mutex_unlock(&budget->lock);
+}
@@ -0,0 +1,310 @@
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "include/cache.h"
+#include "include/hash.h"
+#include "include/util.h"
+
+/* Hex digits of the key used for the name of the subdirectory, so no
+ * directory has too many entries */
+#define SUBDIR_DIGITS 2
+
+typedef struct {
+    char* path;
+    uint64_t size;
+    struct timespec mtime;
+} Entry;
+
+/*----------------------------------------------------------------------------*/
+
+/* Path of the entry of the key, or of its subdirectory. Returns a new
+ * allocated string */
+static char* entry_path(const RenderCache* cache, Hash128 key, bool subdir) {
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)key.hi,
+             (unsigned long long)key.lo);
+
+    const size_t sz = strlen(cache->dir) + sizeof(hex) + 8;
+    char* ret       = malloc(sz);
+    if (!ret)
+        return NULL;
+
+    if (subdir)
+        snprintf(ret, sz, "%s/%.*s", cache->dir, SUBDIR_DIGITS, hex);
+    else
+        snprintf(ret, sz, "%s/%.*s/%s.png", cache->dir, SUBDIR_DIGITS, hex,
+                 hex + SUBDIR_DIGITS);
+    return ret;
+}
+
+/* Path of a new temporary file, unique for every process and thread */
+static char* tmp_path(RenderCache* cache) {
+    const size_t sz = strlen(cache->dir) + 64;
+    char* ret       = malloc(sz);
+    if (!ret)
+        return NULL;
+
+    snprintf(ret, sz, "%s/tmp-%ld-%u", cache->dir, (long)getpid(),
+             atomic_fetch_add(&cache->tmp_seq, 1));
+    return ret;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = data;
+    while (size > 0) {
+        const ssize_t ret = write(fd, p, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        p += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+/* Write the data to a new file, and make sure it's on disk before it's
+ * renamed, so a crash can't leave a truncated entry */
+static bool write_file_synced(const char* path, const void* data,
+                              size_t size) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    const bool ok = write_all(fd, data, size) && fdatasync(fd) == 0;
+    close(fd);
+
+    if (!ok)
+        unlink(path);
+    return ok;
+}
+
+/* Move the temporary file to the entry of the key */
+static void commit_entry(RenderCache* cache, Hash128 key, const char* tmp) {
+    char* subdir = entry_path(cache, key, true);
+    char* path   = entry_path(cache, key, false);
+
+    if (subdir && path && (mkdir(subdir, 0755) == 0 || errno == EEXIST) &&
+        rename(tmp, path) == 0)
+        atomic_fetch_add(&cache->stores, 1);
+    else
+        unlink(tmp);
+
+    free(subdir);
+    free(path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool cache_open(RenderCache* cache, const char* dir, uint64_t max_size,
+                uint64_t seed) {
+    if (!mkdir_parents(dir) || (mkdir(dir, 0755) != 0 && errno != EEXIST))
+        return false;
+
+    cache->dir = strdup(dir);
+    if (!cache->dir)
+        return false;
+
+    cache->max_size = max_size;
+    cache->seed     = seed;
+    atomic_init(&cache->tmp_seq, 0);
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->stores, 0);
+    atomic_init(&cache->evicted, 0);
+    return true;
+}
+
+Hash128 cache_key(const RenderCache* cache, const void* src, size_t src_sz) {
+    return hash128(src, src_sz, cache->seed);
+}
+
+bool cache_copy(RenderCache* cache, Hash128 key, const char* out) {
+    char* path = entry_path(cache, key, false);
+    if (!path)
+        return false;
+
+    /* The entry is copied, never linked, since the output can be written
+     * again in place by a render without the cache */
+    size_t size;
+    void* data = read_file(path, &size);
+    bool found = false;
+    if (data) {
+        FILE* fd = fopen(out, "wb");
+        found    = fd && fwrite(data, 1, size, fd) == size;
+        if (fd && fclose(fd) != 0)
+            found = false;
+        free(data);
+    }
+
+    /* The modification time is the last use, for the LRU */
+    if (found)
+        utimensat(AT_FDCWD, path, NULL, 0);
+
+    atomic_fetch_add(found ? &cache->hits : &cache->misses, 1);
+    free(path);
+    return found;
+}
+
+void* cache_load(RenderCache* cache, Hash128 key, size_t* size) {
+    char* path = entry_path(cache, key, false);
+    if (!path)
+        return NULL;
+
+    void* data = read_file(path, size);
+    if (data)
+        utimensat(AT_FDCWD, path, NULL, 0);
+
+    atomic_fetch_add(data ? &cache->hits : &cache->misses, 1);
+    free(path);
+    return data;
+}
+
+void cache_store(RenderCache* cache, Hash128 key, const void* data,
+                 size_t size) {
+    char* tmp = tmp_path(cache);
+    if (tmp && write_file_synced(tmp, data, size))
+        commit_entry(cache, key, tmp);
+    free(tmp);
+}
+
+void cache_store_file(RenderCache* cache, Hash128 key, const char* path) {
+    size_t size;
+    void* data = read_file(path, &size);
+    if (data)
+        cache_store(cache, key, data, size);
+    free(data);
+}
+
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    Entry* entries;
+    size_t num, cap;
+    uint64_t total;
+} EntryList;
+
+static bool is_subdir_name(const char* name) {
+    for (int i = 0; i < SUBDIR_DIGITS; i++)
+        if (!((name[i] >= '0' && name[i] <= '9') ||
+              (name[i] >= 'a' && name[i] <= 'f')))
+            return false;
+
+    return name[SUBDIR_DIGITS] == '\0';
+}
+
+/* Add the entries of a subdirectory to the list */
+static void list_subdir(const char* subdir, EntryList* list) {
+    DIR* dir = opendir(subdir);
+    if (!dir)
+        return;
+
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        char* path = path_join(subdir, ent->d_name, "");
+        struct stat st;
+        if (!path || lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        if (list->num >= list->cap) {
+            list->cap  = list->cap ? 2 * list->cap : 256;
+            Entry* tmp = realloc(list->entries, list->cap * sizeof(Entry));
+            if (!tmp) {
+                free(path);
+                break;
+            }
+            list->entries = tmp;
+        }
+
+        list->entries[list->num++] = (Entry){
+            .path  = path,
+            .size  = st.st_size,
+            .mtime = st.st_mtim,
+        };
+        list->total += st.st_size;
+    }
+
+    closedir(dir);
+}
+
+/* Oldest first */
+static int cmp_mtime(const void* a, const void* b) {
+    const Entry* ea = a;
+    const Entry* eb = b;
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+        return (ea->mtime.tv_sec > eb->mtime.tv_sec) -
+               (ea->mtime.tv_sec < eb->mtime.tv_sec);
+    return (ea->mtime.tv_nsec > eb->mtime.tv_nsec) -
+           (ea->mtime.tv_nsec < eb->mtime.tv_nsec);
+}
+
+void cache_close(RenderCache* cache) {
+    if (atomic_load(&cache->stores) == 0) {
+        free(cache->dir);
+        return;
+    }
+
+    DIR* dir = opendir(cache->dir);
+    if (!dir) {
+        free(cache->dir);
+        return;
+    }
+
+    EntryList list = { 0 };
+    const time_t now = time(NULL);
+
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        char* path = path_join(cache->dir, ent->d_name, "");
+        if (!path)
+            continue;
+
+        struct stat st;
+        if (is_subdir_name(ent->d_name)) {
+            list_subdir(path, &list);
+        } else if (strncmp(ent->d_name, "tmp-", 4) == 0 &&
+                   lstat(path, &st) == 0 &&
+                   now - st.st_mtime > CACHE_TMP_MAX_AGE) {
+            unlink(path);
+        }
+
+        free(path);
+    }
+    closedir(dir);
+
+    /* Remove the least recently used entries until it fits */
+    if (list.total > cache->max_size) {
+        qsort(list.entries, list.num, sizeof(Entry), cmp_mtime);
+
+        for (size_t i = 0; i < list.num && list.total > cache->max_size;
+             i++) {
+            if (unlink(list.entries[i].path) != 0)
+                continue;
+
+            list.total -= list.entries[i].size;
+            atomic_fetch_add(&cache->evicted, 1);
+        }
+    }
+
+    for (size_t i = 0; i < list.num; i++)
+        free(list.entries[i].path);
+    free(list.entries);
+    free(cache->dir);
+}
@@ -0,0 +1,633 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "include/fastpng.h"
+#include "include/bandenc.h"
+#include "include/render.h"
+
+/* PNG filter type of every row. Sub would turn the runs of a color into
+ * zeros, but None keeps the bytes of a glyph the same wherever it is, so they
+ * match more often */
+#define FILTER_NONE 0
+
+/* Limits of the matches of deflate */
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_DIST  32768
+
+/* Symbols of each deflate block. A block is written after the row that fills
+ * it, so it can have a row more */
+#define BLOCK_SYMS (64 * 1024)
+
+/* Sizes of the alphabets of deflate */
+#define NUM_LITLEN 286
+#define NUM_DIST   30
+#define NUM_CLEN   19
+
+#define END_OF_BLOCK  256
+#define MAX_BITS      15
+#define MAX_CLEN_BITS 7
+
+/* Symbols of the blocks, see emit_match(). Literals are only the byte, and
+ * matches have the length, the distance and the code of the distance */
+#define SYM_MATCH      0x80000000
+#define SYM_DIST_SHIFT 9
+#define SYM_CODE_SHIFT 25
+#define SYM_LEN_MASK   0x1FF
+#define SYM_DIST_MASK  0xFFFF
+#define SYM_CODE_MASK  0x1F
+
+/* Table of the last positions of each hash of 8 bytes, two pixels. Each
+ * hash has a few of them, from the newest */
+#define HASH_BITS 14
+#define HASH_SZ   (1 << HASH_BITS)
+#define HASH_WAYS 16
+
+/* Bytes between the positions inside a match that are added to the hashes */
+#define HASH_STEP 4
+
+/* Filtered bytes kept before the current row, besides the deflate window.
+ * The window is moved back to the start when it's full */
+#define HISTORY_SZ (4 * MAX_DIST)
+
+/* Bytes reserved for each symbol: 15 bits of its code, 5 extra bits of the
+ * length, 15 of the distance and 13 extra bits */
+#define MAX_SYM_BYTES 6
+
+/* Bytes reserved for the header of each block, and the end */
+#define MAX_HEADER_BYTES 512
+
+/* Base values and extra bits of the length and distance codes */
+static const uint16_t len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[NUM_DIST] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577,
+};
+static const uint8_t dist_extra[NUM_DIST] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+/* Order of the lengths of the code length code in the block header */
+static const uint8_t clen_order[NUM_CLEN] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+typedef struct {
+    uint16_t code; /* Bit-reversed, deflate writes it from the lowest bit */
+    uint8_t len;
+} HuffCode;
+
+/* Writes bits from the lowest one into the output, which must have been
+ * reserved before */
+typedef struct {
+    ByteBuf* out;
+    uint64_t bits;
+    int num_bits;
+} BitWriter;
+
+typedef struct {
+    /* Bytes of each filtered row, with the filter type */
+    size_t stride;
+
+    /* The row above is in the deflate window, and the code of its distance */
+    bool up_ok;
+    int up_code;
+
+    /* Last filtered bytes, from position `history_pos' of the stream. The
+     * current row is at `pos' */
+    uint8_t* history;
+    size_t history_cap;
+    size_t history_pos, pos;
+
+    /* Last positions of each hash, see hash_at() */
+    size_t* hashes;
+
+    /* Symbols of the current block, and their counts */
+    uint32_t* syms;
+    size_t num_syms;
+    uint32_t litlen_freqs[NUM_LITLEN];
+    uint32_t dist_freqs[NUM_DIST];
+
+    uint32_t adler;
+    BitWriter bw;
+} FastEncoder;
+
+/*----------------------------------------------------------------------------*/
+
+static void put_bits(BitWriter* bw, uint32_t val, int num_bits) {
+    bw->bits |= (uint64_t)val << bw->num_bits;
+    bw->num_bits += num_bits;
+    if (bw->num_bits < 32)
+        return;
+
+    uint8_t* p = bw->out->data + bw->out->size;
+    p[0]       = bw->bits;
+    p[1]       = bw->bits >> 8;
+    p[2]       = bw->bits >> 16;
+    p[3]       = bw->bits >> 24;
+    bw->out->size += 4;
+
+    bw->bits >>= 32;
+    bw->num_bits -= 32;
+}
+
+/* Write the complete bytes, the rest of the bits are kept for the next ones */
+static void flush_bytes(BitWriter* bw) {
+    while (bw->num_bits >= 8) {
+        bw->out->data[bw->out->size++] = bw->bits;
+        bw->bits >>= 8;
+        bw->num_bits -= 8;
+    }
+}
+
+static inline void put_code(BitWriter* bw, HuffCode code) {
+    put_bits(bw, code.code, code.len);
+}
+
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    uint32_t freq;
+    int sym;
+} HuffLeaf;
+
+static int compare_leaves(const void* a, const void* b) {
+    const HuffLeaf* la = a;
+    const HuffLeaf* lb = b;
+
+    if (la->freq != lb->freq)
+        return (la->freq < lb->freq) ? -1 : 1;
+    return la->sym - lb->sym;
+}
+
+/* Lengths of the Huffman code of the symbols with the counts. Returns the
+ * longest one. Codes with less than two symbols get two of length 1, since
+ * zlib doesn't accept incomplete codes. */
+static int huffman_lengths(const uint32_t* freqs, int n, uint8_t* lens) {
+    HuffLeaf leaves[NUM_LITLEN];
+    int num_leaves = 0;
+    for (int i = 0; i < n; i++) {
+        lens[i] = 0;
+        if (freqs[i] > 0) {
+            leaves[num_leaves].freq = freqs[i];
+            leaves[num_leaves].sym  = i;
+            num_leaves++;
+        }
+    }
+
+    if (num_leaves < 2) {
+        const int sym = (num_leaves == 1) ? leaves[0].sym : 0;
+        lens[sym]              = 1;
+        lens[sym == 0 ? 1 : 0] = 1;
+        return 1;
+    }
+
+    qsort(leaves, num_leaves, sizeof(HuffLeaf), compare_leaves);
+
+    /* The leaves and the internal nodes are both sorted by weight, so the
+     * two lightest nodes are always at the front of one of them */
+    uint32_t weights[2 * NUM_LITLEN];
+    int parents[2 * NUM_LITLEN];
+    for (int i = 0; i < num_leaves; i++)
+        weights[i] = leaves[i].freq;
+
+    const int num_nodes = 2 * num_leaves - 1;
+    int next_leaf = 0, next_node = num_leaves;
+    for (int node = num_leaves; node < num_nodes; node++) {
+        weights[node] = 0;
+        for (int k = 0; k < 2; k++) {
+            int child;
+            if (next_leaf < num_leaves &&
+                (next_node >= node || weights[next_leaf] <= weights[next_node]))
+                child = next_leaf++;
+            else
+                child = next_node++;
+
+            weights[node] += weights[child];
+            parents[child] = node;
+        }
+    }
+
+    /* The parents are after their children, reuse the weights as depths */
+    int max_len            = 0;
+    weights[num_nodes - 1] = 0;
+    for (int i = num_nodes - 2; i >= 0; i--) {
+        weights[i] = weights[parents[i]] + 1;
+        if (i < num_leaves) {
+            lens[leaves[i].sym] = weights[i];
+            if ((int)weights[i] > max_len)
+                max_len = weights[i];
+        }
+    }
+
+    return max_len;
+}
+
+/* Same as huffman_lengths(), but the counts are halved until the longest code
+ * has at most `max_bits' */
+static void build_lengths(const uint32_t* freqs, int n, int max_bits,
+                          uint8_t* lens) {
+    uint32_t scaled[NUM_LITLEN];
+    memcpy(scaled, freqs, n * sizeof(uint32_t));
+
+    while (huffman_lengths(scaled, n, lens) > max_bits)
+        for (int i = 0; i < n; i++)
+            if (scaled[i] > 0)
+                scaled[i] = (scaled[i] >> 1) | 1;
+}
+
+/* Canonical codes of the lengths, see RFC 1951 3.2.2 */
+static void build_codes(const uint8_t* lens, int n, HuffCode* codes) {
+    uint16_t counts[MAX_BITS + 1] = { 0 };
+    for (int i = 0; i < n; i++)
+        counts[lens[i]]++;
+    counts[0] = 0;
+
+    uint16_t next[MAX_BITS + 1];
+    uint16_t code = 0;
+    for (int bits = 1; bits <= MAX_BITS; bits++) {
+        code       = (code + counts[bits - 1]) << 1;
+        next[bits] = code;
+    }
+
+    for (int i = 0; i < n; i++) {
+        codes[i].len  = lens[i];
+        codes[i].code = 0;
+        if (lens[i] == 0)
+            continue;
+
+        uint16_t c = next[lens[i]]++;
+        for (int b = 0; b < lens[i]; b++) {
+            codes[i].code = (codes[i].code << 1) | (c & 1);
+            c >>= 1;
+        }
+    }
+}
+
+/* Codes of the lengths and distances. Most lengths are the longest, and most
+ * distances are 1 */
+static int len_code(uint32_t len) {
+    int code = 28;
+    while (len_base[code] > len)
+        code--;
+    return code;
+}
+
+static int dist_code(uint32_t dist) {
+    int code = 0;
+    while (code + 1 < NUM_DIST && dist_base[code + 1] <= dist)
+        code++;
+    return code;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Code lengths of the header compressed with the repeat codes 16, 17 and 18.
+ * Each entry is a symbol of the code length code and its extra bits */
+typedef struct {
+    uint8_t sym, extra;
+} CodeLenSym;
+
+static int rle_lengths(const uint8_t* lens, int n, CodeLenSym* out,
+                       uint32_t* freqs) {
+    int num = 0;
+    for (int i = 0; i < n;) {
+        const uint8_t len = lens[i];
+        int run           = 1;
+        while (i + run < n && lens[i + run] == len)
+            run++;
+
+        if (len == 0 && run >= 11) {
+            if (run > 138)
+                run = 138;
+            out[num++] = (CodeLenSym){ 18, run - 11 };
+        } else if (len == 0 && run >= 3) {
+            out[num++] = (CodeLenSym){ 17, run - 3 };
+        } else if (len != 0 && run >= 4) {
+            /* The first one is written, and then repeated */
+            if (run > 7)
+                run = 7;
+            out[num++] = (CodeLenSym){ len, 0 };
+            out[num++] = (CodeLenSym){ 16, run - 4 };
+        } else {
+            run        = 1;
+            out[num++] = (CodeLenSym){ len, 0 };
+        }
+
+        i += run;
+    }
+
+    for (int i = 0; i < num; i++)
+        freqs[out[i].sym]++;
+    return num;
+}
+
+/* Write the header of a dynamic block, and return the codes of its symbols */
+static void write_block_header(FastEncoder* enc, HuffCode* litlen_codes,
+                               HuffCode* dist_codes) {
+    uint8_t lens[NUM_LITLEN + NUM_DIST];
+    build_lengths(enc->litlen_freqs, NUM_LITLEN, MAX_BITS, lens);
+    build_lengths(enc->dist_freqs, NUM_DIST, MAX_BITS, lens + NUM_LITLEN);
+    build_codes(lens, NUM_LITLEN, litlen_codes);
+    build_codes(lens + NUM_LITLEN, NUM_DIST, dist_codes);
+
+    int num_litlen = NUM_LITLEN;
+    while (lens[num_litlen - 1] == 0)
+        num_litlen--;
+    int num_dist = NUM_DIST;
+    while (lens[NUM_LITLEN + num_dist - 1] == 0)
+        num_dist--;
+
+    /* The lengths of both codes are compressed together */
+    memmove(lens + num_litlen, lens + NUM_LITLEN, num_dist);
+
+    CodeLenSym rle[NUM_LITLEN + NUM_DIST];
+    uint32_t clen_freqs[NUM_CLEN] = { 0 };
+    const int num_rle =
+      rle_lengths(lens, num_litlen + num_dist, rle, clen_freqs);
+
+    uint8_t clen_lens[NUM_CLEN];
+    HuffCode clen_codes[NUM_CLEN];
+    build_lengths(clen_freqs, NUM_CLEN, MAX_CLEN_BITS, clen_lens);
+    build_codes(clen_lens, NUM_CLEN, clen_codes);
+
+    int num_clen = NUM_CLEN;
+    while (clen_lens[clen_order[num_clen - 1]] == 0)
+        num_clen--;
+
+    /* Not the last block, with dynamic codes */
+    BitWriter* bw = &enc->bw;
+    put_bits(bw, 0, 1);
+    put_bits(bw, 2, 2);
+    put_bits(bw, num_litlen - 257, 5);
+    put_bits(bw, num_dist - 1, 5);
+    put_bits(bw, num_clen - 4, 4);
+    for (int i = 0; i < num_clen; i++)
+        put_bits(bw, clen_lens[clen_order[i]], 3);
+
+    static const uint8_t repeat_bits[3] = { 2, 3, 7 };
+    for (int i = 0; i < num_rle; i++) {
+        put_code(bw, clen_codes[rle[i].sym]);
+        if (rle[i].sym >= 16)
+            put_bits(bw, rle[i].extra, repeat_bits[rle[i].sym - 16]);
+    }
+}
+
+/* Write the symbols of the block in its own IDAT chunk */
+static void write_block(FastEncoder* enc) {
+    ByteBuf* out       = enc->bw.out;
+    const size_t start = png_chunk_begin(out, "IDAT");
+    byte_buf_reserve(out, enc->num_syms * MAX_SYM_BYTES + MAX_HEADER_BYTES);
+
+    enc->litlen_freqs[END_OF_BLOCK]++;
+
+    HuffCode litlen_codes[NUM_LITLEN], dist_codes[NUM_DIST];
+    write_block_header(enc, litlen_codes, dist_codes);
+
+    BitWriter* bw = &enc->bw;
+    for (size_t i = 0; i < enc->num_syms; i++) {
+        const uint32_t sym = enc->syms[i];
+        if (!(sym & SYM_MATCH)) {
+            put_code(bw, litlen_codes[sym]);
+            continue;
+        }
+
+        const uint32_t len = sym & SYM_LEN_MASK;
+        const int code     = len_code(len);
+        put_code(bw, litlen_codes[257 + code]);
+        if (len_extra[code] > 0)
+            put_bits(bw, len - len_base[code], len_extra[code]);
+
+        const uint32_t dist = (sym >> SYM_DIST_SHIFT) & SYM_DIST_MASK;
+        const int dcode     = (sym >> SYM_CODE_SHIFT) & SYM_CODE_MASK;
+        put_code(bw, dist_codes[dcode]);
+        if (dist_extra[dcode] > 0)
+            put_bits(bw, dist - dist_base[dcode], dist_extra[dcode]);
+    }
+    put_code(bw, litlen_codes[END_OF_BLOCK]);
+
+    flush_bytes(bw);
+    png_chunk_end(out, start);
+
+    enc->num_syms = 0;
+    memset(enc->litlen_freqs, 0, sizeof(enc->litlen_freqs));
+    memset(enc->dist_freqs, 0, sizeof(enc->dist_freqs));
+}
+
+/*----------------------------------------------------------------------------*/
+
+static inline void emit_literal(FastEncoder* enc, uint8_t c) {
+    enc->syms[enc->num_syms++] = c;
+    enc->litlen_freqs[c]++;
+}
+
+static void emit_match(FastEncoder* enc, uint32_t len, uint32_t dist,
+                       int code) {
+    enc->syms[enc->num_syms++] = SYM_MATCH | (uint32_t)code << SYM_CODE_SHIFT |
+                                 dist << SYM_DIST_SHIFT | len;
+    enc->litlen_freqs[257 + len_code(len)]++;
+    enc->dist_freqs[code]++;
+}
+
+/* Emit a match of any length of at least MIN_MATCH, as many as needed */
+static void emit_long_match(FastEncoder* enc, size_t len, uint32_t dist,
+                            int code) {
+    while (len > 0) {
+        uint32_t part = (len > MAX_MATCH) ? MAX_MATCH : len;
+
+        /* Don't leave a part that is too short for a match */
+        if (len > part && len - part < MIN_MATCH)
+            part = len - MIN_MATCH;
+
+        emit_match(enc, part, dist, code);
+        len -= part;
+    }
+}
+
+/* Number of bytes at the start of `a' that are the same as in `b', up to
+ * `max'. They can overlap, as the copies of deflate */
+static size_t match_len(const uint8_t* a, const uint8_t* b, size_t max) {
+    size_t len = 0;
+    for (; len + sizeof(uint64_t) <= max; len += sizeof(uint64_t)) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + len, sizeof(uint64_t));
+        memcpy(&wb, b + len, sizeof(uint64_t));
+        if (wa != wb)
+            break;
+    }
+
+    while (len < max && a[len] == b[len])
+        len++;
+    return len;
+}
+
+static inline uint32_t hash_at(const uint8_t* p) {
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return (val * 0x9E3779B97F4A7C15) >> (64 - HASH_BITS);
+}
+
+/* Add the position `p' of the stream, with the `bytes', to its hash */
+static inline void hash_insert(FastEncoder* enc, const uint8_t* bytes,
+                               size_t p) {
+    size_t* bucket = enc->hashes + HASH_WAYS * hash_at(bytes);
+    memmove(bucket + 1, bucket, (HASH_WAYS - 1) * sizeof(size_t));
+    bucket[0] = p;
+}
+
+/* Find the longest match of the bytes at position `p' of the stream in the
+ * positions with the same hash, and add `p' to them. Returns its length if
+ * it's longer than `len', and stores the distance */
+static size_t hash_match(FastEncoder* enc, const uint8_t* bytes, size_t p,
+                         size_t max, size_t len, uint32_t* dist) {
+    size_t* bucket = enc->hashes + HASH_WAYS * hash_at(bytes);
+
+    for (int i = 0; i < HASH_WAYS; i++) {
+        const size_t prev = bucket[i];
+        if (prev < enc->history_pos || prev >= p || p - prev > MAX_DIST)
+            continue;
+
+        const size_t prev_len =
+          match_len(bytes, enc->history + (prev - enc->history_pos), max);
+        if (prev_len > len) {
+            len   = prev_len;
+            *dist = p - prev;
+        }
+    }
+
+    hash_insert(enc, bytes, p);
+    return len;
+}
+
+/* Return where the next row goes in the history, moving the last bytes of the
+ * window to the start if it doesn't fit */
+static uint8_t* next_row(FastEncoder* enc) {
+    size_t used = enc->pos - enc->history_pos;
+    if (used + enc->stride > enc->history_cap) {
+        memmove(enc->history, enc->history + used - MAX_DIST, MAX_DIST);
+        enc->history_pos = enc->pos - MAX_DIST;
+        used             = MAX_DIST;
+    }
+
+    return enc->history + used;
+}
+
+static void encode_row(FastEncoder* enc, const uint8_t* row,
+                       const uint8_t* row_above) {
+    const size_t stride = enc->stride;
+    uint8_t* cur        = next_row(enc);
+    const bool has_up   = enc->up_ok && row_above;
+    const uint8_t* up   = has_up ? cur - stride : NULL;
+
+    /* A row with the same pixels as the one above is a copy of it */
+    if (has_up && memcmp(row, row_above, stride - 1) == 0) {
+        memcpy(cur, up, stride);
+        enc->adler = adler32(enc->adler, cur, stride);
+        enc->pos += stride;
+
+        emit_long_match(enc, stride, stride, enc->up_code);
+        return;
+    }
+
+    cur[0] = FILTER_NONE;
+    memcpy(cur + 1, row, stride - 1);
+    enc->adler = adler32(enc->adler, cur, stride);
+
+    /* The filter type is a literal, and the row starts after it */
+    emit_literal(enc, cur[0]);
+    for (size_t i = 1; i < stride;) {
+        const size_t max = (stride - i > MAX_MATCH) ? MAX_MATCH : stride - i;
+
+        /* Runs of the same pixel, usually the background */
+        size_t len    = 0;
+        uint32_t dist = COL_SZ;
+        if (i > COL_SZ)
+            len = match_len(cur + i, cur + i - COL_SZ, max);
+        if (has_up && len < max) {
+            const size_t up_len = match_len(cur + i, up + i, max);
+            if (up_len > len) {
+                len  = up_len;
+                dist = stride;
+            }
+        }
+
+        /* Anything else, usually the same glyph before in the row */
+        if (len < max && max >= sizeof(uint64_t))
+            len = hash_match(enc, cur + i, enc->pos + i, max, len, &dist);
+
+        if (len < MIN_MATCH) {
+            emit_literal(enc, cur[i]);
+            i++;
+            continue;
+        }
+
+        const int code = (dist == stride) ? enc->up_code : dist_code(dist);
+        emit_match(enc, len, dist, code);
+
+        /* The glyphs covered by the match can be found later too */
+        for (size_t j = i + HASH_STEP; j + sizeof(uint64_t) <= i + len;
+             j += HASH_STEP)
+            hash_insert(enc, cur + j, enc->pos + j);
+
+        i += len;
+    }
+
+    enc->pos += stride;
+}
+
+void fastpng_encode(const Canvas* canvas, ByteBuf* out) {
+    FastEncoder enc;
+    memset(&enc, 0, sizeof(enc));
+
+    enc.stride      = (size_t)canvas->w_px * COL_SZ + 1;
+    enc.up_ok       = enc.stride <= MAX_DIST;
+    enc.up_code     = enc.up_ok ? dist_code(enc.stride) : 0;
+    enc.history_cap = HISTORY_SZ + 2 * enc.stride;
+    enc.history     = malloc(enc.history_cap);
+    enc.hashes      = calloc(HASH_SZ * HASH_WAYS, sizeof(size_t));
+    enc.syms        = malloc((BLOCK_SYMS + enc.stride) * sizeof(uint32_t));
+    if (!enc.history || !enc.hashes || !enc.syms)
+        DIE("Can't allocate the PNG encoder\n");
+
+    enc.adler  = adler32(0, NULL, 0);
+    enc.bw.out = out;
+
+    png_start_image(out, canvas->w_px, canvas->h_px);
+
+    for (uint32_t y = 0; y < canvas->h_px; y++) {
+        encode_row(&enc, canvas->rows[y], y > 0 ? canvas->rows[y - 1] : NULL);
+        if (enc.num_syms >= BLOCK_SYMS)
+            write_block(&enc);
+    }
+    if (enc.num_syms > 0)
+        write_block(&enc);
+
+    /* Empty stored block, so the stream ends at a byte boundary before the
+     * final block of png_finish_image() */
+    const size_t start = png_chunk_begin(out, "IDAT");
+    byte_buf_reserve(out, MAX_HEADER_BYTES);
+    put_bits(&enc.bw, 0, 3);
+    put_bits(&enc.bw, 0, (8 - enc.bw.num_bits % 8) % 8);
+    put_bits(&enc.bw, 0xFFFF0000, 32);
+    flush_bytes(&enc.bw);
+    png_chunk_end(out, start);
+
+    png_finish_image(out, enc.adler);
+
+    free(enc.history);
+    free(enc.hashes);
+    free(enc.syms);
+}
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "include/fileio.h"
+#include "include/uring.h"
+#include "include/util.h"
+
+static size_t chunk_size(size_t size) {
+    return size > IO_CHUNK_SZ ? IO_CHUNK_SZ : size;
+}
+
+/* Errors that are not really errors, the request can be repeated */
+static bool is_retry(int res) {
+    return res == -EINTR || res == -EAGAIN;
+}
+
+/* Blocking write of the rest of the data, starting at `done' */
+static bool write_all(int fd, const uint8_t* data, size_t size, size_t done) {
+    while (done < size) {
+        const ssize_t ret = pwrite(fd, data + done, chunk_size(size - done),
+                                   done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        done += ret;
+    }
+
+    return true;
+}
+
+/* The ring can only fail to submit if something is very wrong, and the
+ * requests in it can't be tracked anymore */
+static void submit_or_die(Uring* ring, unsigned wait_nr) {
+    if (!uring_submit(ring, wait_nr)) {
+        fprintf(stderr, "io_uring submission failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void wait_or_die(Uring* ring, struct io_uring_cqe* cqe) {
+    if (!uring_wait(ring, cqe)) {
+        fprintf(stderr, "io_uring wait failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static bool window_has_space(const Prefetcher* pf) {
+    return pf->num_loaded == 0 || (pf->num_loaded < PREFETCH_FILES &&
+                                   pf->loaded_bytes < pf->max_bytes);
+}
+
+/* Change the size of a slot, keeping the size of the window */
+static void slot_resize(Prefetcher* pf, PrefetchSlot* slot, size_t size) {
+    pthread_mutex_lock(&pf->lock);
+    pf->loaded_bytes = pf->loaded_bytes - slot->size + size;
+    slot->size       = size;
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/* Allocate the buffer of an opened slot, with the size of the file */
+static bool slot_alloc(Prefetcher* pf, PrefetchSlot* slot) {
+    struct stat st;
+    if (fstat(slot->fd, &st) != 0)
+        return false;
+
+    slot->data = malloc(st.st_size > 0 ? st.st_size : 1);
+    slot->done = 0;
+    if (!slot->data)
+        return false;
+
+    slot_resize(pf, slot, st.st_size);
+    return true;
+}
+
+/* Close the slot and wake up the threads waiting for it */
+static void slot_finish(Prefetcher* pf, PrefetchSlot* slot, bool ok) {
+    if (slot->fd >= 0)
+        close(slot->fd);
+    slot->fd = -1;
+
+    if (!ok) {
+        free(slot->data);
+        slot->data = NULL;
+        slot_resize(pf, slot, 0);
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    slot->state = SLOT_READY;
+    pthread_cond_broadcast(&pf->cond_ready);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/* Read the whole slot with blocking calls */
+static bool load_sync(Prefetcher* pf, PrefetchSlot* slot) {
+    slot->fd = open(slot->path, O_RDONLY | O_CLOEXEC);
+    if (slot->fd < 0 || !slot_alloc(pf, slot))
+        return false;
+
+    while (slot->done < slot->size) {
+        const ssize_t ret = pread(slot->fd, slot->data + slot->done,
+                                  chunk_size(slot->size - slot->done),
+                                  slot->done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+
+        /* The file was truncated after opening it */
+        if (ret == 0) {
+            slot_resize(pf, slot, slot->done);
+            break;
+        }
+
+        slot->done += ret;
+    }
+
+    return true;
+}
+
+static void submit_open(Prefetcher* pf, size_t idx) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&pf->ring);
+    uring_prep_rw(sqe, IORING_OP_OPENAT, AT_FDCWD, pf->slots[idx].path, 0, 0,
+                  idx);
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    pf->in_flight++;
+}
+
+static void submit_read(Prefetcher* pf, size_t idx) {
+    PrefetchSlot* slot = &pf->slots[idx];
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&pf->ring);
+    uring_prep_rw(sqe, IORING_OP_READ, slot->fd, slot->data + slot->done,
+                  chunk_size(slot->size - slot->done), slot->done, idx);
+    pf->in_flight++;
+}
+
+/* Continue loading a slot after one of its requests finished */
+static void handle_read_cqe(Prefetcher* pf, const struct io_uring_cqe* cqe) {
+    const size_t idx   = cqe->user_data;
+    PrefetchSlot* slot = &pf->slots[idx];
+    pf->in_flight--;
+
+    /* Kernels without these operations, read it the old way */
+    if (cqe->res == -EINVAL) {
+        if (slot->fd >= 0) {
+            close(slot->fd);
+            slot->fd = -1;
+            free(slot->data);
+            slot->data = NULL;
+        }
+        slot_finish(pf, slot, load_sync(pf, slot));
+        return;
+    }
+
+    if (slot->fd < 0) {
+        /* Opened */
+        if (cqe->res < 0) {
+            slot_finish(pf, slot, false);
+            return;
+        }
+
+        slot->fd = cqe->res;
+        if (!slot_alloc(pf, slot)) {
+            slot_finish(pf, slot, false);
+            return;
+        }
+    } else if (is_retry(cqe->res)) {
+        /* Read again */
+    } else if (cqe->res < 0) {
+        slot_finish(pf, slot, false);
+        return;
+    } else if (cqe->res == 0) {
+        /* The file was truncated after opening it */
+        slot_resize(pf, slot, slot->done);
+    } else {
+        slot->done += cqe->res;
+    }
+
+    if (slot->done < slot->size)
+        submit_read(pf, idx);
+    else
+        slot_finish(pf, slot, true);
+}
+
+static void* prefetch_thread(void* arg) {
+    Prefetcher* pf = arg;
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        /* Start loading files while there is space in the window */
+        bool started = false;
+        while (!pf->stopping && pf->next < pf->num_slots &&
+               window_has_space(pf)) {
+            const size_t idx   = pf->order[pf->next++];
+            PrefetchSlot* slot = &pf->slots[idx];
+
+            /* Already taken */
+            if (slot->state != SLOT_IDLE)
+                continue;
+
+            slot->state = SLOT_LOADING;
+            pf->num_loaded++;
+            pthread_mutex_unlock(&pf->lock);
+
+            if (pf->use_ring)
+                submit_open(pf, idx);
+            else
+                slot_finish(pf, slot, load_sync(pf, slot));
+
+            started = true;
+            pthread_mutex_lock(&pf->lock);
+        }
+
+        if (pf->in_flight > 0) {
+            pthread_mutex_unlock(&pf->lock);
+
+            /* Handle every finished request, waiting for at least one */
+            if (started)
+                submit_or_die(&pf->ring, 0);
+
+            struct io_uring_cqe cqe;
+            wait_or_die(&pf->ring, &cqe);
+
+            do {
+                handle_read_cqe(pf, &cqe);
+            } while (uring_peek(&pf->ring, &cqe));
+
+            submit_or_die(&pf->ring, 0);
+            pthread_mutex_lock(&pf->lock);
+            continue;
+        }
+
+        if (pf->stopping || pf->next >= pf->num_slots)
+            break;
+
+        pthread_cond_wait(&pf->cond_space, &pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    return NULL;
+}
+
+bool prefetch_start(Prefetcher* pf, const char* const* paths,
+                    const size_t* order, size_t num_files, size_t max_bytes,
+                    bool use_uring) {
+    pf->slots = calloc(num_files > 0 ? num_files : 1, sizeof(PrefetchSlot));
+    pf->order = malloc((num_files > 0 ? num_files : 1) * sizeof(size_t));
+    if (!pf->slots || !pf->order) {
+        free(pf->slots);
+        free(pf->order);
+        return false;
+    }
+
+    for (size_t i = 0; i < num_files; i++) {
+        pf->slots[i].path  = paths[i];
+        pf->slots[i].state = SLOT_IDLE;
+        pf->slots[i].fd    = -1;
+    }
+    memcpy(pf->order, order, num_files * sizeof(size_t));
+
+    pf->num_slots    = num_files;
+    pf->next         = 0;
+    pf->num_loaded   = 0;
+    pf->loaded_bytes = 0;
+    pf->max_bytes    = max_bytes;
+    pf->in_flight    = 0;
+    pf->stopping     = false;
+    pf->hits         = 0;
+    pf->waits        = 0;
+    pf->misses       = 0;
+
+    /* A request in flight for each file of the window */
+    pf->use_ring = use_uring && uring_init(&pf->ring, PREFETCH_FILES);
+
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond_ready, NULL);
+    pthread_cond_init(&pf->cond_space, NULL);
+
+    return pthread_create(&pf->thread, NULL, prefetch_thread, pf) == 0;
+}
+
+char* prefetch_take(Prefetcher* pf, size_t idx, size_t* size) {
+    PrefetchSlot* slot = &pf->slots[idx];
+
+    pthread_mutex_lock(&pf->lock);
+
+    /* Not requested yet, don't wait for the rest of the window */
+    if (slot->state == SLOT_IDLE) {
+        slot->state = SLOT_TAKEN;
+        pf->misses++;
+        pthread_mutex_unlock(&pf->lock);
+
+        return read_file(slot->path, size);
+    }
+
+    if (slot->state == SLOT_LOADING)
+        pf->waits++;
+    else
+        pf->hits++;
+
+    while (slot->state == SLOT_LOADING)
+        pthread_cond_wait(&pf->cond_ready, &pf->lock);
+
+    char* ret = slot->data;
+    *size     = slot->size;
+
+    pf->num_loaded--;
+    pf->loaded_bytes -= slot->size;
+    slot->state = SLOT_TAKEN;
+    slot->data  = NULL;
+
+    pthread_cond_signal(&pf->cond_space);
+    pthread_mutex_unlock(&pf->lock);
+
+    return ret;
+}
+
+void prefetch_stop(Prefetcher* pf) {
+    pthread_mutex_lock(&pf->lock);
+    pf->stopping = true;
+    pthread_cond_signal(&pf->cond_space);
+    pthread_mutex_unlock(&pf->lock);
+
+    pthread_join(pf->thread, NULL);
+
+    for (size_t i = 0; i < pf->num_slots; i++)
+        free(pf->slots[i].data);
+
+    if (pf->use_ring)
+        uring_free(&pf->ring);
+
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond_ready);
+    pthread_cond_destroy(&pf->cond_space);
+    free(pf->slots);
+    free(pf->order);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Close the file and free the entry */
+static void write_finish(Writeback* wb, WriteOp* op, bool ok) {
+    if (close(op->fd) != 0)
+        ok = false;
+
+    if (ok) {
+        wb->written++;
+    } else {
+        fprintf(stderr, "Can't write output: \"%s\"\n", op->filename);
+        wb->failed = true;
+    }
+
+    free(op->filename);
+    free(op->data);
+    op->fd       = -1;
+    op->filename = NULL;
+    op->data     = NULL;
+}
+
+static void submit_write(Writeback* wb, size_t idx) {
+    WriteOp* op = &wb->ops[idx];
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&wb->ring);
+    uring_prep_rw(sqe, IORING_OP_WRITE, op->fd, (uint8_t*)op->data + op->done,
+                  chunk_size(op->size - op->done), op->done, idx);
+    submit_or_die(&wb->ring, 0);
+}
+
+void writeback_init(Writeback* wb, bool use_uring) {
+    for (int i = 0; i < WRITEBACK_DEPTH; i++)
+        wb->ops[i].fd = -1;
+
+    wb->in_flight = 0;
+    wb->written   = 0;
+    wb->failed    = false;
+    wb->use_ring  = use_uring && uring_init(&wb->ring, WRITEBACK_DEPTH);
+}
+
+bool writeback_submit(Writeback* wb, char* filename, void* data, size_t size) {
+    const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+    if (fd < 0) {
+        free(filename);
+        free(data);
+        return false;
+    }
+
+    WriteOp op = {
+        .fd       = fd,
+        .filename = filename,
+        .data     = data,
+        .size     = size,
+        .done     = 0,
+    };
+
+    if (!wb->use_ring || size == 0) {
+        write_finish(wb, &op, write_all(fd, data, size, 0));
+        return true;
+    }
+
+    while (wb->in_flight >= WRITEBACK_DEPTH)
+        writeback_reap(wb, true);
+
+    size_t idx = 0;
+    while (wb->ops[idx].fd >= 0)
+        idx++;
+
+    wb->ops[idx] = op;
+    wb->in_flight++;
+    submit_write(wb, idx);
+    return true;
+}
+
+void writeback_reap(Writeback* wb, bool wait) {
+    if (wb->in_flight == 0)
+        return;
+
+    struct io_uring_cqe cqe;
+    bool found = true;
+    if (wait)
+        wait_or_die(&wb->ring, &cqe);
+    else
+        found = uring_peek(&wb->ring, &cqe);
+
+    for (; found; found = uring_peek(&wb->ring, &cqe)) {
+        const size_t idx = cqe.user_data;
+        WriteOp* op      = &wb->ops[idx];
+
+        if (is_retry(cqe.res)) {
+            submit_write(wb, idx);
+            continue;
+        }
+
+        /* Kernels without the operation */
+        if (cqe.res == -EINVAL) {
+            wb->in_flight--;
+            write_finish(wb, op, write_all(op->fd, op->data, op->size,
+                                           op->done));
+            continue;
+        }
+
+        if (cqe.res > 0)
+            op->done += cqe.res;
+
+        if (cqe.res > 0 && op->done < op->size) {
+            submit_write(wb, idx);
+            continue;
+        }
+
+        wb->in_flight--;
+        write_finish(wb, op, cqe.res > 0);
+    }
+}
+
+bool writeback_finish(Writeback* wb) {
+    while (wb->in_flight > 0)
+        writeback_reap(wb, true);
+
+    if (wb->use_ring)
+        uring_free(&wb->ring);
+
+    return !wb->failed;
+}
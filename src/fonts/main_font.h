@@ -2,6 +2,8 @@
 #ifndef FONTS_MAIN_FONT_H_
 #define FONTS_MAIN_FONT_H_ 1
 
+#include <stdint.h>
+
 #include "font_defines.h"
 
 #define FONT_W 7
@@ -35,7 +37,12 @@
  *
  *      Font->font['C' * Font->h + y] & (0x80 >> x)
  *
+ * The array is only defined in the file that defines MAIN_FONT_IMPLEMENTATION,
+ * the rest just get the declaration and the FONT_W and FONT_H macros.
  */
+#ifndef MAIN_FONT_IMPLEMENTATION
+extern uint8_t main_font[];
+#else
 uint8_t main_font[] = {
     /* From 0 to 20, NULL */
     ________, /**/
@@ -3622,5 +3629,6 @@ uint8_t main_font[] = {
     ________, /**/
     ________, /**/
 };
+#endif /* MAIN_FONT_IMPLEMENTATION */
 
 #endif /* FONTS_MAIN_FONT_H_ */
@@ -0,0 +1,59 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "include/hash.h"
+
+/* Odd constants with balanced bits, one for each multiply chain */
+#define P0 0xa0761d6478bd642fULL
+#define P1 0xe7037ed1a0b428dbULL
+#define P2 0x8ebc6af09c88c6e3ULL
+#define P3 0x589965cc75374cc3ULL
+
+/* Full 64x64 -> 128 bit multiplication, with both halves folded together */
+static inline uint64_t mum(uint64_t a, uint64_t b) {
+    const __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+Hash128 hash128(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = data;
+    size_t left      = size;
+
+    uint64_t s0 = seed ^ P0, s1 = seed ^ P1, s2 = seed ^ P2, s3 = seed ^ P3;
+
+    /* The four chains don't depend on each other */
+    for (; left >= 64; left -= 64, p += 64) {
+        s0 = mum(read64(p) ^ P1, read64(p + 8) ^ s0);
+        s1 = mum(read64(p + 16) ^ P2, read64(p + 24) ^ s1);
+        s2 = mum(read64(p + 32) ^ P3, read64(p + 40) ^ s2);
+        s3 = mum(read64(p + 48) ^ P0, read64(p + 56) ^ s3);
+    }
+
+    for (; left >= 16; left -= 16, p += 16)
+        s0 = mum(read64(p) ^ P1, read64(p + 8) ^ s0);
+
+    /* The last bytes are padded with zeros, the size is mixed below */
+    uint8_t tail[16] = { 0 };
+    memcpy(tail, p, left);
+    s1 = mum(read64(tail) ^ P2, read64(tail + 8) ^ s1);
+
+    const uint64_t h0 = mum(s0 ^ P3, s1 ^ size);
+    const uint64_t h1 = mum(s2 ^ P1, s3 ^ (size >> 32) ^ P2);
+
+    return (Hash128){
+        .lo = mum(h0 ^ P0, h1 ^ P1),
+        .hi = mum(h0 ^ P2, h1 ^ P3),
+    };
+}
+
+uint64_t hash64(const void* data, size_t size, uint64_t seed) {
+    const Hash128 h = hash128(data, size, seed);
+    return h.lo ^ h.hi;
+}
@@ -49,17 +49,6 @@
 #define _POSIX_C_SOURCE 200809L
 #include "include/highlight.h"
 
-/* States. */
-#define HL_DEFAULT                     0
-#define HL_KEYWORD                     1
-#define HL_NUMBER                      3
-#define HL_CHAR                        4
-#define HL_STRING                      5
-#define HL_COMMENT_MULTI               6
-#define HL_PREPROCESSOR                7
-#define HL_PREPROCESSOR_INCLUDE        8
-#define HL_PREPROCESSOR_INCLUDE_STRING 9
-
 /* Themes. */
 #define COLOR_8       0  /* 8-colors theme.     */
 #define ELF_DEITY     8  /* Elf Deity theme.    */
@@ -160,11 +149,18 @@ int LENGTHS[] = {
 	4
 };
 
-/* Global state. */
+/*
+ * Global state.
+ *
+ * Each thread has its own, so different files (or different
+ * parts of the same file) can be highlighted in parallel.
+ */
 struct global_state
 {
 	int state;
-} gs = {
+};
+
+_Thread_local struct global_state gs = {
 	.state = HL_DEFAULT
 };
 
@@ -233,22 +229,41 @@ unsigned char symbols_table[256] =
 char* highlight_alloc_line(void)
 {
 	struct highlighted_line *hl;
-	hl = calloc(1, sizeof(struct highlighted_line) + (sizeof(char) * 80));
+	hl = arena_alloc(arena_thread(),
+		sizeof(struct highlighted_line) + (sizeof(char) * 80));
 	hl->idx = 0;
 	hl->size = 80;
 	return ((char*)(hl+1));
 }
 
+/**
+ * Grows a Highlighted Line Buffer, whose size has already
+ * been increased, keeping its contents.
+ *
+ * @param hl Highlighted line, with the new size.
+ * @param old_size Previous size of the buffer.
+ *
+ * @return Returns the highlighted line, which may have moved.
+ */
+struct highlighted_line *highlight_grow_line(struct highlighted_line *hl,
+	size_t old_size)
+{
+	return (arena_grow(arena_thread(), hl,
+		sizeof(struct highlighted_line) + old_size,
+		sizeof(struct highlighted_line) + hl->size));
+}
+
 /**
  * Deallocate a Highlighted Line Buffer.
  *
+ * The buffers live in the arena of the thread, so they are
+ * actually freed when the arena is rewound or reset.
+ *
  * @param line Highlighted Line Buffer to be deallocated.
  */
 void highlight_free(char *line)
 {
-	struct highlighted_line *hl;
-	hl = ((struct highlighted_line *)line - 1);
-	free(hl);
+	((void)line);
 }
 
 /**
@@ -276,12 +291,15 @@ static struct keyword* is_keyword(const char *key, size_t size)
 
 	/*
 	 * Otherwise, we should temporarily allocate a new string
-	 * in order to use as parameter of hashtable.
+	 * in order to use as parameter of hashtable, from the
+	 * arena of the thread.
 	 *
 	 * I hope the overhead copy (in order to use hashtable) will
 	 * compensate the O(n) iterations through the list.
 	 */
-	char *nkey = malloc(sizeof(char) * (size+1));
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	char *nkey = arena_alloc(arena, sizeof(char) * (size+1));
 	memcpy(nkey, key, size);
 	nkey[size] = '\0';
 
@@ -290,7 +308,7 @@ static struct keyword* is_keyword(const char *key, size_t size)
 	 * some keyword.
 	 */
 	k = hashtable_get(&ht_keywords, nkey);
-	free(nkey);
+	arena_rewind(arena, mark);
 	return (k);
 }
 
@@ -387,7 +405,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 						tok_size = str_size - i;
 						hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+COMMENT_COLOR],
 							LENGTHS[CURRENT_THEME+COMMENT_COLOR]);
-						hl = add_str_to_hl(hl, line+i, tok_size);
+						hl = add_src_to_hl(hl, line+i, tok_size);
 						hl = add_str_to_hl(hl, RESET_COLOR, 4);
 
 						/* string terminator \'0', =). */
@@ -424,7 +442,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 				else if (highlight_symbol(line[i], &hl))
 					continue;
 
-				hl = add_char_to_hl(hl, line[i]);
+				hl = add_src_char_to_hl(hl, line[i]);
 			}
 			break;
 
@@ -444,12 +462,12 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 					{
 						hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+keyword->color],
 							LENGTHS[CURRENT_THEME+keyword->color]);
-						hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+						hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 						hl = add_str_to_hl(hl, RESET_COLOR, 4);
 
 						/* Maybe we should highlight this remaining char. */
 						if (!highlight_symbol(line[i], &hl))
-							hl = add_char_to_hl(hl, line[i]);
+							hl = add_src_char_to_hl(hl, line[i]);
 						continue;
 					}
 
@@ -466,7 +484,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 						gs.state = HL_DEFAULT;
 						hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+FUNC_CALL_COLOR],
 							LENGTHS[CURRENT_THEME+FUNC_CALL_COLOR]);
-						hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+						hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 						hl = add_str_to_hl(hl, RESET_COLOR, 4);
 
 						/* Opening parenthesis will always be highlighted */
@@ -474,11 +492,11 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 						continue;
 					}
 
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 
 					/* Maybe we should highlight this remaining char. */
 					if (!highlight_symbol(line[i], &hl))
-						hl = add_char_to_hl(hl, line[i]);
+						hl = add_src_char_to_hl(hl, line[i]);
 					continue;
 				}
 			}
@@ -519,21 +537,21 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 					{
 						hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+NUMBER_COLOR],
 							LENGTHS[CURRENT_THEME+NUMBER_COLOR]);
-						hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+						hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 						hl = add_str_to_hl(hl, RESET_COLOR, 4);
 
 						/* Maybe we should highlight this remaining char. */
 						if (!highlight_symbol(line[i], &hl))
-							hl = add_char_to_hl(hl, line[i]);
+							hl = add_src_char_to_hl(hl, line[i]);
 						continue;
 					}
 
 					/* Otherwise, something else. */
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 
 					/* Maybe we should highlight this remaining char. */
 					if (!highlight_symbol(line[i], &hl))
-						hl = add_char_to_hl(hl, line[i]);
+						hl = add_src_char_to_hl(hl, line[i]);
 					continue;
 				}
 			}
@@ -551,8 +569,8 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 
 					hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+STRING_COLOR],
 						LENGTHS[CURRENT_THEME+STRING_COLOR]);
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
-					hl = add_char_to_hl(hl, line[i]);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_char_to_hl(hl, line[i]);
 					hl = add_str_to_hl(hl, RESET_COLOR, 4);
 					continue;
 				}
@@ -563,7 +581,8 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 			case HL_STRING:
 			{
 				/* Should we end char state?. */
-				if (i == str_size || (line[i] == '"' && line[i - 1] != '\\'))
+				if (i == str_size || (line[i] == '"' &&
+					(i == 0 || line[i - 1] != '\\')))
 				{
 					if (i == str_size)
 						keyword_end = i - 1;
@@ -576,7 +595,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 					tok_size = keyword_end - keyword_start + 1;
 					hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+STRING_COLOR],
 						LENGTHS[CURRENT_THEME+STRING_COLOR]);
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 					hl = add_str_to_hl(hl, RESET_COLOR, 4);
 					if (i == str_size)
 						hl = add_char_to_hl(hl, '\0');
@@ -607,7 +626,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 					tok_size = keyword_end - keyword_start + 1;
 					hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+COMMENT_COLOR],
 						LENGTHS[CURRENT_THEME+COMMENT_COLOR]);
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 					hl = add_str_to_hl(hl, RESET_COLOR, 4);
 					if (i == str_size)
 						hl = add_char_to_hl(hl, '\0');
@@ -650,7 +669,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 
 					hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+PREPROC_COLOR],
 						LENGTHS[CURRENT_THEME+PREPROC_COLOR]);
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 					hl = add_str_to_hl(hl, RESET_COLOR, 4);
 				}
 			}
@@ -684,7 +703,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 						tok_size = i - keyword_start;
 						hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+PREPROC_COLOR],
 							LENGTHS[CURRENT_THEME+PREPROC_COLOR]);
-						hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+						hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 						hl = add_str_to_hl(hl, RESET_COLOR, 4);
 						keyword_start = i;
 						gs.state = HL_PREPROCESSOR_INCLUDE_STRING;
@@ -701,7 +720,7 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 
 					hl = add_str_to_hl(hl, COLORS[CURRENT_THEME+STRING_COLOR],
 						LENGTHS[CURRENT_THEME+STRING_COLOR]);
-					hl = add_str_to_hl(hl, line+keyword_start, tok_size);
+					hl = add_src_to_hl(hl, line+keyword_start, tok_size);
 					hl = add_str_to_hl(hl, RESET_COLOR, 4);
 					continue;
 				}
@@ -715,6 +734,196 @@ char *highlight_line(const char *line, char *hl, size_t str_size)
 	return (hl);
 }
 
+/**
+ * For a given line @p line, and the state the lexer is in
+ * at the start of the line, returns the state at the end of
+ * the line, without highlighting anything.
+ *
+ * The transitions are exactly the same as highlight_line(),
+ * but since the only state that survives a line is the one
+ * of unterminated comments, strings and includes, this is
+ * much faster than highlighting the whole line.
+ *
+ * @param line Line (null terminated string) to be scanned.
+ * @param str_size Line size.
+ * @param state Lexer state at the start of the line.
+ *
+ * @return Returns the lexer state at the end of the line.
+ */
+int highlight_line_state(const char *line, size_t str_size, int state)
+{
+	for (size_t i = 0; i < str_size+1; i++)
+	{
+		switch (state)
+		{
+			case HL_DEFAULT:
+				if (is_char_keyword(line[i]) && !isdigit(line[i]))
+					state = HL_KEYWORD;
+				else if (isdigit(line[i]))
+					state = HL_NUMBER;
+				else if (line[i] == '\'')
+					state = HL_CHAR;
+				else if (line[i] == '"')
+					state = HL_STRING;
+				else if (line[i] == '/' && i+1 < str_size)
+				{
+					/* Line comment, nothing else can change the state. */
+					if (line[i+1] == '/')
+						return (state);
+					else if (line[i+1] == '*')
+					{
+						state = HL_COMMENT_MULTI;
+						i += 1;
+					}
+				}
+				else if (line[i] == '#')
+					state = HL_PREPROCESSOR;
+				break;
+
+			/* The char that ends a keyword or number is consumed. */
+			case HL_KEYWORD:
+				if (!is_char_keyword(line[i]))
+					state = HL_DEFAULT;
+				break;
+
+			case HL_NUMBER:
+			{
+				char c = tolower(line[i]);
+				if (!isdigit(c) && (c < 'a' || c > 'f') && c != 'b' &&
+					c != 'x' && c != 'u' && c != 'l' && c != '.')
+					state = HL_DEFAULT;
+			}
+			break;
+
+			case HL_CHAR:
+				if (i == str_size || (line[i] == '\'' && line[i + 1] != '\''))
+					state = HL_DEFAULT;
+				break;
+
+			/* Unterminated strings continue in the next line. */
+			case HL_STRING:
+				if (i != str_size && line[i] == '"' &&
+					(i == 0 || line[i - 1] != '\\'))
+					state = HL_DEFAULT;
+				break;
+
+			case HL_COMMENT_MULTI:
+				if (i != str_size && line[i] == '*' && i+1 < str_size &&
+					line[i+1] == '/')
+				{
+					state = HL_DEFAULT;
+					i += 1;
+				}
+				break;
+
+			case HL_PREPROCESSOR:
+				if (line[i] == 'i' && i+6 < str_size &&
+					!strncmp(line+i, "include", 7))
+				{
+					state = HL_PREPROCESSOR_INCLUDE;
+					i += 6;
+					break;
+				}
+
+				if (i >= str_size-1)
+					state = HL_DEFAULT;
+				break;
+
+			case HL_PREPROCESSOR_INCLUDE:
+				if (line[i] == '<' || line[i] == '"' || i == str_size)
+					state = HL_PREPROCESSOR_INCLUDE_STRING;
+				break;
+
+			case HL_PREPROCESSOR_INCLUDE_STRING:
+				if (line[i] == '>' || line[i] == '"' || i == str_size)
+					state = HL_DEFAULT;
+				break;
+
+			default:
+				break;
+		}
+	}
+	return (state);
+}
+
+/* Characters that can change the state of a line, see highlight_text_state(). */
+#define SC_QUOTE 0x01
+#define SC_SLASH 0x02
+#define SC_HASH  0x04
+#define SC_STAR  0x08
+
+static const unsigned char state_chars[256] =
+{
+	['"'] = SC_QUOTE, ['/'] = SC_SLASH, ['#'] = SC_HASH, ['*'] = SC_STAR
+};
+
+/**
+ * For a given text @p text made of whole lines, each ending
+ * in a newline, and the state the lexer is in at the start
+ * of the text, returns the state at the start of the next
+ * line, the same as calling highlight_line_state() for each
+ * line.
+ *
+ * Most lines start in the default state and don't have any
+ * quote, slash or hash, so they can't end in a comment or
+ * string. Same for comments without stars and strings without
+ * quotes. Those lines are skipped after a single table lookup
+ * per char, and the rest are scanned with highlight_line_state().
+ *
+ * @param text Lines to be scanned.
+ * @param size Text size.
+ * @param state Lexer state at the start of the text.
+ *
+ * @return Returns the lexer state at the end of the text.
+ */
+int highlight_text_state(const char *text, size_t size, int state)
+{
+	size_t start = 0;
+	while (start < size)
+	{
+		unsigned char seen = 0;
+		size_t end = start;
+
+		while (end < size && text[end] != '\n')
+			seen |= state_chars[(unsigned char)text[end++]];
+
+		if (end == size)
+			break;
+
+		if ((state == HL_DEFAULT && (seen & (SC_QUOTE|SC_SLASH|SC_HASH))) ||
+			(state == HL_COMMENT_MULTI && (seen & SC_STAR)) ||
+			(state == HL_STRING && (seen & SC_QUOTE)) ||
+			(state != HL_DEFAULT && state != HL_COMMENT_MULTI &&
+			state != HL_STRING))
+		{
+			state = highlight_line_state(text + start, end - start, state);
+		}
+
+		start = end + 1;
+	}
+	return (state);
+}
+
+/**
+ * Returns the current lexer state of this thread.
+ */
+int highlight_get_state(void)
+{
+	return (gs.state);
+}
+
+/**
+ * Sets the lexer state of this thread, used for the next
+ * call to highlight_line().
+ *
+ * @param state New lexer state, usually HL_DEFAULT or the
+ * value returned by highlight_line_state().
+ */
+void highlight_set_state(int state)
+{
+	gs.state = state;
+}
+
 /**
  * Safe string-to-int routine that takes into account:
  * - Overflow and Underflow
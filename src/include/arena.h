@@ -0,0 +1,70 @@
+#ifndef ARENA_H_
+#define ARENA_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the first chunk of an arena, and alignment of each allocation */
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_ALIGN     16
+
+/* Bigger chunks are returned to the system when the arena is reset */
+#define ARENA_KEEP_MAX (32 * 1024 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* prev;
+    size_t size, used;
+} ArenaChunk;
+
+/*
+ * Bump allocator for the scratch memory of a render. Allocations are never
+ * freed one by one, the whole arena is reset between files. Each chunk is at
+ * least twice as big as the previous one, and the biggest chunk is kept after
+ * a reset, so once it's warm a render doesn't call malloc() at all.
+ */
+typedef struct {
+    /* Chunk where the allocations are made, older chunks are linked by prev */
+    ArenaChunk* head;
+
+    /* Biggest unused chunk, taken before allocating a new one */
+    ArenaChunk* spare;
+
+    /* Stats not added to arena_totals() yet */
+    uint64_t allocs, mallocs;
+} Arena;
+
+/* Position of an arena, see arena_rewind() */
+typedef struct {
+    ArenaChunk* chunk;
+    size_t used;
+} ArenaMark;
+
+void arena_init(Arena* arena);
+
+/* Free all the chunks of the arena */
+void arena_destroy(Arena* arena);
+
+/* Allocate `size' bytes. Never returns NULL */
+void* arena_alloc(Arena* arena, size_t size);
+
+/* Grow an allocation from `old_sz' to `new_sz' bytes. If it's the last one, it
+ * grows in place when it fits, otherwise it's copied. */
+void* arena_grow(Arena* arena, void* ptr, size_t old_sz, size_t new_sz);
+
+/* Get the current position of the arena, and free everything allocated after
+ * it. Marks must be rewound in reverse order. */
+ArenaMark arena_mark(const Arena* arena);
+void arena_rewind(Arena* arena, ArenaMark mark);
+
+/* Free everything in O(1), keeping the biggest chunk for the next render */
+void arena_reset(Arena* arena);
+
+/* Arena of the calling thread, created on the first call and destroyed when
+ * the thread exits */
+Arena* arena_thread(void);
+
+/* Allocations made by all the arenas, and the malloc() calls they needed.
+ * Only counts arenas that have been rewound, reset or destroyed. */
+void arena_totals(uint64_t* allocs, uint64_t* mallocs);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,71 @@
+#ifndef BANDENC_H_
+#define BANDENC_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/* Growable buffer of encoded bytes */
+typedef struct {
+    uint8_t* data;
+    size_t size, cap;
+} ByteBuf;
+
+/*
+ * Encodes bands of rows of a PNG as IDAT chunks that don't depend on each
+ * other, so the chunk of a band can be copied to another image with the same
+ * rows in any position:
+ *
+ *   - The first row of each band is filtered with Sub, which doesn't use the
+ *     row above. The rest use Sub or Up, the one with the smallest sum of
+ *     absolute values, like libpng does.
+ *   - Each band is a raw deflate stream without the final block, compressed
+ *     from an empty window and ended with a full flush, so it ends at a byte
+ *     boundary.
+ *
+ * The zlib header is written by png_start_image(), and the final block and
+ * the Adler-32 of the whole image by png_finish_image(). The Adler-32 of the
+ * bands are combined with adler32_combine().
+ */
+typedef struct {
+    z_stream zs;
+    size_t row_sz;
+
+    /* Filter type and filtered bytes of a row, and the other filter */
+    uint8_t* filtered;
+    uint8_t* other;
+} BandEncoder;
+
+/* Grow the buffer to have space for at least `extra' more bytes */
+void byte_buf_reserve(ByteBuf* buf, size_t extra);
+
+/* Append the data to the buffer, growing it if needed */
+void byte_buf_append(ByteBuf* buf, const void* data, size_t size);
+
+/* Append the length and the type of a chunk, and return where it starts. The
+ * data is appended after it, and then png_chunk_end() is called. */
+size_t png_chunk_begin(ByteBuf* buf, const char* type);
+
+/* Fill the length of the chunk, and append the CRC of its type and data */
+void png_chunk_end(ByteBuf* buf, size_t start);
+
+/* Initialize the encoder for rows of `row_sz' bytes. Returns false on error */
+bool band_encoder_init(BandEncoder* enc, size_t row_sz);
+
+void band_encoder_destroy(BandEncoder* enc);
+
+/* Filter and compress the rows, and append them as an IDAT chunk. Returns the
+ * Adler-32 of the filtered rows, which are `num_rows * (row_sz + 1)' bytes */
+uint32_t band_encode(BandEncoder* enc, uint8_t* const* rows,
+                     uint32_t num_rows, ByteBuf* out);
+
+/* Append the PNG signature, the IHDR chunk of a RGBA image and an IDAT chunk
+ * with the zlib header */
+void png_start_image(ByteBuf* out, uint32_t w_px, uint32_t h_px);
+
+/* Append an IDAT chunk with the final deflate block and the Adler-32 of all
+ * the filtered rows, and the IEND chunk */
+void png_finish_image(ByteBuf* out, uint32_t adler);
+
+#endif /* BANDENC_H_ */
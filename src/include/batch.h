@@ -0,0 +1,90 @@
+#ifndef BATCH_H_
+#define BATCH_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sink.h"
+#include "budget.h"
+#include "cache.h"
+
+/* Files with more lines than this are split into bands of BAND_LINES lines,
+ * rendered as separate jobs into the same canvas */
+#define BAND_LINES      1024
+#define SPLIT_MIN_LINES (2 * BAND_LINES)
+
+typedef struct {
+    /* Path of the source on disk */
+    char* path;
+
+    /* Relative path of the output image, inside the output directory or tar */
+    char* name;
+
+    /* Size of the source, used for scheduling */
+    uint64_t size;
+} BatchFile;
+
+/* Which files are rendered when walking a directory tree. Each list can be
+ * empty, see path_matches() */
+typedef struct {
+    /* Extensions without the dot, like "c" */
+    char* const* exts;
+    int num_exts;
+
+    /* Shell patterns matched against the name and relative path of files and
+     * directories. Matching directories are not walked */
+    char* const* ignores;
+    int num_ignores;
+
+    /* Shell patterns that the relative path of files must match */
+    char* const* filters;
+    int num_filters;
+} WalkFilter;
+
+typedef struct {
+    int rendered;
+    int skipped;
+    int split;
+    int steals;
+    int banded;
+
+    /* Sources that were read ahead, that had to be waited for, and that were
+     * read by the workers themselves */
+    int prefetched;
+    int read_waits;
+    int read_direct;
+    bool io_uring;
+} BatchStats;
+
+/* Recursively find the files that should be rendered inside `root', sorted by
+ * path. Hidden files and directories are ignored. */
+bool walk_tree(const char* root, const WalkFilter* filter, BatchFile** files,
+               size_t* num_files);
+
+/* Check if a file or directory found inside the tree would be rendered or
+ * walked by walk_tree(), from its name and its path relative to the root.
+ * Hidden ones are not. */
+bool walk_filter_accepts(const WalkFilter* filter, const char* name,
+                         const char* rel, bool is_dir);
+
+/* Free the list returned by walk_tree() */
+void batch_files_free(BatchFile* files, size_t num_files);
+
+/* Render all the files with `num_threads' workers, and submit them to the sink
+ * in the order of the list. The highlighter must have been initialized.
+ *
+ * The sources are read ahead by a separate thread, with io_uring if
+ * `use_uring' is set and it's available.
+ *
+ * If `budget' is not NULL, each job reserves its estimated memory before
+ * allocating anything. Jobs that don't fit wait for others to finish, and
+ * jobs that would never fit are rendered in bands of rows.
+ *
+ * If `cache' is not NULL, the images of the sources that are cached are
+ * submitted without rendering them, and the rest are added to it. */
+void batch_render(const BatchFile* files, size_t num_files, int num_threads,
+                  MemBudget* budget, bool use_uring, RenderCache* cache,
+                  Sink* sink, BatchStats* stats);
+
+#endif /* BATCH_H_ */
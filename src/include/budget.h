@@ -0,0 +1,34 @@
+#ifndef BUDGET_H_
+#define BUDGET_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Process-wide memory semaphore. Jobs reserve their estimated footprint before
+ * allocating anything, and wait until it fits under the limit.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    size_t limit;
+    size_t used;
+
+    /* Stats */
+    size_t peak;
+    int waits;
+} MemBudget;
+
+void budget_init(MemBudget* budget, size_t limit);
+void budget_destroy(MemBudget* budget);
+
+/* Wait until `size' bytes fit in the budget and reserve them. Sizes over the
+ * limit must not be reserved, they would never fit. */
+void budget_reserve(MemBudget* budget, size_t size);
+
+/* Return previously reserved bytes to the budget */
+void budget_release(MemBudget* budget, size_t size);
+
+#endif /* BUDGET_H_ */
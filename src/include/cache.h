@@ -0,0 +1,66 @@
+#ifndef CACHE_H_
+#define CACHE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "hash.h"
+
+/* Default maximum size of the cached images */
+#define CACHE_DEFAULT_SIZE (256 * 1024 * 1024)
+
+/* Temporary files older than this were left by a process that died */
+#define CACHE_TMP_MAX_AGE (60 * 60) /* sec */
+
+/*
+ * Directory of rendered images, named after the hash of their source and the
+ * render configuration. Entries are written to a temporary file and renamed,
+ * so other processes never see them half-written. The modification time of
+ * each entry is updated when it's used, and the least recently used entries
+ * are removed when the cache is closed if it's bigger than `max_size'.
+ *
+ * The functions can be called from different threads.
+ */
+typedef struct {
+    char* dir;
+    uint64_t max_size;
+
+    /* See render_config_hash() */
+    uint64_t seed;
+
+    /* Used for the names of the temporary files */
+    atomic_uint tmp_seq;
+
+    /* Stats */
+    atomic_int hits, misses, stores, evicted;
+} RenderCache;
+
+/* Create the cache directory if needed. Returns false on error */
+bool cache_open(RenderCache* cache, const char* dir, uint64_t max_size,
+                uint64_t seed);
+
+/* Remove the least recently used entries if the cache is too big, but only if
+ * something was stored. */
+void cache_close(RenderCache* cache);
+
+/* Key of the image of a source */
+Hash128 cache_key(const RenderCache* cache, const void* src, size_t src_sz);
+
+/* If the image is cached, copy it to the output file. Returns false if it's
+ * not cached. */
+bool cache_copy(RenderCache* cache, Hash128 key, const char* out);
+
+/* If the image is cached, read it into a new allocated buffer and store its
+ * size. Returns NULL if it's not cached. */
+void* cache_load(RenderCache* cache, Hash128 key, size_t* size);
+
+/* Add an image in memory to the cache */
+void cache_store(RenderCache* cache, Hash128 key, const void* data,
+                 size_t size);
+
+/* Add a copy of an image file to the cache */
+void cache_store_file(RenderCache* cache, Hash128 key, const char* path);
+
+#endif /* CACHE_H_ */
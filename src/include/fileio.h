@@ -0,0 +1,131 @@
+#ifndef FILEIO_H_
+#define FILEIO_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "uring.h"
+
+/* Maximum number of sources read ahead and not taken yet, and their size. A
+ * single file bigger than the window is still read ahead. */
+#define PREFETCH_FILES 64
+#define PREFETCH_BYTES (64 * 1024 * 1024)
+
+/* Maximum number of images being written at the same time */
+#define WRITEBACK_DEPTH 32
+
+/* Maximum size of a single read or write request */
+#define IO_CHUNK_SZ (1 << 30)
+
+enum EPrefetchState {
+    SLOT_IDLE,
+    SLOT_LOADING,
+    SLOT_READY,
+    SLOT_TAKEN,
+};
+
+typedef struct {
+    const char* path;
+    enum EPrefetchState state;
+
+    /* Open while loading */
+    int fd;
+
+    /* NULL when ready if the file couldn't be read */
+    char* data;
+    size_t size, done;
+} PrefetchSlot;
+
+/*
+ * Reads the sources of a multi-file render in a background thread, ahead of
+ * the workers that need them, so rendering doesn't wait for the filesystem.
+ * With io_uring, the opens and reads of the whole window are in flight at the
+ * same time. Otherwise, the thread reads them one by one with pread().
+ */
+typedef struct {
+    PrefetchSlot* slots;
+    size_t num_slots;
+
+    /* Order in which the slots are expected to be taken */
+    size_t* order;
+    size_t next;
+
+    /* Slots loading or ready, and the size of the ones already opened */
+    size_t num_loaded;
+    size_t loaded_bytes;
+    size_t max_bytes;
+
+    Uring ring;
+    bool use_ring;
+    unsigned in_flight;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_ready;
+    pthread_cond_t cond_space;
+    bool stopping;
+
+    /* Stats: sources that were ready, that had to be waited for, and that
+     * were read by the caller because they were not requested yet */
+    int hits, waits, misses;
+} Prefetcher;
+
+/* Start reading the files in the specified order, which is a permutation of
+ * the indexes of `paths'. The paths must outlive the prefetcher. If
+ * `use_uring' is false or io_uring is not available, pread() is used. */
+bool prefetch_start(Prefetcher* pf, const char* const* paths,
+                    const size_t* order, size_t num_files, size_t max_bytes,
+                    bool use_uring);
+
+/* Get the contents of a file, waiting for it if it's being read, or reading
+ * it right away if it was not requested yet. The caller owns the returned
+ * buffer. Returns NULL on error. Each file can only be taken once. */
+char* prefetch_take(Prefetcher* pf, size_t idx, size_t* size);
+
+/* Wait for the reads in flight and free the sources that were not taken */
+void prefetch_stop(Prefetcher* pf);
+
+/*----------------------------------------------------------------------------*/
+
+typedef struct {
+    /* Negative if the entry is free */
+    int fd;
+    char* filename;
+    void* data;
+    size_t size, done;
+} WriteOp;
+
+/*
+ * Writes whole files without waiting for them, up to WRITEBACK_DEPTH at the
+ * same time. Without io_uring, the writes are blocking. Must only be used by
+ * one thread.
+ */
+typedef struct {
+    Uring ring;
+    bool use_ring;
+
+    WriteOp ops[WRITEBACK_DEPTH];
+    unsigned in_flight;
+
+    int written;
+    bool failed;
+} Writeback;
+
+void writeback_init(Writeback* wb, bool use_uring);
+
+/* Create the file and start writing the data. The ownership of the filename
+ * and the data is transferred, they are freed when the write finishes. Waits
+ * if there are too many writes in flight. Returns false if the file can't be
+ * created. */
+bool writeback_submit(Writeback* wb, char* filename, void* data, size_t size);
+
+/* Handle the finished writes. If `wait' is true and there are writes in
+ * flight, wait for at least one. */
+void writeback_reap(Writeback* wb, bool wait);
+
+/* Wait for all the writes. Returns false if any of them failed. */
+bool writeback_finish(Writeback* wb);
+
+#endif /* FILEIO_H_ */
@@ -0,0 +1,22 @@
+#ifndef HASH_H_
+#define HASH_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t lo, hi;
+} Hash128;
+
+/*
+ * Non-cryptographic 128-bit hash, used for content-addressed keys. The input
+ * is read in stripes of 64 bytes by four independent multiply chains, so it
+ * runs at several bytes per cycle on 64-bit CPUs. Short inputs only take a
+ * couple of multiplications. The result depends on the byte order of the CPU.
+ */
+Hash128 hash128(const void* data, size_t size, uint64_t seed);
+
+/* Same as hash128(), folded to 64 bits */
+uint64_t hash64(const void* data, size_t size, uint64_t seed);
+
+#endif /* HASH_H_ */
@@ -31,6 +31,7 @@
 	#include <limits.h>
 	#include <errno.h>
 	#include "hashtable.h"
+	#include "arena.h"
 
 	/* External definitions. */
 	extern char *COLORS[];
@@ -38,8 +39,20 @@
 	extern unsigned char symbols_table[];
 	extern int CURRENT_THEME;
 
+	/* States. */
+	#define HL_DEFAULT                     0
+	#define HL_KEYWORD                     1
+	#define HL_NUMBER                      3
+	#define HL_CHAR                        4
+	#define HL_STRING                      5
+	#define HL_COMMENT_MULTI               6
+	#define HL_PREPROCESSOR                7
+	#define HL_PREPROCESSOR_INCLUDE        8
+	#define HL_PREPROCESSOR_INCLUDE_STRING 9
+
     /* Colors constants.
 	 * NOTE: See EPaletteIndexes in main.c */
+	#define ESCAPE_CHAR   0x1B
 	#define RESET_COLOR   "\x1B\x00\x09"
 	#define PREPROC_COLOR    0
 	#define TYPES_COLOR      1
@@ -76,9 +89,24 @@
 	 */
 	extern char* highlight_alloc_line(void);
 
+	/**
+	 * Grows a Highlighted Line Buffer, whose size has already
+	 * been increased, keeping its contents.
+	 *
+	 * @param hl Highlighted line, with the new size.
+	 * @param old_size Previous size of the buffer.
+	 *
+	 * @return Returns the highlighted line, which may have moved.
+	 */
+	extern struct highlighted_line *highlight_grow_line(
+		struct highlighted_line *hl, size_t old_size);
+
 	/**
 	 * Deallocate a Highlighted Line Buffer.
 	 *
+	 * The buffers live in the arena of the thread, so they are
+	 * actually freed when the arena is rewound or reset.
+	 *
 	 * @param line Highlighted Line Buffer to be deallocated.
 	 */
 	extern void highlight_free(char *line);
@@ -95,6 +123,48 @@
 	 */
 	extern char *highlight_line(const char *line, char *hl, size_t str_size);
 
+	/**
+	 * For a given line @p line, and the state the lexer is in
+	 * at the start of the line, returns the state at the end of
+	 * the line, without highlighting anything.
+	 *
+	 * @param line Line (null terminated string) to be scanned.
+	 * @param str_size Line size.
+	 * @param state Lexer state at the start of the line.
+	 *
+	 * @return Returns the lexer state at the end of the line.
+	 */
+	extern int highlight_line_state(const char *line, size_t str_size,
+		int state);
+
+	/**
+	 * For a given text @p text made of whole lines, each ending
+	 * in a newline, and the state the lexer is in at the start
+	 * of the text, returns the state at the start of the next
+	 * line, skipping quickly the lines that can't change it.
+	 *
+	 * @param text Lines to be scanned.
+	 * @param size Text size.
+	 * @param state Lexer state at the start of the text.
+	 *
+	 * @return Returns the lexer state at the end of the text.
+	 */
+	extern int highlight_text_state(const char *text, size_t size,
+		int state);
+
+	/**
+	 * Returns the current lexer state of this thread.
+	 */
+	extern int highlight_get_state(void);
+
+	/**
+	 * Sets the lexer state of this thread, used for the next
+	 * call to highlight_line().
+	 *
+	 * @param state New lexer state.
+	 */
+	extern void highlight_set_state(int state);
+
 	/**
 	 * Initialize the syntax highlight engine.
 	 *
@@ -130,8 +200,7 @@
 		if (hl->idx >= hl->size)
 		{
 			hl->size += 32;
-			hl = realloc(hl, sizeof(struct highlighted_line) +
-				(sizeof(char) * hl->size));
+			hl = highlight_grow_line(hl, hl->size - 32);
 		}
 		line = (char*)(hl+1);
 		line[hl->idx++] = c;
@@ -160,9 +229,9 @@
 		if ( (hl->size - hl->idx) < size )
 		{
 			/* Make room for the string and adds 32 extra chars. */
+			size_t old_size = hl->size;
 			hl->size += (size - (hl->size - hl->idx)) + 32;
-			hl = realloc(hl, sizeof(struct highlighted_line) +
-				(sizeof(char) * hl->size));
+			hl = highlight_grow_line(hl, old_size);
 		}
 		line = (char*)(hl+1);
 		memcpy(line+hl->idx, str, size);
@@ -170,6 +239,56 @@
 		return (line);
 	}
 
+	/**
+	 * Appends the chars @p str of the source, of size @p size,
+	 * into the highlighted buffer @p line.
+	 *
+	 * Since the colors start with ESCAPE_CHAR, each ESCAPE_CHAR
+	 * of the source is appended twice, so it's never taken as
+	 * the start of a color.
+	 *
+	 * @param line Highlighted Buffer.
+	 * @param str Chars of the source to be appended.
+	 * @param size Number of chars.
+	 *
+	 * @return Returns a pointer to the highlighted buffer containing
+	 * the appended chars.
+	 */
+	INLINE char* add_src_to_hl(char *line, const char *str, size_t size)
+	{
+		const char *esc;
+
+		while (size && (esc = memchr(str, ESCAPE_CHAR, size)) != NULL)
+		{
+			size_t len = esc - str + 1;
+			line = add_str_to_hl(line, str, len);
+			line = add_char_to_hl(line, ESCAPE_CHAR);
+			str  += len;
+			size -= len;
+		}
+
+		if (size)
+			line = add_str_to_hl(line, str, size);
+		return (line);
+	}
+
+	/**
+	 * Appends a single char @p c of the source into the
+	 * highlighted buffer @p line, see add_src_to_hl().
+	 *
+	 * @param line Highlighted Buffer.
+	 * @param c Char of the source.
+	 *
+	 * @return Returns a pointer to the highlighted buffer containing
+	 * the appended character.
+	 */
+	INLINE char* add_src_char_to_hl(char *line, char c)
+	{
+		if (c == ESCAPE_CHAR)
+			line = add_char_to_hl(line, c);
+		return (add_char_to_hl(line, c));
+	}
+
 	/**
 	 * Checks if the given character belongs to a valid keyword
 	 * or not.
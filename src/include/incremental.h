@@ -0,0 +1,142 @@
+#ifndef INCREMENTAL_H_
+#define INCREMENTAL_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "render.h"
+
+/* Added to the output path for the name of the sidecar */
+#define INC_SIDECAR_EXT ".inc"
+
+/* Increased when the layout of the sidecar changes */
+#define INC_VERSION 2
+
+/* Lines drawn at a time after the edited ones, while the lexer state is still
+ * different from the previous render. Doubled every time. */
+#define INC_MIN_CHUNK 16
+
+/* Limits of the number of lines of each band of the image, which is
+ * compressed on its own, see inc_write_png(). Between them, a band ends after
+ * a line whose hash has the bits of INC_BAND_MASK clear. */
+#define INC_BAND_MIN  8
+#define INC_BAND_MAX  128
+#define INC_BAND_MASK 31
+
+/* Band of the image, stored as a complete IDAT chunk, see band_encode() */
+typedef struct {
+    /* Hash of the lines and their states, and of the margins it has */
+    uint64_t key;
+
+    /* Position of the chunk in the band data */
+    uint64_t offset;
+    uint32_t size;
+
+    /* Of the filtered rows, and their size */
+    uint32_t adler;
+    uint64_t raw_sz;
+} IncBand;
+
+/*
+ * Render that can be updated after the source is edited, redrawing only the
+ * lines that changed. It's kept in a sidecar file with:
+ *
+ *   - A header with the size of the canvas in chars, and the configuration
+ *     it was rendered with, see render_config_hash().
+ *   - The pixels of the top and bottom margins, and a slot with the rows of
+ *     pixels of each line. They are mapped in memory, and the rows of the
+ *     canvas point to them, so an update only touches the slots it redraws.
+ *   - The hash of each line, its slot, and the lexer state at the start of
+ *     each line and after the last one.
+ *
+ * The new lines are compared with the previous ones, and only the ones
+ * between the first and last difference are drawn, plus the lines after them
+ * until the lexer state is the same as before, for example after opening a
+ * comment. Adding or removing lines only moves the row pointers of the lines
+ * after them, and the slots of removed lines are used again for the next new
+ * ones. Everything is drawn again if the width of the canvas changes.
+ *
+ * The compressed bands of the last image are also kept, so the bands whose
+ * lines didn't change are copied instead of compressed again. Bands end after
+ * lines chosen by their hash, so they move with their lines when others are
+ * added or removed before them.
+ */
+typedef struct {
+    char* path;
+    int fd;
+
+    /* See render_config_hash() */
+    uint64_t config;
+
+    /* The rows point to the mapped pixels. Don't call canvas_alloc() or
+     * canvas_free() on it. */
+    Canvas canvas;
+    uint8_t* map;
+    size_t map_sz;
+    uint32_t num_slots;
+
+    /* Lines of the last render. There are `num_lines + 1' states. */
+    uint32_t num_lines;
+    uint64_t* hashes;
+    uint32_t* slots;
+    int8_t* states;
+
+    /* Bands of the last image written by inc_write_png() */
+    IncBand* bands;
+    uint32_t num_bands;
+    uint8_t* band_data;
+    size_t band_data_sz;
+
+    /* False if there is no previous render that can be updated */
+    bool valid;
+} IncRender;
+
+typedef struct {
+    /* Everything was drawn again */
+    bool full;
+
+    /* The size of the canvas changed */
+    bool resized;
+
+    /* Range of lines that were drawn */
+    uint32_t first_line, lines_drawn;
+
+    /* Time spent comparing the lines, and drawing them */
+    uint64_t diff_ns, draw_ns;
+} IncStats;
+
+typedef struct {
+    /* Bands of the image, and how many were copied from the last one */
+    uint32_t bands, reused;
+
+    /* Filtered bytes that were compressed */
+    uint64_t compressed_sz;
+
+    uint64_t encode_ns;
+} IncEncodeStats;
+
+/* Open or create the sidecar. The previous render is only used if it was
+ * made with the same `config'. Returns false on error. */
+bool inc_open(IncRender* inc, const char* path, uint64_t config);
+
+/* Update the canvas to the new source, and store what was done in `stats'.
+ * The highlighter must have been initialized with highlight_init(). */
+void inc_update(IncRender* inc, const char* src, size_t src_sz,
+                IncStats* stats);
+
+/* Encode the canvas as a PNG file, compressing only the bands that are not in
+ * the last image. The file is not the same as the one of write_png_file(),
+ * but the pixels are. Returns false on error. */
+bool inc_write_png(IncRender* inc, const char* filename,
+                   IncEncodeStats* stats);
+
+/* Write the lines and the bands to the sidecar, so the next inc_open() can
+ * use them. Returns false on error. */
+bool inc_sync(IncRender* inc);
+
+/* Call inc_sync(), unmap the canvas and close the sidecar. Returns false if
+ * the lines or the bands couldn't be written. */
+bool inc_close(IncRender* inc);
+
+#endif /* INCREMENTAL_H_ */
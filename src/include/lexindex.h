@@ -0,0 +1,81 @@
+#ifndef LEXINDEX_H_
+#define LEXINDEX_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Added to the source path for the name of the sidecar */
+#define LEXINDEX_EXT ".lexidx"
+
+#define LEXINDEX_MAGIC   "C2PNGIDX"
+#define LEXINDEX_VERSION 1
+
+/* Lines between checkpoints */
+#define LEXINDEX_INTERVAL 1024
+
+/* Sources with fewer lines are scanned quickly enough without an index, so
+ * it's not saved for them */
+#define LEXINDEX_MIN_LINES 16384
+
+/* Version of the source that the index belongs to */
+typedef struct {
+    uint64_t size;
+    int64_t mtime_ns;
+
+    /* See hash64() */
+    uint64_t hash;
+} LexIndexKey;
+
+/*
+ * Checkpoints of the lexer over a source, so a window of its lines can be
+ * drawn without scanning all the lines before it (see highlight_text_state()).
+ * Every LEXINDEX_INTERVAL lines, it has the offset of the line in the source
+ * and the lexer state at its start. The first checkpoint is always the start
+ * of the source, in the default state.
+ *
+ * The sidecar has a header with the key of the source, followed by the
+ * offsets and then the states. It's only used if the size, modification time
+ * and hash of the source are the same as the key.
+ */
+typedef struct {
+    /* Lines ending in a newline, the ones that are drawn */
+    uint32_t num_lines;
+
+    uint32_t num_checkpoints;
+    uint64_t* offsets;
+    int8_t* states;
+} LexIndex;
+
+/* Fill the key of the source file, read from `path' into `src'. Returns false
+ * if it's not a regular file, or if it changed after reading it. */
+bool lexindex_key(LexIndexKey* key, const char* path, const char* src,
+                  size_t src_sz);
+
+/* Build the index from the lexer states at the start of each line ending in a
+ * newline, stored by source_lines_to_png() in Canvas.line_states */
+void lexindex_from_states(LexIndex* idx, const char* src, size_t src_sz,
+                          const int8_t* states);
+
+/* Build the index by scanning the source with highlight_text_state() */
+void lexindex_scan(LexIndex* idx, const char* src, size_t src_sz);
+
+/* Read the sidecar of the source with the key. Returns false if it's missing,
+ * not valid, or from another version of the source. */
+bool lexindex_load(LexIndex* idx, const char* filename,
+                   const LexIndexKey* key);
+
+/* Write the sidecar. It's written to a temporary file and renamed, so a
+ * sidecar is never truncated. Returns false on errors. */
+bool lexindex_save(const LexIndex* idx, const char* filename,
+                   const LexIndexKey* key);
+
+/* Find the last checkpoint at or before the line (0-based), and store its
+ * offset and state. Returns the line of the checkpoint. */
+uint32_t lexindex_seek(const LexIndex* idx, uint32_t line, size_t* offset,
+                       int* state);
+
+/* Free the checkpoints of the index */
+void lexindex_free(LexIndex* idx);
+
+#endif /* LEXINDEX_H_ */
@@ -0,0 +1,86 @@
+#ifndef LINECACHE_H_
+#define LINECACHE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "render.h"
+
+/* Number of entries of each cache, and of hashes of lines seen once. Must be
+ * powers of two */
+#define LINE_CACHE_SLOTS 2048
+#define LINE_CACHE_SEEN  8192
+
+/* Longer lines are not cached, they rarely repeat */
+#define LINE_CACHE_MAX_LEN 48
+
+/* Pixels of each cache. When it's full, all the entries are dropped */
+#define LINE_CACHE_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    uint64_t hash;
+
+    /* Checked on lookups, besides the hash */
+    const Color* palette;
+    char text[LINE_CACHE_MAX_LEN];
+    uint8_t len;
+    int8_t state;
+
+    /* Lexer state after the line */
+    int8_t end_state;
+
+    /* Cells drawn, and the FONT_H rows of pixels of the ones after the
+     * indentation in the pixel buffer. Blank cells are only background, which
+     * is already there. */
+    uint8_t first_col, cols;
+    uint32_t pixels;
+
+    /* The entry is valid if it matches the epoch of the cache */
+    uint32_t epoch;
+} LineEntry;
+
+/*
+ * Rendered lines of a thread, keyed by their bytes, the lexer state at their
+ * start and the palette. Source files repeat many short lines, like "}",
+ * "break;" or "#endif", and a repeated line is copied with memcpy() instead of
+ * being highlighted and drawn again. Each thread has its own, which is kept
+ * between files.
+ */
+typedef struct {
+    LineEntry slots[LINE_CACHE_SLOTS];
+    uint32_t epoch;
+
+    /* Most lines are unique, so a line is only stored the second time it's
+     * drawn, when its hash is already here */
+    uint64_t seen[LINE_CACHE_SEEN];
+
+    uint8_t* pixels;
+    size_t pixels_used;
+
+    /* Stats not added to line_cache_totals() yet */
+    uint64_t lookups, hits;
+} LineCache;
+
+/* Cache of the calling thread, created on the first call and destroyed when
+ * the thread exits */
+LineCache* line_cache_thread(void);
+
+/* If the line starting in `state' is cached, draw it at the current position
+ * of the canvas, set the lexer state to the one after it and return true.
+ * Otherwise, store its hash for line_cache_put(). */
+bool line_cache_draw(LineCache* cache, Canvas* canvas, const char* line,
+                     size_t len, int state, uint64_t* hash);
+
+/* Copy the line that was just drawn at the current position of the canvas,
+ * if it was seen before. Lines that are too long are ignored. */
+void line_cache_put(LineCache* cache, const Canvas* canvas, uint64_t hash,
+                    const char* line, size_t len, int state, int end_state);
+
+/* Add the stats of the cache to the totals */
+void line_cache_flush_stats(LineCache* cache);
+
+/* Lines looked up in all the caches, and how many were found */
+void line_cache_totals(uint64_t* lookups, uint64_t* hits);
+
+#endif /* LINECACHE_H_ */
@@ -0,0 +1,29 @@
+#ifndef MINIMAP_H_
+#define MINIMAP_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "render.h"
+#include "tokens.h"
+
+/* Maximum rows of each line of a minimap */
+#define MINIMAP_MAX_ROWS 4
+
+/*
+ * Overview of a source with a single pixel for each char, in the foreground
+ * color of its token, or the background for spaces and tabs. There are no
+ * glyphs, margins or border.
+ *
+ * The image uses a 4-bit palette with the colors of the palette[], and each
+ * row is sent to the encoder as soon as it's filled, so only one row is in
+ * memory besides the token stream.
+ *
+ * The minimap of the token stream is drawn with the palette and encoded to the
+ * PNG file. Its size is the size of the canvas in chars, with `line_rows' rows
+ * for each line. Returns false if the token stream is not valid.
+ */
+bool minimap_write_png(const TokenStream* ts, const Color* palette,
+                       int line_rows, const char* filename);
+
+#endif /* MINIMAP_H_ */
@@ -0,0 +1,54 @@
+#ifndef MONTAGE_H_
+#define MONTAGE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "render.h"
+
+/* Added to the output path for the name of the index */
+#define MONTAGE_INDEX_EXT ".json"
+
+typedef struct {
+    const char* path;
+    char* src;
+    size_t src_sz;
+
+    /* Size of the image of the source, see input_get_dimensions() */
+    Canvas canvas;
+
+    /* Position of the image in the sheet, in px */
+    uint32_t x, y;
+} MontageItem;
+
+/*
+ * Sheet with the images of many sources, drawn into a single canvas that is
+ * encoded once. The images are placed in shelves: sorted from the tallest,
+ * from left to right until the row is as wide as the sheet, and then in a new
+ * shelf below the tallest image of the last one. The width of the sheet is
+ * the side of a square with the area of all the images, or the widest image.
+ */
+typedef struct {
+    MontageItem* items;
+    size_t num_items;
+
+    /* Size of the sheet in px */
+    uint32_t w, h;
+} Montage;
+
+/* Read the sources, and place their images in the sheet */
+void montage_init(Montage* montage, char** paths, size_t num_paths);
+
+/* Draw the images of the sources into their place of the sheet with `jobs'
+ * threads. The sheet is allocated, and its gaps have the background color. */
+void montage_draw(const Montage* montage, Canvas* sheet, int jobs);
+
+/* Write a JSON index with the rectangle of each source in the sheet, for
+ * finding the source under a pixel. Returns false on errors. */
+bool montage_write_index(const Montage* montage, const char* filename);
+
+/* Free the sources */
+void montage_free(Montage* montage);
+
+#endif /* MONTAGE_H_ */
@@ -0,0 +1,40 @@
+#ifndef OPTIMIZE_H_
+#define OPTIMIZE_H_ 1
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "render.h"
+
+/* Rows of each band of the sample, and number of bands */
+#define OPTIMIZE_BAND_ROWS 64
+#define OPTIMIZE_BANDS     16
+
+/* Trials with the smallest samples that are encoded in full */
+#define OPTIMIZE_KEEP 4
+
+/*
+ * Encoder of images that are kept, which tries the settings of libpng and
+ * zlib that affect the size of the output:
+ *
+ *   - The filter of the rows: chosen for each row (adaptive), or always None,
+ *     Sub, Up or Paeth.
+ *   - The level, strategy and memory of deflate.
+ *   - The color type: RGBA, or indexed if the image has at most 256 colors,
+ *     with the smallest bit depth that fits them.
+ *
+ * Every trial first encodes a sample of the image, OPTIMIZE_BANDS bands of
+ * OPTIMIZE_BAND_ROWS rows spread over it. The OPTIMIZE_KEEP trials with the
+ * smallest samples are then encoded in full, along with the default settings
+ * of write_png_file() to compare with, and the smallest PNG is kept. The
+ * trials of each stage are run in parallel. Images that are not bigger than
+ * the sample are encoded in full right away.
+ */
+
+/* Write the smallest PNG of the canvas to the file, running the trials with
+ * `jobs' threads. The size and time of each trial are printed to `report'.
+ * Returns false if the file can't be written. */
+bool optimize_write_png(const Canvas* canvas, const char* filename, int jobs,
+                        FILE* report);
+
+#endif /* OPTIMIZE_H_ */
@@ -0,0 +1,37 @@
+#ifndef PARLEX_H_
+#define PARLEX_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "render.h"
+
+/* Chunks for each thread, so the threads that finish early can take more */
+#define PARLEX_CHUNKS_PER_THREAD 4
+
+/* Minimum number of lines of each chunk */
+#define PARLEX_MIN_LINES 256
+
+typedef struct {
+    int chunks;
+    int relexed;
+
+    /* Time of the sequential pre-scan of the real states */
+    uint64_t prescan_ns;
+} ParlexStats;
+
+/*
+ * Same as source_to_png(), but the source is split in chunks of lines that
+ * are highlighted and drawn by `num_threads' threads at the same time.
+ *
+ * Each chunk is drawn assuming it starts in the default state, which is right
+ * unless the previous chunk ends inside a comment or string. Meanwhile, the
+ * real state at the start of each chunk is found with a quick sequential scan,
+ * and the chunks that started in the wrong state are drawn again. Redrawing a
+ * chunk only changes the colors, so the result is the same as drawing it
+ * serially. The canvas must be allocated.
+ */
+void source_to_png_parallel(Canvas* canvas, const char* src, size_t src_sz,
+                            int num_threads, ParlexStats* stats);
+
+#endif /* PARLEX_H_ */
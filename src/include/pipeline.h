@@ -0,0 +1,61 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Maximum number of lines sent between the reader, lexer and rasterizer at a
+ * time */
+#define PIPE_BATCH_LINES 256
+
+/* Lines of each band of scanlines sent to the encoder, and number of bands
+ * that can be in flight */
+#define PIPE_BAND_LINES 32
+#define PIPE_BANDS      4
+
+/* Batches that fit between two stages */
+#define PIPE_RING_SZ 8
+
+/* Size of each read of the source */
+#define PIPE_READ_SZ (256 * 1024)
+
+enum EPipeStages {
+    STAGE_READER,
+    STAGE_LEXER,
+    STAGE_RASTER,
+    STAGE_ENCODER,
+
+    NUM_STAGES,
+};
+
+typedef struct {
+    /* Time doing work, and waiting for the previous and next stages */
+    uint64_t busy_ns;
+    uint64_t input_wait_ns;
+    uint64_t output_wait_ns;
+} StageStats;
+
+typedef struct {
+    uint32_t w, h, w_px, h_px;
+    uint64_t total_ns;
+    StageStats stages[NUM_STAGES];
+} PipelineStats;
+
+/* Names of the stages, for printing the stats */
+extern const char* const pipe_stage_names[NUM_STAGES];
+
+/*
+ * Render the source file to the PNG file with a thread for each stage: the
+ * reader splits the source in batches of lines, the lexer highlights them, the
+ * rasterizer draws them in bands of scanlines, and the encoder compresses each
+ * band as soon as it's drawn. The stages are connected with bounded rings, so
+ * only a few batches and bands are in memory at a time.
+ *
+ * The size of the image is needed before drawing the first band, so the
+ * rasterizer waits until the whole source has been read, but the lexer can
+ * start right away. The highlighter must have been initialized. Returns false
+ * if the source can't be read.
+ */
+bool render_pipelined(const char* in, const char* out, PipelineStats* stats);
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,30 @@
+#ifndef RAWIMG_H_
+#define RAWIMG_H_ 1
+
+#include <stdbool.h>
+
+#include "render.h"
+
+/* Bytes converted before each write of the PPM and QOI backends */
+#define RAWIMG_CHUNK_SZ (4 * 1024 * 1024)
+
+/*
+ * Backends that write the rows of the canvas without compressing them, for
+ * tools that decode the image right away. There is no libpng or zlib setup:
+ * the rows are written with a few big write() calls, and only the PPM and
+ * QOI backends convert them, in chunks of RAWIMG_CHUNK_SZ bytes.
+ *
+ * All of them return false if the file can't be written.
+ */
+
+/* Write a PAM file with RGB_ALPHA tuples, the bytes of the rows as they are.
+ * Rows that follow each other in memory are written at once. */
+bool rawimg_write_pam(const Canvas* canvas, const char* filename);
+
+/* Write a binary PPM file, the rows without the alpha */
+bool rawimg_write_ppm(const Canvas* canvas, const char* filename);
+
+/* Write a QOI file with 4 channels, see https://qoiformat.org */
+bool rawimg_write_qoi(const Canvas* canvas, const char* filename);
+
+#endif /* RAWIMG_H_ */
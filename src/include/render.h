@@ -0,0 +1,221 @@
+#ifndef RENDER_H_
+#define RENDER_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <png.h>
+
+#include "../fonts/main_font.h" /* FONT_W, FONT_H */
+#include "arena.h"
+
+/* Increased when the same source and options are rendered differently, so
+ * the cached images are not used, see render_config_hash() */
+#define RENDER_VERSION 1
+
+#define MIN_W        80 /* chars */
+#define MIN_H        0  /* chars */
+#define MARGIN       10 /* px */
+#define LINE_SPACING 1  /* px */
+#define BORDER_SZ    2  /* px */
+#define TAB_SZ       4  /* chars */
+
+/* Theme of the global palette[], see setup_theme_palette() */
+#define DEFAULT_THEME "dark"
+
+/* Names of the themes, for the usage */
+#define THEME_NAMES "dark, light"
+
+/* Bytes of each entry in rows[] */
+#define COL_SZ 4
+
+/* Approximate memory used by libpng and zlib when encoding, without the rows
+ * or the output. The deflate window and hash chains use most of it. */
+#define ENCODER_MEM (256 * 1024)
+
+/* Character position -> Pixel position */
+#define CHAR_Y_TO_PX(Y) (MARGIN + (Y) * (FONT_H + LINE_SPACING))
+#define CHAR_X_TO_PX(X) (MARGIN + (X) * FONT_W)
+
+#define COL(RGB, A)            \
+    ((Color){                  \
+      .r = (RGB >> 16) & 0xFF, \
+      .g = (RGB >> 8) & 0xFF,  \
+      .b = RGB & 0xFF,         \
+      .a = A & 0xFF,           \
+    })
+
+#define DIE(...)                      \
+    {                                 \
+        fprintf(stderr, __VA_ARGS__); \
+        exit(1);                      \
+    }
+
+enum EPaletteIndexes {
+    /* Used by highlight.c */
+    COL_DEFAULT = 0,
+    COL_PREPROC,
+    COL_TYPES,
+    COL_KWRDS,
+    COL_NUMBER,
+    COL_STRING,
+    COL_COMMENT,
+    COL_FUNC_CALL,
+    COL_SYMBOL,
+
+    /* Used only when rendering */
+    COL_BACK,
+    COL_BORDER,
+
+    PALETTE_SZ,
+};
+
+typedef struct {
+    uint8_t r, g, b, a;
+} Color;
+
+typedef struct {
+    /* Size in chars. Overwritten by input_get_dimensions() */
+    uint32_t w, h;
+
+    /* Size in px. Includes margins */
+    uint32_t w_px, h_px;
+
+    /* Current position when printing in chars */
+    uint32_t x, y;
+
+    /* If set, only the columns [first_col, first_col + w) of the lines are
+     * drawn, starting at the left margin. The line caches are not used. */
+    bool clip_cols;
+    uint32_t first_col;
+
+    /* Actually png_bytep is typedef'd to a pointer, so this is a (void**) */
+    png_bytep* rows;
+
+    /* All the rows are allocated in a single block, pointed by rows[] */
+    uint8_t* pixels;
+
+    /* Range of rows that are allocated. Usually all of them, except when
+     * rendering in bands, see render_banded_to_mem() */
+    uint32_t rows_start, rows_end;
+
+    /* Colors used for drawing, usually the global palette[] */
+    const Color* palette;
+
+    /* If not NULL, the rows are allocated here and canvas_free() does
+     * nothing, they are freed when the arena is rewound or reset */
+    Arena* arena;
+
+    /* If not NULL, source_lines_to_png() stores the lexer state at the start
+     * of each line it draws, indexed by line */
+    int8_t* line_states;
+} Canvas;
+
+/* Initialized in setup_palette() */
+extern Color palette[PALETTE_SZ];
+
+/* If set, write_png_file() and encode_png_mem() use fastpng_encode() instead
+ * of libpng. Set by --fast-png */
+extern bool fast_png;
+
+/*----------------------------------------------------------------------------*/
+
+/* Fill the global palette[] with the colors of DEFAULT_THEME */
+void setup_palette(void);
+
+/* Fill the palette with the colors of the theme. Returns false if there is no
+ * theme with that name, see THEME_NAMES */
+bool setup_theme_palette(Color* dst, const char* theme);
+
+/* Number of pixels of the FONT_W by FONT_H glyph of the char that are drawn
+ * with the foreground color */
+uint32_t glyph_pixels(uint8_t c);
+
+/* Initialize the canvas with the minimum size and the default palette */
+void canvas_init(Canvas* canvas);
+
+/* Calculate the size of the canvas in chars and pixels from the source */
+void input_get_dimensions(Canvas* canvas, const char* src, size_t src_sz);
+
+/* Grow the size of the canvas in chars with a part of the source that starts
+ * at line `first_line'. Returns the line where the part ends, for the next
+ * call. The size in pixels is not updated, see canvas_update_px_size(). */
+uint32_t input_scan_dimensions(Canvas* canvas, const char* src,
+                               size_t src_sz, uint32_t first_line);
+
+/* Calculate the size of the canvas in pixels from its size in chars */
+void canvas_update_px_size(Canvas* canvas);
+
+/* Allocate the rows of the canvas and clear them with the background */
+void canvas_alloc(Canvas* canvas);
+
+/* Free the rows of the canvas */
+void canvas_free(Canvas* canvas);
+
+/* Highlight and draw the source into the canvas. The highlighter must have
+ * been initialized with highlight_init() */
+void source_to_png(Canvas* canvas, const char* src, size_t src_sz);
+
+/* Same as source_to_png(), but the source is only a part of the file that
+ * starts at line `first_line', and the lexer starts in `state'. Different
+ * parts of the same canvas can be drawn from different threads */
+void source_lines_to_png(Canvas* canvas, const char* src, size_t src_sz,
+                         uint32_t first_line, int state);
+
+/* Draw `len' chars at the current position of the canvas, which is moved
+ * after them. The chars can't be newlines */
+void draw_span(Canvas* canvas, const char* s, size_t len, Color fg, Color bg);
+
+/* Draw a line returned by highlight_line() at line `line' of the canvas */
+void draw_highlighted_line(Canvas* canvas, uint32_t line, const char* hl_line);
+
+/* Clear the rows of lines [l0, l1) with the background, including the sides.
+ * The first and last lines also clear the margins, see canvas_set_band() */
+void canvas_clear_lines(Canvas* canvas, uint32_t l0, uint32_t l1);
+
+/* Draw the border around the whole canvas. Only the allocated rows are drawn,
+ * see canvas_set_band() */
+void draw_border(Canvas* canvas);
+
+/* Point the rows of lines [l0, l1) to the `band' buffer, and clear them with
+ * the background. Only those rows are drawn until the next call. The first
+ * and last bands also have the margins. */
+void canvas_set_band(Canvas* canvas, uint8_t* band, uint32_t l0, uint32_t l1);
+
+/* Write the PNG header for the size of the canvas. Used when the rows are
+ * written in parts with png_write_rows() */
+void encode_png_header(png_structp png, png_infop info, const Canvas* canvas);
+
+/* Hash of everything besides the source that changes the output: the version,
+ * the layout constants, the font, the palette and the encoder. Used as the
+ * seed of the cache keys */
+uint64_t render_config_hash(const Color* palette);
+
+/* Encode the canvas as a PNG file */
+void write_png_file(const Canvas* canvas, const char* filename);
+
+/* Encode the canvas as a PNG into a new allocated buffer, and store its size */
+void* encode_png_mem(const Canvas* canvas, size_t* size);
+
+/* Estimate the memory needed for rendering and encoding `num_rows' rows of the
+ * canvas in memory, including the output PNG. Used for memory admission */
+size_t canvas_mem_estimate(const Canvas* canvas, uint32_t num_rows);
+
+/* Render the source in memory to the output PNG file, calling all of the
+ * functions above in order. The canvas is allocated in the arena of the
+ * thread, and it's rewound at the end */
+void render_to_file(const char* src, size_t src_sz, const char* filename);
+
+/* Same as render_to_file(), but return the encoded PNG in a new allocated
+ * buffer, see encode_png_mem() */
+void* render_to_mem(const char* src, size_t src_sz, size_t* png_sz);
+
+/* Same as render_to_mem(), but only `band_lines' lines worth of rows are in
+ * memory at a time. Each band is encoded as soon as it's drawn, and its rows
+ * are reused for the next one. The canvas must have its dimensions. */
+void* render_banded_to_mem(Canvas* canvas, const char* src, size_t src_sz,
+                           uint32_t band_lines, size_t* png_sz);
+
+#endif /* RENDER_H_ */
@@ -0,0 +1,87 @@
+#ifndef SINK_H_
+#define SINK_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "tar.h"
+#include "fileio.h"
+
+/* Maximum number of finished images waiting for the writer, unless they are
+ * the next one it needs */
+#define SINK_MAX_PENDING 64
+
+typedef struct SinkItem {
+    uint64_t seq;
+    char* path;
+    void* data;
+    size_t size;
+
+    /* Temporary file with the data, if it didn't fit in memory */
+    FILE* spill;
+
+    struct SinkItem* next;
+} SinkItem;
+
+/*
+ * Destination of the images in multi-file modes. It can be a directory or a
+ * tar stream. A single writer thread writes the images in the order of their
+ * sequence numbers, no matter the order in which they are submitted, so the
+ * output is deterministic even if the images are rendered in parallel.
+ */
+typedef struct {
+    /* Output directory, or tar archive if is_tar is set */
+    const char* out;
+    bool is_tar;
+    TarWriter tar;
+
+    /* Writes the files of an output directory */
+    Writeback wb;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_ready;
+    pthread_cond_t cond_space;
+
+    /* Sorted by sequence number */
+    SinkItem* pending;
+    size_t num_pending;
+
+    /* Sequence number that the writer needs next */
+    uint64_t next_seq;
+
+    /* SINK_MAX_PENDING by default, zero means no limit */
+    size_t max_pending;
+
+    /* Bytes of the pending images kept in memory. When they would go over
+     * `max_pending_bytes', images that the writer doesn't need yet are moved
+     * to temporary files instead. Zero means no limit, the default. */
+    size_t pending_bytes;
+    size_t max_pending_bytes;
+    int spilled;
+
+    bool closing;
+    bool failed;
+    int written;
+} Sink;
+
+/* Open the output directory or tar archive ("-" for stdout), and start the
+ * writer thread. The files of a directory are written with io_uring if
+ * `use_uring' is set and it's available. */
+bool sink_open(Sink* sink, const char* out, bool is_tar, bool use_uring);
+
+/* Hand a finished image to the writer. The path is copied, but the ownership
+ * of the data is transferred to the sink. If the data is NULL, the sequence
+ * number is skipped without writing anything. Every sequence number from zero
+ * must be submitted exactly once. */
+void sink_submit(Sink* sink, uint64_t seq, const char* path, void* data,
+                 size_t size);
+
+/* Wait for the writer to finish and close the output. Returns false if any of
+ * the writes failed */
+bool sink_close(Sink* sink);
+
+#endif /* SINK_H_ */
@@ -0,0 +1,51 @@
+#ifndef SPSC_H_
+#define SPSC_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Keep the indexes written by each side in different cache lines */
+#define CACHE_LINE_SZ 64
+
+/*
+ * Bounded single-producer, single-consumer queue of pointers. Pushing and
+ * popping only use atomics while the ring is neither full nor empty. When a
+ * side has to wait, it sleeps on the condition variable, and the other side
+ * only takes the lock if someone is sleeping.
+ */
+typedef struct {
+    void** items;
+    size_t cap;
+
+    /* Next item to pop, only written by the consumer */
+    _Alignas(CACHE_LINE_SZ) atomic_size_t head;
+    uint64_t pop_wait_ns;
+
+    /* Next slot to push, only written by the producer */
+    _Alignas(CACHE_LINE_SZ) atomic_size_t tail;
+    uint64_t push_wait_ns;
+
+    _Alignas(CACHE_LINE_SZ) atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SpscRing;
+
+/* Create a ring for `cap' items, rounded up to a power of two */
+bool spsc_init(SpscRing* ring, size_t cap);
+void spsc_destroy(SpscRing* ring);
+
+/* Push an item, waiting while the ring is full. The time spent waiting is
+ * added to `push_wait_ns'. */
+void spsc_push(SpscRing* ring, void* item);
+
+/* Push an item only if the ring is not full */
+bool spsc_try_push(SpscRing* ring, void* item);
+
+/* Pop an item, waiting while the ring is empty. The time spent waiting is
+ * added to `pop_wait_ns'. */
+void* spsc_pop(SpscRing* ring);
+
+#endif /* SPSC_H_ */
@@ -0,0 +1,82 @@
+#ifndef TAR_H_
+#define TAR_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+/* Size of each tar block, headers and data are padded to this */
+#define TAR_BLOCK_SZ 512
+
+/* Values of the typeflag field that we care about */
+#define TAR_REGULAR      '0'
+#define TAR_REGULAR_OLD  '\0'
+#define TAR_CONTIGUOUS   '7'
+#define TAR_DIRECTORY    '5'
+#define TAR_PAX_HEADER   'x'
+#define TAR_PAX_GLOBAL   'g'
+#define TAR_GNU_LONGNAME 'L'
+
+typedef struct {
+    /* Underlying stream. It can be gzip-compressed or not, zlib reads plain
+     * files transparently */
+    gzFile gz;
+
+    /* Bytes of the current member that have not been read yet */
+    uint64_t left;
+
+    /* Padding after the current member data, up to the next block */
+    uint64_t pad;
+
+    /* Path of the current member, returned in TarMember.path */
+    char* path;
+
+    /* Overrides for the next header, from pax headers or GNU long names */
+    char* next_path;
+    int64_t next_size;
+} TarReader;
+
+typedef struct {
+    /* Owned by the reader, valid until the next call to tar_next() */
+    const char* path;
+    uint64_t size;
+    char type;
+} TarMember;
+
+typedef struct {
+    FILE* fd;
+
+    /* Modification time used in the headers of all members */
+    int64_t mtime;
+} TarWriter;
+
+/* Open the archive for reading. The filename "-" means stdin */
+bool tar_open(TarReader* tar, const char* filename);
+
+/* Skip whatever is left of the current member and read the next header.
+ * Returns 1 if there is a new member, 0 at the end of the archive or -1 on
+ * error. Pax and GNU long name headers are handled here and never returned */
+int tar_next(TarReader* tar, TarMember* member);
+
+/* Read exactly `sz' bytes of the data of the current member */
+bool tar_read(TarReader* tar, void* buf, uint64_t sz);
+
+/* Close the archive and free the reader */
+void tar_close(TarReader* tar);
+
+/*----------------------------------------------------------------------------*/
+
+/* Open the archive for writing. The filename "-" means stdout */
+bool tar_writer_open(TarWriter* tar, const char* filename);
+
+/* Write a regular file member with its header, data and padding. The size
+ * must be known beforehand, so the data is already in memory */
+bool tar_write_member(TarWriter* tar, const char* path, const void* data,
+                      size_t size);
+
+/* Write the end-of-archive blocks and close the file */
+bool tar_writer_close(TarWriter* tar);
+
+#endif /* TAR_H_ */
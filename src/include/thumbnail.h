@@ -0,0 +1,68 @@
+#ifndef THUMBNAIL_H_
+#define THUMBNAIL_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "render.h"
+#include "tokens.h"
+
+/*
+ * Small version of the image, drawn straight from the token stream without
+ * drawing the full canvas. Each char is reduced to its average color, the
+ * foreground weighted by the pixels of its glyph (see glyph_pixels()) and the
+ * background by the rest, and added to the pixels of the thumbnail that
+ * overlap it, weighted by the overlapped area. This is the same as a box
+ * filter of the full image when the pixels of the thumbnail cover whole
+ * glyphs, which is the usual case.
+ */
+typedef struct {
+    /* Size in px */
+    uint32_t w, h;
+
+    /* Pixels of the thumbnail for each pixel of the canvas */
+    double scale_x, scale_y;
+
+    /* Range of rows in `sums'. Usually all of them, except when drawing a
+     * band, see thumbnail_draw_band() */
+    uint32_t rows_start, rows_end;
+
+    /* Area-weighted sum of the RGBA colors inside each pixel */
+    float* sums;
+} Thumbnail;
+
+/* Parse a "WxH" size, where one of them can be zero to only limit the other.
+ * Returns false if it's not valid. */
+bool thumbnail_parse_size(const char* str, uint32_t* w, uint32_t* h);
+
+/* Draw the thumbnail of the token stream with the palette. It's as big as
+ * possible inside `max_w' by `max_h' (zero for no limit), keeping the aspect
+ * of the full image, but never bigger than it. Returns false if the token
+ * stream is not valid. */
+bool thumbnail_from_tokens(Thumbnail* thumb, const TokenStream* ts,
+                           const Color* palette, uint32_t max_w,
+                           uint32_t max_h);
+
+/* Set the size of the thumbnail, and its pixels for each pixel of the canvas,
+ * without allocating it */
+void thumbnail_init(Thumbnail* thumb, uint32_t w, uint32_t h, double scale_x,
+                    double scale_y);
+
+/* Draw the rows [rows_start, rows_end) of the thumbnail, freeing the previous
+ * band. With the line offsets of tokens_line_offsets(), only the lines that
+ * overlap the band are read; with NULL, all of them. Returns false if the
+ * token stream is not valid. */
+bool thumbnail_draw_band(Thumbnail* thumb, const TokenStream* ts,
+                         const uint64_t* offsets, const Color* palette,
+                         uint32_t rows_start, uint32_t rows_end);
+
+/* Convert the drawn rows to RGBA pixels */
+void thumbnail_get_pixels(const Thumbnail* thumb, uint8_t* pixels);
+
+/* Encode the thumbnail as a PNG file */
+void thumbnail_write_png(const Thumbnail* thumb, const char* filename);
+
+/* Free the pixels of the thumbnail */
+void thumbnail_free(Thumbnail* thumb);
+
+#endif /* THUMBNAIL_H_ */
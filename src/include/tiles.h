@@ -0,0 +1,46 @@
+#ifndef TILES_H_
+#define TILES_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "render.h"
+#include "tokens.h"
+
+/* Size of the tiles in px */
+#define TILE_SZ 256
+
+/* Keys of the tiles of the last run, inside the directory of the tiles */
+#define TILES_MANIFEST "tiles.c2idx"
+
+#define TILES_MAGIC   "C2PNGTIL"
+#define TILES_VERSION 1
+
+typedef struct {
+    uint32_t w, h;
+    int levels;
+
+    /* Tiles of all levels, and the ones that were drawn and encoded */
+    uint32_t tiles, drawn;
+} TilesStats;
+
+/*
+ * Deep Zoom (DZI) pyramid of the image, for viewers that only load the tiles
+ * they show. The <name>.dzi file describes the image, and the tiles of each
+ * level are in <name>_files/<level>/<col>_<row>.png. Level 0 is a single
+ * pixel, and each level is twice as big as the previous one, up to the full
+ * image in the last one.
+ *
+ * Each row of tiles is drawn by one of the threads straight from the token
+ * stream: the full image as a few lines of the canvas, and the rest as a band
+ * of a thumbnail (see Thumbnail), where each char is reduced to its average
+ * color instead of resampling the full image.
+ *
+ * The key of each tile is the hash of the lines it overlaps, its position and
+ * the configuration. The keys are kept in TILES_MANIFEST, and the tiles whose
+ * key didn't change since the last run are not drawn again.
+ */
+bool tiles_write_dzi(const TokenStream* ts, const Color* palette,
+                     const char* filename, int jobs, TilesStats* stats);
+
+#endif /* TILES_H_ */
@@ -0,0 +1,117 @@
+#ifndef TOKENS_H_
+#define TOKENS_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "render.h"
+
+#define TOKENS_MAGIC   "C2PNGTOK"
+#define TOKENS_VERSION 1
+
+/*
+ * Highlighted source saved after lexing, so it can be drawn again with other
+ * palettes or layouts without calling highlight_line(). The header is followed
+ * by the lines, each one a list of spans and a line break:
+ *
+ *   - Span: a varint (LEB128) with the number of chars shifted left by 4,
+ *     and the foreground palette index in the low 4 bits, followed by the
+ *     chars. The background is COL_BACK, unless the low bits are 0xF: then a
+ *     class byte follows the varint, with the foreground index in its low
+ *     nibble and the background in the high one. Consecutive spans always
+ *     have different colors.
+ *   - Line break: a zero varint.
+ *
+ * The chars are stored as they are in the source, tabs are expanded when
+ * drawing them. The file is read with mmap(), see tokens_open().
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    /* Size in chars, see input_get_dimensions() */
+    uint32_t w, h;
+
+    /* Number of lines in the data, and its size in bytes */
+    uint32_t num_lines;
+    uint64_t data_sz;
+} TokensHeader;
+
+/* Token stream in memory, or mapped from a file with tokens_open(). It's only
+ * read when drawing, so it can be drawn by many threads at the same time. */
+typedef struct {
+    const TokensHeader* header;
+    const uint8_t* data;
+
+    /* Header and data allocated by tokens_highlight(), or NULL */
+    uint8_t* buf;
+
+    void* map;
+    size_t map_sz;
+} TokenStream;
+
+/* Position in the data of a token stream, see tokens_read() */
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+
+    /* Set if the data is not valid */
+    bool error;
+} TokenReader;
+
+/* Span or line break returned by tokens_read() */
+typedef struct {
+    /* Chars of the span, or NULL for a line break */
+    const char* chars;
+    size_t len;
+
+    /* Number of chars in the canvas, with the tabs expanded */
+    uint64_t width;
+
+    /* Palette indexes */
+    uint8_t fg, bg;
+} TokenSpan;
+
+/* Highlight the source into a token stream in memory. The highlighter must
+ * have been initialized with highlight_init(). */
+void tokens_highlight(TokenStream* ts, const char* src, size_t src_sz);
+
+/* Write the token stream to the file. Returns false on error */
+bool tokens_save(const TokenStream* ts, const char* filename);
+
+/* Map a token stream written by tokens_save(). Returns false if the file
+ * can't be read or is not a valid token stream. */
+bool tokens_open(TokenStream* ts, const char* filename);
+
+/* Set the size of the canvas in chars and pixels from the token stream */
+void tokens_get_dimensions(const TokenStream* ts, Canvas* canvas);
+
+/* Start reading the spans of the token stream */
+void tokens_reader_init(TokenReader* reader, const TokenStream* ts);
+
+/* Read the next span or line break. Returns false at the end of the data, or
+ * if it's not valid, which also sets `error' */
+bool tokens_read(TokenReader* reader, TokenSpan* span);
+
+/* Draw the lines of the token stream into the canvas, which must have been
+ * allocated. Returns false if the data is truncated. */
+bool tokens_to_png(const TokenStream* ts, Canvas* canvas);
+
+/* Find the offset in the data of the start of each line, and of the end of
+ * the last one, so the lines can be drawn in any order. The array has
+ * `num_lines + 1' offsets, and must be freed. Returns NULL if the data is not
+ * valid. */
+uint64_t* tokens_line_offsets(const TokenStream* ts);
+
+/* Draw the lines from `first_line' to `end_line' (without it) at the top of
+ * the canvas, which must have been allocated, with the offsets of
+ * tokens_line_offsets(). Returns false if the data is not valid. */
+bool tokens_lines_to_png(const TokenStream* ts, const uint64_t* offsets,
+                         uint32_t first_line, uint32_t end_line,
+                         Canvas* canvas);
+
+/* Free or unmap the token stream */
+void tokens_close(TokenStream* ts);
+
+#endif /* TOKENS_H_ */
@@ -0,0 +1,67 @@
+#ifndef URING_H_
+#define URING_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper using the raw system calls, so liburing is not
+ * needed. A ring must only be used by one thread at a time.
+ */
+typedef struct {
+    int fd;
+
+    /* Submission queue, shared with the kernel */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_entries;
+
+    /* Tail of the entries we filled, published in uring_submit() */
+    unsigned sq_local_tail;
+
+    /* Completion queue, shared with the kernel */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /* Mapped regions, the CQ ring can be the same as the SQ ring */
+    void* sq_ring;
+    size_t sq_ring_sz;
+    void* cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+} Uring;
+
+/* Create a ring with at least `entries' submission entries. Returns false if
+ * io_uring is not available, for example in old kernels or when it has been
+ * disabled. */
+bool uring_init(Uring* ring, unsigned entries);
+
+void uring_free(Uring* ring);
+
+/* Get a cleared submission entry, or NULL if the queue is full */
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+
+/* Fill an entry for a read, write or open. The `user_data' is returned in the
+ * completion. */
+void uring_prep_rw(struct io_uring_sqe* sqe, int opcode, int fd,
+                   const void* addr, unsigned len, uint64_t off,
+                   uint64_t user_data);
+
+/* Submit the pending entries, and wait until at least `wait_nr' completions
+ * are available. Returns false on error. */
+bool uring_submit(Uring* ring, unsigned wait_nr);
+
+/* Pop a completion without waiting. Returns false if there are none. */
+bool uring_peek(Uring* ring, struct io_uring_cqe* cqe);
+
+/* Submit the pending entries, and pop a completion waiting if needed */
+bool uring_wait(Uring* ring, struct io_uring_cqe* cqe);
+
+#endif /* URING_H_ */
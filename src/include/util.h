@@ -0,0 +1,37 @@
+#ifndef UTIL_H_
+#define UTIL_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Read the whole file into a new allocated buffer, and store its size in
+ * `size'. Returns NULL on error. */
+char* read_file(const char* filename, size_t* size);
+
+/* Create all the parent directories of `path', like "mkdir -p $(dirname)" */
+bool mkdir_parents(const char* path);
+
+/* Allocate a new string with `dir', a slash (if needed), `file' and `ext' */
+char* path_join(const char* dir, const char* file, const char* ext);
+
+/* Skip the leading slashes, "./" and "../" components of the path, so it can
+ * be used relative to an output directory or inside an archive */
+const char* strip_path_prefix(const char* path);
+
+/* Heuristic used by git, grep, etc. The data is considered binary if there is
+ * a NULL byte in the first few KiB */
+bool is_text_data(const char* data, size_t size);
+
+/* Parse a size in bytes with an optional K, M or G suffix (powers of 1024).
+ * Returns false if the string is not a valid size. */
+bool parse_size(const char* str, size_t* size);
+
+/* Check if the path matches any of the shell patterns. Empty lists match
+ * everything */
+bool path_matches(const char* path, char* const* patterns, int num_patterns);
+
+/* Monotonic time in nanoseconds, for the stats */
+uint64_t time_ns(void);
+
+#endif /* UTIL_H_ */
@@ -0,0 +1,33 @@
+#ifndef VECTOR_H_
+#define VECTOR_H_ 1
+
+#include <stdbool.h>
+
+#include "render.h"
+#include "tokens.h"
+
+/* Rows from the top of a cell to the baseline of its glyph */
+#define FONT_BASELINE 10
+
+/*
+ * Backends that write the text of the token stream instead of drawing its
+ * glyphs, for browsers. Each palette index is a CSS class, "cN" for the
+ * foreground and "bN" for the background, and the layout has the same cells,
+ * margins and border as the PNG: chars are FONT_W pixels apart, and lines
+ * FONT_H + LINE_SPACING. The glyphs are the monospace font of the browser.
+ *
+ * Bytes that are not printable ASCII are written as the character with the
+ * same code in Latin-1, so each byte is still a single cell.
+ *
+ * Both return false if the token stream is not valid.
+ */
+
+/* Write an SVG image, where each span is positioned in its cells */
+bool vector_write_svg(const TokenStream* ts, const Color* palette,
+                      const char* filename);
+
+/* Write an HTML page with the text in a <pre> block */
+bool vector_write_html(const TokenStream* ts, const Color* palette,
+                       const char* filename);
+
+#endif /* VECTOR_H_ */
@@ -0,0 +1,106 @@
+#ifndef WATCH_H_
+#define WATCH_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "incremental.h"
+#include "batch.h" /* WalkFilter */
+
+/* Time without events after a change before rendering, so the writes of a
+ * single save are handled together */
+#define WATCH_DEBOUNCE_MS 30
+
+/* Maximum time waiting for that, for files that are written continuously */
+#define WATCH_DEBOUNCE_MAX_MS 500
+
+/* Incremental renders kept open between changes. The least recently used
+ * one is closed when there are more. */
+#define WATCH_MAX_OPEN 8
+
+/* Directory watched with inotify */
+typedef struct {
+    int wd;
+    char* path;
+
+    /* Path relative to the root of the tree, or NULL if it's not part of it
+     * and only has the files added with watch_add_file() */
+    char* rel;
+} WatchDir;
+
+/* Source that is rendered again when it changes */
+typedef struct {
+    char* path;
+    char* out;
+
+    /* Directory and name of the source inside it */
+    size_t dir;
+    const char* name;
+
+    /* Kept open between changes, see WATCH_MAX_OPEN */
+    IncRender* inc;
+    uint64_t last_used;
+
+    /* Time of the first event of a change that was not rendered yet, or
+     * zero */
+    uint64_t event_ns;
+} WatchTarget;
+
+/*
+ * Renders sources again in the same process whenever they are written, so the
+ * highlighter, the palette and the buffers of the thread are already warm. The
+ * directories of the sources are watched instead of the files, so editors that
+ * save to a new file and rename it are also seen. Each change is rendered with
+ * an incremental render (see IncRender), and the time from the save to the
+ * written image is printed and kept for watch_print_stats().
+ */
+typedef struct {
+    int fd;
+
+    /* See render_config_hash() */
+    uint64_t config;
+
+    WatchDir* dirs;
+    size_t num_dirs, cap_dirs;
+
+    WatchTarget* targets;
+    size_t num_targets, cap_targets;
+    int num_open;
+    uint64_t use_seq;
+
+    /* Used for new files of the tree, see watch_add_tree() */
+    const WalkFilter* filter;
+    const char* out_dir;
+    char* out_real;
+
+    /* Time from the first event of each change to its image */
+    uint64_t* latencies;
+    size_t num_latencies, cap_latencies;
+} Watch;
+
+/* Initialize inotify. Returns false on error */
+bool watch_init(Watch* watch, uint64_t config);
+
+/* Render the source to `out' when it changes */
+bool watch_add_file(Watch* watch, const char* path, const char* out);
+
+/* Render the files of the tree that pass the filter, including new ones, to
+ * the same relative path with a ".png" extension inside `out_dir'. New
+ * directories are also watched. Only one tree can be added, and the filter
+ * must outlive the watch. */
+bool watch_add_tree(Watch* watch, const char* root, const char* out_dir,
+                    const WalkFilter* filter);
+
+/* Render the sources that change until SIGINT or SIGTERM */
+void watch_run(Watch* watch);
+
+/* Print the number of changes rendered and the distribution of their
+ * latency */
+void watch_print_stats(const Watch* watch, FILE* fp);
+
+/* Close the incremental renders and stop watching */
+void watch_destroy(Watch* watch);
+
+#endif /* WATCH_H_ */
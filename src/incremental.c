@@ -0,0 +1,609 @@
+#define _GNU_SOURCE /* mremap() */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/incremental.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/hash.h"
+#include "include/bandenc.h"
+#include "include/util.h" /* time_ns() */
+
+#define SIDECAR_MAGIC "C2PNGINC"
+
+/* The pixels start after the header, aligned to a page so they can be
+ * mapped */
+#define SIDECAR_HDR_SZ 4096
+
+/* Rows of pixels of each line, see CHAR_Y_TO_PX() */
+#define LINE_ROWS (FONT_H + LINE_SPACING)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    /* Set while the pixels are being changed, and cleared once the lines are
+     * written by inc_sync(). A sidecar left dirty is rendered again. */
+    uint32_t dirty;
+
+    uint64_t config;
+
+    /* Size of the canvas in chars. There is a line for each row. */
+    uint32_t w, h;
+
+    uint32_t num_slots;
+
+    /* Bands of the last image, after the lines */
+    uint32_t num_bands;
+    uint64_t band_data_sz;
+} SidecarHeader;
+
+/*----------------------------------------------------------------------------*/
+
+static size_t row_size(const Canvas* canvas) {
+    return (size_t)canvas->w_px * COL_SZ;
+}
+
+/* The pixels have the top and bottom margins, followed by the slots */
+static size_t pixels_size(const Canvas* canvas, uint32_t num_slots) {
+    return (2 * MARGIN + (size_t)num_slots * LINE_ROWS) * row_size(canvas);
+}
+
+static uint8_t* slot_pixels(const IncRender* inc, uint32_t slot) {
+    const size_t row_sz = row_size(&inc->canvas);
+    return inc->map + (2 * MARGIN + (size_t)slot * LINE_ROWS) * row_sz;
+}
+
+/* Offset of the hashes in the file, followed by the slots, the states, the
+ * bands and their data */
+static off_t lines_offset(const IncRender* inc) {
+    return SIDECAR_HDR_SZ + pixels_size(&inc->canvas, inc->num_slots);
+}
+
+static bool write_header(const IncRender* inc, bool dirty) {
+    SidecarHeader hdr = {
+        .version   = INC_VERSION,
+        .dirty     = dirty,
+        .config    = inc->config,
+        .w         = inc->canvas.w,
+        .h         = inc->canvas.h,
+        .num_slots = inc->num_slots,
+        .num_bands = inc->num_bands,
+
+        .band_data_sz = inc->band_data_sz,
+    };
+    memcpy(hdr.magic, SIDECAR_MAGIC, sizeof(hdr.magic));
+
+    return pwrite(inc->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+}
+
+/* Map the pixels of the slots, growing the file if needed. The pixels that
+ * were already in the file are kept. */
+static void map_pixels(IncRender* inc) {
+    const Canvas* canvas = &inc->canvas;
+    const size_t map_sz  = pixels_size(canvas, inc->num_slots);
+    if (inc->map && inc->map_sz == map_sz)
+        return;
+
+    struct stat st;
+    if (fstat(inc->fd, &st) != 0 ||
+        ((size_t)st.st_size < SIDECAR_HDR_SZ + map_sz &&
+         ftruncate(inc->fd, SIDECAR_HDR_SZ + map_sz) != 0))
+        DIE("Can't resize \"%s\" for a %dx%d image\n", inc->path,
+            canvas->w_px, canvas->h_px);
+
+    /* Growing the mapping keeps the pages that are already mapped */
+    void* map = inc->map
+                  ? mremap(inc->map, inc->map_sz, map_sz, MREMAP_MAYMOVE)
+                  : mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         inc->fd, SIDECAR_HDR_SZ);
+    if (map == MAP_FAILED)
+        DIE("Can't map %dx%d image from \"%s\"\n", canvas->w_px, canvas->h_px,
+            inc->path);
+
+    inc->map    = map;
+    inc->map_sz = map_sz;
+}
+
+/* Point the rows of the canvas to the margins and to the slot of each line */
+static void point_rows(IncRender* inc) {
+    Canvas* canvas      = &inc->canvas;
+    const size_t row_sz = row_size(canvas);
+
+    png_bytep* rows = realloc(canvas->rows, canvas->h_px * sizeof(png_bytep));
+    if (!rows)
+        DIE("Can't allocate %dx%d image\n", canvas->w_px, canvas->h_px);
+    canvas->rows = rows;
+
+    const uint32_t bottom = CHAR_Y_TO_PX(canvas->h);
+    for (uint32_t y = 0; y < MARGIN; y++) {
+        rows[y]          = inc->map + y * row_sz;
+        rows[bottom + y] = inc->map + (MARGIN + y) * row_sz;
+    }
+
+    for (uint32_t l = 0; l < canvas->h; l++) {
+        uint8_t* pixels      = slot_pixels(inc, inc->slots[l]);
+        png_bytep* line_rows = &rows[CHAR_Y_TO_PX(l)];
+
+        for (uint32_t y = 0; y < LINE_ROWS; y++)
+            line_rows[y] = pixels + y * row_sz;
+    }
+
+    canvas->pixels     = NULL;
+    canvas->rows_start = 0;
+    canvas->rows_end   = canvas->h_px;
+}
+
+/* Read the lines and map the canvas of the previous render, if the sidecar
+ * has a complete one made with the same configuration */
+static bool load_previous(IncRender* inc) {
+    SidecarHeader hdr;
+    if (pread(inc->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, SIDECAR_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != INC_VERSION || hdr.dirty || hdr.config != inc->config ||
+        hdr.num_slots < hdr.h)
+        return false;
+
+    Canvas* canvas = &inc->canvas;
+    canvas->w      = hdr.w;
+    canvas->h      = hdr.h;
+    canvas_update_px_size(canvas);
+    inc->num_slots = hdr.num_slots;
+
+    const uint32_t num_lines = hdr.h;
+    const size_t hashes_sz   = num_lines * sizeof(uint64_t);
+    const size_t slots_sz    = num_lines * sizeof(uint32_t);
+    const size_t states_sz   = num_lines + 1;
+    const off_t off          = lines_offset(inc);
+
+    struct stat st;
+    if (fstat(inc->fd, &st) != 0 ||
+        (size_t)st.st_size < off + hashes_sz + slots_sz + states_sz)
+        return false;
+
+    inc->hashes = malloc(hashes_sz > 0 ? hashes_sz : 1);
+    inc->slots  = malloc(slots_sz > 0 ? slots_sz : 1);
+    inc->states = malloc(states_sz);
+    if (!inc->hashes || !inc->slots || !inc->states ||
+        pread(inc->fd, inc->hashes, hashes_sz, off) != (ssize_t)hashes_sz ||
+        pread(inc->fd, inc->slots, slots_sz, off + hashes_sz) !=
+          (ssize_t)slots_sz ||
+        pread(inc->fd, inc->states, states_sz, off + hashes_sz + slots_sz) !=
+          (ssize_t)states_sz)
+        return false;
+
+    for (uint32_t l = 0; l < num_lines; l++)
+        if (inc->slots[l] >= inc->num_slots)
+            return false;
+
+    inc->num_lines = num_lines;
+    map_pixels(inc);
+    point_rows(inc);
+
+    /* Without the bands, the next image is compressed from scratch */
+    const size_t bands_sz = hdr.num_bands * sizeof(IncBand);
+    const off_t bands_off = off + hashes_sz + slots_sz + states_sz;
+
+    inc->bands     = malloc(bands_sz > 0 ? bands_sz : 1);
+    inc->band_data = malloc(hdr.band_data_sz > 0 ? hdr.band_data_sz : 1);
+    if (inc->bands && inc->band_data &&
+        pread(inc->fd, inc->bands, bands_sz, bands_off) ==
+          (ssize_t)bands_sz &&
+        pread(inc->fd, inc->band_data, hdr.band_data_sz,
+              bands_off + bands_sz) == (ssize_t)hdr.band_data_sz) {
+        inc->num_bands    = hdr.num_bands;
+        inc->band_data_sz = hdr.band_data_sz;
+    }
+
+    for (uint32_t i = 0; i < inc->num_bands; i++)
+        if (inc->bands[i].offset + inc->bands[i].size > inc->band_data_sz)
+            inc->num_bands = 0;
+
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool inc_open(IncRender* inc, const char* path, uint64_t config) {
+    inc->path = strdup(path);
+    if (!inc->path)
+        return false;
+
+    inc->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (inc->fd < 0) {
+        free(inc->path);
+        return false;
+    }
+
+    inc->config    = config;
+    inc->map       = NULL;
+    inc->map_sz    = 0;
+    inc->num_slots = 0;
+    inc->num_lines = 0;
+    inc->hashes    = NULL;
+    inc->slots     = NULL;
+    inc->states    = NULL;
+    canvas_init(&inc->canvas);
+
+    inc->bands        = NULL;
+    inc->num_bands    = 0;
+    inc->band_data    = NULL;
+    inc->band_data_sz = 0;
+
+    inc->valid = load_previous(inc);
+    if (!inc->valid) {
+        free(inc->hashes);
+        free(inc->slots);
+        free(inc->states);
+        inc->hashes    = NULL;
+        inc->slots     = NULL;
+        inc->states    = NULL;
+        inc->num_lines = 0;
+        inc->num_slots = 0;
+    }
+
+    return true;
+}
+
+/* Give a slot to the new lines [p, e), which replace the previous lines
+ * [p, old_e). Their slots are used first, then the ones of lines removed
+ * before, and then new ones. */
+static void assign_slots(IncRender* inc, uint32_t* slots, uint32_t p,
+                         uint32_t e, uint32_t old_e) {
+    uint32_t l = p;
+    for (; l < e && l < old_e; l++)
+        slots[l] = inc->slots[l];
+
+    if (l == e)
+        return;
+
+    uint8_t* used = calloc(inc->num_slots > 0 ? inc->num_slots : 1, 1);
+    if (!used)
+        DIE("Can't allocate the slots of %d lines\n", inc->num_lines);
+
+    for (uint32_t i = 0; i < inc->num_lines; i++)
+        used[inc->slots[i]] = 1;
+
+    for (uint32_t slot = 0; slot < inc->num_slots && l < e; slot++)
+        if (!used[slot])
+            slots[l++] = slot;
+
+    while (l < e)
+        slots[l++] = inc->num_slots++;
+
+    free(used);
+}
+
+/* Clear and draw lines [l0, l1) of the source with the lexer starting in the
+ * state of line `l0'. Stores the state after them in the state of `l1'. */
+static void draw_lines(Canvas* canvas, const char* src, const size_t* starts,
+                       uint32_t l0, uint32_t l1) {
+    canvas_clear_lines(canvas, l0, l1);
+    source_lines_to_png(canvas, src + starts[l0], starts[l1] - starts[l0], l0,
+                        canvas->line_states[l0]);
+    canvas->line_states[l1] = highlight_get_state();
+}
+
+void inc_update(IncRender* inc, const char* src, size_t src_sz,
+                IncStats* stats) {
+    const uint64_t start_time = time_ns();
+    Canvas* canvas            = &inc->canvas;
+
+    /* The width also counts the last line if it doesn't end in a newline,
+     * which is not drawn */
+    Canvas dims;
+    canvas_init(&dims);
+    input_scan_dimensions(&dims, src, src_sz, 0);
+    const uint32_t n0 = inc->num_lines, n1 = dims.h;
+
+    /* Start of each line, and where the last one ends */
+    size_t* starts   = malloc((n1 + 1) * sizeof(size_t));
+    uint64_t* hashes = malloc((n1 > 0 ? n1 : 1) * sizeof(uint64_t));
+    uint32_t* slots  = malloc((n1 > 0 ? n1 : 1) * sizeof(uint32_t));
+    int8_t* states   = malloc(n1 + 1);
+    if (!starts || !hashes || !slots || !states)
+        DIE("Can't allocate the lines of a %d line source\n", n1);
+
+    starts[0] = 0;
+    for (uint32_t l = 0; l < n1; l++) {
+        const char* end = memchr(src + starts[l], '\n', src_sz - starts[l]);
+        starts[l + 1]   = end - src + 1;
+        hashes[l]       = hash64(src + starts[l], end - (src + starts[l]), 0);
+    }
+
+    /* Lines [0, p) and the last `s' lines are the same as before */
+    const bool full = !inc->valid || dims.w != canvas->w;
+    uint32_t p = 0, s = 0;
+    if (!full) {
+        const uint32_t min = n0 < n1 ? n0 : n1;
+        while (p < min && inc->hashes[p] == hashes[p])
+            p++;
+        while (s < min - p && inc->hashes[n0 - 1 - s] == hashes[n1 - 1 - s])
+            s++;
+    }
+
+    const uint64_t draw_time = time_ns();
+    stats->diff_ns           = draw_time - start_time;
+
+    /* Until the lines are written, the sidecar is not valid */
+    write_header(inc, true);
+
+    uint32_t l = p;
+    if (full) {
+        /* The lines are in order, there are no removed ones */
+        for (uint32_t i = 0; i < n1; i++)
+            slots[i] = i;
+
+        free(inc->slots);
+        inc->slots     = slots;
+        inc->num_slots = n1;
+
+        canvas->w = dims.w;
+        canvas->h = n1;
+        canvas_update_px_size(canvas);
+        map_pixels(inc);
+        point_rows(inc);
+
+        canvas->line_states = states;
+        states[0]           = HL_DEFAULT;
+        draw_lines(canvas, src, starts, 0, n1);
+        draw_border(canvas);
+        l = n1;
+    } else {
+        /* The lines before the first change start in the same state */
+        memcpy(states, inc->states, p + 1);
+
+        /* The lines that didn't change keep their pixels */
+        memcpy(slots, inc->slots, p * sizeof(uint32_t));
+        memcpy(&slots[n1 - s], &inc->slots[n0 - s], s * sizeof(uint32_t));
+        assign_slots(inc, slots, p, n1 - s, n0 - s);
+
+        free(inc->slots);
+        inc->slots = slots;
+
+        canvas->h = n1;
+        canvas_update_px_size(canvas);
+        map_pixels(inc);
+        point_rows(inc);
+
+        /* Draw the changed lines, and then the next ones until they start in
+         * the same state as before. Those and the rest are not drawn. */
+        const uint32_t e    = n1 - s;
+        const int64_t delta = (int64_t)n1 - n0;
+        uint32_t chunk      = INC_MIN_CHUNK;
+
+        canvas->line_states = states;
+        while (l < n1) {
+            if (l >= e && states[l] == inc->states[l - delta]) {
+                memcpy(&states[l], &inc->states[l - delta], n1 - l + 1);
+                break;
+            }
+
+            uint32_t next = e;
+            if (l >= e) {
+                next = (n1 - l > chunk) ? l + chunk : n1;
+                chunk *= 2;
+            }
+
+            draw_lines(canvas, src, starts, l, next);
+            l = next;
+        }
+
+        /* Restore the border of the rows that were drawn */
+        canvas->rows_start = (p == 0) ? 0 : CHAR_Y_TO_PX(p);
+        canvas->rows_end   = (l == n1) ? canvas->h_px : CHAR_Y_TO_PX(l);
+        draw_border(canvas);
+        canvas->rows_start = 0;
+        canvas->rows_end   = canvas->h_px;
+    }
+
+    canvas->line_states = NULL;
+    stats->draw_ns      = time_ns() - draw_time;
+    stats->full         = full;
+    stats->resized      = full || n1 != n0;
+    stats->first_line   = p;
+    stats->lines_drawn  = l - p;
+
+    free(starts);
+    free(inc->hashes);
+    free(inc->states);
+    inc->hashes    = hashes;
+    inc->states    = states;
+    inc->num_lines = n1;
+    inc->valid     = true;
+}
+
+/* Line after the last one of the band that starts at line `l0' */
+static uint32_t band_end(const IncRender* inc, uint32_t l0) {
+    uint32_t l = l0;
+    while (l < inc->num_lines) {
+        const uint32_t num = ++l - l0;
+        if (num >= INC_BAND_MAX ||
+            (num >= INC_BAND_MIN &&
+             ((inc->hashes[l - 1] >> 32) & INC_BAND_MASK) == 0))
+            break;
+    }
+
+    return l;
+}
+
+/* The pixels of a line only depend on its bytes, the lexer state at its
+ * start, and the width of the canvas. The first and last bands also have the
+ * margins. */
+static uint64_t band_key(const IncRender* inc, uint32_t l0, uint32_t l1) {
+    const uint64_t seed = (uint64_t)inc->canvas.w << 2 | (l0 == 0) << 1 |
+                          (l1 == inc->num_lines);
+
+    const uint64_t ret =
+      hash64(&inc->hashes[l0], (l1 - l0) * sizeof(uint64_t), seed);
+    return hash64(&inc->states[l0], l1 - l0, ret);
+}
+
+/* Index of the band of the last image with the key, or -1 */
+static int64_t find_band(const IncRender* inc, const uint32_t* table,
+                         uint32_t mask, uint64_t key) {
+    for (uint32_t i = key & mask; table[i] != 0; i = (i + 1) & mask)
+        if (inc->bands[table[i] - 1].key == key)
+            return table[i] - 1;
+
+    return -1;
+}
+
+bool inc_write_png(IncRender* inc, const char* filename,
+                   IncEncodeStats* stats) {
+    const uint64_t start_time = time_ns();
+    Canvas* canvas            = &inc->canvas;
+    const size_t row_sz       = (size_t)canvas->w_px * COL_SZ;
+
+    BandEncoder enc;
+    if (!band_encoder_init(&enc, row_sz))
+        DIE("Can't initialize the encoder\n");
+
+    /* Open addressing table of the previous bands by key, with their index
+     * plus one */
+    uint32_t mask = 15;
+    while (mask < 2 * inc->num_bands)
+        mask = mask * 2 + 1;
+
+    uint32_t* table = calloc(mask + 1, sizeof(uint32_t));
+    if (!table)
+        DIE("Can't allocate the table of %d bands\n", inc->num_bands);
+
+    for (uint32_t i = 0; i < inc->num_bands; i++) {
+        uint32_t j = inc->bands[i].key & mask;
+        while (table[j] != 0)
+            j = (j + 1) & mask;
+        table[j] = i + 1;
+    }
+
+    ByteBuf data   = { 0 };
+    IncBand* bands = NULL;
+    uint32_t num = 0, cap = 0;
+    uint32_t adler = adler32(0, NULL, 0);
+
+    stats->reused        = 0;
+    stats->compressed_sz = 0;
+
+    uint32_t l0 = 0;
+    do {
+        const uint32_t l1 = band_end(inc, l0);
+        const uint32_t y0 = (l0 == 0) ? 0 : CHAR_Y_TO_PX(l0);
+        const uint32_t y1 =
+          (l1 == canvas->h) ? canvas->h_px : CHAR_Y_TO_PX(l1);
+
+        if (num >= cap) {
+            cap          = cap ? 2 * cap : 64;
+            IncBand* tmp = realloc(bands, cap * sizeof(IncBand));
+            if (!tmp)
+                DIE("Can't allocate the table of %d bands\n", cap);
+            bands = tmp;
+        }
+
+        IncBand* band = &bands[num++];
+        band->key     = band_key(inc, l0, l1);
+        band->offset  = data.size;
+
+        const int64_t prev = find_band(inc, table, mask, band->key);
+        if (prev >= 0) {
+            const IncBand* old = &inc->bands[prev];
+            byte_buf_append(&data, inc->band_data + old->offset, old->size);
+            band->adler  = old->adler;
+            band->raw_sz = old->raw_sz;
+            stats->reused++;
+        } else {
+            band->adler  = band_encode(&enc, &canvas->rows[y0], y1 - y0, &data);
+            band->raw_sz = (uint64_t)(y1 - y0) * (row_sz + 1);
+            stats->compressed_sz += band->raw_sz;
+        }
+
+        band->size = data.size - band->offset;
+        adler      = adler32_combine(adler, band->adler, band->raw_sz);
+        l0         = l1;
+    } while (l0 < canvas->h);
+
+    free(table);
+    band_encoder_destroy(&enc);
+
+    ByteBuf head = { 0 }, tail = { 0 };
+    png_start_image(&head, canvas->w_px, canvas->h_px);
+    png_finish_image(&tail, adler);
+
+    FILE* fd = fopen(filename, "wb");
+    bool ok  = fd && fwrite(head.data, 1, head.size, fd) == head.size &&
+              fwrite(data.data, 1, data.size, fd) == data.size &&
+              fwrite(tail.data, 1, tail.size, fd) == tail.size;
+    if (fd && fclose(fd) != 0)
+        ok = false;
+
+    free(head.data);
+    free(tail.data);
+
+    free(inc->bands);
+    free(inc->band_data);
+    inc->bands        = bands;
+    inc->num_bands    = num;
+    inc->band_data    = data.data;
+    inc->band_data_sz = data.size;
+
+    stats->bands     = num;
+    stats->encode_ns = time_ns() - start_time;
+    return ok;
+}
+
+bool inc_sync(IncRender* inc) {
+    if (!inc->valid)
+        return true;
+
+    const size_t hashes_sz = inc->num_lines * sizeof(uint64_t);
+    const size_t slots_sz  = inc->num_lines * sizeof(uint32_t);
+    const size_t states_sz = inc->num_lines + 1;
+    const size_t bands_sz  = inc->num_bands * sizeof(IncBand);
+
+    off_t off = lines_offset(inc);
+    const struct {
+        const void* data;
+        size_t size;
+    } parts[] = {
+        { inc->hashes, hashes_sz },
+        { inc->slots, slots_sz },
+        { inc->states, states_sz },
+        { inc->bands, bands_sz },
+        { inc->band_data, inc->band_data_sz },
+    };
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (parts[i].size > 0 &&
+            pwrite(inc->fd, parts[i].data, parts[i].size, off) !=
+              (ssize_t)parts[i].size)
+            return false;
+        off += parts[i].size;
+    }
+
+    /* The file can be bigger if the canvas was wider before */
+    return ftruncate(inc->fd, off) == 0 && write_header(inc, false);
+}
+
+bool inc_close(IncRender* inc) {
+    const bool ret = inc_sync(inc);
+
+    if (inc->map)
+        munmap(inc->map, inc->map_sz);
+    close(inc->fd);
+
+    free(inc->canvas.rows);
+    free(inc->hashes);
+    free(inc->slots);
+    free(inc->states);
+    free(inc->bands);
+    free(inc->band_data);
+    free(inc->path);
+    return ret;
+}
@@ -0,0 +1,205 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "include/lexindex.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/hash.h"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t interval;
+    LexIndexKey key;
+    uint32_t num_lines;
+    uint32_t num_checkpoints;
+} LexIndexHeader;
+
+/*----------------------------------------------------------------------------*/
+
+bool lexindex_key(LexIndexKey* key, const char* path, const char* src,
+                  size_t src_sz) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (size_t)st.st_size != src_sz)
+        return false;
+
+    memset(key, 0, sizeof(LexIndexKey));
+    key->size     = src_sz;
+    key->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+                    st.st_mtim.tv_nsec;
+    key->hash     = hash64(src, src_sz, LEXINDEX_VERSION);
+    return true;
+}
+
+/* Checkpoints of the lines that are drawn, and always the first one */
+static uint32_t num_checkpoints(uint32_t num_lines) {
+    return (num_lines == 0) ? 1 : (num_lines - 1) / LEXINDEX_INTERVAL + 1;
+}
+
+static void alloc_checkpoints(LexIndex* idx, uint32_t num_lines) {
+    idx->num_lines       = num_lines;
+    idx->num_checkpoints = num_checkpoints(num_lines);
+    idx->offsets         = malloc(idx->num_checkpoints * sizeof(uint64_t));
+    idx->states          = malloc(idx->num_checkpoints * sizeof(int8_t));
+    if (!idx->offsets || !idx->states)
+        DIE("Can't allocate %d lexer checkpoints\n", idx->num_checkpoints);
+}
+
+/* Offset of the line after the next `lines' ones from `pos', or the end of
+ * the source. Stores the number of lines that were skipped. */
+static size_t skip_lines(const char* src, size_t src_sz, size_t pos,
+                         uint32_t lines, uint32_t* skipped) {
+    const char* nl;
+    uint32_t i = 0;
+    while (i < lines && (nl = memchr(src + pos, '\n', src_sz - pos)) != NULL) {
+        pos = nl - src + 1;
+        i++;
+    }
+
+    *skipped = i;
+    return pos;
+}
+
+void lexindex_from_states(LexIndex* idx, const char* src, size_t src_sz,
+                          const int8_t* states) {
+    uint32_t num_lines;
+    skip_lines(src, src_sz, 0, UINT32_MAX, &num_lines);
+    alloc_checkpoints(idx, num_lines);
+
+    size_t pos = 0;
+    uint32_t skipped;
+    for (uint32_t i = 0; i < idx->num_checkpoints; i++) {
+        if (i > 0)
+            pos = skip_lines(src, src_sz, pos, LEXINDEX_INTERVAL, &skipped);
+
+        idx->offsets[i] = pos;
+        idx->states[i]  = states[i * LEXINDEX_INTERVAL];
+    }
+}
+
+void lexindex_scan(LexIndex* idx, const char* src, size_t src_sz) {
+    /* Count the lines first, for the number of checkpoints */
+    uint32_t num_lines;
+    skip_lines(src, src_sz, 0, UINT32_MAX, &num_lines);
+    alloc_checkpoints(idx, num_lines);
+
+    size_t pos = 0;
+    int state  = HL_DEFAULT;
+    uint32_t skipped;
+    for (uint32_t i = 0; i < idx->num_checkpoints; i++) {
+        if (i > 0) {
+            const size_t next =
+              skip_lines(src, src_sz, pos, LEXINDEX_INTERVAL, &skipped);
+            state = highlight_text_state(src + pos, next - pos, state);
+            pos   = next;
+        }
+
+        idx->offsets[i] = pos;
+        idx->states[i]  = state;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool lexindex_load(LexIndex* idx, const char* filename,
+                   const LexIndexKey* key) {
+    memset(idx, 0, sizeof(LexIndex));
+
+    FILE* fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    LexIndexHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, LEXINDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != LEXINDEX_VERSION ||
+        hdr.interval != LEXINDEX_INTERVAL ||
+        memcmp(&hdr.key, key, sizeof(LexIndexKey)) != 0 ||
+        hdr.num_checkpoints != num_checkpoints(hdr.num_lines)) {
+        fclose(fp);
+        return false;
+    }
+
+    alloc_checkpoints(idx, hdr.num_lines);
+    const bool ok =
+      fread(idx->offsets, sizeof(uint64_t), idx->num_checkpoints, fp) ==
+        idx->num_checkpoints &&
+      fread(idx->states, sizeof(int8_t), idx->num_checkpoints, fp) ==
+        idx->num_checkpoints;
+    fclose(fp);
+
+    /* The offsets must be increasing and inside the source */
+    for (uint32_t i = 1; ok && i < idx->num_checkpoints; i++)
+        if (idx->offsets[i] < idx->offsets[i - 1] ||
+            idx->offsets[i] > key->size) {
+            lexindex_free(idx);
+            return false;
+        }
+
+    if (!ok)
+        lexindex_free(idx);
+
+    return ok;
+}
+
+bool lexindex_save(const LexIndex* idx, const char* filename,
+                   const LexIndexKey* key) {
+    LexIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LEXINDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version         = LEXINDEX_VERSION;
+    hdr.interval        = LEXINDEX_INTERVAL;
+    hdr.key             = *key;
+    hdr.num_lines       = idx->num_lines;
+    hdr.num_checkpoints = idx->num_checkpoints;
+
+    const size_t tmp_sz = strlen(filename) + 32;
+    char* tmp           = malloc(tmp_sz);
+    if (!tmp)
+        return false;
+    snprintf(tmp, tmp_sz, "%s.tmp-%ld", filename, (long)getpid());
+
+    FILE* fp = fopen(tmp, "wb");
+    bool ret =
+      fp && fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+      fwrite(idx->offsets, sizeof(uint64_t), idx->num_checkpoints, fp) ==
+        idx->num_checkpoints &&
+      fwrite(idx->states, sizeof(int8_t), idx->num_checkpoints, fp) ==
+        idx->num_checkpoints;
+    if (fp && fclose(fp) != 0)
+        ret = false;
+
+    if (ret)
+        ret = rename(tmp, filename) == 0;
+    if (!ret)
+        unlink(tmp);
+
+    free(tmp);
+    return ret;
+}
+
+uint32_t lexindex_seek(const LexIndex* idx, uint32_t line, size_t* offset,
+                       int* state) {
+    uint32_t i = line / LEXINDEX_INTERVAL;
+    if (i >= idx->num_checkpoints)
+        i = idx->num_checkpoints - 1;
+
+    *offset = idx->offsets[i];
+    *state  = idx->states[i];
+    return i * LEXINDEX_INTERVAL;
+}
+
+void lexindex_free(LexIndex* idx) {
+    free(idx->offsets);
+    free(idx->states);
+    idx->offsets         = NULL;
+    idx->states          = NULL;
+    idx->num_checkpoints = 0;
+}
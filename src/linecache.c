@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "include/linecache.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/hash.h"
+
+/* Bytes of each row of pixels of a line with `cols' cells */
+#define LINE_ROW_SZ(COLS) ((size_t)(COLS) * FONT_W * COL_SZ)
+
+static atomic_uint_fast64_t total_lookups, total_hits;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+/*----------------------------------------------------------------------------*/
+
+static void thread_cache_free(void* arg) {
+    LineCache* cache = arg;
+    line_cache_flush_stats(cache);
+    free(cache->pixels);
+    free(cache);
+}
+
+static void thread_key_init(void) {
+    if (pthread_key_create(&thread_key, thread_cache_free) != 0)
+        DIE("Can't create the line cache key\n");
+}
+
+LineCache* line_cache_thread(void) {
+    pthread_once(&thread_once, thread_key_init);
+
+    LineCache* cache = pthread_getspecific(thread_key);
+    if (cache)
+        return cache;
+
+    /* The epoch of the cache starts at 1, so the zeroed slots are invalid */
+    cache           = calloc(1, sizeof(LineCache));
+    uint8_t* pixels = malloc(LINE_CACHE_BYTES);
+    if (!cache || !pixels || pthread_setspecific(thread_key, cache) != 0)
+        DIE("Can't allocate the line cache\n");
+
+    cache->epoch  = 1;
+    cache->pixels = pixels;
+    return cache;
+}
+
+static LineEntry* find_slot(LineCache* cache, uint64_t hash) {
+    return &cache->slots[hash & (LINE_CACHE_SLOTS - 1)];
+}
+
+bool line_cache_draw(LineCache* cache, Canvas* canvas, const char* line,
+                     size_t len, int state, uint64_t* hash) {
+    cache->lookups++;
+    if (len > LINE_CACHE_MAX_LEN)
+        return false;
+
+    *hash = hash64(line, len, state);
+
+    const LineEntry* entry = find_slot(cache, *hash);
+    if (entry->epoch != cache->epoch || entry->hash != *hash ||
+        entry->len != len || entry->state != state ||
+        entry->palette != canvas->palette ||
+        memcmp(entry->text, line, len) != 0)
+        return false;
+
+    /* Lines always start at the first column */
+    const size_t row_sz   = LINE_ROW_SZ(entry->cols - entry->first_col);
+    const uint32_t y      = CHAR_Y_TO_PX(canvas->y);
+    const uint32_t x      = CHAR_X_TO_PX(entry->first_col) * COL_SZ;
+    const uint8_t* pixels = cache->pixels + entry->pixels;
+
+    for (uint32_t fy = 0; fy < FONT_H; fy++)
+        memcpy(&canvas->rows[y + fy][x], pixels + fy * row_sz, row_sz);
+
+    canvas->x = entry->cols;
+    highlight_set_state(entry->end_state);
+
+    cache->hits++;
+    return true;
+}
+
+void line_cache_put(LineCache* cache, const Canvas* canvas, uint64_t hash,
+                    const char* line, size_t len, int state, int end_state) {
+    if (len > LINE_CACHE_MAX_LEN)
+        return;
+
+    /* The slots use the low bits of the hash */
+    uint64_t* seen = &cache->seen[(hash >> 32) & (LINE_CACHE_SEEN - 1)];
+    if (*seen != hash) {
+        *seen = hash;
+        return;
+    }
+
+    /* Tabs take more than one cell, see png_putchar() */
+    uint32_t first_col = 0;
+    for (size_t i = 0; i < len && (line[i] == ' ' || line[i] == '\t'); i++)
+        first_col += (line[i] == '\t') ? TAB_SZ : 1;
+
+    const uint32_t cols = canvas->x;
+    if (first_col > cols)
+        first_col = cols;
+
+    const size_t row_sz = LINE_ROW_SZ(cols - first_col);
+    const size_t size   = FONT_H * row_sz;
+
+    /* Start again when it's full, dropping every entry */
+    if (cache->pixels_used + size > LINE_CACHE_BYTES) {
+        cache->epoch++;
+        cache->pixels_used = 0;
+    }
+
+    LineEntry* entry = find_slot(cache, hash);
+    entry->hash      = hash;
+    entry->palette   = canvas->palette;
+    entry->len       = len;
+    entry->state     = state;
+    entry->end_state = end_state;
+    entry->first_col = first_col;
+    entry->cols      = cols;
+    entry->pixels    = cache->pixels_used;
+    entry->epoch     = cache->epoch;
+    memcpy(entry->text, line, len);
+
+    const uint32_t y = CHAR_Y_TO_PX(canvas->y);
+    const uint32_t x = CHAR_X_TO_PX(first_col) * COL_SZ;
+    uint8_t* pixels  = cache->pixels + cache->pixels_used;
+
+    for (uint32_t fy = 0; fy < FONT_H; fy++)
+        memcpy(pixels + fy * row_sz, &canvas->rows[y + fy][x], row_sz);
+
+    cache->pixels_used += size;
+}
+
+void line_cache_flush_stats(LineCache* cache) {
+    atomic_fetch_add(&total_lookups, cache->lookups);
+    atomic_fetch_add(&total_hits, cache->hits);
+    cache->lookups = 0;
+    cache->hits    = 0;
+}
+
+void line_cache_totals(uint64_t* lookups, uint64_t* hits) {
+    *lookups = atomic_load(&total_lookups);
+    *hits    = atomic_load(&total_hits);
+}
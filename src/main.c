@@ -2,332 +2,1623 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
-#include <png.h>
-
-#include "fonts/main_font.h" /* FONT_W, FONT_H, main_font[] */
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define OPTPARSE_IMPLEMENTATION
+#define OPTPARSE_API static
+#include "include/optparse.h"
+#include "include/render.h"
+#include "include/arena.h"
 #include "include/highlight.h"
+#include "include/tar.h"
+#include "include/sink.h"
+#include "include/batch.h"
+#include "include/budget.h"
+#include "include/pipeline.h"
+#include "include/parlex.h"
+#include "include/cache.h"
+#include "include/linecache.h"
+#include "include/incremental.h"
+#include "include/watch.h"
+#include "include/tokens.h"
+#include "include/thumbnail.h"
+#include "include/minimap.h"
+#include "include/lexindex.h"
+#include "include/tiles.h"
+#include "include/montage.h"
+#include "include/vector.h"
+#include "include/rawimg.h"
+#include "include/optimize.h"
+#include "include/util.h"
+
+/* Maximum number of --filter, --ext and --ignore patterns */
+#define MAX_FILTERS 64
+
+/* Maximum number of --theme outputs */
+#define MAX_THEMES 16
+
+/* Formats of the output of a single file, see output_format() */
+enum EFormat {
+    FORMAT_PNG,
+    FORMAT_SVG,
+    FORMAT_HTML,
+    FORMAT_PAM,
+    FORMAT_PPM,
+    FORMAT_QOI,
+};
 
-#define MIN_W        80 /* chars */
-#define MIN_H        0  /* chars */
-#define MARGIN       10 /* px */
-#define LINE_SPACING 1  /* px */
-#define BORDER_SZ    2  /* px */
-#define TAB_SZ       4  /* chars */
-
-/* Bytes of each entry in rows[] */
-#define COL_SZ 4
-
-/* Character position -> Pixel position */
-#define CHAR_Y_TO_PX(Y) (MARGIN + Y * (FONT_H + LINE_SPACING))
-#define CHAR_X_TO_PX(X) (MARGIN + X * FONT_W)
-
-#define COL(RGB, A)            \
-    ((Color){                  \
-      .r = (RGB >> 16) & 0xFF, \
-      .g = (RGB >> 8) & 0xFF,  \
-      .b = RGB & 0xFF,         \
-      .a = A & 0xFF,           \
-    })
-
-#define DIE(...)                      \
-    {                                 \
-        fprintf(stderr, __VA_ARGS__); \
-        exit(1);                      \
-    }
-
-enum EPaletteIndexes {
-    /* Used by highlight.c */
-    COL_DEFAULT = 0,
-    COL_PREPROC,
-    COL_TYPES,
-    COL_KWRDS,
-    COL_NUMBER,
-    COL_STRING,
-    COL_COMMENT,
-    COL_FUNC_CALL,
-    COL_SYMBOL,
-
-    /* Used only in main.c */
-    COL_BACK,
-    COL_BORDER,
-
-    PALETTE_SZ,
+/* What main() does with the arguments, picked in this order by pick_mode() */
+enum EMode {
+    MODE_TAR,
+    MODE_MULTI,
+    MODE_RECURSIVE,
+    MODE_WINDOW,
+    MODE_MONTAGE,
+    MODE_TILES,
+    MODE_MINIMAP,
+    MODE_THUMBNAIL,
+    MODE_THEMES,
+    MODE_TO_TOKENS,
+    MODE_VECTOR,
+    MODE_FROM_TOKENS,
+    MODE_SINGLE,
 };
 
-typedef struct {
-    uint8_t r, g, b, a;
-} Color;
+enum EOptions {
+    OPT_TAR,
+    OPT_FILTER,
+    OPT_MULTI,
+    OPT_TAR_OUTPUT,
+    OPT_RECURSIVE,
+    OPT_JOBS,
+    OPT_EXT,
+    OPT_IGNORE,
+    OPT_MEM_LIMIT,
+    OPT_SYNC_IO,
+    OPT_PIPELINE,
+    OPT_PARALLEL,
+    OPT_CACHE_DIR,
+    OPT_CACHE_SIZE,
+    OPT_INCREMENTAL,
+    OPT_WATCH,
+    OPT_TO_TOKENS,
+    OPT_FROM_TOKENS,
+    OPT_THEME,
+    OPT_THUMBNAIL,
+    OPT_MINIMAP,
+    OPT_LINES,
+    OPT_COLS,
+    OPT_TILES,
+    OPT_MONTAGE,
+    OPT_FAST_PNG,
+    OPT_FORMAT,
+    OPT_OPTIMIZE,
+    OPT_HELP,
+
+    OPT_END,
+};
+
+static const struct optparse_long longopts[] = {
+    [OPT_TAR]         = { "tar", 't', OPTPARSE_NONE },
+    [OPT_FILTER]      = { "filter", 'f', OPTPARSE_REQUIRED },
+    [OPT_MULTI]       = { "multi", 'm', OPTPARSE_NONE },
+    [OPT_TAR_OUTPUT]  = { "tar-output", 'T', OPTPARSE_NONE },
+    [OPT_RECURSIVE]   = { "recursive", 'r', OPTPARSE_NONE },
+    [OPT_JOBS]        = { "jobs", 'j', OPTPARSE_REQUIRED },
+    [OPT_EXT]         = { "ext", 'e', OPTPARSE_REQUIRED },
+    [OPT_IGNORE]      = { "ignore", 'i', OPTPARSE_REQUIRED },
+    [OPT_MEM_LIMIT]   = { "mem-limit", 'M', OPTPARSE_REQUIRED },
+    [OPT_SYNC_IO]     = { "sync-io", 'S', OPTPARSE_NONE },
+    [OPT_PIPELINE]    = { "pipeline", 'p', OPTPARSE_NONE },
+    [OPT_PARALLEL]    = { "parallel", 'P', OPTPARSE_NONE },
+    [OPT_CACHE_DIR]   = { "cache-dir", 'c', OPTPARSE_REQUIRED },
+    [OPT_CACHE_SIZE]  = { "cache-size", 'C', OPTPARSE_REQUIRED },
+    [OPT_INCREMENTAL] = { "incremental", 'I', OPTPARSE_NONE },
+    [OPT_WATCH]       = { "watch", 'w', OPTPARSE_NONE },
+    [OPT_TO_TOKENS]   = { "to-tokens", 'k', OPTPARSE_NONE },
+    [OPT_FROM_TOKENS] = { "from-tokens", 'K', OPTPARSE_NONE },
+    [OPT_THEME]       = { "theme", 'y', OPTPARSE_REQUIRED },
+    [OPT_THUMBNAIL]   = { "thumbnail", 'n', OPTPARSE_REQUIRED },
+    [OPT_MINIMAP]     = { "minimap", 'u', OPTPARSE_OPTIONAL },
+    [OPT_LINES]       = { "lines", 'l', OPTPARSE_REQUIRED },
+    [OPT_COLS]        = { "cols", 'o', OPTPARSE_REQUIRED },
+    [OPT_TILES]       = { "tiles", 'z', OPTPARSE_NONE },
+    [OPT_MONTAGE]     = { "montage", 'a', OPTPARSE_NONE },
+    [OPT_FAST_PNG]    = { "fast-png", 'F', OPTPARSE_NONE },
+    [OPT_FORMAT]      = { "format", 'x', OPTPARSE_REQUIRED },
+    [OPT_OPTIMIZE]    = { "optimize", 'O', OPTPARSE_NONE },
+    [OPT_HELP]        = { "help", 'h', OPTPARSE_NONE },
+    [OPT_END]         = { 0 },
+};
+
+/* Filled in parse_args() */
+static struct {
+    enum EMode mode;
+    bool tar;
+    bool multi;
+    bool tar_output;
+    bool recursive;
+    int jobs;
+    size_t mem_limit;
+    bool sync_io;
+    bool pipeline;
+    bool parallel;
+    const char* cache_dir;
+    size_t cache_size;
+    bool incremental;
+    bool watch;
+    bool to_tokens;
+    bool from_tokens;
+    const char* theme;
+    char* theme_names[MAX_THEMES];
+    char* theme_outputs[MAX_THEMES];
+    int num_themes;
+    uint32_t thumbnail_w, thumbnail_h;
+    const char* thumbnail_output;
+    int minimap_rows;
+
+    /* Window of --lines and --cols, from 0 and without the end */
+    bool lines, cols;
+    uint32_t first_line, end_line;
+    uint32_t first_col, end_col;
+    bool tiles;
+    bool montage;
+    enum EFormat format;
+    bool format_set;
+    bool optimize;
+    char* filters[MAX_FILTERS];
+    int num_filters;
+    char* exts[MAX_FILTERS];
+    int num_exts;
+    char* ignores[MAX_FILTERS];
+    int num_ignores;
+
+    /* Positional arguments */
+    char** inputs;
+    int num_inputs;
+    const char* output;
+} args;
+
+/* Opened in main() if there is a --cache-dir */
+static RenderCache* cache = NULL;
 
 /*----------------------------------------------------------------------------*/
 
-/* Initialized in setup_palette() */
-static Color palette[PALETTE_SZ];
+static void usage(const char* self) {
+    fprintf(stderr,
+            "Usage: %s [options] <in> <out>\n"
+            "       %s [options] --tar <archive> <out>\n"
+            "       %s [options] --multi <in>... <out>\n"
+            "       %s [options] --recursive <dir> <out>\n"
+            "       %s [options] --theme <name>:<out>... <in>\n"
+            "       %s [options] --montage <in>... <out>\n"
+            "\n"
+            "The format of the <out> image is chosen by its extension: .png, "
+            "or .pam,\n"
+            ".ppm and .qoi without compression. The <out> of a single file "
+            "can also be\n"
+            "an .svg or .html file, drawn by the browser from the highlighted "
+            "text.\n"
+            "\n"
+            "Options:\n"
+            "  -t, --tar          Render every text member of a tar archive, "
+            "optionally\n"
+            "                     gzip-compressed. Use \"-\" for stdin.\n"
+            "  -f, --filter GLOB  Only render archive members or files whose "
+            "path\n"
+            "                     matches GLOB. Can be used more than once.\n"
+            "  -m, --multi        Render every input file, <out> is a "
+            "directory.\n"
+            "  -T, --tar-output   Write the images of a multi-file mode as "
+            "members of\n"
+            "                     the <out> tar archive. Use \"-\" for "
+            "stdout.\n"
+            "  -r, --recursive    Render every text file inside <dir>, "
+            "recursively.\n"
+            "  -j, --jobs N       Number of worker threads for --multi and "
+            "--recursive.\n"
+            "                     Defaults to the number of CPUs.\n"
+            "  -e, --ext LIST     Only render files with one of the "
+            "comma-separated\n"
+            "                     extensions, like \"c,h\".\n"
+            "  -i, --ignore GLOB  Don't render or walk files and directories "
+            "whose name\n"
+            "                     or path matches GLOB.\n"
+            "  -M, --mem-limit SZ Keep the memory of --multi and --recursive "
+            "renders\n"
+            "                     under SZ bytes (K, M and G suffixes). Files "
+            "that\n"
+            "                     don't fit wait, or are rendered in bands.\n"
+            "  -S, --sync-io      Read and write the files of --multi and "
+            "--recursive\n"
+            "                     with blocking calls instead of io_uring.\n"
+            "  -p, --pipeline     Read, highlight, draw and encode a single "
+            "file at the\n"
+            "                     same time, each in its own thread, and "
+            "print the\n"
+            "                     utilization of each stage.\n"
+            "  -P, --parallel     Highlight and draw a single file with "
+            "--jobs threads.\n"
+            "  -c, --cache-dir DIR\n"
+            "                     Reuse the images of sources rendered "
+            "before with the\n"
+            "                     same options, which are stored in DIR.\n"
+            "  -C, --cache-size SZ\n"
+            "                     Maximum size of the cache, 256M by "
+            "default. The least\n"
+            "                     recently used images are removed.\n"
+            "  -I, --incremental  Keep the canvas of a single file in "
+            "<out>%s, and only\n"
+            "                     draw the lines that changed since the "
+            "last render.\n"
+            "  -w, --watch        After rendering, render the sources again "
+            "whenever they\n"
+            "                     change, until interrupted. Implies "
+            "--incremental.\n"
+            "  -k, --to-tokens    Only highlight a single file, and write "
+            "its token\n"
+            "                     stream to <out>.\n"
+            "  -K, --from-tokens  Draw <in>, a token stream written with "
+            "--to-tokens,\n"
+            "                     without highlighting it again.\n"
+            "  -y, --theme NAME[:OUT]\n"
+            "                     Colors of the images: %s. With OUT, "
+            "write an\n"
+            "                     image of the single <in> with that theme. "
+            "Can be used\n"
+            "                     more than once, highlighting <in> only "
+            "once.\n"
+            "  -n, --thumbnail WxH[:OUT]\n"
+            "                     Draw a thumbnail of a single file that "
+            "fits in WxH\n"
+            "                     (0 for no limit) to <out>, or to OUT and "
+            "the full\n"
+            "                     image to <out>, without drawing the full "
+            "image twice.\n"
+            "  -u, --minimap[=N]  Draw a single file with a pixel for each "
+            "char, and N\n"
+            "                     rows for each line (1 by default, up to "
+            "%d).\n"
+            "  -l, --lines A:B    Only draw the lines from A to B of a single "
+            "file,\n"
+            "                     counting from 1. Either of them can be "
+            "omitted.\n"
+            "  -o, --cols C:D     Only draw the columns from C to D of a "
+            "single file.\n"
+            "  -z, --tiles        Write a Deep Zoom pyramid of tiles of a "
+            "single file,\n"
+            "                     described by the <out> .dzi file. Tiles "
+            "that didn't\n"
+            "                     change since the last run are not drawn "
+            "again.\n"
+            "  -a, --montage      Draw every input file into a single "
+            "<out> image, with\n"
+            "                     --jobs threads, and write the rectangle "
+            "of each one\n"
+            "                     to <out>%s.\n"
+            "  -F, --fast-png     Encode the images with the built-in "
+            "encoder for text\n"
+            "                     images instead of libpng. About twice as "
+            "fast, but\n"
+            "                     the files are about 15%% bigger.\n"
+            "  -x, --format NAME  Format of the <out> image, instead of its "
+            "extension:\n"
+            "                     png, svg, html, pam, ppm or qoi.\n"
+            "  -O, --optimize     Encode the PNG with many settings of the "
+            "filters and\n"
+            "                     zlib in --jobs threads, and keep the "
+            "smallest one.\n"
+            "                     Much slower, for images that are kept.\n"
+            "  -h, --help         Show this help and exit.\n",
+            self, self, self, self, self, self, INC_SIDECAR_EXT, THEME_NAMES,
+            MINIMAP_MAX_ROWS, MONTAGE_INDEX_EXT);
+}
 
-/* Current position when printing in chars */
-static uint32_t x = 0, y = 0;
+/* Add a pattern to one of the lists, making sure it fits */
+static void add_pattern(char** list, int* num, char* pattern) {
+    if (*num >= MAX_FILTERS)
+        DIE("Too many patterns, maximum is %d\n", MAX_FILTERS);
+    list[(*num)++] = pattern;
+}
 
-/* Size in chars. Overwritten by input_get_dimensions() */
-static uint32_t w = MIN_W, h = MIN_H;
+/* Add a "NAME:OUT" theme output, or set the theme of every image if there is
+ * no output */
+static void add_theme(char* arg) {
+    char* sep = strchr(arg, ':');
+    if (!sep) {
+        args.theme = arg;
+        return;
+    }
 
-/* Size in px. Includes margins */
-static uint32_t w_px = 0, h_px = 0;
+    if (args.num_themes >= MAX_THEMES)
+        DIE("Too many themes, maximum is %d\n", MAX_THEMES);
 
-/* Actually png_bytep is typedef'd to a pointer, so this is a (void**) */
-static png_bytep* rows = NULL;
+    *sep = '\0';
+    args.theme_names[args.num_themes]   = arg;
+    args.theme_outputs[args.num_themes] = sep + 1;
+    args.num_themes++;
+}
 
-/*----------------------------------------------------------------------------*/
+/* Set the "WxH" size of the thumbnail, and its output after a colon */
+static void set_thumbnail(char* arg) {
+    char* sep = strchr(arg, ':');
+    if (sep) {
+        *sep                  = '\0';
+        args.thumbnail_output = sep + 1;
+    }
 
-static inline bool get_font_bit(uint8_t c, uint8_t x, uint8_t y) {
-    return main_font[c * FONT_H + y] & (0x80 >> x);
+    if (!thumbnail_parse_size(arg, &args.thumbnail_w, &args.thumbnail_h))
+        DIE("Invalid thumbnail size: \"%s\"\n", arg);
 }
 
-static inline void setup_palette(void) {
-    palette[COL_DEFAULT]   = COL(0xFFFFFF, 255);
-    palette[COL_PREPROC]   = COL(0xFF6740, 255);
-    palette[COL_TYPES]     = COL(0x79A8FF, 255);
-    palette[COL_KWRDS]     = COL(0xFF6F9F, 255);
-    palette[COL_NUMBER]    = COL(0x88CA9F, 255);
-    palette[COL_STRING]    = COL(0x00D3D0, 255);
-    palette[COL_COMMENT]   = COL(0x989898, 255);
-    palette[COL_FUNC_CALL] = palette[COL_DEFAULT];
-    palette[COL_SYMBOL]    = palette[COL_DEFAULT];
+/* Names of the formats for --format, which are also their extensions */
+static const char* const format_names[] = {
+    [FORMAT_PNG] = "png", [FORMAT_SVG] = "svg", [FORMAT_HTML] = "html",
+    [FORMAT_PAM] = "pam", [FORMAT_PPM] = "ppm", [FORMAT_QOI] = "qoi",
+};
+
+static bool parse_format(const char* name, enum EFormat* format) {
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]);
+         i++) {
+        if (strcasecmp(name, format_names[i]) == 0) {
+            *format = i;
+            return true;
+        }
+    }
 
-    palette[COL_BACK]   = COL(0x050505, 255);
-    palette[COL_BORDER] = COL(0x222222, 255);
+    if (strcasecmp(name, "htm") == 0) {
+        *format = FORMAT_HTML;
+        return true;
+    }
+    return false;
 }
 
-static void input_get_dimensions(char* filename) {
-    FILE* fd = fopen(filename, "r");
+/* Format of the output of a single file, by its extension */
+static enum EFormat output_format(const char* out) {
+    const char* ext = strrchr(out, '.');
+    enum EFormat format;
+    if (!ext || strchr(ext, '/') || !parse_format(ext + 1, &format))
+        return FORMAT_PNG;
 
-    uint32_t x = 0, y = 0;
+    return format;
+}
 
-    char c;
-    while ((c = fgetc(fd)) != EOF) {
-        if (c == '\n') {
-            y++;
-            x = 0;
-        } else {
-            x++;
-        }
+#define OPT_BIT(opt)    ((uint64_t)1 << (opt))
+#define FORMAT_BIT(fmt) (1 << (fmt))
+
+/* Options that every mode accepts */
+#define OPTS_ANY_MODE                                                          \
+    (OPT_BIT(OPT_JOBS) | OPT_BIT(OPT_THEME) | OPT_BIT(OPT_FAST_PNG) |          \
+     OPT_BIT(OPT_FORMAT) | OPT_BIT(OPT_HELP))
+#define OPTS_CACHE (OPT_BIT(OPT_CACHE_DIR) | OPT_BIT(OPT_CACHE_SIZE))
+#define OPTS_SINK  (OPT_BIT(OPT_TAR_OUTPUT) | OPT_BIT(OPT_SYNC_IO) | OPTS_CACHE)
+
+#define FORMATS_RAW                                                            \
+    (FORMAT_BIT(FORMAT_PNG) | FORMAT_BIT(FORMAT_PAM) |                         \
+     FORMAT_BIT(FORMAT_PPM) | FORMAT_BIT(FORMAT_QOI))
+
+/* Options that each mode uses, besides OPTS_ANY_MODE, and its output formats.
+ * The other options are rejected instead of ignored. */
+static const struct {
+    uint64_t opts;
+    int formats;
+} modes[] = {
+    [MODE_TAR] = {
+      OPT_BIT(OPT_TAR) | OPT_BIT(OPT_FILTER) | OPTS_SINK,
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_MULTI] = {
+      OPT_BIT(OPT_MULTI) | OPT_BIT(OPT_MEM_LIMIT) | OPT_BIT(OPT_WATCH) |
+        OPTS_SINK,
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_RECURSIVE] = {
+      OPT_BIT(OPT_RECURSIVE) | OPT_BIT(OPT_FILTER) | OPT_BIT(OPT_EXT) |
+        OPT_BIT(OPT_IGNORE) | OPT_BIT(OPT_MEM_LIMIT) | OPT_BIT(OPT_WATCH) |
+        OPTS_SINK,
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_WINDOW] = {
+      OPT_BIT(OPT_LINES) | OPT_BIT(OPT_COLS) | OPT_BIT(OPT_OPTIMIZE),
+      FORMATS_RAW,
+    },
+    [MODE_MONTAGE] = {
+      OPT_BIT(OPT_MONTAGE) | OPT_BIT(OPT_OPTIMIZE),
+      FORMATS_RAW,
+    },
+    [MODE_TILES] = {
+      OPT_BIT(OPT_TILES) | OPT_BIT(OPT_FROM_TOKENS),
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_MINIMAP] = {
+      OPT_BIT(OPT_MINIMAP) | OPT_BIT(OPT_FROM_TOKENS),
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_THUMBNAIL] = {
+      OPT_BIT(OPT_THUMBNAIL) | OPT_BIT(OPT_FROM_TOKENS),
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_THEMES] = {
+      OPT_BIT(OPT_FROM_TOKENS),
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_TO_TOKENS] = {
+      OPT_BIT(OPT_TO_TOKENS),
+      FORMAT_BIT(FORMAT_PNG),
+    },
+    [MODE_VECTOR] = {
+      OPT_BIT(OPT_FROM_TOKENS),
+      FORMAT_BIT(FORMAT_SVG) | FORMAT_BIT(FORMAT_HTML),
+    },
+    [MODE_FROM_TOKENS] = {
+      OPT_BIT(OPT_FROM_TOKENS) | OPT_BIT(OPT_OPTIMIZE),
+      FORMATS_RAW,
+    },
+    [MODE_SINGLE] = {
+      OPT_BIT(OPT_PIPELINE) | OPT_BIT(OPT_PARALLEL) | OPT_BIT(OPT_INCREMENTAL) |
+        OPT_BIT(OPT_WATCH) | OPT_BIT(OPT_OPTIMIZE) | OPTS_CACHE,
+      FORMATS_RAW,
+    },
+};
 
-        if (w < x)
-            w = x;
+/* Mode of the arguments. If there are options of more than one, the first
+ * one in EMode is picked, and parse_args() rejects the others. */
+static enum EMode pick_mode(void) {
+    if (args.tar)
+        return MODE_TAR;
+    if (args.multi)
+        return MODE_MULTI;
+    if (args.recursive)
+        return MODE_RECURSIVE;
+    if (args.lines || args.cols)
+        return MODE_WINDOW;
+    if (args.montage)
+        return MODE_MONTAGE;
+    if (args.tiles)
+        return MODE_TILES;
+    if (args.minimap_rows)
+        return MODE_MINIMAP;
+    if (args.thumbnail_w || args.thumbnail_h)
+        return MODE_THUMBNAIL;
+    if (args.num_themes > 0)
+        return MODE_THEMES;
+    if (args.to_tokens)
+        return MODE_TO_TOKENS;
+    if (args.format == FORMAT_SVG || args.format == FORMAT_HTML)
+        return MODE_VECTOR;
+    if (args.from_tokens)
+        return MODE_FROM_TOKENS;
+    return MODE_SINGLE;
+}
 
-        if (h < y)
-            h = y;
+/* Parse an "A:B" range counting from 1, where A or B can be omitted, into
+ * [first, end) counting from 0 */
+static void parse_range(const char* str, uint32_t* first, uint32_t* end) {
+    const char* sep = strchr(str, ':');
+    if (!sep)
+        DIE("Invalid range, expected A:B: \"%s\"\n", str);
+
+    unsigned long a = 1, b = UINT32_MAX;
+    char* num_end;
+    if (sep != str) {
+        a = strtoul(str, &num_end, 10);
+        if (num_end != sep)
+            DIE("Invalid range start: \"%s\"\n", str);
+    }
+    if (sep[1] != '\0') {
+        b = strtoul(sep + 1, &num_end, 10);
+        if (*num_end != '\0')
+            DIE("Invalid range end: \"%s\"\n", str);
     }
 
-    fclose(fd);
+    if (a < 1 || b < a || b > UINT32_MAX)
+        DIE("Invalid range: \"%s\"\n", str);
+
+    *first = a - 1;
+    *end   = b;
 }
 
-static void draw_rect(int x, int y, int w, int h, Color c) {
-    for (int cur_y = y; cur_y < y + h; cur_y++) {
-        /* To get the real position in the rows array, we need to multiply the
-         * positions by the size of each element: COL_SZ (4) */
-        for (int cur_x = x * COL_SZ; cur_x < (x + w) * COL_SZ;
-             cur_x += COL_SZ) {
-            rows[cur_y][cur_x]     = c.r;
-            rows[cur_y][cur_x + 1] = c.g;
-            rows[cur_y][cur_x + 2] = c.b;
-            rows[cur_y][cur_x + 3] = c.a;
+static void parse_args(char** argv) {
+    struct optparse options;
+    optparse_init(&options, argv);
+
+    args.jobs       = sysconf(_SC_NPROCESSORS_ONLN);
+    args.cache_size = CACHE_DEFAULT_SIZE;
+    args.end_line   = UINT32_MAX;
+    args.end_col    = UINT32_MAX;
+
+    uint64_t given = 0;
+    int opt, longindex;
+    while ((opt = optparse_long(&options, longopts, &longindex)) != -1) {
+        if (opt == '?') {
+            usage(argv[0]);
+            DIE("%s: %s\n", argv[0], options.errmsg);
+        }
+        given |= OPT_BIT(longindex);
+
+        switch (longindex) {
+            case OPT_TAR:
+                args.tar = true;
+                break;
+            case OPT_FILTER:
+                add_pattern(args.filters, &args.num_filters, options.optarg);
+                break;
+            case OPT_MULTI:
+                args.multi = true;
+                break;
+            case OPT_TAR_OUTPUT:
+                args.tar_output = true;
+                break;
+            case OPT_RECURSIVE:
+                args.recursive = true;
+                break;
+            case OPT_JOBS:
+                args.jobs = atoi(options.optarg);
+                if (args.jobs < 1)
+                    DIE("Invalid number of jobs: \"%s\"\n", options.optarg);
+                break;
+            case OPT_EXT:
+                for (char* ext = strtok(options.optarg, ","); ext != NULL;
+                     ext = strtok(NULL, ","))
+                    add_pattern(args.exts, &args.num_exts,
+                                ext[0] == '.' ? ext + 1 : ext);
+                break;
+            case OPT_IGNORE:
+                add_pattern(args.ignores, &args.num_ignores, options.optarg);
+                break;
+            case OPT_MEM_LIMIT:
+                if (!parse_size(options.optarg, &args.mem_limit) ||
+                    args.mem_limit == 0)
+                    DIE("Invalid memory limit: \"%s\"\n", options.optarg);
+                break;
+            case OPT_SYNC_IO:
+                args.sync_io = true;
+                break;
+            case OPT_PIPELINE:
+                args.pipeline = true;
+                break;
+            case OPT_PARALLEL:
+                args.parallel = true;
+                break;
+            case OPT_CACHE_DIR:
+                args.cache_dir = options.optarg;
+                break;
+            case OPT_CACHE_SIZE:
+                if (!parse_size(options.optarg, &args.cache_size))
+                    DIE("Invalid cache size: \"%s\"\n", options.optarg);
+                break;
+            case OPT_INCREMENTAL:
+                args.incremental = true;
+                break;
+            case OPT_WATCH:
+                args.watch = true;
+                break;
+            case OPT_TO_TOKENS:
+                args.to_tokens = true;
+                break;
+            case OPT_FROM_TOKENS:
+                args.from_tokens = true;
+                break;
+            case OPT_THEME:
+                add_theme(options.optarg);
+                break;
+            case OPT_THUMBNAIL:
+                set_thumbnail(options.optarg);
+                break;
+            case OPT_LINES:
+                args.lines = true;
+                parse_range(options.optarg, &args.first_line, &args.end_line);
+                break;
+            case OPT_COLS:
+                args.cols = true;
+                parse_range(options.optarg, &args.first_col, &args.end_col);
+                break;
+            case OPT_TILES:
+                args.tiles = true;
+                break;
+            case OPT_MONTAGE:
+                args.montage = true;
+                break;
+            case OPT_FAST_PNG:
+                fast_png = true;
+                break;
+            case OPT_FORMAT:
+                if (!parse_format(options.optarg, &args.format)) {
+                    usage(argv[0]);
+                    DIE("%s: Unknown format: \"%s\"\n", argv[0],
+                        options.optarg);
+                }
+                args.format_set = true;
+                break;
+            case OPT_OPTIMIZE:
+                args.optimize = true;
+                break;
+            case OPT_MINIMAP:
+                args.minimap_rows = options.optarg ? atoi(options.optarg) : 1;
+                if (args.minimap_rows < 1 ||
+                    args.minimap_rows > MINIMAP_MAX_ROWS)
+                    DIE("Invalid rows for each minimap line: \"%s\"\n",
+                        options.optarg);
+                break;
+            case OPT_HELP:
+                usage(argv[0]);
+                exit(0);
         }
     }
+
+    /* Leave only the positional arguments in argv, after argv[0] */
+    int i = 1;
+    char* arg;
+    while ((arg = optparse_arg(&options)) != NULL)
+        argv[i++] = arg;
+    argv[i] = NULL;
+
+    /* A tar output can hold more than one image */
+    if (args.tar_output && !args.tar && !args.recursive)
+        args.multi = true;
+
+    /* The outputs of the themes are in the options */
+    const int num_args   = i - 1;
+    const int num_inputs = (args.num_themes > 0) ? num_args : num_args - 1;
+    if (num_inputs < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    args.inputs     = &argv[1];
+    args.num_inputs = num_inputs;
+    args.output     = (args.num_themes > 0) ? NULL : argv[num_args];
+
+    /* The other formats only write a single image at once, and the text
+     * backends only the image of a single file */
+    if (!args.format_set && !args.tar && !args.multi && !args.recursive &&
+        args.output)
+        args.format = output_format(args.output);
+
+    args.mode = pick_mode();
+    if ((given & ~(modes[args.mode].opts | OPTS_ANY_MODE)) != 0 ||
+        (modes[args.mode].formats & FORMAT_BIT(args.format)) == 0 ||
+        (args.num_themes > 0 && args.mode != MODE_THEMES) ||
+        (args.mode != MODE_MULTI && args.mode != MODE_MONTAGE &&
+         num_inputs != 1) ||
+        args.pipeline + args.parallel + args.incremental > 1 ||
+        (args.watch && (args.tar_output || args.pipeline || args.parallel)) ||
+        (args.format != FORMAT_PNG &&
+         (args.pipeline || args.incremental || args.watch)) ||
+        (args.optimize &&
+         (args.format != FORMAT_PNG || fast_png || args.pipeline ||
+          args.incremental || args.watch))) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* The changes of a single file are drawn over its last render */
+    if (args.watch && args.mode == MODE_SINGLE)
+        args.incremental = true;
 }
 
-static void png_putchar(char c, Color fg, Color bg) {
-    /* Hadle special cases */
-    switch (c) {
-        case '\n':
-            y++;
-            x = 0;
-            return;
-        case '\t':
-            for (int i = 0; i < TAB_SZ; i++)
-                png_putchar(' ', fg, bg);
-            return;
+static void open_sink(Sink* sink) {
+    if (!sink_open(sink, args.output, args.tar_output, !args.sync_io))
+        DIE("Can't open output: \"%s\"\n", args.output);
+}
+
+static void close_sink(Sink* sink) {
+    if (!sink_close(sink))
+        DIE("Error writing output: \"%s\"\n", args.output);
+}
+
+/* Print how many allocations the arenas saved, once the threads that used
+ * them are done */
+static void print_arena_stats(FILE* fp) {
+    uint64_t allocs, mallocs;
+    arena_totals(&allocs, &mallocs);
+
+    fprintf(fp,
+            "Scratch memory: %llu allocations served by %llu malloc() "
+            "calls.\n",
+            (unsigned long long)allocs, (unsigned long long)mallocs);
+}
+
+/* Print how many lines were copied from the line caches */
+static void print_line_cache_stats(FILE* fp) {
+    uint64_t lookups, hits;
+    line_cache_totals(&lookups, &hits);
+    if (lookups == 0)
+        return;
+
+    fprintf(fp, "Line cache: %llu of %llu lines copied (%.1f%%).\n",
+            (unsigned long long)hits, (unsigned long long)lookups,
+            100.0 * hits / lookups);
+}
+
+/* Save the checkpoints of the lexer next to the source, so later --lines
+ * renders don't scan all the lines before their window. The states were
+ * stored while drawing it. Sources that are not regular files are skipped,
+ * and not being able to write the index is not an error. */
+static void save_lex_index(const char* in, const char* src, size_t src_sz,
+                           const int8_t* states) {
+    LexIndexKey key;
+    if (!lexindex_key(&key, in, src, src_sz))
+        return;
+
+    LexIndex idx;
+    lexindex_from_states(&idx, src, src_sz, states);
+
+    char* path = path_join("", in, LEXINDEX_EXT);
+    if (!path)
+        DIE("Can't allocate the index path for \"%s\"\n", in);
+    if (lexindex_save(&idx, path, &key))
+        printf("Saved %d lexer checkpoints to \"%s\".\n", idx.num_checkpoints,
+               path);
+
+    free(path);
+    lexindex_free(&idx);
+}
+
+/* Load the checkpoints of the lexer for the source, or scan it and save them
+ * if they are missing or from another version of it. Returns false if the
+ * source is not a regular file. */
+static bool load_lex_index(const char* in, const char* src, size_t src_sz,
+                           LexIndex* idx) {
+    LexIndexKey key;
+    if (!lexindex_key(&key, in, src, src_sz))
+        return false;
+
+    char* path = path_join("", in, LEXINDEX_EXT);
+    if (!path)
+        DIE("Can't allocate the index path for \"%s\"\n", in);
+    if (!lexindex_load(idx, path, &key)) {
+        lexindex_scan(idx, src, src_sz);
+        if (idx->num_lines >= LEXINDEX_MIN_LINES &&
+            lexindex_save(idx, path, &key))
+            printf("Saved %d lexer checkpoints to \"%s\".\n",
+                   idx->num_checkpoints, path);
     }
 
-    /* Iterate each pixel that forms the font char */
-    for (uint8_t fy = 0; fy < FONT_H; fy++) {
-        /* Get real screen position from the char offset on the image and the
-         * pixel font offset on the char */
-        const uint32_t final_y = CHAR_Y_TO_PX(y) + fy;
+    free(path);
+    return true;
+}
 
-        for (uint8_t fx = 0; fx < FONT_W; fx++) {
-            /* For the final_x, we also need to multiply it by the size of each
-            pixel in the cols array */
-            const uint32_t final_x = (CHAR_X_TO_PX(x) + fx) * COL_SZ;
+/* Write the image to the output file, in the format of the arguments */
+static void write_image(const Canvas* canvas, const char* out) {
+    bool ok = true;
+    switch (args.format) {
+        case FORMAT_PAM:
+            ok = rawimg_write_pam(canvas, out);
+            break;
+        case FORMAT_PPM:
+            ok = rawimg_write_ppm(canvas, out);
+            break;
+        case FORMAT_QOI:
+            ok = rawimg_write_qoi(canvas, out);
+            break;
+        default:
+            if (args.optimize)
+                ok = optimize_write_png(canvas, out, args.jobs, stdout);
+            else
+                write_png_file(canvas, out);
+            break;
+    }
 
-            /* Actual color to use depending if the bit is set in the font */
-            Color col = get_font_bit(c, fx, fy) ? fg : bg;
+    if (!ok)
+        DIE("Error writing file: \"%s\"\n", out);
+}
 
-            rows[final_y][final_x]     = col.r;
-            rows[final_y][final_x + 1] = col.g;
-            rows[final_y][final_x + 2] = col.b;
-            rows[final_y][final_x + 3] = col.a;
-        }
+static void render_single(const char* in, const char* out) {
+    size_t src_sz;
+    char* src = read_file(in, &src_sz);
+    if (!src)
+        DIE("Can't open file: \"%s\"\n", in);
+
+    Canvas canvas;
+    canvas_init(&canvas);
+
+    /* Ugly, but does the job */
+    input_get_dimensions(&canvas, src, src_sz);
+    printf("Source contains %d rows and %d cols.\n", canvas.h, canvas.w);
+    printf("Generating %dx%d image...\n", canvas.w_px, canvas.h_px);
+
+    /* Allocate and clear with background */
+    canvas.arena = arena_thread();
+    canvas_alloc(&canvas);
+
+    /* The lexer states of big sources are kept for their index, see
+     * save_lex_index() */
+    int8_t* states = NULL;
+    if (canvas.h >= LEXINDEX_MIN_LINES) {
+        states = malloc(canvas.h);
+        if (!states)
+            DIE("Can't allocate the lexer states of %d lines\n", canvas.h);
+        canvas.line_states = states;
+    }
+
+    /* Convert the text to png */
+    if (args.parallel) {
+        ParlexStats stats;
+        source_to_png_parallel(&canvas, src, src_sz, args.jobs, &stats);
+        printf("Highlighted %d chunks with %d threads, %d again after the "
+               "%.1f ms pre-scan.\n",
+               stats.chunks, args.jobs, stats.relexed, stats.prescan_ns / 1e6);
+    } else {
+        source_to_png(&canvas, src, src_sz);
+    }
+
+    /* Draw border */
+    draw_border(&canvas);
+
+    if (states) {
+        save_lex_index(in, src, src_sz, states);
+        free(states);
     }
 
-    x++;
+    /* Write rows to the output file */
+    write_image(&canvas, out);
+
+    canvas_free(&canvas);
+    arena_reset(canvas.arena);
+    free(src);
+
+    print_arena_stats(stdout);
+    print_line_cache_stats(stdout);
 }
 
-static void png_print(const char* s) {
-    Color fg = palette[COL_DEFAULT];
-    Color bg = palette[COL_BACK];
+/* Render the source file with a thread for each stage, and print how busy
+ * each one was */
+static void render_single_pipelined(const char* in, const char* out) {
+    PipelineStats stats;
+    if (!render_pipelined(in, out, &stats))
+        DIE("Can't open file: \"%s\"\n", in);
+
+    printf("Source contains %d rows and %d cols.\n", stats.h, stats.w);
+    printf("Generated %dx%d image in %.1f ms.\n", stats.w_px, stats.h_px,
+           stats.total_ns / 1e6);
+
+    int bottleneck = 0;
+    for (int i = 0; i < NUM_STAGES; i++) {
+        const StageStats* stage = &stats.stages[i];
+        printf("  %-10s %5.1f%% busy, waited %8.1f ms for input, %8.1f ms "
+               "for output\n",
+               pipe_stage_names[i], 100.0 * stage->busy_ns / stats.total_ns,
+               stage->input_wait_ns / 1e6, stage->output_wait_ns / 1e6);
+
+        if (stage->busy_ns > stats.stages[bottleneck].busy_ns)
+            bottleneck = i;
+    }
 
-    while (*s != '\0' && *s != EOF) {
-        /* Escape character used to change color */
-        if (*s == 0x1B) {
-            s++;
+    printf("Bottleneck: %s.\n", pipe_stage_names[bottleneck]);
+}
 
-            /* See bottom of COLORS[] in highlight.c */
-            const int fg_idx = *s++;
-            const int bg_idx = *s++;
+/* Update the image of the source from the previous render, kept in a
+ * sidecar next to the output */
+static void render_single_incremental(const char* in, const char* out) {
+    size_t src_sz;
+    char* src = read_file(in, &src_sz);
+    if (!src)
+        DIE("Can't open file: \"%s\"\n", in);
+
+    char* sidecar = path_join("", out, INC_SIDECAR_EXT);
+    if (!sidecar)
+        DIE("Can't allocate the sidecar path for \"%s\"\n", out);
+
+    IncRender inc;
+    if (!inc_open(&inc, sidecar, render_config_hash(palette)))
+        DIE("Can't open sidecar: \"%s\"\n", sidecar);
+
+    IncStats stats;
+    inc_update(&inc, src, src_sz, &stats);
+
+    printf("Source contains %d rows and %d cols.\n", inc.canvas.h,
+           inc.canvas.w);
+    if (stats.full)
+        printf("Drew all the lines in %.2f ms.\n", stats.draw_ns / 1e6);
+    else
+        printf("Drew %d lines from line %d in %.2f ms, compared the lines in "
+               "%.2f ms.\n",
+               stats.lines_drawn, stats.first_line + 1, stats.draw_ns / 1e6,
+               stats.diff_ns / 1e6);
+
+    IncEncodeStats encode_stats;
+    if (!inc_write_png(&inc, out, &encode_stats))
+        DIE("Can't write file: \"%s\"\n", out);
+
+    printf("Encoded %dx%d image in %.1f ms, copied %d of %d bands and "
+           "compressed %llu KiB.\n",
+           inc.canvas.w_px, inc.canvas.h_px, encode_stats.encode_ns / 1e6,
+           encode_stats.reused, encode_stats.bands,
+           (unsigned long long)encode_stats.compressed_sz / 1024);
+
+    if (!inc_close(&inc))
+        DIE("Error writing sidecar: \"%s\"\n", sidecar);
+
+    free(sidecar);
+    free(src);
+}
 
-            /* Also skip NULL terminator for the color strings */
-            s++;
+/* Highlight the source file, and write its token stream to the output */
+static void write_tokens(const char* in, const char* out) {
+    size_t src_sz;
+    char* src = read_file(in, &src_sz);
+    if (!src)
+        DIE("Can't open file: \"%s\"\n", in);
 
-#ifdef DISABLE_SYNTAX_HIGHLIGHT
-            /* No syntax highlight, unused */
-            (void)fg_idx;
-            (void)bg_idx;
-#else
-            fg = palette[fg_idx];
-            bg = palette[bg_idx];
-#endif
+    const uint64_t start_ns = time_ns();
+    TokenStream ts;
+    tokens_highlight(&ts, src, src_sz);
+    printf("Highlighted the source in %.1f ms.\n",
+           (time_ns() - start_ns) / 1e6);
 
-            continue;
+    if (!tokens_save(&ts, out))
+        DIE("Can't write file: \"%s\"\n", out);
+
+    tokens_close(&ts);
+    free(src);
+}
+
+/* Draw the token stream written by write_tokens() to the output image */
+static void render_tokens(const char* in, const char* out) {
+    TokenStream ts;
+    if (!tokens_open(&ts, in))
+        DIE("Can't open token stream: \"%s\"\n", in);
+
+    Canvas canvas;
+    canvas_init(&canvas);
+    tokens_get_dimensions(&ts, &canvas);
+    printf("Source contains %d rows and %d cols.\n", canvas.h, canvas.w);
+    printf("Generating %dx%d image...\n", canvas.w_px, canvas.h_px);
+
+    canvas.arena = arena_thread();
+    canvas_alloc(&canvas);
+
+    if (!tokens_to_png(&ts, &canvas))
+        DIE("Invalid token stream: \"%s\"\n", in);
+
+    draw_border(&canvas);
+    write_image(&canvas, out);
+
+    canvas_free(&canvas);
+    arena_reset(canvas.arena);
+    tokens_close(&ts);
+}
+
+/* Image of the shared token stream drawn with its own palette, in its own
+ * thread, see render_themes() */
+typedef struct {
+    const char* theme;
+    const char* out;
+    Color palette[PALETTE_SZ];
+    const TokenStream* ts;
+    pthread_t thread;
+
+    uint64_t draw_ns, encode_ns;
+} ThemeOutput;
+
+/* Draw the token stream with the palette, and encode it to the output PNG
+ * file. Used from the threads of render_themes(). */
+static void draw_tokens_file(const TokenStream* ts, const Color* palette,
+                             const char* out, uint64_t* draw_ns,
+                             uint64_t* encode_ns) {
+    const uint64_t start_ns = time_ns();
+
+    Canvas canvas;
+    canvas_init(&canvas);
+    canvas.palette = palette;
+
+    canvas.arena         = arena_thread();
+    const ArenaMark mark = arena_mark(canvas.arena);
+
+    tokens_get_dimensions(ts, &canvas);
+    canvas_alloc(&canvas);
+
+    if (!tokens_to_png(ts, &canvas))
+        DIE("Invalid token stream: \"%s\"\n", args.inputs[0]);
+    draw_border(&canvas);
+
+    const uint64_t drawn_ns = time_ns();
+    write_png_file(&canvas, out);
+
+    *draw_ns   = drawn_ns - start_ns;
+    *encode_ns = time_ns() - drawn_ns;
+    arena_rewind(canvas.arena, mark);
+}
+
+static void* theme_thread(void* arg) {
+    ThemeOutput* output = arg;
+    draw_tokens_file(output->ts, output->palette, output->out,
+                     &output->draw_ns, &output->encode_ns);
+    return NULL;
+}
+
+/* Highlight the source into a token stream, or map it with --from-tokens */
+static void load_tokens(TokenStream* ts, const char* in) {
+    if (args.from_tokens) {
+        if (!tokens_open(ts, in))
+            DIE("Can't open token stream: \"%s\"\n", in);
+        return;
+    }
+
+    size_t src_sz;
+    char* src = read_file(in, &src_sz);
+    if (!src)
+        DIE("Can't open file: \"%s\"\n", in);
+
+    const uint64_t start_ns = time_ns();
+    tokens_highlight(ts, src, src_sz);
+    printf("Highlighted the source once in %.1f ms.\n",
+           (time_ns() - start_ns) / 1e6);
+    free(src);
+}
+
+/* Highlight the source once, or map its token stream, and draw and encode an
+ * image for each --theme at the same time */
+static void render_themes(const char* in) {
+    ThemeOutput outputs[MAX_THEMES];
+    for (int i = 0; i < args.num_themes; i++) {
+        outputs[i].theme = args.theme_names[i];
+        outputs[i].out   = args.theme_outputs[i];
+        if (!setup_theme_palette(outputs[i].palette, outputs[i].theme))
+            DIE("Unknown theme: \"%s\"\n", outputs[i].theme);
+    }
+
+    TokenStream ts;
+    load_tokens(&ts, in);
+
+    for (int i = 0; i < args.num_themes; i++) {
+        outputs[i].ts = &ts;
+        if (pthread_create(&outputs[i].thread, NULL, theme_thread,
+                           &outputs[i]) != 0)
+            DIE("Can't create thread for theme \"%s\"\n", outputs[i].theme);
+    }
+
+    for (int i = 0; i < args.num_themes; i++) {
+        pthread_join(outputs[i].thread, NULL);
+        printf("Drew \"%s\" with the %s theme in %.1f ms, encoded it in "
+               "%.1f ms.\n",
+               outputs[i].out, outputs[i].theme, outputs[i].draw_ns / 1e6,
+               outputs[i].encode_ns / 1e6);
+    }
+
+    tokens_close(&ts);
+}
+
+/* Draw the thumbnail of a single file from its token stream. If the thumbnail
+ * has its own output, the full image is drawn to <out> from the same token
+ * stream. */
+static void render_thumbnail(const char* in, const char* out) {
+    TokenStream ts;
+    load_tokens(&ts, in);
+
+    const char* thumb_out = out;
+    if (args.thumbnail_output) {
+        uint64_t draw_ns, encode_ns;
+        draw_tokens_file(&ts, palette, out, &draw_ns, &encode_ns);
+        printf("Drew the image in %.1f ms, encoded it in %.1f ms.\n",
+               draw_ns / 1e6, encode_ns / 1e6);
+
+        thumb_out = args.thumbnail_output;
+    }
+
+    const uint64_t start_ns = time_ns();
+    Thumbnail thumb;
+    if (!thumbnail_from_tokens(&thumb, &ts, palette, args.thumbnail_w,
+                               args.thumbnail_h))
+        DIE("Invalid token stream: \"%s\"\n", in);
+
+    const uint64_t drawn_ns = time_ns();
+    thumbnail_write_png(&thumb, thumb_out);
+    printf("Drew %dx%d thumbnail in %.1f ms, encoded it in %.1f ms.\n",
+           thumb.w, thumb.h, (drawn_ns - start_ns) / 1e6,
+           (time_ns() - drawn_ns) / 1e6);
+
+    thumbnail_free(&thumb);
+    tokens_close(&ts);
+}
+
+/* Draw the minimap of a single file, from its token stream */
+static void render_minimap(const char* in, const char* out) {
+    TokenStream ts;
+    load_tokens(&ts, in);
+
+    const uint64_t start_ns = time_ns();
+    if (!minimap_write_png(&ts, palette, args.minimap_rows, out))
+        DIE("Invalid token stream: \"%s\"\n", in);
+
+    printf("Drew and encoded %dx%d minimap in %.1f ms.\n", ts.header->w,
+           ts.header->h * args.minimap_rows, (time_ns() - start_ns) / 1e6);
+    tokens_close(&ts);
+}
+
+/* Draw the tiles of a single file that changed since the last run, from its
+ * token stream */
+static void render_tiles(const char* in, const char* out) {
+    TokenStream ts;
+    load_tokens(&ts, in);
+
+    const uint64_t start_ns = time_ns();
+    TilesStats stats;
+    if (!tiles_write_dzi(&ts, palette, out, args.jobs, &stats))
+        DIE("Invalid token stream: \"%s\"\n", in);
+
+    printf("Drew %d of %d tiles of the %dx%d image in %d levels with %d "
+           "threads in %.1f ms.\n",
+           stats.drawn, stats.tiles, stats.w, stats.h, stats.levels,
+           args.jobs, (time_ns() - start_ns) / 1e6);
+
+    tokens_close(&ts);
+}
+
+/* Write the text of a single file as SVG or HTML, from its token stream */
+static void render_vector(const char* in, const char* out) {
+    TokenStream ts;
+    load_tokens(&ts, in);
+
+    const uint64_t start_ns = time_ns();
+    const bool ok = (args.format == FORMAT_SVG)
+                      ? vector_write_svg(&ts, palette, out)
+                      : vector_write_html(&ts, palette, out);
+    if (!ok)
+        DIE("Invalid token stream: \"%s\"\n", in);
+
+    printf("Wrote the %s text in %.1f ms.\n",
+           (args.format == FORMAT_SVG) ? "SVG" : "HTML",
+           (time_ns() - start_ns) / 1e6);
+
+    tokens_close(&ts);
+}
+
+/* Draw the input files into a single sheet, encoded once, and write the
+ * index of their rectangles */
+static void render_montage(char** inputs, int num_inputs, const char* out) {
+    Montage montage;
+    montage_init(&montage, inputs, num_inputs);
+    printf("Generating %dx%d sheet with %d images...\n", montage.w,
+           montage.h, num_inputs);
+
+    const uint64_t start_ns = time_ns();
+    Canvas sheet;
+    montage_draw(&montage, &sheet, args.jobs);
+
+    const uint64_t drawn_ns = time_ns();
+    write_image(&sheet, out);
+    printf("Drew the images with %d threads in %.1f ms, encoded the sheet in "
+           "%.1f ms.\n",
+           args.jobs, (drawn_ns - start_ns) / 1e6,
+           (time_ns() - drawn_ns) / 1e6);
+
+    char* index = path_join("", out, MONTAGE_INDEX_EXT);
+    if (!index || !montage_write_index(&montage, index))
+        DIE("Can't write the index of the sheet: \"%s%s\"\n", out,
+            MONTAGE_INDEX_EXT);
+
+    free(index);
+    canvas_free(&sheet);
+    montage_free(&montage);
+}
+
+/* Render the --lines and --cols window of the source file. The lines before
+ * the window are only scanned for the state of the lexer at its start, and
+ * the columns outside of it are highlighted but not drawn. */
+static void render_window(const char* in, const char* out) {
+    size_t src_sz;
+    char* src = read_file(in, &src_sz);
+    if (!src)
+        DIE("Can't open file: \"%s\"\n", in);
+
+    const uint64_t start_ns = time_ns();
+
+    /* Start from the last checkpoint of the lexer before the window, see
+     * LexIndex */
+    size_t pos    = 0;
+    uint32_t line = 0;
+    int state     = HL_DEFAULT;
+    LexIndex idx;
+    if (load_lex_index(in, src, src_sz, &idx)) {
+        line = lexindex_seek(&idx, args.first_line, &pos, &state);
+        lexindex_free(&idx);
+    }
+
+    /* Skip the rest of the lines before the window. Only lines ending in a
+     * newline are drawn, see source_lines_to_png() */
+    const size_t checkpoint        = pos;
+    const uint32_t checkpoint_line = line;
+    const char* nl;
+    while (line < args.first_line &&
+           (nl = memchr(src + pos, '\n', src_sz - pos)) != NULL) {
+        pos = nl - src + 1;
+        line++;
+    }
+
+    if (line < args.first_line)
+        DIE("The source only has %d lines\n", line);
+
+    state = highlight_text_state(src + checkpoint, pos - checkpoint, state);
+    const uint64_t scanned_ns = time_ns();
+
+    size_t end = pos;
+    while (line < args.end_line &&
+           (nl = memchr(src + end, '\n', src_sz - end)) != NULL) {
+        end = nl - src + 1;
+        line++;
+    }
+
+    Canvas canvas;
+    canvas_init(&canvas);
+    input_scan_dimensions(&canvas, src + pos, end - pos, 0);
+
+    if (args.cols) {
+        const uint32_t end_col =
+          (args.end_col == UINT32_MAX) ? canvas.w : args.end_col;
+
+        canvas.clip_cols = true;
+        canvas.first_col = args.first_col;
+        canvas.w         = end_col > args.first_col ? end_col - args.first_col
+                                                    : 1;
+    }
+    canvas_update_px_size(&canvas);
+
+    printf("Window contains %d rows and %d cols.\n", canvas.h, canvas.w);
+    printf("Generating %dx%d image...\n", canvas.w_px, canvas.h_px);
+
+    canvas.arena = arena_thread();
+    canvas_alloc(&canvas);
+
+    source_lines_to_png(&canvas, src + pos, end - pos, 0, state);
+    draw_border(&canvas);
+
+    printf("Scanned %d lines before the window in %.1f ms, from line %d, "
+           "drew the window in %.1f ms.\n",
+           args.first_line - checkpoint_line, (scanned_ns - start_ns) / 1e6,
+           checkpoint_line + 1,
+           (time_ns() - scanned_ns) / 1e6);
+
+    write_image(&canvas, out);
+
+    canvas_free(&canvas);
+    arena_reset(canvas.arena);
+    free(src);
+}
+
+/* Render a single file with the mode of the arguments, unless its image is
+ * cached. Sources that are not regular files can only be read once, so they
+ * are not cached. */
+static void render_single_file(const char* in, const char* out) {
+    struct stat st;
+    const bool use_cache = cache && stat(in, &st) == 0 && S_ISREG(st.st_mode);
+
+    Hash128 key;
+    if (use_cache) {
+        size_t src_sz;
+        char* src = read_file(in, &src_sz);
+        if (!src)
+            DIE("Can't open file: \"%s\"\n", in);
+
+        key = cache_key(cache, src, src_sz);
+        free(src);
+
+        if (cache_copy(cache, key, out)) {
+            printf("Cached image copied to \"%s\".\n", out);
+            return;
         }
+    }
+
+    if (args.pipeline)
+        render_single_pipelined(in, out);
+    else if (args.incremental)
+        render_single_incremental(in, out);
+    else
+        render_single(in, out);
+
+    if (use_cache)
+        cache_store_file(cache, key, out);
+}
 
-        png_putchar(*s, fg, bg);
-        s++;
+/* Check that the member path doesn't escape the output directory */
+static bool is_safe_path(const char* path) {
+    if (path[0] == '/')
+        return false;
+
+    /* Check each component, after the start or after a slash */
+    for (const char* p = path; *p != '\0'; p++) {
+        if (p != path && p[-1] != '/')
+            continue;
+
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return false;
     }
+
+    return true;
 }
 
-static void source_to_png(const char* filename) {
-    /* Write the characters to the rows array */
-    FILE* fd = fopen(filename, "r");
-    if (!fd)
-        DIE("Can't open file: \"%s\"\n", filename);
+/* Render each regular text member of the archive into the sink, in a single
+ * sequential pass and without extracting anything */
+static void render_tar(const char* archive) {
+    TarReader tar;
+    if (!tar_open(&tar, archive))
+        DIE("Can't open archive: \"%s\"\n", archive);
 
-    if (highlight_init(NULL) < 0)
-        DIE("Unable to initialize the highlight library\n");
+    Sink sink;
+    open_sink(&sink);
+
+    uint64_t seq = 0;
+    int skipped  = 0;
 
-    /* Used when calling highlight_line() */
-    char* hl_line = highlight_alloc_line();
+    TarMember member;
+    int ret;
+    while ((ret = tar_next(&tar, &member)) > 0) {
+        if (member.type != TAR_REGULAR && member.type != TAR_REGULAR_OLD &&
+            member.type != TAR_CONTIGUOUS)
+            continue;
 
-    /* Used by us for storing each line and adding NULL terminator */
-    char* line_buf   = malloc(w * sizeof(char));
-    int line_buf_pos = 0;
+        if (!path_matches(member.path, args.filters, args.num_filters))
+            continue;
 
-    char c;
-    while ((c = fgetc(fd)) != EOF) {
-        /* Store chars until newline */
-        if (c != '\n') {
-            line_buf[line_buf_pos++] = c;
+        if (!is_safe_path(member.path)) {
+            fprintf(stderr, "Skipping unsafe member path: \"%s\"\n",
+                    member.path);
+            skipped++;
             continue;
         }
 
-        /* We encountered newline, terminate string */
-        line_buf[line_buf_pos] = '\0';
+        char* src = malloc(member.size > 0 ? member.size : 1);
+        if (!src)
+            DIE("Can't allocate %llu bytes for \"%s\"\n",
+                (unsigned long long)member.size, member.path);
+
+        if (!tar_read(&tar, src, member.size))
+            DIE("Can't read member \"%s\" of \"%s\"\n", member.path, archive);
 
-        /* Check color and print */
-        hl_line = highlight_line(line_buf, hl_line, line_buf_pos);
+        if (!is_text_data(src, member.size)) {
+            free(src);
+            skipped++;
+            continue;
+        }
+
+        char* name = path_join("", strip_path_prefix(member.path), ".png");
+        if (!name)
+            DIE("Can't allocate output path for \"%s\"\n", member.path);
+
+        size_t png_sz;
+        void* png = NULL;
+
+        Hash128 key;
+        if (cache) {
+            key = cache_key(cache, src, member.size);
+            png = cache_load(cache, key, &png_sz);
+        }
 
-        /* Print the line with the escape codes, used for changing the colors */
-        png_print(hl_line);
+        if (!png) {
+            png = render_to_mem(src, member.size, &png_sz);
+            if (cache)
+                cache_store(cache, key, png, png_sz);
+        }
 
-        /* Reset for next line */
-        line_buf_pos = 0;
+        sink_submit(&sink, seq++, name, png, png_sz);
 
-        /* Print the newline we encountered */
-        png_putchar('\n', palette[COL_DEFAULT], palette[COL_BACK]);
+        free(name);
+        free(src);
     }
 
-    highlight_free(hl_line);
-    highlight_finish();
+    if (ret < 0)
+        DIE("Error reading archive: \"%s\"\n", archive);
+
+    tar_close(&tar);
+    close_sink(&sink);
 
-    free(line_buf);
-    fclose(fd);
+    fprintf(stderr, "Rendered %d members, skipped %d.\n", sink.written,
+            skipped);
+    print_arena_stats(stderr);
+    print_line_cache_stats(stderr);
 }
 
-static void draw_border(void) {
-    draw_rect(0, 0, w_px, BORDER_SZ, palette[COL_BORDER]);
-    draw_rect(0, 0, BORDER_SZ, h_px, palette[COL_BORDER]);
-    draw_rect(0, h_px - BORDER_SZ, w_px, BORDER_SZ, palette[COL_BORDER]);
-    draw_rect(w_px - BORDER_SZ, 0, BORDER_SZ, h_px, palette[COL_BORDER]);
+/* Render the files with the worker threads, and print the stats */
+static void render_batch(const BatchFile* files, size_t num_files) {
+    Sink sink;
+    open_sink(&sink);
+
+    MemBudget budget;
+    if (args.mem_limit > 0)
+        budget_init(&budget, args.mem_limit);
+
+    BatchStats stats;
+    batch_render(files, num_files, args.jobs,
+                 args.mem_limit > 0 ? &budget : NULL, !args.sync_io, cache,
+                 &sink, &stats);
+
+    close_sink(&sink);
+
+    fprintf(stderr,
+            "Rendered %d files, skipped %d. Split %d big files in bands, "
+            "%d jobs stolen by %d workers.\n",
+            stats.rendered, stats.skipped, stats.split, stats.steals,
+            args.jobs);
+    fprintf(stderr,
+            "Input (%s): %d files read ahead, %d waited for, %d read by the "
+            "workers.\n",
+            stats.io_uring ? "io_uring" : "pread", stats.prefetched,
+            stats.read_waits, stats.read_direct);
+    print_arena_stats(stderr);
+    print_line_cache_stats(stderr);
+
+    if (args.mem_limit > 0) {
+        fprintf(stderr,
+                "Memory: peak %zu KiB reserved of %zu KiB, %d waits, %d "
+                "files rendered in row bands, %d images spilled to temporary "
+                "files.\n",
+                budget.peak / 1024, budget.limit / 1024, budget.waits,
+                stats.banded, sink.spilled);
+        budget_destroy(&budget);
+    } else if (sink.spilled > 0) {
+        fprintf(stderr, "Output: %d images spilled to temporary files.\n",
+                sink.spilled);
+    }
 }
 
-static void write_png_file(const char* filename) {
-    FILE* fd = fopen(filename, "wb");
-    if (!fd)
-        DIE("Can't open file: \"%s\"\n", filename);
+/* Render each of the input files into the sink */
+static void render_multi(char** inputs, int num_inputs) {
+    BatchFile* files = calloc(num_inputs, sizeof(BatchFile));
+    if (!files)
+        DIE("Can't allocate the file list\n");
+
+    for (int i = 0; i < num_inputs; i++) {
+        files[i].path = strdup(inputs[i]);
+        files[i].name = path_join("", strip_path_prefix(inputs[i]), ".png");
+        if (!files[i].path || !files[i].name)
+            DIE("Can't allocate output path for \"%s\"\n", inputs[i]);
+
+        /* Only used for scheduling, unreadable files are skipped later */
+        struct stat st;
+        files[i].size = stat(inputs[i], &st) == 0 ? st.st_size : 0;
+    }
 
-    png_structp png =
-      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png)
-        DIE("Can't create png_structp\n");
+    render_batch(files, num_inputs);
+    batch_files_free(files, num_inputs);
+}
 
-    png_infop info = png_create_info_struct(png);
-    if (!info)
-        DIE("Can't create png_infop\n");
+/* Files of the tree rendered with --recursive, also used by --watch */
+static const WalkFilter* walk_filter(void) {
+    static WalkFilter filter;
+    filter.exts        = args.exts;
+    filter.num_exts    = args.num_exts;
+    filter.ignores     = args.ignores;
+    filter.num_ignores = args.num_ignores;
+    filter.filters     = args.filters;
+    filter.num_filters = args.num_filters;
+    return &filter;
+}
+
+/* Render every file that passes the filters inside the directory */
+static void render_recursive(const char* dir) {
+    BatchFile* files;
+    size_t num_files;
+    if (!walk_tree(dir, walk_filter(), &files, &num_files))
+        DIE("Can't walk directory: \"%s\"\n", dir);
 
-    /* Specify the PNG info */
-    png_init_io(png, fd);
-    png_set_IHDR(png, info, w_px, h_px, 8, PNG_COLOR_TYPE_RGBA,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
+    render_batch(files, num_files);
+    batch_files_free(files, num_files);
+}
 
-    /* Write the rows, a global variable that has been filled somewhere else */
-    png_write_image(png, rows);
-    png_write_end(png, NULL);
+/* Render the inputs again whenever they change, to the same outputs as the
+ * first render */
+static void watch_inputs(void) {
+    Watch watch;
+    if (!watch_init(&watch, render_config_hash(palette)))
+        DIE("Can't initialize inotify\n");
+
+    bool ok = true;
+    if (args.recursive) {
+        ok = watch_add_tree(&watch, args.inputs[0], args.output,
+                            walk_filter());
+    } else if (args.multi) {
+        for (int i = 0; i < args.num_inputs && ok; i++) {
+            char* name =
+              path_join("", strip_path_prefix(args.inputs[i]), ".png");
+            char* out = name ? path_join(args.output, name, "") : NULL;
+            ok        = out && watch_add_file(&watch, args.inputs[i], out);
+            free(name);
+            free(out);
+        }
+    } else {
+        ok = watch_add_file(&watch, args.inputs[0], args.output);
+    }
 
-    /* Free each pointer of the rows pointer array */
-    for (uint32_t y = 0; y < h_px; y++)
-        free(rows[y]);
+    if (!ok)
+        DIE("Can't watch the inputs\n");
 
-    /* And the array itself */
-    free(rows);
+    printf("Watching for changes, press Ctrl-C to stop.\n");
+    fflush(stdout);
 
-    fclose(fd);
-    png_destroy_write_struct(&png, &info);
+    watch_run(&watch);
+    watch_print_stats(&watch, stdout);
+    watch_destroy(&watch);
 }
 
 int main(int argc, char** argv) {
-    if (argc < 3)
-        DIE("Usage: %s <in> <out>\n", argv[0]);
+    (void)argc;
+    parse_args(argv);
 
     /* Setup color palette */
     setup_palette();
+    if (args.theme && !setup_theme_palette(palette, args.theme))
+        DIE("Unknown theme: \"%s\"\n", args.theme);
+
+    static RenderCache cache_storage;
+    if (args.cache_dir) {
+        /* The cached images are in the format of the output */
+        uint64_t seed = render_config_hash(palette);
+        if (args.format != FORMAT_PNG)
+            seed = hash64(&args.format, sizeof(args.format), seed);
+        if (args.optimize)
+            seed = hash64(&args.optimize, sizeof(args.optimize), seed);
+        if (!cache_open(&cache_storage, args.cache_dir, args.cache_size, seed))
+            DIE("Can't open cache directory: \"%s\"\n", args.cache_dir);
+        cache = &cache_storage;
+    }
 
-    /* Ugly, but does the job */
-    input_get_dimensions(argv[1]);
-    printf("Source contains %d rows and %d cols.\n", h, w);
-
-    /* Convert to pixel size, adding top, bottom, left and down margins */
-    w_px = MARGIN + w * FONT_W + MARGIN;
-    h_px = MARGIN + h * (FONT_H + LINE_SPACING) + MARGIN;
-    printf("Generating %dx%d image...\n", w_px, h_px);
-
-    /* We allocate H_PX rows, W_PX cols in each row, and 4 bytes per pixel */
-    rows = malloc(h_px * sizeof(png_bytep));
-    for (uint32_t y = 0; y < h_px; y++)
-        rows[y] = malloc(w_px * sizeof(uint8_t) * COL_SZ);
+    /* The highlighter is only initialized once, even for archives */
+    if (highlight_init(NULL) < 0)
+        DIE("Unable to initialize the highlight library\n");
 
-    /* Clear with background */
-    draw_rect(0, 0, w_px, h_px, palette[COL_BACK]);
+    switch (args.mode) {
+        case MODE_TAR:
+            render_tar(args.inputs[0]);
+            break;
+        case MODE_MULTI:
+            render_multi(args.inputs, args.num_inputs);
+            break;
+        case MODE_RECURSIVE:
+            render_recursive(args.inputs[0]);
+            break;
+        case MODE_WINDOW:
+            render_window(args.inputs[0], args.output);
+            break;
+        case MODE_MONTAGE:
+            render_montage(args.inputs, args.num_inputs, args.output);
+            break;
+        case MODE_TILES:
+            render_tiles(args.inputs[0], args.output);
+            break;
+        case MODE_MINIMAP:
+            render_minimap(args.inputs[0], args.output);
+            break;
+        case MODE_THUMBNAIL:
+            render_thumbnail(args.inputs[0], args.output);
+            break;
+        case MODE_THEMES:
+            render_themes(args.inputs[0]);
+            break;
+        case MODE_TO_TOKENS:
+            write_tokens(args.inputs[0], args.output);
+            break;
+        case MODE_VECTOR:
+            render_vector(args.inputs[0], args.output);
+            break;
+        case MODE_FROM_TOKENS:
+            render_tokens(args.inputs[0], args.output);
+            break;
+        case MODE_SINGLE:
+            render_single_file(args.inputs[0], args.output);
+            break;
+    }
 
-    /* Convert the text to png */
-    source_to_png(argv[1]);
+    /* The multi-file modes print their own stats to stderr */
+    if (args.mode != MODE_TAR && args.mode != MODE_MULTI &&
+        args.mode != MODE_RECURSIVE)
+        puts("Done.");
 
-    /* Draw border */
-    draw_border();
+    if (args.watch)
+        watch_inputs();
 
-    /* Write rows to the output png file */
-    write_png_file(argv[2]);
+    if (cache) {
+        cache_close(cache);
+        fprintf(stderr,
+                "Cache: %d hits, %d misses, %d images stored, %d removed.\n",
+                atomic_load(&cache->hits), atomic_load(&cache->misses),
+                atomic_load(&cache->stores), atomic_load(&cache->evicted));
+    }
 
-    puts("Done.");
+    highlight_finish();
     return 0;
 }
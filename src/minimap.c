@@ -0,0 +1,138 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "include/minimap.h"
+#include "include/render.h"
+#include "include/tokens.h"
+
+/* Bits of each pixel of the minimap, enough for PALETTE_SZ colors */
+#define BIT_DEPTH 4
+
+/*----------------------------------------------------------------------------*/
+
+static inline void put_pixel(uint8_t* row, uint32_t x, uint8_t idx) {
+    /* The first pixel of each byte is in the high nibble */
+    const int shift = (x & 1) ? 0 : 4;
+    row[x / 2]      = (row[x / 2] & ~(0xF << shift)) | idx << shift;
+}
+
+static void clear_row(uint8_t* row, size_t row_sz) {
+    memset(row, COL_BACK << 4 | COL_BACK, row_sz);
+}
+
+bool minimap_write_png(const TokenStream* ts, const Color* palette,
+                       int line_rows, const char* filename) {
+    const uint32_t w     = ts->header->w;
+    const uint32_t lines = ts->header->num_lines;
+    const size_t row_sz  = (w + 1) / 2;
+
+    if (w == 0 || lines > ts->header->h)
+        return false;
+
+    /* Empty sources have a single row */
+    uint32_t h = ts->header->h * line_rows;
+    if (h < 1)
+        h = 1;
+
+    uint8_t* row = malloc(row_sz);
+    if (!row)
+        DIE("Can't allocate a %d px minimap row\n", w);
+
+    FILE* fd = fopen(filename, "wb");
+    if (!fd)
+        DIE("Can't open file: \"%s\"\n", filename);
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        DIE("Can't create png_structp\n");
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        DIE("Can't create png_infop\n");
+
+    /* Minimaps of huge sources are taller than the default limit of libpng,
+     * which is meant for reading */
+    png_set_user_limits(png, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+
+    /* Minimaps are meant to be fast, and the fastest level is only about 50%
+     * bigger than the default one */
+    png_set_compression_level(png, Z_BEST_SPEED);
+
+    png_init_io(png, fd);
+    png_set_IHDR(png, info, w, h, BIT_DEPTH, PNG_COLOR_TYPE_PALETTE,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+
+    /* The palette is opaque, see setup_theme_palette() */
+    png_color plte[PALETTE_SZ];
+    for (int i = 0; i < PALETTE_SZ; i++) {
+        plte[i].red   = palette[i].r;
+        plte[i].green = palette[i].g;
+        plte[i].blue  = palette[i].b;
+    }
+    png_set_PLTE(png, info, plte, PALETTE_SZ);
+    png_write_info(png, info);
+
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+    clear_row(row, row_sz);
+
+    bool ret   = true;
+    uint32_t x = 0, y = 0;
+    TokenSpan span;
+    while (ret && tokens_read(&reader, &span)) {
+        if (!span.chars) {
+            if (y >= lines) {
+                ret = false;
+                break;
+            }
+
+            for (int i = 0; i < line_rows; i++)
+                png_write_row(png, row);
+
+            clear_row(row, row_sz);
+            x = 0;
+            y++;
+            continue;
+        }
+
+        if (y >= lines || x + span.width > w) {
+            ret = false;
+            break;
+        }
+
+        for (size_t i = 0; i < span.len; i++) {
+            const char c = span.chars[i];
+
+            /* Tabs are TAB_SZ spaces, see png_putchar() */
+            if (c == '\t') {
+                for (int j = 0; j < TAB_SZ; j++)
+                    put_pixel(row, x++, span.bg);
+            } else {
+                put_pixel(row, x++, (c == ' ') ? span.bg : span.fg);
+            }
+        }
+    }
+
+    if (reader.error || y != lines)
+        ret = false;
+
+    /* The lines after the last one, up to the minimum height */
+    clear_row(row, row_sz);
+    for (uint32_t i = y * line_rows; i < h; i++)
+        png_write_row(png, row);
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    fclose(fd);
+    free(row);
+
+    return ret;
+}
@@ -0,0 +1,210 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "include/montage.h"
+#include "include/render.h"
+#include "include/util.h"
+
+/* Shared by the threads of montage_draw() */
+typedef struct {
+    const Montage* montage;
+    Canvas* sheet;
+    atomic_size_t next_item;
+} MontageContext;
+
+/*----------------------------------------------------------------------------*/
+
+/* Tallest images first, in the order of the arguments otherwise */
+static int compare_heights(const void* a, const void* b) {
+    const MontageItem* ia = *(const MontageItem* const*)a;
+    const MontageItem* ib = *(const MontageItem* const*)b;
+
+    if (ia->canvas.h_px != ib->canvas.h_px)
+        return (ia->canvas.h_px > ib->canvas.h_px) ? -1 : 1;
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+static void place_items(Montage* montage) {
+    MontageItem** sorted = malloc(montage->num_items * sizeof(MontageItem*));
+    if (!sorted)
+        DIE("Can't allocate %zu montage items\n", montage->num_items);
+
+    /* Width of a square with the area of all the images */
+    double area    = 0;
+    uint32_t max_w = 0;
+    for (size_t i = 0; i < montage->num_items; i++) {
+        const Canvas* canvas = &montage->items[i].canvas;
+
+        area += (double)canvas->w_px * canvas->h_px;
+        if (canvas->w_px > max_w)
+            max_w = canvas->w_px;
+        sorted[i] = &montage->items[i];
+    }
+
+    uint32_t shelf_w = ceil(sqrt(area));
+    if (shelf_w < max_w)
+        shelf_w = max_w;
+
+    qsort(sorted, montage->num_items, sizeof(MontageItem*), compare_heights);
+
+    /* The first image of each shelf is the tallest one */
+    uint32_t x = 0, y = 0, shelf_h = 0;
+    montage->w = 0;
+    for (size_t i = 0; i < montage->num_items; i++) {
+        MontageItem* item = sorted[i];
+        if (x > 0 && x + item->canvas.w_px > shelf_w) {
+            y += shelf_h;
+            x = shelf_h = 0;
+        }
+
+        item->x = x;
+        item->y = y;
+
+        x += item->canvas.w_px;
+        if (shelf_h == 0)
+            shelf_h = item->canvas.h_px;
+        if (x > montage->w)
+            montage->w = x;
+    }
+    montage->h = y + shelf_h;
+
+    free(sorted);
+}
+
+void montage_init(Montage* montage, char** paths, size_t num_paths) {
+    montage->num_items = num_paths;
+    montage->items     = calloc(num_paths, sizeof(MontageItem));
+    if (!montage->items)
+        DIE("Can't allocate %zu montage items\n", num_paths);
+
+    for (size_t i = 0; i < num_paths; i++) {
+        MontageItem* item = &montage->items[i];
+
+        item->path = paths[i];
+        item->src  = read_file(item->path, &item->src_sz);
+        if (!item->src)
+            DIE("Can't open file: \"%s\"\n", item->path);
+
+        canvas_init(&item->canvas);
+        input_get_dimensions(&item->canvas, item->src, item->src_sz);
+    }
+
+    place_items(montage);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Draw the source into its rectangle of the sheet, with rows that point to
+ * the sheet */
+static void draw_item(const MontageItem* item, Canvas* sheet) {
+    Canvas canvas = item->canvas;
+    canvas.rows   = malloc(canvas.h_px * sizeof(png_bytep));
+    if (!canvas.rows)
+        DIE("Can't allocate the rows of \"%s\"\n", item->path);
+
+    for (uint32_t y = 0; y < canvas.h_px; y++)
+        canvas.rows[y] = sheet->rows[item->y + y] + item->x * COL_SZ;
+    canvas.rows_start = 0;
+    canvas.rows_end   = canvas.h_px;
+
+    /* The sheet is already cleared with the background */
+    source_to_png(&canvas, item->src, item->src_sz);
+    draw_border(&canvas);
+
+    free(canvas.rows);
+}
+
+static void* montage_thread(void* arg) {
+    MontageContext* ctx = arg;
+
+    for (;;) {
+        const size_t i = atomic_fetch_add(&ctx->next_item, 1);
+        if (i >= ctx->montage->num_items)
+            break;
+
+        draw_item(&ctx->montage->items[i], ctx->sheet);
+    }
+
+    return NULL;
+}
+
+void montage_draw(const Montage* montage, Canvas* sheet, int jobs) {
+    canvas_init(sheet);
+    sheet->w_px = montage->w;
+    sheet->h_px = montage->h;
+    canvas_alloc(sheet);
+
+    MontageContext ctx = {
+        .montage = montage,
+        .sheet   = sheet,
+    };
+    atomic_init(&ctx.next_item, 0);
+
+    if ((size_t)jobs > montage->num_items)
+        jobs = montage->num_items;
+
+    pthread_t* threads = malloc(jobs * sizeof(pthread_t));
+    if (!threads)
+        DIE("Can't allocate %d threads\n", jobs);
+
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&threads[i], NULL, montage_thread, &ctx) != 0)
+            DIE("Can't create montage thread\n");
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void write_json_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+bool montage_write_index(const Montage* montage, const char* filename) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "{\n  \"width\": %u,\n  \"height\": %u,\n  \"files\": [\n",
+            montage->w, montage->h);
+
+    for (size_t i = 0; i < montage->num_items; i++) {
+        const MontageItem* item = &montage->items[i];
+
+        fprintf(fp, "    { \"path\": ");
+        write_json_string(fp, item->path);
+        fprintf(fp, ", \"x\": %u, \"y\": %u, \"w\": %u, \"h\": %u }%s\n",
+                item->x, item->y, item->canvas.w_px, item->canvas.h_px,
+                (i + 1 < montage->num_items) ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+    return fclose(fp) == 0;
+}
+
+void montage_free(Montage* montage) {
+    for (size_t i = 0; i < montage->num_items; i++)
+        free(montage->items[i].src);
+    free(montage->items);
+
+    montage->items     = NULL;
+    montage->num_items = 0;
+}
@@ -0,0 +1,510 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "include/optimize.h"
+#include "include/bandenc.h" /* ByteBuf */
+#include "include/render.h"
+#include "include/util.h" /* time_ns() */
+
+/* Most colors of an indexed PNG, and slots of the table of colors */
+#define MAX_COLORS  256
+#define COLOR_SLOTS 1024
+
+/* Settings tried with each color type. Z_RLE is tried once per filter. */
+#define NUM_FILTERS    5
+#define NUM_LEVELS     2
+#define NUM_STRATEGIES 2
+#define NUM_MEM_LEVELS 2
+
+#define MAX_TRIALS \
+    (2 * NUM_FILTERS * (NUM_STRATEGIES * NUM_LEVELS * NUM_MEM_LEVELS + 1))
+
+/* Filters of the trials, the first one chooses a filter for each row */
+static const struct {
+    int mask;
+    const char* name;
+} filters[NUM_FILTERS] = {
+    { PNG_ALL_FILTERS, "adaptive" }, { PNG_FILTER_NONE, "none" },
+    { PNG_FILTER_SUB, "sub" },       { PNG_FILTER_UP, "up" },
+    { PNG_FILTER_PAETH, "paeth" },
+};
+
+/* The first ones are the defaults of libpng for filtered images */
+static const int levels[NUM_LEVELS] = { Z_DEFAULT_COMPRESSION,
+                                        Z_BEST_COMPRESSION };
+static const int strategies[NUM_STRATEGIES] = { Z_FILTERED,
+                                                Z_DEFAULT_STRATEGY };
+static const int mem_levels[NUM_MEM_LEVELS] = { 8, MAX_MEM_LEVEL };
+
+/* Settings of an encode, and its results */
+typedef struct {
+    bool indexed;
+    int filter; /* Index in filters[] */
+    int level, strategy, mem_level;
+
+    /* Results of the sample and of the full image */
+    size_t sample_sz, full_sz;
+    uint64_t sample_ns, full_ns;
+
+    /* PNG of the full image */
+    ByteBuf png;
+} Trial;
+
+/* Colors of an image with at most MAX_COLORS of them, and its rows packed as
+ * indexes in the order of the colors */
+typedef struct {
+    int num_colors;
+    int bit_depth;
+    bool has_alpha;
+    png_color plte[MAX_COLORS];
+    png_byte trns[MAX_COLORS];
+
+    uint8_t* packed;
+    size_t packed_row_sz;
+} IndexedColors;
+
+/* Open addressing table of the colors of an image, as read from the rows */
+typedef struct {
+    uint32_t keys[COLOR_SLOTS];
+    int16_t indexes[COLOR_SLOTS];
+} ColorTable;
+
+/* Rows encoded by a stage, all of them or a sample */
+typedef struct {
+    uint32_t w, h;
+    png_bytep* rows;
+
+    /* Same rows packed as indexes, or NULL */
+    png_bytep* packed;
+} TrialImage;
+
+/* Shared by the threads of run_stage() */
+typedef struct {
+    const TrialImage* image;
+    const IndexedColors* colors;
+    Trial** trials;
+    size_t num_trials;
+
+    /* Keep the PNG, and fill the full_* results instead of the sample_* */
+    bool full;
+
+    atomic_size_t next_trial;
+} StageContext;
+
+/*----------------------------------------------------------------------------*/
+
+/* Index of the color, adding it if it's not in the table. Returns -1 if there
+ * are already MAX_COLORS colors. */
+static int color_index(ColorTable* table, IndexedColors* colors,
+                       const uint8_t* px) {
+    uint32_t key;
+    memcpy(&key, px, COL_SZ);
+
+    uint32_t slot = (key * 2654435761u) % COLOR_SLOTS;
+    while (table->indexes[slot] >= 0) {
+        if (table->keys[slot] == key)
+            return table->indexes[slot];
+        slot = (slot + 1) % COLOR_SLOTS;
+    }
+
+    if (colors->num_colors >= MAX_COLORS)
+        return -1;
+
+    const int idx           = colors->num_colors++;
+    table->keys[slot]       = key;
+    table->indexes[slot]    = idx;
+    colors->plte[idx].red   = px[0];
+    colors->plte[idx].green = px[1];
+    colors->plte[idx].blue  = px[2];
+    colors->trns[idx]       = px[3];
+    if (px[3] != 0xFF)
+        colors->has_alpha = true;
+
+    return idx;
+}
+
+/* Find the colors of the canvas, and pack its rows with the smallest bit
+ * depth for them. Returns false if it has more than MAX_COLORS colors. */
+static bool index_colors(const Canvas* canvas, IndexedColors* colors) {
+    ColorTable* table = malloc(sizeof(ColorTable));
+    if (!table)
+        DIE("Can't allocate the color table\n");
+    memset(table->indexes, 0xFF, sizeof(table->indexes));
+
+    colors->num_colors = 0;
+    colors->has_alpha  = false;
+    colors->packed     = NULL;
+
+    /* Most of the pixels are the same as the one before */
+    uint32_t last = 0;
+    int last_idx  = -1;
+    for (uint32_t y = 0; y < canvas->h_px; y++) {
+        const uint8_t* row = canvas->rows[y];
+        for (uint32_t x = 0; x < canvas->w_px; x++) {
+            uint32_t key;
+            memcpy(&key, &row[x * COL_SZ], COL_SZ);
+            if (last_idx >= 0 && key == last)
+                continue;
+
+            last_idx = color_index(table, colors, &row[x * COL_SZ]);
+            last     = key;
+            if (last_idx < 0) {
+                free(table);
+                return false;
+            }
+        }
+    }
+
+    if (colors->num_colors <= 2)
+        colors->bit_depth = 1;
+    else if (colors->num_colors <= 4)
+        colors->bit_depth = 2;
+    else if (colors->num_colors <= 16)
+        colors->bit_depth = 4;
+    else
+        colors->bit_depth = 8;
+
+    const int depth       = colors->bit_depth;
+    colors->packed_row_sz = ((size_t)canvas->w_px * depth + 7) / 8;
+    colors->packed        = calloc(canvas->h_px, colors->packed_row_sz);
+    if (!colors->packed)
+        DIE("Can't allocate the indexed rows\n");
+
+    /* The first pixel of each byte is in its high bits */
+    last_idx = -1;
+    for (uint32_t y = 0; y < canvas->h_px; y++) {
+        const uint8_t* row = canvas->rows[y];
+        uint8_t* dst       = &colors->packed[y * colors->packed_row_sz];
+
+        for (uint32_t x = 0; x < canvas->w_px; x++) {
+            uint32_t key;
+            memcpy(&key, &row[x * COL_SZ], COL_SZ);
+            if (last_idx < 0 || key != last) {
+                last_idx = color_index(table, colors, &row[x * COL_SZ]);
+                last     = key;
+            }
+
+            const size_t bit = (size_t)x * depth;
+            dst[bit / 8] |= last_idx << (8 - depth - bit % 8);
+        }
+    }
+
+    free(table);
+    return true;
+}
+
+/* Fill the trials with every combination of the settings, the first one
+ * being the defaults of write_png_file(). Returns the number of trials. */
+static size_t make_trials(Trial* trials, bool indexed) {
+    size_t num = 0;
+
+    for (int color = 0; color < (indexed ? 2 : 1); color++) {
+        for (int f = 0; f < NUM_FILTERS; f++) {
+            const Trial base = {
+                .indexed   = color == 1,
+                .filter    = f,
+                .level     = Z_BEST_COMPRESSION,
+                .strategy  = Z_RLE,
+                .mem_level = 8,
+            };
+
+            for (int s = 0; s < NUM_STRATEGIES; s++) {
+                for (int l = 0; l < NUM_LEVELS; l++) {
+                    for (int m = 0; m < NUM_MEM_LEVELS; m++) {
+                        trials[num]           = base;
+                        trials[num].strategy  = strategies[s];
+                        trials[num].level     = levels[l];
+                        trials[num].mem_level = mem_levels[m];
+                        num++;
+                    }
+                }
+            }
+
+            /* Runs only look at the previous byte, so the level and the
+             * memory don't matter */
+            trials[num++] = base;
+        }
+    }
+
+    return num;
+}
+
+static const char* strategy_name(int strategy) {
+    switch (strategy) {
+        case Z_FILTERED:
+            return "filtered";
+        case Z_RLE:
+            return "rle";
+        default:
+            return "default";
+    }
+}
+
+/* Print the settings of the trial, and its size and time */
+static void print_trial(FILE* fp, const Trial* trial, size_t size,
+                        size_t base_sz, uint64_t ns) {
+    const int level =
+      (trial->level == Z_DEFAULT_COMPRESSION) ? 6 : trial->level;
+
+    fprintf(fp,
+            "  %-5s %-8s %-8s level %d, mem %d: %9zu bytes, %8lld saved "
+            "(%5.1f%%), %.1f ms\n",
+            trial->indexed ? "index" : "rgba", filters[trial->filter].name,
+            strategy_name(trial->strategy), level, trial->mem_level, size,
+            (long long)base_sz - (long long)size,
+            100.0 * ((double)base_sz - size) / base_sz, ns / 1e6);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void png_buf_write(png_structp png, png_bytep data, png_size_t sz) {
+    byte_buf_append(png_get_io_ptr(png), data, sz);
+}
+
+static void png_buf_flush(png_structp png) {
+    (void)png;
+}
+
+/* Encode the image with the settings of the trial, appending it to `out' */
+static void encode_trial(const Trial* trial, const TrialImage* image,
+                         const IndexedColors* colors, ByteBuf* out) {
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        DIE("Can't create png_structp\n");
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        DIE("Can't create png_infop\n");
+
+    png_set_write_fn(png, out, png_buf_write, png_buf_flush);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, filters[trial->filter].mask);
+    png_set_compression_level(png, trial->level);
+    png_set_compression_strategy(png, trial->strategy);
+    png_set_compression_mem_level(png, trial->mem_level);
+
+    png_bytep* rows = image->rows;
+    if (trial->indexed) {
+        png_set_IHDR(png, info, image->w, image->h, colors->bit_depth,
+                     PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_PLTE(png, info, colors->plte, colors->num_colors);
+        if (colors->has_alpha)
+            png_set_tRNS(png, info, colors->trns, colors->num_colors, NULL);
+
+        rows = image->packed;
+    } else {
+        png_set_IHDR(png, info, image->w, image->h, 8, PNG_COLOR_TYPE_RGBA,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                     PNG_FILTER_TYPE_DEFAULT);
+    }
+
+    png_write_info(png, info);
+    png_write_image(png, rows);
+    png_write_end(png, NULL);
+
+    png_destroy_write_struct(&png, &info);
+}
+
+static void* stage_thread(void* arg) {
+    StageContext* ctx = arg;
+
+    for (;;) {
+        const size_t i = atomic_fetch_add(&ctx->next_trial, 1);
+        if (i >= ctx->num_trials)
+            break;
+
+        Trial* trial = ctx->trials[i];
+        ByteBuf png  = { 0 };
+
+        const uint64_t start_ns = time_ns();
+        encode_trial(trial, ctx->image, ctx->colors, &png);
+        const uint64_t ns = time_ns() - start_ns;
+
+        if (ctx->full) {
+            trial->full_sz = png.size;
+            trial->full_ns = ns;
+            trial->png     = png;
+        } else {
+            trial->sample_sz = png.size;
+            trial->sample_ns = ns;
+            free(png.data);
+        }
+    }
+
+    return NULL;
+}
+
+/* Encode the image with each of the trials, using `jobs' threads */
+static void run_stage(const TrialImage* image, const IndexedColors* colors,
+                      Trial** trials, size_t num_trials, bool full,
+                      int jobs) {
+    StageContext ctx = {
+        .image      = image,
+        .colors     = colors,
+        .trials     = trials,
+        .num_trials = num_trials,
+        .full       = full,
+    };
+    atomic_init(&ctx.next_trial, 0);
+
+    if ((size_t)jobs > num_trials)
+        jobs = num_trials;
+
+    pthread_t* threads = malloc(jobs * sizeof(pthread_t));
+    if (!threads)
+        DIE("Can't allocate %d threads\n", jobs);
+
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&threads[i], NULL, stage_thread, &ctx) != 0)
+            DIE("Can't create optimize thread\n");
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+/* Smallest samples first, in the order of the trials otherwise */
+static int compare_samples(const void* a, const void* b) {
+    const Trial* ta = *(Trial* const*)a;
+    const Trial* tb = *(Trial* const*)b;
+    if (ta->sample_sz != tb->sample_sz)
+        return (ta->sample_sz < tb->sample_sz) ? -1 : 1;
+
+    return (ta < tb) ? -1 : (ta > tb);
+}
+
+/* Point the rows of the sample to OPTIMIZE_BANDS bands of the image, the
+ * first and the last ones at its ends */
+static void sample_image(const TrialImage* image, TrialImage* sample) {
+    sample->w = image->w;
+    sample->h = OPTIMIZE_BANDS * OPTIMIZE_BAND_ROWS;
+
+    sample->rows = malloc(2 * sample->h * sizeof(png_bytep));
+    if (!sample->rows)
+        DIE("Can't allocate the rows of the sample\n");
+    sample->packed = image->packed ? &sample->rows[sample->h] : NULL;
+
+    for (uint32_t i = 0; i < OPTIMIZE_BANDS; i++) {
+        const uint32_t start = (uint64_t)(image->h - OPTIMIZE_BAND_ROWS) * i /
+                               (OPTIMIZE_BANDS - 1);
+
+        for (uint32_t j = 0; j < OPTIMIZE_BAND_ROWS; j++) {
+            const uint32_t y = i * OPTIMIZE_BAND_ROWS + j;
+
+            sample->rows[y] = image->rows[start + j];
+            if (sample->packed)
+                sample->packed[y] = image->packed[start + j];
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool optimize_write_png(const Canvas* canvas, const char* filename, int jobs,
+                        FILE* report) {
+    TrialImage image = {
+        .w    = canvas->w_px,
+        .h    = canvas->h_px,
+        .rows = canvas->rows,
+    };
+
+    IndexedColors colors;
+    const bool indexed = index_colors(canvas, &colors);
+    if (indexed) {
+        image.packed = malloc(image.h * sizeof(png_bytep));
+        if (!image.packed)
+            DIE("Can't allocate the indexed rows\n");
+
+        for (uint32_t y = 0; y < image.h; y++)
+            image.packed[y] = &colors.packed[y * colors.packed_row_sz];
+
+        fprintf(report, "The image has %d colors, also trying %d-bit "
+                        "indexed PNGs.\n",
+                colors.num_colors, colors.bit_depth);
+    } else {
+        fprintf(report, "The image has more than %d colors, only trying "
+                        "RGBA PNGs.\n",
+                MAX_COLORS);
+    }
+
+    Trial trials[MAX_TRIALS];
+    const size_t num_trials = make_trials(trials, indexed);
+
+    Trial* order[MAX_TRIALS];
+    for (size_t i = 0; i < num_trials; i++)
+        order[i] = &trials[i];
+
+    /* The first trial has the default settings, and it's always kept */
+    Trial* const base = &trials[0];
+    size_t num_kept   = num_trials;
+    if (image.h > OPTIMIZE_BANDS * OPTIMIZE_BAND_ROWS) {
+        TrialImage sample;
+        sample_image(&image, &sample);
+
+        const uint64_t start_ns = time_ns();
+        run_stage(&sample, &colors, order, num_trials, false, jobs);
+        fprintf(report,
+                "Encoded %zu trials of %u sampled rows in %.1f ms with %d "
+                "threads:\n",
+                num_trials, sample.h, (time_ns() - start_ns) / 1e6, jobs);
+        for (size_t i = 0; i < num_trials; i++)
+            print_trial(report, &trials[i], trials[i].sample_sz,
+                        base->sample_sz, trials[i].sample_ns);
+
+        qsort(order, num_trials, sizeof(Trial*), compare_samples);
+        num_kept = OPTIMIZE_KEEP;
+
+        bool has_base = false;
+        for (size_t i = 0; i < num_kept; i++)
+            if (order[i] == base)
+                has_base = true;
+        if (!has_base)
+            order[num_kept++] = base;
+
+        free(sample.rows);
+    }
+
+    const uint64_t start_ns = time_ns();
+    run_stage(&image, &colors, order, num_kept, true, jobs);
+    fprintf(report,
+            "Encoded %zu trials of the full image in %.1f ms with %d "
+            "threads:\n",
+            num_kept, (time_ns() - start_ns) / 1e6, jobs);
+
+    Trial* best = base;
+    for (size_t i = 0; i < num_kept; i++) {
+        print_trial(report, order[i], order[i]->full_sz, base->full_sz,
+                    order[i]->full_ns);
+        if (order[i]->full_sz < best->full_sz)
+            best = order[i];
+    }
+
+    fprintf(report,
+            "Kept the smallest PNG, %zu bytes, %lld bytes (%.1f%%) smaller "
+            "than the default settings.\n",
+            best->full_sz, (long long)base->full_sz - (long long)best->full_sz,
+            100.0 * ((double)base->full_sz - best->full_sz) / base->full_sz);
+
+    bool ok  = false;
+    FILE* fd = fopen(filename, "wb");
+    if (fd) {
+        ok = fwrite(best->png.data, 1, best->png.size, fd) == best->png.size;
+        ok = (fclose(fd) == 0) && ok;
+    }
+
+    for (size_t i = 0; i < num_kept; i++)
+        free(order[i]->png.data);
+    free(image.packed);
+    free(colors.packed);
+
+    return ok;
+}
@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "include/parlex.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/util.h" /* time_ns() */
+
+typedef struct {
+    size_t offset, size;
+    uint32_t first_line;
+
+    /* Assumed when drawing, and real after the pre-scan */
+    int state;
+    int real_state;
+} Chunk;
+
+typedef struct {
+    Canvas* canvas;
+    const char* src;
+    Chunk* chunks;
+
+    /* Indexes of the chunks drawn in the current phase, taken in order */
+    size_t* jobs;
+    size_t num_jobs;
+    atomic_size_t next;
+
+    uint64_t prescan_ns;
+} Parlex;
+
+static void* lex_thread(void* arg) {
+    Parlex* px = arg;
+
+    size_t i;
+    while ((i = atomic_fetch_add(&px->next, 1)) < px->num_jobs) {
+        const Chunk* chunk = &px->chunks[px->jobs[i]];
+
+        /* Each chunk has its own position, but they share the rows */
+        Canvas canvas = *px->canvas;
+        source_lines_to_png(&canvas, px->src + chunk->offset, chunk->size,
+                            chunk->first_line, chunk->state);
+    }
+
+    return NULL;
+}
+
+/* Start the threads for the jobs of this phase, and join them. The calling
+ * thread runs `before' and then draws chunks too. */
+static void run_phase(Parlex* px, int num_threads, void (*before)(Parlex*)) {
+    if ((size_t)num_threads > px->num_jobs)
+        num_threads = px->num_jobs;
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    if (!threads)
+        DIE("Can't allocate the lexer threads\n");
+
+    atomic_store(&px->next, 0);
+    for (int i = 1; i < num_threads; i++)
+        if (pthread_create(&threads[i], NULL, lex_thread, px) != 0)
+            DIE("Can't create lexer thread\n");
+
+    if (before)
+        before(px);
+    lex_thread(px);
+
+    for (int i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+/* Find the real state at the start of each chunk, while the threads draw */
+static void prescan(Parlex* px) {
+    const uint64_t start = time_ns();
+
+    int state = HL_DEFAULT;
+    for (size_t i = 0; i < px->num_jobs; i++) {
+        Chunk* chunk      = &px->chunks[i];
+        chunk->real_state = state;
+        state = highlight_text_state(px->src + chunk->offset, chunk->size,
+                                     state);
+    }
+
+    px->prescan_ns = time_ns() - start;
+}
+
+void source_to_png_parallel(Canvas* canvas, const char* src, size_t src_sz,
+                            int num_threads, ParlexStats* stats) {
+    size_t num_chunks = (size_t)num_threads * PARLEX_CHUNKS_PER_THREAD;
+    if (num_chunks > canvas->h / PARLEX_MIN_LINES)
+        num_chunks = canvas->h / PARLEX_MIN_LINES;
+
+    stats->chunks     = 1;
+    stats->relexed    = 0;
+    stats->prescan_ns = 0;
+
+    if (num_threads <= 1 || num_chunks <= 1) {
+        source_to_png(canvas, src, src_sz);
+        return;
+    }
+
+    Chunk* chunks = malloc(num_chunks * sizeof(Chunk));
+    size_t* jobs  = malloc(num_chunks * sizeof(size_t));
+    if (!chunks || !jobs)
+        DIE("Can't allocate the lexer chunks\n");
+
+    /* Split in chunks of whole lines. Only lines ending in a newline are
+     * drawn, see source_lines_to_png() */
+    const uint32_t chunk_lines = (canvas->h + num_chunks - 1) / num_chunks;
+    size_t pos    = 0;
+    uint32_t line = 0;
+    num_chunks    = 0;
+
+    while (line < canvas->h) {
+        Chunk* chunk      = &chunks[num_chunks];
+        chunk->offset     = pos;
+        chunk->first_line = line;
+        chunk->state      = HL_DEFAULT;
+
+        for (uint32_t i = 0; i < chunk_lines && line < canvas->h; i++) {
+            pos = (const char*)memchr(src + pos, '\n', src_sz - pos) - src + 1;
+            line++;
+        }
+
+        chunk->size      = pos - chunk->offset;
+        jobs[num_chunks] = num_chunks;
+        num_chunks++;
+    }
+
+    Parlex px = {
+        .canvas   = canvas,
+        .src      = src,
+        .chunks   = chunks,
+        .jobs     = jobs,
+        .num_jobs = num_chunks,
+    };
+
+    /* Draw every chunk assuming the default state */
+    run_phase(&px, num_threads, prescan);
+
+    /* Draw again the ones that started inside a comment or string */
+    px.num_jobs = 0;
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (chunks[i].real_state == chunks[i].state)
+            continue;
+
+        chunks[i].state      = chunks[i].real_state;
+        jobs[px.num_jobs++] = i;
+    }
+
+    if (px.num_jobs > 0)
+        run_phase(&px, num_threads, NULL);
+
+    stats->chunks     = num_chunks;
+    stats->relexed    = px.num_jobs;
+    stats->prescan_ns = px.prescan_ns;
+
+    free(chunks);
+    free(jobs);
+}
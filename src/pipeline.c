@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <png.h>
+
+#include "include/pipeline.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/spsc.h"
+#include "include/util.h"
+
+const char* const pipe_stage_names[NUM_STAGES] = {
+    [STAGE_READER]  = "reader",
+    [STAGE_LEXER]   = "lexer",
+    [STAGE_RASTER]  = "rasterizer",
+    [STAGE_ENCODER] = "encoder",
+};
+
+/* Whole lines of the source, each ending in a newline */
+typedef struct {
+    const char* src;
+    size_t size;
+    uint32_t first_line, num_lines;
+} LineBatch;
+
+/* Highlighted lines, one after the other in `text', and each one terminated
+ * by a NULL byte that is not part of an escape sequence */
+typedef struct {
+    char* text;
+    size_t* offsets;
+    uint32_t first_line, num_lines;
+} LexedBatch;
+
+/* Scanlines of the lines of a band, pointed by the rows of the canvas */
+typedef struct {
+    uint8_t* pixels;
+    uint32_t y0, y1;
+} Band;
+
+typedef struct {
+    int fd;
+    FILE* out;
+
+    /* The source is read in place. The batches point to it. */
+    char* src;
+    size_t src_sz;
+
+    /* Bytes read before starting the reader */
+    size_t src_read;
+
+    Canvas canvas;
+
+    /* Set by the reader once the whole source has been read */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool dims_ready;
+    bool read_failed;
+
+    SpscRing lines;      /* Reader -> lexer */
+    SpscRing lexed;      /* Lexer -> rasterizer */
+    SpscRing bands;      /* Rasterizer -> encoder */
+    SpscRing free_bands; /* Encoder -> rasterizer */
+    Band band_pool[PIPE_BANDS];
+
+    uint64_t start_ns;
+    uint64_t end_ns[NUM_STAGES];
+    uint64_t dims_wait_ns;
+} Pipeline;
+
+/*----------------------------------------------------------------------------*/
+
+/* State of the reader between reads */
+typedef struct {
+    /* Bytes read, and bytes that are whole lines with known dimensions */
+    size_t read, scanned;
+    uint32_t lines;
+
+    /* Bytes and lines already sent to the lexer */
+    size_t pushed;
+    uint32_t pushed_lines;
+
+    /* Next batch, if it didn't fit in the ring */
+    LineBatch* pending;
+} Reader;
+
+/* Send the scanned lines to the lexer. If `wait' is false, stop when the ring
+ * is full instead of waiting, so the reader can keep reading. */
+static void push_lines(Pipeline* pipe, Reader* reader, bool wait) {
+    while (reader->pending || reader->pushed < reader->scanned) {
+        if (!reader->pending) {
+            LineBatch* batch = malloc(sizeof(LineBatch));
+            if (!batch)
+                DIE("Can't allocate line batch\n");
+
+            batch->src        = pipe->src + reader->pushed;
+            batch->first_line = reader->pushed_lines;
+            batch->num_lines  = 0;
+
+            size_t pos = reader->pushed;
+            while (pos < reader->scanned &&
+                   batch->num_lines < PIPE_BATCH_LINES) {
+                pos = (const char*)memchr(pipe->src + pos, '\n',
+                                          reader->scanned - pos) -
+                      pipe->src + 1;
+                batch->num_lines++;
+            }
+
+            batch->size = pos - reader->pushed;
+            reader->pushed = pos;
+            reader->pushed_lines += batch->num_lines;
+            reader->pending = batch;
+        }
+
+        if (wait)
+            spsc_push(&pipe->lines, reader->pending);
+        else if (!spsc_try_push(&pipe->lines, reader->pending))
+            return;
+
+        reader->pending = NULL;
+    }
+}
+
+/* Find the dimensions of the whole lines read so far */
+static void scan_lines(Pipeline* pipe, Reader* reader) {
+    const char* nl = memrchr(pipe->src + reader->scanned, '\n',
+                             reader->read - reader->scanned);
+    if (!nl)
+        return;
+
+    const size_t end = nl - pipe->src + 1;
+    reader->lines    = input_scan_dimensions(&pipe->canvas,
+                                             pipe->src + reader->scanned,
+                                             end - reader->scanned,
+                                             reader->lines);
+    reader->scanned  = end;
+}
+
+/* Read the source in chunks, and send its lines to the lexer while reading */
+static void* reader_thread(void* arg) {
+    Pipeline* pipe = arg;
+    Canvas* canvas = &pipe->canvas;
+
+    Reader reader = { .read = pipe->src_read };
+    bool failed   = false;
+
+    for (;;) {
+        const size_t left = pipe->src_sz - reader.read;
+        if (left == 0)
+            break;
+
+        const ssize_t ret =
+          read(pipe->fd, pipe->src + reader.read,
+               left < PIPE_READ_SZ ? left : PIPE_READ_SZ);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            failed = true;
+        if (ret <= 0)
+            break;
+
+        reader.read += ret;
+
+        /* Only send whole lines, the rest is scanned after the next read */
+        scan_lines(pipe, &reader);
+        push_lines(pipe, &reader, false);
+    }
+
+    /* The last line doesn't end in a newline, so it's not drawn, but it's
+     * part of the width. The file could also have been truncated. */
+    scan_lines(pipe, &reader);
+    input_scan_dimensions(canvas, pipe->src + reader.scanned,
+                          reader.read - reader.scanned, reader.lines);
+    canvas_update_px_size(canvas);
+    pipe->src_sz = reader.read;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->dims_ready  = true;
+    pipe->read_failed = failed;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    push_lines(pipe, &reader, true);
+    spsc_push(&pipe->lines, NULL);
+
+    pipe->end_ns[STAGE_READER] = time_ns();
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Highlight the batches of lines in order */
+static void* lexer_thread(void* arg) {
+    Pipeline* pipe = arg;
+
+    highlight_set_state(HL_DEFAULT);
+    char* hl_line = highlight_alloc_line();
+
+    /* Each line is copied here to add the NULL terminator, like
+     * source_lines_to_png() does */
+    size_t line_cap = 0x100;
+    char* line_buf  = malloc(line_cap);
+
+    LineBatch* batch;
+    while ((batch = spsc_pop(&pipe->lines)) != NULL) {
+        LexedBatch* lexed = malloc(sizeof(LexedBatch));
+        size_t text_cap   = batch->size * 4 + 0x100;
+        if (lexed) {
+            lexed->text    = malloc(text_cap);
+            lexed->offsets = malloc(batch->num_lines * sizeof(size_t));
+        }
+        if (!line_buf || !lexed || !lexed->text || !lexed->offsets)
+            DIE("Can't allocate lexer batch\n");
+
+        lexed->first_line = batch->first_line;
+        lexed->num_lines  = batch->num_lines;
+
+        size_t pos = 0, text_sz = 0;
+        for (uint32_t i = 0; i < batch->num_lines; i++) {
+            const char* line = batch->src + pos;
+            const size_t len =
+              (const char*)memchr(line, '\n', batch->size - pos) - line;
+            pos += len + 1;
+
+            if (len + 1 > line_cap) {
+                while (len + 1 > line_cap)
+                    line_cap *= 2;
+
+                line_buf = realloc(line_buf, line_cap);
+                if (!line_buf)
+                    DIE("Can't allocate line buffer\n");
+            }
+
+            memcpy(line_buf, line, len);
+            line_buf[len] = '\0';
+            hl_line       = highlight_line(line_buf, hl_line, len);
+
+            const size_t hl_sz = ((struct highlighted_line*)hl_line - 1)->idx;
+            if (text_sz + hl_sz + 1 > text_cap) {
+                while (text_sz + hl_sz + 1 > text_cap)
+                    text_cap *= 2;
+
+                lexed->text = realloc(lexed->text, text_cap);
+                if (!lexed->text)
+                    DIE("Can't allocate lexer batch\n");
+            }
+
+            memcpy(lexed->text + text_sz, hl_line, hl_sz);
+            lexed->text[text_sz + hl_sz] = '\0';
+            lexed->offsets[i]            = text_sz;
+            text_sz += hl_sz + 1;
+        }
+
+        free(batch);
+        spsc_push(&pipe->lexed, lexed);
+    }
+    spsc_push(&pipe->lexed, NULL);
+
+    highlight_free(hl_line);
+    free(line_buf);
+
+    pipe->end_ns[STAGE_LEXER] = time_ns();
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Get a free band for lines [l0, l1), waiting for the encoder if needed */
+static Band* next_band(Pipeline* pipe, uint32_t l0, uint32_t l1) {
+    Band* band = spsc_pop(&pipe->free_bands);
+    canvas_set_band(&pipe->canvas, band->pixels, l0, l1);
+
+    band->y0 = pipe->canvas.rows_start;
+    band->y1 = pipe->canvas.rows_end;
+    return band;
+}
+
+static uint32_t band_end(const Canvas* canvas, uint32_t l0) {
+    return canvas->h - l0 > PIPE_BAND_LINES ? l0 + PIPE_BAND_LINES
+                                            : canvas->h;
+}
+
+/* Draw the highlighted lines in bands, and send each band to the encoder when
+ * all of its lines are drawn */
+static void* raster_thread(void* arg) {
+    Pipeline* pipe = arg;
+    Canvas* canvas = &pipe->canvas;
+
+    const uint64_t start = time_ns();
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->dims_ready)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    pthread_mutex_unlock(&pipe->lock);
+    pipe->dims_wait_ns = time_ns() - start;
+
+    /* Only the bands are allocated, not the whole image */
+    const size_t row_sz   = (size_t)canvas->w_px * COL_SZ;
+    const size_t max_rows =
+      MARGIN + PIPE_BAND_LINES * (FONT_H + LINE_SPACING) + MARGIN;
+
+    canvas->rows = calloc(canvas->h_px, sizeof(png_bytep));
+    if (!canvas->rows)
+        DIE("Can't allocate %dx%d image\n", canvas->w_px, canvas->h_px);
+
+    for (int i = 0; i < PIPE_BANDS; i++) {
+        pipe->band_pool[i].pixels = malloc(max_rows * row_sz);
+        if (!pipe->band_pool[i].pixels)
+            DIE("Can't allocate %dx%d image band\n", canvas->w_px,
+                (int)max_rows);
+    }
+
+    uint32_t l0 = 0, l1 = band_end(canvas, 0);
+    Band* band  = next_band(pipe, l0, l1);
+
+    LexedBatch* lexed;
+    while ((lexed = spsc_pop(&pipe->lexed)) != NULL) {
+        for (uint32_t i = 0; i < lexed->num_lines; i++) {
+            const uint32_t line = lexed->first_line + i;
+
+            while (line >= l1) {
+                draw_border(canvas);
+                spsc_push(&pipe->bands, band);
+
+                l0   = l1;
+                l1   = band_end(canvas, l0);
+                band = next_band(pipe, l0, l1);
+            }
+
+            draw_highlighted_line(canvas, line,
+                                  lexed->text + lexed->offsets[i]);
+        }
+
+        free(lexed->text);
+        free(lexed->offsets);
+        free(lexed);
+    }
+
+    /* The last band, and the empty ones if the source was truncated */
+    for (;;) {
+        draw_border(canvas);
+        spsc_push(&pipe->bands, band);
+
+        if (l1 >= canvas->h)
+            break;
+
+        l0   = l1;
+        l1   = band_end(canvas, l0);
+        band = next_band(pipe, l0, l1);
+    }
+    spsc_push(&pipe->bands, NULL);
+
+    pipe->end_ns[STAGE_RASTER] = time_ns();
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Compress the bands in order, and give them back to the rasterizer */
+static void* encoder_thread(void* arg) {
+    Pipeline* pipe = arg;
+    Canvas* canvas = &pipe->canvas;
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        DIE("Can't create png_structp\n");
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        DIE("Can't create png_infop\n");
+
+    png_init_io(png, pipe->out);
+
+    /* The size is known once the first band is ready */
+    Band* band = spsc_pop(&pipe->bands);
+    encode_png_header(png, info, canvas);
+
+    for (; band != NULL; band = spsc_pop(&pipe->bands)) {
+        png_write_rows(png, &canvas->rows[band->y0], band->y1 - band->y0);
+        spsc_push(&pipe->free_bands, band);
+    }
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+
+    pipe->end_ns[STAGE_ENCODER] = time_ns();
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void set_stats(StageStats* stats, uint64_t total, uint64_t input_wait,
+                      uint64_t output_wait) {
+    stats->input_wait_ns  = input_wait;
+    stats->output_wait_ns = output_wait;
+    stats->busy_ns = total > input_wait + output_wait
+                       ? total - input_wait - output_wait
+                       : 0;
+}
+
+bool render_pipelined(const char* in, const char* out, PipelineStats* stats) {
+    Pipeline pipe;
+    canvas_init(&pipe.canvas);
+
+    struct stat st;
+    pipe.fd = open(in, O_RDONLY | O_CLOEXEC);
+    if (pipe.fd < 0)
+        return false;
+
+    if (fstat(pipe.fd, &st) != 0) {
+        close(pipe.fd);
+        return false;
+    }
+
+    /* The batches point to the source, so it can't grow while reading. Other
+     * files are read before starting. */
+    if (S_ISREG(st.st_mode)) {
+        pipe.src_sz   = st.st_size;
+        pipe.src_read = 0;
+        pipe.src      = malloc(pipe.src_sz > 0 ? pipe.src_sz : 1);
+    } else {
+        pipe.src      = read_file(in, &pipe.src_sz);
+        pipe.src_read = pipe.src_sz;
+    }
+    if (!pipe.src) {
+        close(pipe.fd);
+        return false;
+    }
+
+    pipe.out = fopen(out, "wb");
+    if (!pipe.out)
+        DIE("Can't open file: \"%s\"\n", out);
+
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
+    pipe.dims_ready  = false;
+    pipe.read_failed = false;
+
+    if (!spsc_init(&pipe.lines, PIPE_RING_SZ) ||
+        !spsc_init(&pipe.lexed, PIPE_RING_SZ) ||
+        !spsc_init(&pipe.bands, PIPE_BANDS) ||
+        !spsc_init(&pipe.free_bands, PIPE_BANDS))
+        DIE("Can't allocate the pipeline\n");
+
+    /* The pixels of the bands are allocated once the width is known */
+    for (int i = 0; i < PIPE_BANDS; i++) {
+        pipe.band_pool[i].pixels = NULL;
+        spsc_push(&pipe.free_bands, &pipe.band_pool[i]);
+    }
+
+    static void* (*const funcs[NUM_STAGES])(void*) = {
+        [STAGE_READER]  = reader_thread,
+        [STAGE_LEXER]   = lexer_thread,
+        [STAGE_RASTER]  = raster_thread,
+        [STAGE_ENCODER] = encoder_thread,
+    };
+
+    pthread_t threads[NUM_STAGES];
+    pipe.start_ns = time_ns();
+    for (int i = 0; i < NUM_STAGES; i++)
+        if (pthread_create(&threads[i], NULL, funcs[i], &pipe) != 0)
+            DIE("Can't create pipeline thread\n");
+
+    for (int i = 0; i < NUM_STAGES; i++)
+        pthread_join(threads[i], NULL);
+
+    fclose(pipe.out);
+    close(pipe.fd);
+
+    const Canvas* canvas = &pipe.canvas;
+    stats->w        = canvas->w;
+    stats->h        = canvas->h;
+    stats->w_px     = canvas->w_px;
+    stats->h_px     = canvas->h_px;
+    stats->total_ns = pipe.end_ns[STAGE_ENCODER] - pipe.start_ns;
+
+    uint64_t total[NUM_STAGES];
+    for (int i = 0; i < NUM_STAGES; i++)
+        total[i] = pipe.end_ns[i] - pipe.start_ns;
+
+    /* Waiting for a free band is waiting for the encoder */
+    set_stats(&stats->stages[STAGE_READER], total[STAGE_READER], 0,
+              pipe.lines.push_wait_ns);
+    set_stats(&stats->stages[STAGE_LEXER], total[STAGE_LEXER],
+              pipe.lines.pop_wait_ns, pipe.lexed.push_wait_ns);
+    set_stats(&stats->stages[STAGE_RASTER], total[STAGE_RASTER],
+              pipe.dims_wait_ns + pipe.lexed.pop_wait_ns,
+              pipe.bands.push_wait_ns + pipe.free_bands.pop_wait_ns);
+    set_stats(&stats->stages[STAGE_ENCODER], total[STAGE_ENCODER],
+              pipe.bands.pop_wait_ns, pipe.free_bands.push_wait_ns);
+
+    for (int i = 0; i < PIPE_BANDS; i++)
+        free(pipe.band_pool[i].pixels);
+    free(canvas->rows);
+    free(pipe.src);
+
+    spsc_destroy(&pipe.lines);
+    spsc_destroy(&pipe.lexed);
+    spsc_destroy(&pipe.bands);
+    spsc_destroy(&pipe.free_bands);
+    pthread_mutex_destroy(&pipe.lock);
+    pthread_cond_destroy(&pipe.cond);
+
+    return !pipe.read_failed;
+}
@@ -0,0 +1,276 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "include/rawimg.h"
+#include "include/render.h"
+
+/* Maximum size of a single write() */
+#define MAX_WRITE_SZ (1 << 30)
+
+/* Operations of QOI, and the longest run */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+#define QOI_OP_RGBA  0xFF
+#define QOI_MAX_RUN  62
+
+/* Longest QOI operation, a pixel with QOI_OP_RGBA */
+#define QOI_MAX_OP_SZ 5
+
+static const uint8_t qoi_end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+/* Output file and the chunk being filled */
+typedef struct {
+    int fd;
+    bool ok;
+
+    uint8_t* chunk;
+    size_t size;
+} RawWriter;
+
+/*----------------------------------------------------------------------------*/
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = data;
+    while (size > 0) {
+        const size_t part = (size > MAX_WRITE_SZ) ? MAX_WRITE_SZ : size;
+        const ssize_t ret = write(fd, p, part);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        p += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+/* Open the file, and allocate the chunk if `chunk' is set */
+static bool writer_open(RawWriter* w, const char* filename, bool chunk) {
+    w->ok    = true;
+    w->size  = 0;
+    w->chunk = NULL;
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0)
+        return false;
+
+    if (chunk) {
+        w->chunk = malloc(RAWIMG_CHUNK_SZ);
+        if (!w->chunk)
+            DIE("Can't allocate the output chunk\n");
+    }
+
+    return true;
+}
+
+static void writer_flush(RawWriter* w) {
+    if (w->ok && w->size > 0)
+        w->ok = write_all(w->fd, w->chunk, w->size);
+    w->size = 0;
+}
+
+/* Flush the chunk if it doesn't have space for `size' more bytes */
+static inline uint8_t* writer_reserve(RawWriter* w, size_t size) {
+    if (w->size + size > RAWIMG_CHUNK_SZ)
+        writer_flush(w);
+    return w->chunk + w->size;
+}
+
+static bool writer_close(RawWriter* w) {
+    if (w->chunk)
+        writer_flush(w);
+
+    const bool ok = w->ok && close(w->fd) == 0;
+    free(w->chunk);
+    return ok;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool rawimg_write_pam(const Canvas* canvas, const char* filename) {
+    RawWriter w;
+    if (!writer_open(&w, filename, false))
+        return false;
+
+    char header[256];
+    const int header_sz =
+      snprintf(header, sizeof(header),
+               "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %d\nMAXVAL 255\n"
+               "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+               canvas->w_px, canvas->h_px, COL_SZ);
+    w.ok = write_all(w.fd, header, header_sz);
+
+    /* Usually all the rows are a single block, see canvas_alloc() */
+    const size_t row_sz = (size_t)canvas->w_px * COL_SZ;
+    for (uint32_t y = 0; w.ok && y < canvas->h_px;) {
+        uint32_t end = y + 1;
+        while (end < canvas->h_px &&
+               canvas->rows[end] == canvas->rows[end - 1] + row_sz)
+            end++;
+
+        w.ok = write_all(w.fd, canvas->rows[y], (end - y) * row_sz);
+        y    = end;
+    }
+
+    return writer_close(&w);
+}
+
+bool rawimg_write_ppm(const Canvas* canvas, const char* filename) {
+    RawWriter w;
+    if (!writer_open(&w, filename, true))
+        return false;
+
+    w.size = snprintf((char*)w.chunk, RAWIMG_CHUNK_SZ, "P6\n%u %u\n255\n",
+                      canvas->w_px, canvas->h_px);
+
+    for (uint32_t y = 0; y < canvas->h_px; y++) {
+        const uint8_t* src = canvas->rows[y];
+
+        /* As many pixels of the row as fit in the chunk */
+        for (uint32_t x = 0; x < canvas->w_px;) {
+            uint8_t* dst = writer_reserve(&w, 3);
+            size_t num   = (RAWIMG_CHUNK_SZ - w.size) / 3;
+            if (num > canvas->w_px - x)
+                num = canvas->w_px - x;
+
+            for (size_t i = 0; i < num; i++, x++) {
+                dst[3 * i]     = src[x * COL_SZ];
+                dst[3 * i + 1] = src[x * COL_SZ + 1];
+                dst[3 * i + 2] = src[x * COL_SZ + 2];
+            }
+            w.size += 3 * num;
+        }
+    }
+
+    return writer_close(&w);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static inline int qoi_hash(Color c) {
+    return (c.r * 3 + c.g * 5 + c.b * 7 + c.a * 11) % 64;
+}
+
+static inline bool same_color(Color a, Color b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static void put_u32(uint8_t* p, uint32_t val) {
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+/* Encode a pixel that is not the same as the last one */
+static size_t qoi_encode_pixel(uint8_t* p, Color px, Color prev,
+                               Color* index) {
+    const int idx = qoi_hash(px);
+    if (same_color(index[idx], px)) {
+        p[0] = QOI_OP_INDEX | idx;
+        return 1;
+    }
+    index[idx] = px;
+
+    if (px.a != prev.a) {
+        p[0] = QOI_OP_RGBA;
+        p[1] = px.r;
+        p[2] = px.g;
+        p[3] = px.b;
+        p[4] = px.a;
+        return 5;
+    }
+
+    const int8_t vr   = px.r - prev.r;
+    const int8_t vg   = px.g - prev.g;
+    const int8_t vb   = px.b - prev.b;
+    const int8_t vg_r = vr - vg;
+    const int8_t vg_b = vb - vg;
+
+    if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+        p[0] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        return 1;
+    }
+
+    if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 &&
+        vg_b <= 7) {
+        p[0] = QOI_OP_LUMA | (vg + 32);
+        p[1] = (vg_r + 8) << 4 | (vg_b + 8);
+        return 2;
+    }
+
+    p[0] = QOI_OP_RGB;
+    p[1] = px.r;
+    p[2] = px.g;
+    p[3] = px.b;
+    return 4;
+}
+
+bool rawimg_write_qoi(const Canvas* canvas, const char* filename) {
+    RawWriter w;
+    if (!writer_open(&w, filename, true))
+        return false;
+
+    /* Magic, size, channels and sRGB colorspace */
+    memcpy(w.chunk, "qoif", 4);
+    put_u32(w.chunk + 4, canvas->w_px);
+    put_u32(w.chunk + 8, canvas->h_px);
+    w.chunk[12] = COL_SZ;
+    w.chunk[13] = 0;
+    w.size      = 14;
+
+    Color index[64];
+    memset(index, 0, sizeof(index));
+
+    /* The runs continue in the next row */
+    Color prev = { .r = 0, .g = 0, .b = 0, .a = 255 };
+    int run    = 0;
+    for (uint32_t y = 0; y < canvas->h_px; y++) {
+        const Color* row = (const Color*)canvas->rows[y];
+
+        for (uint32_t x = 0; x < canvas->w_px; x++) {
+            const Color px = row[x];
+            if (same_color(px, prev)) {
+                if (++run < QOI_MAX_RUN)
+                    continue;
+
+                *writer_reserve(&w, 1) = QOI_OP_RUN | (run - 1);
+                w.size++;
+                run = 0;
+                continue;
+            }
+
+            uint8_t* p = writer_reserve(&w, 1 + QOI_MAX_OP_SZ);
+            if (run > 0) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                w.size++;
+                run = 0;
+            }
+
+            w.size += qoi_encode_pixel(p, px, prev, index);
+            prev = px;
+        }
+    }
+
+    uint8_t* p = writer_reserve(&w, 1 + sizeof(qoi_end));
+    if (run > 0) {
+        *p++ = QOI_OP_RUN | (run - 1);
+        w.size++;
+    }
+    memcpy(p, qoi_end, sizeof(qoi_end));
+    w.size += sizeof(qoi_end);
+
+    return writer_close(&w);
+}
@@ -0,0 +1,682 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include <zlib.h>
+
+#define MAIN_FONT_IMPLEMENTATION
+#include "fonts/main_font.h" /* FONT_W, FONT_H, main_font[] */
+#include "include/render.h"
+#include "include/bandenc.h" /* ByteBuf */
+#include "include/fastpng.h"
+#include "include/highlight.h"
+#include "include/hash.h"
+#include "include/linecache.h"
+
+Color palette[PALETTE_SZ];
+bool fast_png = false;
+
+/*----------------------------------------------------------------------------*/
+
+static inline bool get_font_bit(uint8_t c, uint8_t x, uint8_t y) {
+    return main_font[c * FONT_H + y] & (0x80 >> x);
+}
+
+/* Colors of each theme, in RGB. The function calls and symbols use the
+ * default color */
+static const struct {
+    const char* name;
+    uint32_t colors[PALETTE_SZ];
+} themes[] = {
+    {
+      "dark",
+      {
+        [COL_DEFAULT] = 0xFFFFFF,
+        [COL_PREPROC] = 0xFF6740,
+        [COL_TYPES]   = 0x79A8FF,
+        [COL_KWRDS]   = 0xFF6F9F,
+        [COL_NUMBER]  = 0x88CA9F,
+        [COL_STRING]  = 0x00D3D0,
+        [COL_COMMENT] = 0x989898,
+        [COL_BACK]    = 0x050505,
+        [COL_BORDER]  = 0x222222,
+      },
+    },
+    {
+      "light",
+      {
+        [COL_DEFAULT] = 0x1A1A1A,
+        [COL_PREPROC] = 0xB3401F,
+        [COL_TYPES]   = 0x2659B2,
+        [COL_KWRDS]   = 0xC2185B,
+        [COL_NUMBER]  = 0x2E7D32,
+        [COL_STRING]  = 0x00838F,
+        [COL_COMMENT] = 0x707070,
+        [COL_BACK]    = 0xFAFAFA,
+        [COL_BORDER]  = 0xDDDDDD,
+      },
+    },
+};
+
+bool setup_theme_palette(Color* dst, const char* theme) {
+    for (size_t i = 0; i < sizeof(themes) / sizeof(themes[0]); i++) {
+        if (strcmp(themes[i].name, theme) != 0)
+            continue;
+
+        for (int j = 0; j < PALETTE_SZ; j++)
+            dst[j] = COL(themes[i].colors[j], 255);
+
+        dst[COL_FUNC_CALL] = dst[COL_DEFAULT];
+        dst[COL_SYMBOL]    = dst[COL_DEFAULT];
+        return true;
+    }
+
+    return false;
+}
+
+void setup_palette(void) {
+    setup_theme_palette(palette, DEFAULT_THEME);
+}
+
+uint32_t glyph_pixels(uint8_t c) {
+    uint32_t ret = 0;
+    for (uint8_t fy = 0; fy < FONT_H; fy++)
+        for (uint8_t fx = 0; fx < FONT_W; fx++)
+            ret += get_font_bit(c, fx, fy);
+
+    return ret;
+}
+
+void canvas_init(Canvas* canvas) {
+    canvas->w       = MIN_W;
+    canvas->h       = MIN_H;
+    canvas->w_px    = 0;
+    canvas->h_px    = 0;
+    canvas->x       = 0;
+    canvas->y       = 0;
+    canvas->rows    = NULL;
+    canvas->pixels  = NULL;
+    canvas->palette = palette;
+    canvas->arena   = NULL;
+
+    canvas->line_states = NULL;
+    canvas->clip_cols   = false;
+    canvas->first_col   = 0;
+
+    canvas->rows_start = 0;
+    canvas->rows_end   = 0;
+}
+
+uint32_t input_scan_dimensions(Canvas* canvas, const char* src,
+                               size_t src_sz, uint32_t first_line) {
+    uint32_t x = 0, y = first_line;
+
+    for (size_t i = 0; i < src_sz; i++) {
+        if (src[i] == '\n') {
+            y++;
+            x = 0;
+        } else if (src[i] == '\t') {
+            /* Tabs are drawn as TAB_SZ spaces by png_putchar() */
+            x += TAB_SZ;
+        } else {
+            x++;
+        }
+
+        if (canvas->w < x)
+            canvas->w = x;
+
+        if (canvas->h < y)
+            canvas->h = y;
+    }
+
+    return y;
+}
+
+void canvas_update_px_size(Canvas* canvas) {
+    /* Convert to pixel size, adding top, bottom, left and down margins */
+    canvas->w_px = MARGIN + canvas->w * FONT_W + MARGIN;
+    canvas->h_px = MARGIN + canvas->h * (FONT_H + LINE_SPACING) + MARGIN;
+}
+
+void input_get_dimensions(Canvas* canvas, const char* src, size_t src_sz) {
+    input_scan_dimensions(canvas, src, src_sz, 0);
+    canvas_update_px_size(canvas);
+}
+
+static void draw_rect(Canvas* canvas, int x, int y, int w, int h, Color c) {
+    /* Only draw the allocated rows */
+    const int rows_start = canvas->rows_start, rows_end = canvas->rows_end;
+    const int start_y    = y > rows_start ? y : rows_start;
+    const int end_y      = y + h < rows_end ? y + h : rows_end;
+
+    for (int cur_y = start_y; cur_y < end_y; cur_y++) {
+        /* To get the real position in the rows array, we need to multiply the
+         * positions by the size of each element: COL_SZ (4) */
+        for (int cur_x = x * COL_SZ; cur_x < (x + w) * COL_SZ;
+             cur_x += COL_SZ) {
+            canvas->rows[cur_y][cur_x]     = c.r;
+            canvas->rows[cur_y][cur_x + 1] = c.g;
+            canvas->rows[cur_y][cur_x + 2] = c.b;
+            canvas->rows[cur_y][cur_x + 3] = c.a;
+        }
+    }
+}
+
+void canvas_alloc(Canvas* canvas) {
+    /* We allocate H_PX rows, W_PX cols in each row, and 4 bytes per pixel. A
+     * single block is big enough to be returned to the system when freed. */
+    const size_t row_sz = (size_t)canvas->w_px * sizeof(uint8_t) * COL_SZ;
+
+    if (canvas->arena) {
+        canvas->rows   = arena_alloc(canvas->arena,
+                                     canvas->h_px * sizeof(png_bytep));
+        canvas->pixels = arena_alloc(canvas->arena, canvas->h_px * row_sz);
+    } else {
+        canvas->rows   = malloc(canvas->h_px * sizeof(png_bytep));
+        canvas->pixels = malloc(canvas->h_px * row_sz);
+    }
+
+    if (!canvas->rows || !canvas->pixels)
+        DIE("Can't allocate %dx%d image\n", canvas->w_px, canvas->h_px);
+
+    for (uint32_t y = 0; y < canvas->h_px; y++)
+        canvas->rows[y] = canvas->pixels + y * row_sz;
+
+    canvas->rows_start = 0;
+    canvas->rows_end   = canvas->h_px;
+
+    /* Clear with background */
+    draw_rect(canvas, 0, 0, canvas->w_px, canvas->h_px,
+              canvas->palette[COL_BACK]);
+}
+
+void canvas_free(Canvas* canvas) {
+    if (!canvas->rows)
+        return;
+
+    /* Free the rows, and the array of pointers to them */
+    if (!canvas->arena) {
+        free(canvas->pixels);
+        free(canvas->rows);
+    }
+    canvas->pixels = NULL;
+    canvas->rows   = NULL;
+}
+
+static void png_putchar(Canvas* canvas, char c, Color fg, Color bg) {
+    /* Hadle special cases */
+    switch (c) {
+        case '\n':
+            canvas->y++;
+            canvas->x = 0;
+            return;
+        case '\t':
+            for (int i = 0; i < TAB_SZ; i++)
+                png_putchar(canvas, ' ', fg, bg);
+            return;
+    }
+
+    /* Column of the canvas, skipping the ones outside of the window */
+    uint32_t col = canvas->x;
+    if (canvas->clip_cols) {
+        if (col < canvas->first_col || col - canvas->first_col >= canvas->w) {
+            canvas->x++;
+            return;
+        }
+        col -= canvas->first_col;
+    }
+
+    /* Iterate each pixel that forms the font char */
+    for (uint8_t fy = 0; fy < FONT_H; fy++) {
+        /* Get real screen position from the char offset on the image and the
+         * pixel font offset on the char */
+        const uint32_t final_y = CHAR_Y_TO_PX(canvas->y) + fy;
+
+        for (uint8_t fx = 0; fx < FONT_W; fx++) {
+            /* For the final_x, we also need to multiply it by the size of each
+            pixel in the cols array */
+            const uint32_t final_x = (CHAR_X_TO_PX(col) + fx) * COL_SZ;
+
+            /* Actual color to use depending if the bit is set in the font */
+            Color col = get_font_bit(c, fx, fy) ? fg : bg;
+
+            canvas->rows[final_y][final_x]     = col.r;
+            canvas->rows[final_y][final_x + 1] = col.g;
+            canvas->rows[final_y][final_x + 2] = col.b;
+            canvas->rows[final_y][final_x + 3] = col.a;
+        }
+    }
+
+    canvas->x++;
+}
+
+static void png_print(Canvas* canvas, const char* s) {
+    Color fg = canvas->palette[COL_DEFAULT];
+    Color bg = canvas->palette[COL_BACK];
+
+    while (*s != '\0' && *s != EOF) {
+        /* Escape character used to change color */
+        if (*s == ESCAPE_CHAR) {
+            s++;
+
+            /* A doubled escape is a char of the source, see add_src_to_hl() */
+            if (*s == ESCAPE_CHAR) {
+                png_putchar(canvas, *s++, fg, bg);
+                continue;
+            }
+
+            /* See bottom of COLORS[] in highlight.c */
+            const int fg_idx = *s++;
+            const int bg_idx = *s++;
+
+            /* Also skip NULL terminator for the color strings */
+            s++;
+
+#ifdef DISABLE_SYNTAX_HIGHLIGHT
+            /* No syntax highlight, unused */
+            (void)fg_idx;
+            (void)bg_idx;
+#else
+            fg = canvas->palette[fg_idx];
+            bg = canvas->palette[bg_idx];
+#endif
+
+            continue;
+        }
+
+        png_putchar(canvas, *s, fg, bg);
+        s++;
+    }
+}
+
+void draw_span(Canvas* canvas, const char* s, size_t len, Color fg, Color bg) {
+    for (size_t i = 0; i < len; i++)
+        png_putchar(canvas, s[i], fg, bg);
+}
+
+void draw_highlighted_line(Canvas* canvas, uint32_t line, const char* hl_line) {
+    canvas->x = 0;
+    canvas->y = line;
+    png_print(canvas, hl_line);
+}
+
+/* Bytes of the longest line of the source */
+static size_t longest_line(const char* src, size_t src_sz) {
+    size_t ret = 0, pos = 0;
+    while (pos < src_sz) {
+        const char* nl   = memchr(src + pos, '\n', src_sz - pos);
+        const size_t end = nl ? (size_t)(nl - src) : src_sz;
+
+        if (end - pos > ret)
+            ret = end - pos;
+        pos = end + 1;
+    }
+
+    return ret;
+}
+
+void source_to_png(Canvas* canvas, const char* src, size_t src_sz) {
+    source_lines_to_png(canvas, src, src_sz, 0, HL_DEFAULT);
+}
+
+void source_lines_to_png(Canvas* canvas, const char* src, size_t src_sz,
+                         uint32_t first_line, int state) {
+    canvas->x = 0;
+    canvas->y = first_line;
+    highlight_set_state(state);
+
+    /* The buffers are freed at the end by rewinding the arena */
+    Arena* arena         = arena_thread();
+    const ArenaMark mark = arena_mark(arena);
+
+    /* Used by us for storing each line and adding NULL terminator. Lines can
+     * be wider than the canvas if only some columns are drawn. */
+    const size_t max_len =
+      canvas->clip_cols ? longest_line(src, src_sz) : canvas->w;
+    char* line_buf   = arena_alloc(arena, (max_len + 1) * sizeof(char));
+    int line_buf_pos = 0;
+
+    /* Used when calling highlight_line(). Allocated last, so it can grow in
+     * place */
+    char* hl_line = highlight_alloc_line();
+
+    /* The cached lines are whole, see Canvas.clip_cols */
+    LineCache* line_cache = canvas->clip_cols ? NULL : line_cache_thread();
+
+    for (size_t i = 0; i < src_sz; i++) {
+        const char c = src[i];
+
+        /* Store chars until newline */
+        if (c != '\n') {
+            line_buf[line_buf_pos++] = c;
+            continue;
+        }
+
+        /* We encountered newline, terminate string */
+        line_buf[line_buf_pos] = '\0';
+
+        /* Repeated lines are copied from the cache */
+        const int line_state = highlight_get_state();
+        if (canvas->line_states)
+            canvas->line_states[canvas->y] = line_state;
+
+        uint64_t hash;
+        if (!line_cache ||
+            !line_cache_draw(line_cache, canvas, line_buf, line_buf_pos,
+                             line_state, &hash)) {
+            /* Check color and print. Some lines, like a bare "#include",
+             * end without the NULL terminator */
+            hl_line = highlight_line(line_buf, hl_line, line_buf_pos);
+            hl_line = add_char_to_hl(hl_line, '\0');
+
+            /* Print the line with the escape codes, used for changing the
+             * colors */
+            png_print(canvas, hl_line);
+
+            if (line_cache)
+                line_cache_put(line_cache, canvas, hash, line_buf,
+                               line_buf_pos, line_state, highlight_get_state());
+        }
+
+        /* Reset for next line */
+        line_buf_pos = 0;
+
+        /* Print the newline we encountered */
+        png_putchar(canvas, '\n', canvas->palette[COL_DEFAULT],
+                    canvas->palette[COL_BACK]);
+    }
+
+    if (line_cache)
+        line_cache_flush_stats(line_cache);
+    arena_rewind(arena, mark);
+}
+
+void canvas_clear_lines(Canvas* canvas, uint32_t l0, uint32_t l1) {
+    const uint32_t y0 = (l0 == 0) ? 0 : CHAR_Y_TO_PX(l0);
+    const uint32_t y1 = (l1 == canvas->h) ? canvas->h_px : CHAR_Y_TO_PX(l1);
+
+    draw_rect(canvas, 0, y0, canvas->w_px, y1 - y0, canvas->palette[COL_BACK]);
+}
+
+void draw_border(Canvas* canvas) {
+    const Color col   = canvas->palette[COL_BORDER];
+    const uint32_t wp = canvas->w_px, hp = canvas->h_px;
+
+    draw_rect(canvas, 0, 0, wp, BORDER_SZ, col);
+    draw_rect(canvas, 0, 0, BORDER_SZ, hp, col);
+    draw_rect(canvas, 0, hp - BORDER_SZ, wp, BORDER_SZ, col);
+    draw_rect(canvas, wp - BORDER_SZ, 0, BORDER_SZ, hp, col);
+}
+
+uint64_t render_config_hash(const Color* palette) {
+    const int64_t config[] = {
+        RENDER_VERSION, MIN_W,  MIN_H,  MARGIN, LINE_SPACING,
+        BORDER_SZ,      TAB_SZ, COL_SZ, FONT_W, FONT_H,
+#ifdef DISABLE_SYNTAX_HIGHLIGHT
+        1,
+#else
+        0,
+#endif
+        /* The compressed bytes can change between versions */
+        PNG_LIBPNG_VER, ZLIB_VERNUM, fast_png,
+    };
+
+    uint64_t ret = hash64(config, sizeof(config), 0);
+    ret = hash64(main_font, sizeof(main_font), ret);
+    return hash64(palette, PALETTE_SZ * sizeof(Color), ret);
+}
+
+/* Initial size of the output buffer. Text images compress to a fraction of a
+ * byte per pixel */
+#define PNG_OUT_ESTIMATE(CANVAS) \
+    (0x1000 + (size_t)(CANVAS)->w_px * (CANVAS)->h_px / 16)
+
+/* Initial size of the output buffer of render_banded_to_mem(), which is used
+ * for huge images that would waste most of PNG_OUT_ESTIMATE() */
+#define PNG_OUT_BANDED_SZ (1024 * 1024)
+
+/* Buffer filled by png_mem_write() */
+typedef struct {
+    uint8_t* data;
+    size_t size, cap;
+} MemBuffer;
+
+static void png_mem_write(png_structp png, png_bytep data, png_size_t sz) {
+    MemBuffer* buf = png_get_io_ptr(png);
+
+    if (buf->size + sz > buf->cap) {
+        while (buf->size + sz > buf->cap)
+            buf->cap *= 2;
+
+        buf->data = realloc(buf->data, buf->cap);
+        if (!buf->data)
+            png_error(png, "Can't grow the output buffer");
+    }
+
+    memcpy(buf->data + buf->size, data, sz);
+    buf->size += sz;
+}
+
+static void png_mem_flush(png_structp png) {
+    (void)png;
+}
+
+static void mem_buffer_init(MemBuffer* buf, size_t cap) {
+    buf->size = 0;
+    buf->cap  = cap;
+    buf->data = malloc(buf->cap);
+    if (!buf->data)
+        DIE("Can't allocate the output buffer\n");
+}
+
+void encode_png_header(png_structp png, png_infop info, const Canvas* canvas) {
+    /* Specify the PNG info */
+    png_set_IHDR(png, info, canvas->w_px, canvas->h_px, 8, PNG_COLOR_TYPE_RGBA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+}
+
+/* Write the header and the rows of the canvas, once the output has been set */
+static void encode_canvas(png_structp png, png_infop info,
+                          const Canvas* canvas) {
+    encode_png_header(png, info, canvas);
+
+    /* Write the rows, that have been filled somewhere else */
+    png_write_image(png, canvas->rows);
+    png_write_end(png, NULL);
+}
+
+void write_png_file(const Canvas* canvas, const char* filename) {
+    FILE* fd = fopen(filename, "wb");
+    if (!fd)
+        DIE("Can't open file: \"%s\"\n", filename);
+
+    if (fast_png) {
+        ByteBuf buf = { 0 };
+        fastpng_encode(canvas, &buf);
+        if (fwrite(buf.data, 1, buf.size, fd) != buf.size)
+            DIE("Error writing file: \"%s\"\n", filename);
+
+        fclose(fd);
+        free(buf.data);
+        return;
+    }
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        DIE("Can't create png_structp\n");
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        DIE("Can't create png_infop\n");
+
+    png_init_io(png, fd);
+    encode_canvas(png, info, canvas);
+
+    fclose(fd);
+    png_destroy_write_struct(&png, &info);
+}
+
+void* encode_png_mem(const Canvas* canvas, size_t* size) {
+    if (fast_png) {
+        ByteBuf buf = { 0 };
+        fastpng_encode(canvas, &buf);
+        *size = buf.size;
+        return buf.data;
+    }
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        DIE("Can't create png_structp\n");
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        DIE("Can't create png_infop\n");
+
+    MemBuffer buf;
+    mem_buffer_init(&buf, PNG_OUT_ESTIMATE(canvas));
+
+    png_set_write_fn(png, &buf, png_mem_write, png_mem_flush);
+    encode_canvas(png, info, canvas);
+
+    png_destroy_write_struct(&png, &info);
+
+    *size = buf.size;
+    return buf.data;
+}
+
+void render_to_file(const char* src, size_t src_sz, const char* filename) {
+    Canvas canvas;
+    canvas_init(&canvas);
+
+    canvas.arena         = arena_thread();
+    const ArenaMark mark = arena_mark(canvas.arena);
+
+    input_get_dimensions(&canvas, src, src_sz);
+    canvas_alloc(&canvas);
+
+    source_to_png(&canvas, src, src_sz);
+    draw_border(&canvas);
+
+    write_png_file(&canvas, filename);
+    arena_rewind(canvas.arena, mark);
+}
+
+void* render_to_mem(const char* src, size_t src_sz, size_t* png_sz) {
+    Canvas canvas;
+    canvas_init(&canvas);
+
+    canvas.arena         = arena_thread();
+    const ArenaMark mark = arena_mark(canvas.arena);
+
+    input_get_dimensions(&canvas, src, src_sz);
+    canvas_alloc(&canvas);
+
+    source_to_png(&canvas, src, src_sz);
+    draw_border(&canvas);
+
+    void* ret = encode_png_mem(&canvas, png_sz);
+    arena_rewind(canvas.arena, mark);
+
+    return ret;
+}
+
+size_t canvas_mem_estimate(const Canvas* canvas, uint32_t num_rows) {
+    const size_t row_sz = (size_t)canvas->w_px * COL_SZ;
+
+    /* Rows, the array of pointers, the encoder (which keeps two rows for
+     * filtering) and the output buffer */
+    return num_rows * row_sz + canvas->h_px * sizeof(png_bytep) +
+           ENCODER_MEM + 2 * (row_sz + 1) + PNG_OUT_ESTIMATE(canvas);
+}
+
+void canvas_set_band(Canvas* canvas, uint8_t* band, uint32_t l0,
+                     uint32_t l1) {
+    const size_t row_sz = (size_t)canvas->w_px * COL_SZ;
+
+    /* Pixel rows of the lines, and the margins at the start or end */
+    const uint32_t y0 = (l0 == 0) ? 0 : CHAR_Y_TO_PX(l0);
+    const uint32_t y1 = (l1 == canvas->h) ? canvas->h_px : CHAR_Y_TO_PX(l1);
+
+    for (uint32_t y = y0; y < y1; y++)
+        canvas->rows[y] = band + (y - y0) * row_sz;
+    canvas->rows_start = y0;
+    canvas->rows_end   = y1;
+
+    draw_rect(canvas, 0, 0, canvas->w_px, canvas->h_px,
+              canvas->palette[COL_BACK]);
+}
+
+void* render_banded_to_mem(Canvas* canvas, const char* src, size_t src_sz,
+                           uint32_t band_lines, size_t* png_sz) {
+    const size_t row_sz = (size_t)canvas->w_px * COL_SZ;
+    if (band_lines < 1)
+        band_lines = 1;
+
+    /* The first and last bands also have the margins */
+    const uint32_t max_rows =
+      MARGIN + band_lines * (FONT_H + LINE_SPACING) + MARGIN;
+    uint8_t* band = malloc(max_rows * row_sz);
+    canvas->rows  = calloc(canvas->h_px, sizeof(png_bytep));
+    if (!band || !canvas->rows)
+        DIE("Can't allocate %dx%d image band\n", canvas->w_px, max_rows);
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        DIE("Can't create png_structp\n");
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        DIE("Can't create png_infop\n");
+
+    MemBuffer buf;
+    mem_buffer_init(&buf, PNG_OUT_BANDED_SZ);
+    png_set_write_fn(png, &buf, png_mem_write, png_mem_flush);
+
+    encode_png_header(png, info, canvas);
+
+    size_t pos  = 0;
+    int state   = HL_DEFAULT;
+    uint32_t l0 = 0;
+    do {
+        const uint32_t l1 =
+          (canvas->h - l0 > band_lines) ? l0 + band_lines : canvas->h;
+
+        canvas_set_band(canvas, band, l0, l1);
+        const uint32_t y0 = canvas->rows_start, y1 = canvas->rows_end;
+
+        /* Find where the lines of this band end in the source */
+        size_t end = pos;
+        for (uint32_t l = l0; l < l1; l++)
+            end = (const char*)memchr(src + end, '\n', src_sz - end) - src + 1;
+
+        source_lines_to_png(canvas, src + pos, end - pos, l0, state);
+        state = highlight_get_state();
+        pos   = end;
+
+        draw_border(canvas);
+        png_write_rows(png, &canvas->rows[y0], y1 - y0);
+
+        for (uint32_t y = y0; y < y1; y++)
+            canvas->rows[y] = NULL;
+
+        l0 = l1;
+    } while (l0 < canvas->h);
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+
+    free(canvas->rows);
+    canvas->rows       = NULL;
+    canvas->rows_start = canvas->rows_end = 0;
+    free(band);
+
+    *png_sz = buf.size;
+    return buf.data;
+}
@@ -0,0 +1,229 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "include/sink.h"
+#include "include/tar.h"
+#include "include/fileio.h"
+#include "include/util.h"
+
+/* Write or start writing the item. The files of a directory are counted and
+ * reported by the writeback when they finish, and it takes the data. */
+static bool write_item(Sink* sink, SinkItem* item) {
+    if (sink->is_tar)
+        return tar_write_member(&sink->tar, item->path, item->data,
+                                item->size);
+
+    char* filename = path_join(sink->out, item->path, "");
+    if (!filename || !mkdir_parents(filename)) {
+        free(filename);
+        return false;
+    }
+
+    void* data = item->data;
+    item->data = NULL;
+    return writeback_submit(&sink->wb, filename, data, item->size);
+}
+
+/* Move the data of the item to a temporary file, and free it */
+static bool spill_item(SinkItem* item) {
+    item->spill = tmpfile();
+    if (!item->spill)
+        return false;
+
+    if (fwrite(item->data, 1, item->size, item->spill) != item->size ||
+        fflush(item->spill) != 0) {
+        fclose(item->spill);
+        item->spill = NULL;
+        return false;
+    }
+
+    free(item->data);
+    item->data = NULL;
+    return true;
+}
+
+/* Read back the data of a spilled item */
+static bool unspill_item(SinkItem* item) {
+    item->data = malloc(item->size);
+    const bool ok =
+      item->data && fseek(item->spill, 0, SEEK_SET) == 0 &&
+      fread(item->data, 1, item->size, item->spill) == item->size;
+
+    fclose(item->spill);
+    item->spill = NULL;
+    return ok;
+}
+
+static void* writer_thread(void* arg) {
+    Sink* sink = arg;
+
+    pthread_mutex_lock(&sink->lock);
+    for (;;) {
+        /* Wait for the next item in order. When closing, the rest are written
+         * in order even if some sequence number was never submitted. */
+        while (!sink->closing &&
+               (!sink->pending || sink->pending->seq != sink->next_seq)) {
+            /* Finish the writes in flight while there is nothing else to do,
+             * so their data is freed */
+            if (!sink->is_tar && sink->wb.in_flight > 0) {
+                pthread_mutex_unlock(&sink->lock);
+                writeback_reap(&sink->wb, true);
+                pthread_mutex_lock(&sink->lock);
+                continue;
+            }
+
+            pthread_cond_wait(&sink->cond_ready, &sink->lock);
+        }
+
+        SinkItem* item = sink->pending;
+        if (!item)
+            break;
+
+        sink->pending = item->next;
+        sink->num_pending--;
+        sink->next_seq = item->seq + 1;
+        pthread_cond_broadcast(&sink->cond_space);
+
+        /* Don't hold the lock while writing */
+        pthread_mutex_unlock(&sink->lock);
+
+        const size_t item_size = item->size;
+        const bool in_memory   = item->data != NULL;
+        const bool skipped     = !in_memory && !item->spill;
+
+        /* Spilled images are read back only when it's their turn */
+        const bool ok = skipped || ((in_memory || unspill_item(item)) &&
+                                    write_item(sink, item));
+
+        if (!ok)
+            fprintf(stderr, "Can't write output: \"%s\"\n", item->path);
+
+        free(item->data);
+        free(item->path);
+        free(item);
+
+        pthread_mutex_lock(&sink->lock);
+        if (in_memory)
+            sink->pending_bytes -= item_size;
+        if (ok && !skipped && sink->is_tar)
+            sink->written++;
+        sink->failed |= !ok;
+    }
+    pthread_mutex_unlock(&sink->lock);
+
+    if (!sink->is_tar) {
+        const bool ok = writeback_finish(&sink->wb);
+
+        pthread_mutex_lock(&sink->lock);
+        sink->written += sink->wb.written;
+        sink->failed |= !ok;
+        pthread_mutex_unlock(&sink->lock);
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool sink_open(Sink* sink, const char* out, bool is_tar, bool use_uring) {
+    sink->out         = out;
+    sink->is_tar      = is_tar;
+    sink->pending     = NULL;
+    sink->num_pending = 0;
+    sink->next_seq    = 0;
+    sink->max_pending = SINK_MAX_PENDING;
+
+    sink->pending_bytes     = 0;
+    sink->max_pending_bytes = 0;
+    sink->spilled           = 0;
+    sink->closing     = false;
+    sink->failed      = false;
+    sink->written     = 0;
+
+    if (is_tar && !tar_writer_open(&sink->tar, out))
+        return false;
+
+    if (!is_tar)
+        writeback_init(&sink->wb, use_uring);
+
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond_ready, NULL);
+    pthread_cond_init(&sink->cond_space, NULL);
+
+    return pthread_create(&sink->thread, NULL, writer_thread, sink) == 0;
+}
+
+void sink_submit(Sink* sink, uint64_t seq, const char* path, void* data,
+                 size_t size) {
+    SinkItem* item = malloc(sizeof(SinkItem));
+    if (!item || !(item->path = strdup(path))) {
+        fprintf(stderr, "Can't allocate output item for \"%s\"\n", path);
+        exit(1);
+    }
+
+    item->seq   = seq;
+    item->data  = data;
+    item->size  = size;
+    item->spill = NULL;
+
+    pthread_mutex_lock(&sink->lock);
+
+    /* Images that the writer doesn't need yet wait in a temporary file if
+     * they don't fit in memory. The writer might be waiting for a slow file,
+     * so this is never done by blocking. */
+    if (data && sink->max_pending_bytes > 0 && seq != sink->next_seq &&
+        sink->pending_bytes + size > sink->max_pending_bytes) {
+        pthread_mutex_unlock(&sink->lock);
+        if (!spill_item(item)) {
+            fprintf(stderr, "Can't spill output \"%s\" to a temporary file\n",
+                    path);
+            exit(1);
+        }
+        pthread_mutex_lock(&sink->lock);
+        sink->spilled++;
+    } else if (data) {
+        sink->pending_bytes += size;
+    }
+
+    /* Limit the memory used by finished images, but never block the one that
+     * the writer is waiting for */
+    while (sink->max_pending > 0 && sink->num_pending >= sink->max_pending &&
+           seq != sink->next_seq)
+        pthread_cond_wait(&sink->cond_space, &sink->lock);
+
+    /* Insert sorted. Items usually arrive almost in order, but the list is
+     * short anyway */
+    SinkItem** p = &sink->pending;
+    while (*p && (*p)->seq < seq)
+        p = &(*p)->next;
+
+    item->next = *p;
+    *p         = item;
+    sink->num_pending++;
+
+    pthread_cond_signal(&sink->cond_ready);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+bool sink_close(Sink* sink) {
+    pthread_mutex_lock(&sink->lock);
+    sink->closing = true;
+    pthread_cond_signal(&sink->cond_ready);
+    pthread_mutex_unlock(&sink->lock);
+
+    pthread_join(sink->thread, NULL);
+
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->cond_ready);
+    pthread_cond_destroy(&sink->cond_space);
+
+    if (sink->is_tar && !tar_writer_close(&sink->tar))
+        sink->failed = true;
+
+    return !sink->failed;
+}
@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "include/spsc.h"
+#include "include/util.h" /* time_ns() */
+
+bool spsc_init(SpscRing* ring, size_t cap) {
+    ring->cap = 1;
+    while (ring->cap < cap)
+        ring->cap *= 2;
+
+    ring->items = malloc(ring->cap * sizeof(void*));
+    if (!ring->items)
+        return false;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleepers, 0);
+    ring->pop_wait_ns  = 0;
+    ring->push_wait_ns = 0;
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    return true;
+}
+
+void spsc_destroy(SpscRing* ring) {
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+    free(ring->items);
+}
+
+/*
+ * The sleeper increments `sleepers' before checking the indexes again, and
+ * the other side moves its index before checking `sleepers'. Both are
+ * sequentially consistent, so either the sleeper sees the new index, or the
+ * other side sees the sleeper and signals it under the lock.
+ */
+static void wake(SpscRing* ring) {
+    if (atomic_load(&ring->sleepers) == 0)
+        return;
+
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static bool is_full(SpscRing* ring, size_t tail) {
+    return tail - atomic_load(&ring->head) >= ring->cap;
+}
+
+static bool is_empty(SpscRing* ring, size_t head) {
+    return atomic_load(&ring->tail) == head;
+}
+
+bool spsc_try_push(SpscRing* ring, void* item) {
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (is_full(ring, tail))
+        return false;
+
+    ring->items[tail & (ring->cap - 1)] = item;
+    atomic_store(&ring->tail, tail + 1);
+    wake(ring);
+    return true;
+}
+
+void spsc_push(SpscRing* ring, void* item) {
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (is_full(ring, tail)) {
+        const uint64_t start = time_ns();
+
+        atomic_fetch_add(&ring->sleepers, 1);
+        pthread_mutex_lock(&ring->lock);
+        while (is_full(ring, tail))
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+        atomic_fetch_sub(&ring->sleepers, 1);
+
+        ring->push_wait_ns += time_ns() - start;
+    }
+
+    ring->items[tail & (ring->cap - 1)] = item;
+    atomic_store(&ring->tail, tail + 1);
+    wake(ring);
+}
+
+void* spsc_pop(SpscRing* ring) {
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (is_empty(ring, head)) {
+        const uint64_t start = time_ns();
+
+        atomic_fetch_add(&ring->sleepers, 1);
+        pthread_mutex_lock(&ring->lock);
+        while (is_empty(ring, head))
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+        atomic_fetch_sub(&ring->sleepers, 1);
+
+        ring->pop_wait_ns += time_ns() - start;
+    }
+
+    void* ret = ring->items[head & (ring->cap - 1)];
+    atomic_store(&ring->head, head + 1);
+    wake(ring);
+    return ret;
+}
@@ -0,0 +1,398 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "include/tar.h"
+
+/* Buffer used by zlib when reading the archive */
+#define GZ_BUFFER_SZ (128 * 1024)
+
+/* Offsets and sizes of the ustar header fields we use */
+#define HDR_NAME       0
+#define HDR_NAME_SZ    100
+#define HDR_MODE       100
+#define HDR_MODE_SZ    8
+#define HDR_UID        108
+#define HDR_GID        116
+#define HDR_ID_SZ      8
+#define HDR_SIZE       124
+#define HDR_SIZE_SZ    12
+#define HDR_MTIME      136
+#define HDR_MTIME_SZ   12
+#define HDR_CHKSUM     148
+#define HDR_CHKSUM_SZ  8
+#define HDR_TYPEFLAG   156
+#define HDR_MAGIC      257
+#define HDR_VERSION    263
+#define HDR_PREFIX     345
+#define HDR_PREFIX_SZ  155
+
+/*----------------------------------------------------------------------------*/
+
+/* Parse a numeric field. They are octal strings, except when the first bit is
+ * set, which is the GNU base-256 extension for big files */
+static uint64_t parse_number(const uint8_t* field, size_t sz) {
+    uint64_t ret = 0;
+
+    if (field[0] & 0x80) {
+        ret = field[0] & 0x7F;
+        for (size_t i = 1; i < sz; i++)
+            ret = (ret << 8) | field[i];
+        return ret;
+    }
+
+    for (size_t i = 0; i < sz; i++) {
+        if (field[i] == ' ')
+            continue;
+        if (field[i] < '0' || field[i] > '7')
+            break;
+
+        ret = (ret << 3) | (field[i] - '0');
+    }
+
+    return ret;
+}
+
+static bool valid_checksum(const uint8_t* hdr) {
+    const uint64_t expected = parse_number(&hdr[HDR_CHKSUM], HDR_CHKSUM_SZ);
+
+    /* The checksum field itself is treated as spaces */
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SZ; i++)
+        if (i >= HDR_CHKSUM && i < HDR_CHKSUM + HDR_CHKSUM_SZ)
+            sum += ' ';
+        else
+            sum += hdr[i];
+
+    return sum == expected;
+}
+
+static bool is_zero_block(const uint8_t* hdr) {
+    for (int i = 0; i < TAR_BLOCK_SZ; i++)
+        if (hdr[i] != 0)
+            return false;
+
+    return true;
+}
+
+/* Read the whole data of the current member into a new NULL-terminated
+ * buffer, and its size into `out_sz'. Used for pax and GNU long name
+ * headers */
+static char* read_member_str(TarReader* tar, size_t* out_sz) {
+    /* Avoid allocating absurd sizes for corrupted headers */
+    if (tar->left > 0x100000)
+        return NULL;
+
+    char* ret = malloc(tar->left + 1);
+    if (!ret)
+        return NULL;
+
+    const uint64_t sz = tar->left;
+    if (!tar_read(tar, ret, sz)) {
+        free(ret);
+        return NULL;
+    }
+
+    ret[sz] = '\0';
+    *out_sz = sz;
+    return ret;
+}
+
+/* Parse the "LEN key=value\n" records of the `data_sz' bytes of a pax header.
+ * We only care about the path and size keys */
+static bool parse_pax(TarReader* tar, const char* data, size_t data_sz) {
+    const char* p        = data;
+    const char* data_end = data + data_sz;
+
+    while (p < data_end) {
+        char* end;
+        const long len = strtol(p, &end, 10);
+        if (len <= 0 || *end != ' ')
+            return false;
+
+        /* The length includes the "LEN " prefix, and can't go past the data */
+        const char* key = end + 1;
+        if ((size_t)len > (size_t)(data_end - p) ||
+            (size_t)len <= (size_t)(key - p))
+            return false;
+
+        const char* record_end = p + len;
+        const char* eq         = memchr(key, '=', record_end - key);
+        if (!eq || record_end[-1] != '\n')
+            return false;
+
+        const char* val    = eq + 1;
+        const size_t val_sz = record_end - 1 - val;
+
+        if ((size_t)(eq - key) == 4 && !strncmp(key, "path", 4)) {
+            free(tar->next_path);
+            tar->next_path = strndup(val, val_sz);
+        } else if ((size_t)(eq - key) == 4 && !strncmp(key, "size", 4)) {
+            tar->next_size = strtoll(val, NULL, 10);
+        }
+
+        p = record_end;
+    }
+
+    return true;
+}
+
+static bool skip_bytes(TarReader* tar, uint64_t sz) {
+    char buf[0x1000];
+
+    while (sz > 0) {
+        const unsigned chunk = sz < sizeof(buf) ? sz : sizeof(buf);
+        if (gzread(tar->gz, buf, chunk) != (int)chunk)
+            return false;
+        sz -= chunk;
+    }
+
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool tar_open(TarReader* tar, const char* filename) {
+    if (!strcmp(filename, "-"))
+        tar->gz = gzdopen(dup(STDIN_FILENO), "rb");
+    else
+        tar->gz = gzopen(filename, "rb");
+
+    if (!tar->gz)
+        return false;
+
+    gzbuffer(tar->gz, GZ_BUFFER_SZ);
+
+    tar->left      = 0;
+    tar->pad       = 0;
+    tar->path      = NULL;
+    tar->next_path = NULL;
+    tar->next_size = -1;
+    return true;
+}
+
+int tar_next(TarReader* tar, TarMember* member) {
+    uint8_t hdr[TAR_BLOCK_SZ];
+
+    for (;;) {
+        /* Skip the unread data of the last member, and its padding */
+        if (!skip_bytes(tar, tar->left + tar->pad))
+            return -1;
+        tar->left = tar->pad = 0;
+
+        const int read = gzread(tar->gz, hdr, TAR_BLOCK_SZ);
+        if (read == 0)
+            return 0;
+        if (read != TAR_BLOCK_SZ)
+            return -1;
+
+        /* The archive ends with two zero blocks, but some writers only add
+         * one. We don't need to read the second one. */
+        if (is_zero_block(hdr))
+            return 0;
+
+        if (!valid_checksum(hdr))
+            return -1;
+
+        const char type = hdr[HDR_TYPEFLAG];
+        uint64_t size   = parse_number(&hdr[HDR_SIZE], HDR_SIZE_SZ);
+        if (tar->next_size >= 0 && type != TAR_PAX_HEADER &&
+            type != TAR_GNU_LONGNAME)
+            size = tar->next_size;
+
+        tar->left = size;
+        tar->pad  = (TAR_BLOCK_SZ - size % TAR_BLOCK_SZ) % TAR_BLOCK_SZ;
+
+        /* Extended headers apply to the next member, not returned */
+        if (type == TAR_PAX_HEADER || type == TAR_GNU_LONGNAME) {
+            size_t data_sz;
+            char* data = read_member_str(tar, &data_sz);
+            if (!data)
+                return -1;
+
+            if (type == TAR_GNU_LONGNAME) {
+                free(tar->next_path);
+                tar->next_path = data;
+                continue;
+            }
+
+            const bool ok = parse_pax(tar, data, data_sz);
+            free(data);
+            if (!ok)
+                return -1;
+            continue;
+        }
+
+        /* Global pax headers are ignored */
+        if (type == TAR_PAX_GLOBAL)
+            continue;
+
+        free(tar->path);
+        if (tar->next_path) {
+            tar->path      = tar->next_path;
+            tar->next_path = NULL;
+        } else {
+            /* Name, with the optional ustar prefix */
+            char name[HDR_PREFIX_SZ + 1 + HDR_NAME_SZ + 1];
+            const bool ustar = !memcmp(&hdr[HDR_MAGIC], "ustar", 5);
+
+            if (ustar && hdr[HDR_PREFIX] != '\0')
+                snprintf(name, sizeof(name), "%.*s/%.*s", HDR_PREFIX_SZ,
+                         (char*)&hdr[HDR_PREFIX], HDR_NAME_SZ,
+                         (char*)&hdr[HDR_NAME]);
+            else
+                snprintf(name, sizeof(name), "%.*s", HDR_NAME_SZ,
+                         (char*)&hdr[HDR_NAME]);
+
+            tar->path = strdup(name);
+        }
+        tar->next_size = -1;
+
+        if (!tar->path)
+            return -1;
+
+        member->path = tar->path;
+        member->size = size;
+        member->type = type;
+        return 1;
+    }
+}
+
+bool tar_read(TarReader* tar, void* buf, uint64_t sz) {
+    if (sz > tar->left)
+        return false;
+
+    char* p = buf;
+    while (sz > 0) {
+        /* gzread() takes an unsigned int */
+        const unsigned chunk = sz < 0x40000000 ? sz : 0x40000000;
+        if (gzread(tar->gz, p, chunk) != (int)chunk)
+            return false;
+
+        p += chunk;
+        sz -= chunk;
+        tar->left -= chunk;
+    }
+
+    return true;
+}
+
+void tar_close(TarReader* tar) {
+    gzclose(tar->gz);
+    free(tar->path);
+    free(tar->next_path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Write a number as a NULL-terminated octal string that fills the field */
+static void write_octal(uint8_t* field, size_t sz, uint64_t num) {
+    field[sz - 1] = '\0';
+    for (size_t i = sz - 1; i > 0; i--) {
+        field[i - 1] = '0' + (num & 7);
+        num >>= 3;
+    }
+}
+
+static bool write_header(TarWriter* tar, const char* name, char type,
+                         uint64_t size) {
+    uint8_t hdr[TAR_BLOCK_SZ] = { 0 };
+
+    strncpy((char*)&hdr[HDR_NAME], name, HDR_NAME_SZ);
+    write_octal(&hdr[HDR_MODE], HDR_MODE_SZ, 0644);
+    write_octal(&hdr[HDR_UID], HDR_ID_SZ, 0);
+    write_octal(&hdr[HDR_GID], HDR_ID_SZ, 0);
+    write_octal(&hdr[HDR_MTIME], HDR_MTIME_SZ, tar->mtime);
+
+    /* Octal only fits 8 GiB, use the GNU base-256 extension after that */
+    if (size < 077777777777ULL) {
+        write_octal(&hdr[HDR_SIZE], HDR_SIZE_SZ, size);
+    } else {
+        hdr[HDR_SIZE] = 0x80;
+        for (int i = HDR_SIZE_SZ - 1; i > 0; i--, size >>= 8)
+            hdr[HDR_SIZE + i] = size & 0xFF;
+    }
+
+    hdr[HDR_TYPEFLAG] = type;
+    memcpy(&hdr[HDR_MAGIC], "ustar", 6);
+    memcpy(&hdr[HDR_VERSION], "00", 2);
+
+    /* The checksum is calculated with the field filled with spaces, and it's
+     * stored as 6 octal digits, a NULL and a space */
+    memset(&hdr[HDR_CHKSUM], ' ', HDR_CHKSUM_SZ);
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SZ; i++)
+        sum += hdr[i];
+    write_octal(&hdr[HDR_CHKSUM], HDR_CHKSUM_SZ - 1, sum);
+
+    return fwrite(hdr, TAR_BLOCK_SZ, 1, tar->fd) == 1;
+}
+
+static bool write_data(TarWriter* tar, const void* data, size_t size) {
+    static const uint8_t zeros[TAR_BLOCK_SZ] = { 0 };
+    const size_t pad = (TAR_BLOCK_SZ - size % TAR_BLOCK_SZ) % TAR_BLOCK_SZ;
+
+    if (size > 0 && fwrite(data, size, 1, tar->fd) != 1)
+        return false;
+
+    return pad == 0 || fwrite(zeros, pad, 1, tar->fd) == 1;
+}
+
+bool tar_writer_open(TarWriter* tar, const char* filename) {
+    if (!strcmp(filename, "-"))
+        tar->fd = stdout;
+    else
+        tar->fd = fopen(filename, "wb");
+
+    if (!tar->fd)
+        return false;
+
+    tar->mtime = time(NULL);
+    return true;
+}
+
+bool tar_write_member(TarWriter* tar, const char* path, const void* data,
+                      size_t size) {
+    /* Paths that don't fit in the ustar name field are stored in a pax header
+     * before the member, and truncated in the ustar header itself */
+    const size_t path_len = strlen(path);
+    if (path_len > HDR_NAME_SZ) {
+        char record[0x1000];
+
+        /* The length of the record includes the digits of the length */
+        const int base_len = strlen(" path=\n") + path_len;
+        int len, digits = 1;
+        while (snprintf(NULL, 0, "%d", base_len + digits) != digits)
+            digits++;
+        len = base_len + digits;
+
+        if (len >= (int)sizeof(record))
+            return false;
+        snprintf(record, sizeof(record), "%d path=%s\n", len, path);
+
+        if (!write_header(tar, "././@PaxHeader", TAR_PAX_HEADER, len) ||
+            !write_data(tar, record, len))
+            return false;
+    }
+
+    return write_header(tar, path, TAR_REGULAR, size) &&
+           write_data(tar, data, size);
+}
+
+bool tar_writer_close(TarWriter* tar) {
+    static const uint8_t zeros[TAR_BLOCK_SZ * 2] = { 0 };
+
+    bool ret = fwrite(zeros, sizeof(zeros), 1, tar->fd) == 1;
+    if (tar->fd == stdout)
+        ret = fflush(tar->fd) == 0 && ret;
+    else
+        ret = fclose(tar->fd) == 0 && ret;
+
+    return ret;
+}
@@ -0,0 +1,243 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "include/thumbnail.h"
+#include "include/render.h"
+#include "include/tokens.h"
+
+/* Channels of each pixel in Thumbnail.sums */
+#define CHANNELS 4
+
+/*----------------------------------------------------------------------------*/
+
+bool thumbnail_parse_size(const char* str, uint32_t* w, uint32_t* h) {
+    char* end;
+    const unsigned long pw = strtoul(str, &end, 10);
+    if (end == str || *end != 'x')
+        return false;
+
+    const char* hstr       = end + 1;
+    const unsigned long ph = strtoul(hstr, &end, 10);
+    if (end == hstr || *end != '\0' || (pw == 0 && ph == 0) ||
+        pw > UINT32_MAX || ph > UINT32_MAX)
+        return false;
+
+    *w = pw;
+    *h = ph;
+    return true;
+}
+
+/* Add the color to the rectangle [x0, x1) by [y0, y1) of the canvas, weighted
+ * by the area of each pixel of the thumbnail that it overlaps. Only the
+ * allocated rows are drawn. */
+static void add_rect(Thumbnail* thumb, uint32_t x0, uint32_t y0, uint32_t x1,
+                     uint32_t y1, const float* col) {
+    const double u0 = x0 * thumb->scale_x, u1 = x1 * thumb->scale_x;
+    const double v0 = y0 * thumb->scale_y, v1 = y1 * thumb->scale_y;
+
+    uint32_t ty = v0;
+    if (ty < thumb->rows_start)
+        ty = thumb->rows_start;
+
+    for (; ty < thumb->rows_end && ty < v1; ty++) {
+        const double wy  = fmin(v1, ty + 1) - fmax(v0, ty);
+        const size_t row = (size_t)(ty - thumb->rows_start) * thumb->w;
+
+        for (uint32_t tx = u0; tx < thumb->w && tx < u1; tx++) {
+            const double weight = wy * (fmin(u1, tx + 1) - fmax(u0, tx));
+
+            float* sum = &thumb->sums[(row + tx) * CHANNELS];
+            for (int i = 0; i < CHANNELS; i++)
+                sum[i] += col[i] * weight;
+        }
+    }
+}
+
+static void color_to_floats(Color c, float* out) {
+    out[0] = c.r;
+    out[1] = c.g;
+    out[2] = c.b;
+    out[3] = c.a;
+}
+
+void thumbnail_init(Thumbnail* thumb, uint32_t w, uint32_t h, double scale_x,
+                    double scale_y) {
+    thumb->w          = w;
+    thumb->h          = h;
+    thumb->scale_x    = scale_x;
+    thumb->scale_y    = scale_y;
+    thumb->rows_start = 0;
+    thumb->rows_end   = 0;
+    thumb->sums       = NULL;
+}
+
+bool thumbnail_from_tokens(Thumbnail* thumb, const TokenStream* ts,
+                           const Color* palette, uint32_t max_w,
+                           uint32_t max_h) {
+    Canvas canvas;
+    canvas_init(&canvas);
+    tokens_get_dimensions(ts, &canvas);
+
+    /* Fit inside the box, without making it bigger */
+    double scale = 1.0;
+    if (max_w != 0)
+        scale = fmin(scale, (double)max_w / canvas.w_px);
+    if (max_h != 0)
+        scale = fmin(scale, (double)max_h / canvas.h_px);
+
+    const uint32_t w = fmax(1.0, round(canvas.w_px * scale));
+    const uint32_t h = fmax(1.0, round(canvas.h_px * scale));
+
+    /* The exact scale of each axis, so the canvas covers the whole
+     * thumbnail */
+    thumbnail_init(thumb, w, h, (double)w / canvas.w_px,
+                   (double)h / canvas.h_px);
+
+    if (!thumbnail_draw_band(thumb, ts, NULL, palette, 0, h)) {
+        thumbnail_free(thumb);
+        return false;
+    }
+
+    return true;
+}
+
+bool thumbnail_draw_band(Thumbnail* thumb, const TokenStream* ts,
+                         const uint64_t* offsets, const Color* palette,
+                         uint32_t rows_start, uint32_t rows_end) {
+    Canvas canvas;
+    canvas_init(&canvas);
+    tokens_get_dimensions(ts, &canvas);
+
+    const size_t num_px = (size_t)thumb->w * (rows_end - rows_start);
+    free(thumb->sums);
+    thumb->sums       = malloc(num_px * CHANNELS * sizeof(float));
+    thumb->rows_start = rows_start;
+    thumb->rows_end   = rows_end;
+    if (!thumb->sums)
+        DIE("Can't allocate %dx%d thumbnail\n", thumb->w,
+            rows_end - rows_start);
+
+    /* Everything is the background, the rest is added as the difference */
+    float back[CHANNELS];
+    color_to_floats(palette[COL_BACK], back);
+    for (size_t i = 0; i < num_px; i++)
+        memcpy(&thumb->sums[i * CHANNELS], back, sizeof(back));
+
+    /* Same rectangles as draw_border(), without overlapping */
+    const uint32_t wp = canvas.w_px, hp = canvas.h_px;
+    float border[CHANNELS];
+    color_to_floats(palette[COL_BORDER], border);
+    for (int i = 0; i < CHANNELS; i++)
+        border[i] -= back[i];
+
+    add_rect(thumb, 0, 0, wp, BORDER_SZ, border);
+    add_rect(thumb, 0, hp - BORDER_SZ, wp, hp, border);
+    add_rect(thumb, 0, BORDER_SZ, BORDER_SZ, hp - BORDER_SZ, border);
+    add_rect(thumb, wp - BORDER_SZ, BORDER_SZ, wp, hp - BORDER_SZ, border);
+
+    /* Only the lines that overlap the band, or all of them */
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+
+    uint32_t first_line = 0, end_line = ts->header->num_lines;
+    if (offsets) {
+        const uint32_t line_h = FONT_H + LINE_SPACING;
+        const uint32_t y0     = rows_start / thumb->scale_y;
+        const uint32_t y1     = ceil(rows_end / thumb->scale_y);
+
+        first_line = (y0 > MARGIN) ? (y0 - MARGIN) / line_h : 0;
+        if (y1 <= MARGIN)
+            end_line = 0;
+        else if ((y1 - MARGIN) / line_h + 1 < end_line)
+            end_line = (y1 - MARGIN) / line_h + 1;
+        if (first_line > end_line)
+            first_line = end_line;
+
+        reader.p   = ts->data + offsets[first_line];
+        reader.end = ts->data + offsets[end_line];
+    }
+
+    /* Fraction of each glyph drawn with the foreground */
+    float coverage[256];
+    for (int c = 0; c < 256; c++)
+        coverage[c] = (float)glyph_pixels(c) / (FONT_W * FONT_H);
+
+    uint32_t x = 0, y = first_line;
+    TokenSpan span;
+    while (tokens_read(&reader, &span)) {
+        if (!span.chars) {
+            y++;
+            x = 0;
+            continue;
+        }
+
+        if (y >= canvas.h || x + span.width > canvas.w)
+            return false;
+
+        float fg[CHANNELS], bg[CHANNELS];
+        color_to_floats(palette[span.fg], fg);
+        color_to_floats(palette[span.bg], bg);
+
+        for (size_t i = 0; i < span.len; i++) {
+            /* Tabs are drawn as TAB_SZ spaces, see png_putchar() */
+            const uint8_t c     = (span.chars[i] == '\t') ? ' ' : span.chars[i];
+            const int num_cells = (span.chars[i] == '\t') ? TAB_SZ : 1;
+
+            /* Average color of the glyph, minus the background */
+            float delta[CHANNELS];
+            bool empty = true;
+            for (int j = 0; j < CHANNELS; j++) {
+                delta[j] = bg[j] + (fg[j] - bg[j]) * coverage[c] - back[j];
+                empty &= (delta[j] == 0);
+            }
+
+            if (!empty)
+                add_rect(thumb, CHAR_X_TO_PX(x), CHAR_Y_TO_PX(y),
+                         CHAR_X_TO_PX(x + num_cells), CHAR_Y_TO_PX(y) + FONT_H,
+                         delta);
+            x += num_cells;
+        }
+    }
+
+    return !reader.error && y == end_line;
+}
+
+void thumbnail_get_pixels(const Thumbnail* thumb, uint8_t* pixels) {
+    const size_t num_px =
+      (size_t)thumb->w * (thumb->rows_end - thumb->rows_start);
+
+    for (size_t i = 0; i < num_px * CHANNELS; i++) {
+        const float val = roundf(thumb->sums[i]);
+        pixels[i]       = val < 0 ? 0 : val > 255 ? 255 : val;
+    }
+}
+
+void thumbnail_write_png(const Thumbnail* thumb, const char* filename) {
+    const size_t row_sz = (size_t)thumb->w * COL_SZ;
+
+    /* Only the size and the rows are used by write_png_file() */
+    Canvas canvas;
+    canvas_init(&canvas);
+    canvas.w_px   = thumb->w;
+    canvas.h_px   = thumb->h;
+    canvas.rows   = malloc(thumb->h * sizeof(png_bytep));
+    canvas.pixels = malloc(thumb->h * row_sz);
+    if (!canvas.rows || !canvas.pixels)
+        DIE("Can't allocate %dx%d thumbnail\n", thumb->w, thumb->h);
+
+    thumbnail_get_pixels(thumb, canvas.pixels);
+    for (uint32_t y = 0; y < thumb->h; y++)
+        canvas.rows[y] = canvas.pixels + y * row_sz;
+
+    write_png_file(&canvas, filename);
+    canvas_free(&canvas);
+}
+
+void thumbnail_free(Thumbnail* thumb) {
+    free(thumb->sums);
+    thumb->sums = NULL;
+}
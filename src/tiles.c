@@ -0,0 +1,501 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "include/tiles.h"
+#include "include/render.h"
+#include "include/tokens.h"
+#include "include/thumbnail.h"
+#include "include/hash.h"
+#include "include/util.h"
+
+#define DZI_EXT ".dzi"
+
+/* Added to the name of the .dzi file for the directory of the tiles */
+#define FILES_SUFFIX "_files"
+
+/* Keys of the tiles of a level, by row */
+typedef struct {
+    uint32_t cols, rows;
+    uint64_t* keys;
+} TileLevel;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_levels;
+} ManifestHeader;
+
+/* Shared by the threads of tiles_write_dzi() */
+typedef struct {
+    const TokenStream* ts;
+    const Color* palette;
+    const uint64_t* offsets;
+    uint64_t config;
+    const char* dir;
+
+    /* Size of the full image, in px and chars */
+    Canvas canvas;
+    int max_level;
+
+    /* Keys of this run, filled by the threads, and of the last one */
+    TileLevel* levels;
+    TileLevel* old_levels;
+    uint32_t num_old_levels;
+
+    /* Rows of tiles of all the levels, from the biggest level */
+    uint32_t num_jobs;
+    int* job_levels;
+    uint32_t* job_rows;
+    atomic_uint next_job;
+
+    atomic_uint drawn;
+    atomic_bool error;
+} TilesContext;
+
+/*----------------------------------------------------------------------------*/
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+/* Size of the image `shift' levels below the full one, rounded up */
+static uint32_t level_size(uint32_t full, int shift) {
+    return ((uint64_t)full + (1ull << shift) - 1) >> shift;
+}
+
+static char* tile_path(const TilesContext* ctx, int level, uint32_t col,
+                       uint32_t row) {
+    const size_t sz = strlen(ctx->dir) + 64;
+    char* ret       = malloc(sz);
+    if (!ret)
+        DIE("Can't allocate the path of a tile\n");
+
+    snprintf(ret, sz, "%s/%d/%u_%u.png", ctx->dir, level, col, row);
+    return ret;
+}
+
+/* Encode the pixels of the tile, where `rows' point to its first column */
+static void write_tile(const char* path, png_bytep* rows, uint32_t w,
+                       uint32_t h) {
+    /* Only the size and the rows are used by write_png_file() */
+    Canvas tile;
+    canvas_init(&tile);
+    tile.w_px = w;
+    tile.h_px = h;
+    tile.rows = rows;
+
+    write_png_file(&tile, path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Draw the lines [first_line, end_line) at the top of a smaller canvas, which
+ * has the same rows as the full canvas for those lines, and for the margins
+ * before the first line and after the last one of the image */
+static bool draw_lines(const TilesContext* ctx, uint32_t first_line,
+                       uint32_t end_line, Canvas* lines) {
+    const uint32_t num_lines = ctx->ts->header->num_lines;
+
+    canvas_init(lines);
+    lines->palette = ctx->palette;
+    lines->w       = ctx->canvas.w;
+    lines->h       = end_line - first_line;
+    canvas_update_px_size(lines);
+    canvas_alloc(lines);
+
+    /* The lines after the last one are empty */
+    if (!tokens_lines_to_png(ctx->ts, ctx->offsets,
+                             min_u32(first_line, num_lines),
+                             min_u32(end_line, num_lines), lines)) {
+        canvas_free(lines);
+        return false;
+    }
+
+    draw_border(lines);
+    return true;
+}
+
+static bool draw_tile_row(TilesContext* ctx, int level, uint32_t row) {
+    const int shift      = ctx->max_level - level;
+    const uint32_t lw    = level_size(ctx->canvas.w_px, shift);
+    const uint32_t lh    = level_size(ctx->canvas.h_px, shift);
+    const uint32_t ty0   = row * TILE_SZ;
+    const uint32_t ty1   = (lh - ty0 > TILE_SZ) ? ty0 + TILE_SZ : lh;
+    const uint32_t line  = FONT_H + LINE_SPACING;
+    const TileLevel* old = (uint32_t)level < ctx->num_old_levels
+                             ? &ctx->old_levels[level]
+                             : NULL;
+    TileLevel* tiles     = &ctx->levels[level];
+    uint64_t* keys       = &tiles->keys[(size_t)row * tiles->cols];
+
+    /* Rows of the full image, and the lines that overlap them */
+    const uint64_t y0 = (uint64_t)ty0 << shift;
+    uint64_t y1       = (uint64_t)ty1 << shift;
+    if (y1 > ctx->canvas.h_px)
+        y1 = ctx->canvas.h_px;
+
+    uint32_t first_line = (y0 > MARGIN) ? (y0 - MARGIN) / line : 0;
+    uint32_t end_line   = (y1 > MARGIN) ? (y1 - MARGIN + line - 1) / line : 0;
+    if (end_line > ctx->canvas.h)
+        end_line = ctx->canvas.h;
+    if (first_line > end_line)
+        first_line = end_line;
+
+    /* Hash of the tokens of the lines that are not empty */
+    const uint32_t num_lines = ctx->ts->header->num_lines;
+    const uint64_t start     = ctx->offsets[min_u32(first_line, num_lines)];
+    const uint64_t end       = ctx->offsets[min_u32(end_line, num_lines)];
+    const uint64_t lines_hash =
+      hash64(ctx->ts->data + start, end - start, ctx->config);
+
+    /* Tiles whose key changed, or whose file is missing */
+    bool* stale = malloc(tiles->cols * sizeof(bool));
+    if (!stale)
+        DIE("Can't allocate a row of %d tiles\n", tiles->cols);
+
+    bool changed = false;
+    for (uint32_t col = 0; col < tiles->cols; col++) {
+        const uint64_t key_data[] = {
+            lines_hash, level, shift, col, row, y1, first_line,
+            ctx->canvas.w_px,
+        };
+        keys[col] = hash64(key_data, sizeof(key_data), ctx->config) | 1;
+
+        stale[col] = !old || col >= old->cols || row >= old->rows ||
+                     old->keys[(size_t)row * old->cols + col] != keys[col];
+        if (!stale[col]) {
+            char* path = tile_path(ctx, level, col, row);
+            stale[col] = access(path, F_OK) != 0;
+            free(path);
+        }
+
+        changed |= stale[col];
+    }
+
+    if (!changed) {
+        free(stale);
+        return true;
+    }
+
+    /* Draw the rows of the tiles, from the lines of the canvas or as a band
+     * of a thumbnail */
+    Canvas lines;
+    uint8_t* pixels = NULL;
+    png_bytep band_rows[TILE_SZ];
+    if (shift == 0) {
+        if (!draw_lines(ctx, first_line, end_line, &lines)) {
+            free(stale);
+            return false;
+        }
+
+        /* Row of the smaller canvas at the first row of the tiles */
+        const uint32_t origin = y0 - (CHAR_Y_TO_PX(first_line) - MARGIN);
+        for (uint32_t y = 0; y < ty1 - ty0; y++)
+            band_rows[y] = lines.rows[origin + y];
+    } else {
+        const double scale = 1.0 / (1ull << shift);
+
+        Thumbnail thumb;
+        thumbnail_init(&thumb, lw, lh, scale, scale);
+        if (!thumbnail_draw_band(&thumb, ctx->ts, ctx->offsets, ctx->palette,
+                                 ty0, ty1)) {
+            thumbnail_free(&thumb);
+            free(stale);
+            return false;
+        }
+
+        const size_t row_sz = (size_t)lw * COL_SZ;
+        pixels              = malloc((ty1 - ty0) * row_sz);
+        if (!pixels)
+            DIE("Can't allocate %dx%d row of tiles\n", lw, ty1 - ty0);
+
+        thumbnail_get_pixels(&thumb, pixels);
+        thumbnail_free(&thumb);
+
+        for (uint32_t y = 0; y < ty1 - ty0; y++)
+            band_rows[y] = pixels + y * row_sz;
+    }
+
+    for (uint32_t col = 0; col < tiles->cols; col++) {
+        if (!stale[col])
+            continue;
+
+        const uint32_t tx0 = col * TILE_SZ;
+        const uint32_t tx1 = (lw - tx0 > TILE_SZ) ? tx0 + TILE_SZ : lw;
+
+        png_bytep rows[TILE_SZ];
+        for (uint32_t y = 0; y < ty1 - ty0; y++)
+            rows[y] = band_rows[y] + tx0 * COL_SZ;
+
+        char* path = tile_path(ctx, level, col, row);
+        write_tile(path, rows, tx1 - tx0, ty1 - ty0);
+        free(path);
+
+        atomic_fetch_add(&ctx->drawn, 1);
+    }
+
+    if (shift == 0)
+        canvas_free(&lines);
+    free(pixels);
+    free(stale);
+    return true;
+}
+
+static void* tiles_thread(void* arg) {
+    TilesContext* ctx = arg;
+
+    for (;;) {
+        const uint32_t job = atomic_fetch_add(&ctx->next_job, 1);
+        if (job >= ctx->num_jobs || atomic_load(&ctx->error))
+            break;
+
+        if (!draw_tile_row(ctx, ctx->job_levels[job], ctx->job_rows[job]))
+            atomic_store(&ctx->error, true);
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void free_levels(TileLevel* levels, uint32_t num_levels) {
+    if (!levels)
+        return;
+
+    for (uint32_t i = 0; i < num_levels; i++)
+        free(levels[i].keys);
+    free(levels);
+}
+
+/* Read the keys of the last run. Returns NULL if there are none. */
+static TileLevel* load_manifest(const char* path, uint32_t* num_levels) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+
+    ManifestHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, TILES_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TILES_VERSION || hdr.num_levels > 64) {
+        fclose(fp);
+        return NULL;
+    }
+
+    TileLevel* levels = calloc(hdr.num_levels, sizeof(TileLevel));
+    if (!levels)
+        DIE("Can't allocate the keys of %d levels\n", hdr.num_levels);
+
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < hdr.num_levels; i++) {
+        TileLevel* level = &levels[i];
+
+        ok = fread(&level->cols, sizeof(uint32_t), 1, fp) == 1 &&
+             fread(&level->rows, sizeof(uint32_t), 1, fp) == 1 &&
+             (uint64_t)level->cols * level->rows <= UINT32_MAX;
+        if (!ok)
+            break;
+
+        const size_t num_keys = (size_t)level->cols * level->rows;
+        level->keys           = malloc(num_keys * sizeof(uint64_t) + 1);
+
+        ok = level->keys &&
+             fread(level->keys, sizeof(uint64_t), num_keys, fp) == num_keys;
+    }
+    fclose(fp);
+
+    if (!ok) {
+        free_levels(levels, hdr.num_levels);
+        return NULL;
+    }
+
+    *num_levels = hdr.num_levels;
+    return levels;
+}
+
+/* Write the keys to a temporary file, renamed when it's complete */
+static bool save_manifest(const char* path, const TileLevel* levels,
+                          uint32_t num_levels) {
+    ManifestHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TILES_MAGIC, sizeof(hdr.magic));
+    hdr.version    = TILES_VERSION;
+    hdr.num_levels = num_levels;
+
+    char* tmp = path_join("", path, ".tmp");
+    if (!tmp)
+        return false;
+
+    FILE* fp = fopen(tmp, "wb");
+    bool ret = fp && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (uint32_t i = 0; ret && i < num_levels; i++) {
+        const TileLevel* level = &levels[i];
+        const size_t num_keys  = (size_t)level->cols * level->rows;
+
+        ret = fwrite(&level->cols, sizeof(uint32_t), 1, fp) == 1 &&
+              fwrite(&level->rows, sizeof(uint32_t), 1, fp) == 1 &&
+              fwrite(level->keys, sizeof(uint64_t), num_keys, fp) == num_keys;
+    }
+    if (fp && fclose(fp) != 0)
+        ret = false;
+
+    if (ret)
+        ret = rename(tmp, path) == 0;
+    if (!ret)
+        unlink(tmp);
+
+    free(tmp);
+    return ret;
+}
+
+static bool write_descriptor(const char* filename, uint32_t w, uint32_t h) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp,
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+            "       Format=\"png\" Overlap=\"0\" TileSize=\"%d\">\n"
+            "  <Size Width=\"%u\" Height=\"%u\"/>\n"
+            "</Image>\n",
+            TILE_SZ, w, h);
+
+    return fclose(fp) == 0;
+}
+
+/* Directory of the tiles, the name of the .dzi file without its extension */
+static char* files_dir(const char* filename) {
+    size_t len           = strlen(filename);
+    const size_t ext_len = strlen(DZI_EXT);
+    if (len > ext_len && strcmp(filename + len - ext_len, DZI_EXT) == 0)
+        len -= ext_len;
+
+    const size_t sz = len + strlen(FILES_SUFFIX) + 1;
+    char* ret       = malloc(sz);
+    if (!ret)
+        DIE("Can't allocate the directory of the tiles\n");
+
+    snprintf(ret, sz, "%.*s%s", (int)len, filename, FILES_SUFFIX);
+    return ret;
+}
+
+bool tiles_write_dzi(const TokenStream* ts, const Color* palette,
+                     const char* filename, int jobs, TilesStats* stats) {
+    TilesContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ts      = ts;
+    ctx.palette = palette;
+    ctx.config  = render_config_hash(palette);
+    ctx.offsets = tokens_line_offsets(ts);
+    if (!ctx.offsets)
+        return false;
+
+    canvas_init(&ctx.canvas);
+    tokens_get_dimensions(ts, &ctx.canvas);
+
+    /* The last level is the first one that is as big as the image */
+    const uint32_t w = ctx.canvas.w_px, h = ctx.canvas.h_px;
+    while ((1ull << ctx.max_level) < w || (1ull << ctx.max_level) < h)
+        ctx.max_level++;
+
+    const int num_levels = ctx.max_level + 1;
+    ctx.levels           = calloc(num_levels, sizeof(TileLevel));
+    if (!ctx.levels)
+        DIE("Can't allocate the keys of %d levels\n", num_levels);
+
+    stats->w      = w;
+    stats->h      = h;
+    stats->levels = num_levels;
+    stats->tiles  = 0;
+    for (int i = 0; i < num_levels; i++) {
+        const int shift  = ctx.max_level - i;
+        TileLevel* level = &ctx.levels[i];
+
+        level->cols = (level_size(w, shift) + TILE_SZ - 1) / TILE_SZ;
+        level->rows = (level_size(h, shift) + TILE_SZ - 1) / TILE_SZ;
+        level->keys =
+          malloc((size_t)level->cols * level->rows * sizeof(uint64_t));
+        if (!level->keys)
+            DIE("Can't allocate the keys of level %d\n", i);
+
+        ctx.num_jobs += level->rows;
+        stats->tiles += level->cols * level->rows;
+    }
+
+    /* The biggest levels first, since they take longer */
+    ctx.job_levels = malloc(ctx.num_jobs * sizeof(int));
+    ctx.job_rows   = malloc(ctx.num_jobs * sizeof(uint32_t));
+    if (!ctx.job_levels || !ctx.job_rows)
+        DIE("Can't allocate %d rows of tiles\n", ctx.num_jobs);
+
+    uint32_t job = 0;
+    for (int i = num_levels - 1; i >= 0; i--) {
+        for (uint32_t row = 0; row < ctx.levels[i].rows; row++) {
+            ctx.job_levels[job] = i;
+            ctx.job_rows[job]   = row;
+            job++;
+        }
+    }
+
+    char* dir = files_dir(filename);
+    ctx.dir   = dir;
+    for (int i = 0; i < num_levels; i++) {
+        char level_dir[32];
+        snprintf(level_dir, sizeof(level_dir), "%d/", i);
+
+        char* path = path_join(dir, level_dir, "");
+        if (!path || !mkdir_parents(path))
+            DIE("Can't create directory: \"%s\"\n", path);
+        free(path);
+    }
+
+    char* manifest = path_join(dir, TILES_MANIFEST, "");
+    if (!manifest)
+        DIE("Can't allocate the path of the manifest\n");
+    ctx.old_levels = load_manifest(manifest, &ctx.num_old_levels);
+
+    atomic_init(&ctx.next_job, 0);
+    atomic_init(&ctx.drawn, 0);
+    atomic_init(&ctx.error, false);
+
+    if ((uint32_t)jobs > ctx.num_jobs)
+        jobs = ctx.num_jobs;
+
+    pthread_t* threads = malloc(jobs * sizeof(pthread_t));
+    if (!threads)
+        DIE("Can't allocate %d threads\n", jobs);
+
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&threads[i], NULL, tiles_thread, &ctx) != 0)
+            DIE("Can't create tile thread\n");
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    const bool ret = !atomic_load(&ctx.error);
+    stats->drawn   = atomic_load(&ctx.drawn);
+
+    /* Without the manifest, everything is drawn again in the next run */
+    if (ret) {
+        if (!write_descriptor(filename, w, h))
+            DIE("Can't write file: \"%s\"\n", filename);
+        if (!save_manifest(manifest, ctx.levels, num_levels))
+            unlink(manifest);
+    }
+
+    free(threads);
+    free(manifest);
+    free(dir);
+    free(ctx.job_levels);
+    free(ctx.job_rows);
+    free_levels(ctx.levels, num_levels);
+    free_levels(ctx.old_levels, ctx.num_old_levels);
+    free((uint64_t*)ctx.offsets);
+    return ret;
+}
@@ -0,0 +1,391 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/tokens.h"
+#include "include/render.h"
+#include "include/highlight.h"
+#include "include/bandenc.h" /* ByteBuf */
+#include "include/arena.h"
+
+/* Palette class of the text before the first escape of each line, see
+ * png_print() */
+#define DEFAULT_CLASS (COL_DEFAULT | COL_BACK << 4)
+
+/* Foreground of a span with a class byte after the varint, see TokensHeader */
+#define FG_ESCAPE 0xF
+
+/*----------------------------------------------------------------------------*/
+
+static void append_varint(ByteBuf* buf, uint64_t val) {
+    uint8_t bytes[10];
+    int len = 0;
+
+    do {
+        bytes[len] = val & 0x7F;
+        val >>= 7;
+        if (val != 0)
+            bytes[len] |= 0x80;
+        len++;
+    } while (val != 0);
+
+    byte_buf_append(buf, bytes, len);
+}
+
+static void append_span(ByteBuf* buf, uint8_t class, const char* chars,
+                        size_t len) {
+    if (len == 0)
+        return;
+
+    /* The highlighter only changes the foreground */
+    if ((class >> 4) == COL_BACK) {
+        append_varint(buf, (uint64_t)len << 4 | (class & 0xF));
+    } else {
+        append_varint(buf, (uint64_t)len << 4 | FG_ESCAPE);
+        byte_buf_append(buf, &class, 1);
+    }
+
+    byte_buf_append(buf, chars, len);
+}
+
+/* Append the spans of a line returned by highlight_line(). The chars are
+ * joined in `span' until the class changes. Stops at the same chars as
+ * png_print(). */
+static void append_hl_line(ByteBuf* buf, const char* s, char* span) {
+    uint8_t class  = DEFAULT_CLASS;
+    size_t span_sz = 0;
+
+    while (*s != '\0' && *s != EOF) {
+        if (*s == ESCAPE_CHAR && s[1] == ESCAPE_CHAR) {
+            /* A doubled escape is a char of the source */
+            span[span_sz++] = *s;
+            s += 2;
+            continue;
+        }
+
+        if (*s == ESCAPE_CHAR) {
+            /* Escape, foreground, background and NULL terminator */
+            const uint8_t next = (uint8_t)s[1] | (uint8_t)s[2] << 4;
+            s += 4;
+
+            if (next != class) {
+                append_span(buf, class, span, span_sz);
+                class   = next;
+                span_sz = 0;
+            }
+            continue;
+        }
+
+        span[span_sz++] = *s++;
+    }
+
+    append_span(buf, class, span, span_sz);
+
+    /* Line break */
+    append_varint(buf, 0);
+}
+
+void tokens_highlight(TokenStream* ts, const char* src, size_t src_sz) {
+    Canvas canvas;
+    canvas_init(&canvas);
+    input_get_dimensions(&canvas, src, src_sz);
+
+    /* The buffers are freed at the end by rewinding the arena */
+    Arena* arena         = arena_thread();
+    const ArenaMark mark = arena_mark(arena);
+
+    /* A line has at most `w' chars, since tabs are wider */
+    char* line_buf = arena_alloc(arena, canvas.w + 1);
+    char* span     = arena_alloc(arena, canvas.w + 1);
+    char* hl_line  = highlight_alloc_line();
+
+    /* The header is filled at the end. The data is roughly the size of the
+     * source, plus a byte for each span. */
+    ByteBuf data = { 0 };
+    TokensHeader header;
+    memset(&header, 0, sizeof(header));
+    byte_buf_append(&data, &header, sizeof(header));
+    highlight_set_state(HL_DEFAULT);
+
+    uint32_t num_lines = 0;
+    size_t line_start  = 0;
+    for (size_t i = 0; i < src_sz; i++) {
+        if (src[i] != '\n')
+            continue;
+
+        /* Same as source_lines_to_png(), the line needs a NULL terminator */
+        const size_t len = i - line_start;
+        memcpy(line_buf, src + line_start, len);
+        line_buf[len] = '\0';
+
+        hl_line = highlight_line(line_buf, hl_line, len);
+        hl_line = add_char_to_hl(hl_line, '\0');
+        append_hl_line(&data, hl_line, span);
+
+        num_lines++;
+        line_start = i + 1;
+    }
+
+    arena_rewind(arena, mark);
+
+    memcpy(header.magic, TOKENS_MAGIC, sizeof(header.magic));
+    header.version   = TOKENS_VERSION;
+    header.w         = canvas.w;
+    header.h         = canvas.h;
+    header.num_lines = num_lines;
+    header.data_sz   = data.size - sizeof(header);
+    memcpy(data.data, &header, sizeof(header));
+
+    ts->header = (const TokensHeader*)data.data;
+    ts->data   = data.data + sizeof(header);
+    ts->buf    = data.data;
+    ts->map    = NULL;
+    ts->map_sz = 0;
+}
+
+bool tokens_save(const TokenStream* ts, const char* filename) {
+    const size_t size = sizeof(TokensHeader) + ts->header->data_sz;
+
+    FILE* fp = fopen(filename, "wb");
+    bool ret = fp && fwrite(ts->header, size, 1, fp) == 1;
+    if (fp && fclose(fp) != 0)
+        ret = false;
+
+    return ret;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool tokens_open(TokenStream* ts, const char* filename) {
+    memset(ts, 0, sizeof(TokenStream));
+
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TokensHeader)) {
+        close(fd);
+        return false;
+    }
+
+    /* The mapping stays valid after closing the file */
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const TokensHeader* header = map;
+    if (memcmp(header->magic, TOKENS_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TOKENS_VERSION ||
+        header->data_sz > st.st_size - sizeof(TokensHeader)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    ts->header = header;
+    ts->data   = (const uint8_t*)map + sizeof(TokensHeader);
+    ts->map    = map;
+    ts->map_sz = st.st_size;
+    return true;
+}
+
+void tokens_get_dimensions(const TokenStream* ts, Canvas* canvas) {
+    canvas->w = ts->header->w;
+    canvas->h = ts->header->h;
+    canvas_update_px_size(canvas);
+}
+
+static bool read_varint(const uint8_t** p, const uint8_t* end,
+                        uint64_t* val) {
+    *val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end)
+            return false;
+
+        const uint8_t byte = *(*p)++;
+        *val |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+/* Number of chars of the span in the canvas, with the tabs expanded like
+ * png_putchar(). Returns false if there is a newline, which would be drawn as
+ * a line break. */
+static bool span_width(const uint8_t* chars, size_t len, uint64_t* width) {
+    uint64_t ret = len;
+    for (size_t i = 0; i < len; i++) {
+        if (chars[i] == '\n')
+            return false;
+        if (chars[i] == '\t')
+            ret += TAB_SZ - 1;
+    }
+
+    *width = ret;
+    return true;
+}
+
+void tokens_reader_init(TokenReader* reader, const TokenStream* ts) {
+    reader->p     = ts->data;
+    reader->end   = ts->data + ts->header->data_sz;
+    reader->error = false;
+}
+
+bool tokens_read(TokenReader* reader, TokenSpan* span) {
+    if (reader->p >= reader->end)
+        return false;
+
+    uint64_t val;
+    if (!read_varint(&reader->p, reader->end, &val)) {
+        reader->error = true;
+        return false;
+    }
+
+    if (val == 0) {
+        span->chars = NULL;
+        span->len   = 0;
+        span->width = 0;
+        return true;
+    }
+
+    uint8_t fg = val & 0xF, bg = COL_BACK;
+    if (fg == FG_ESCAPE) {
+        if (reader->p >= reader->end) {
+            reader->error = true;
+            return false;
+        }
+
+        fg = *reader->p & 0xF;
+        bg = *reader->p >> 4;
+        reader->p++;
+    }
+
+    /* The chars must fit in the data, the colors in the palette, and the
+     * line breaks can't be inside a span */
+    const uint64_t len = val >> 4;
+    if (len == 0 || len > (uint64_t)(reader->end - reader->p) ||
+        fg >= PALETTE_SZ || bg >= PALETTE_SZ ||
+        !span_width(reader->p, len, &span->width)) {
+        reader->error = true;
+        return false;
+    }
+
+#ifdef DISABLE_SYNTAX_HIGHLIGHT
+    /* No syntax highlight, same as png_print() */
+    fg = COL_DEFAULT;
+    bg = COL_BACK;
+#endif
+
+    span->chars = (const char*)reader->p;
+    span->len   = len;
+    span->fg    = fg;
+    span->bg    = bg;
+
+    reader->p += len;
+    return true;
+}
+
+uint64_t* tokens_line_offsets(const TokenStream* ts) {
+    const uint32_t num_lines = ts->header->num_lines;
+
+    uint64_t* ret = malloc((num_lines + 1) * sizeof(uint64_t));
+    if (!ret)
+        DIE("Can't allocate the offsets of %d lines\n", num_lines);
+
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+
+    uint32_t line = 0;
+    ret[0]        = 0;
+    TokenSpan span;
+    while (tokens_read(&reader, &span)) {
+        if (span.chars)
+            continue;
+
+        if (line >= num_lines)
+            break;
+        ret[++line] = reader.p - ts->data;
+    }
+
+    if (reader.error || line != num_lines) {
+        free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+bool tokens_lines_to_png(const TokenStream* ts, const uint64_t* offsets,
+                         uint32_t first_line, uint32_t end_line,
+                         Canvas* canvas) {
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+    reader.p   = ts->data + offsets[first_line];
+    reader.end = ts->data + offsets[end_line];
+
+    canvas->x = 0;
+    canvas->y = 0;
+
+    TokenSpan span;
+    while (tokens_read(&reader, &span)) {
+        if (!span.chars) {
+            canvas->y++;
+            canvas->x = 0;
+            continue;
+        }
+
+        if (canvas->y >= canvas->h || canvas->x + span.width > canvas->w)
+            return false;
+
+        draw_span(canvas, span.chars, span.len, canvas->palette[span.fg],
+                  canvas->palette[span.bg]);
+    }
+
+    return !reader.error && canvas->y == end_line - first_line;
+}
+
+bool tokens_to_png(const TokenStream* ts, Canvas* canvas) {
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+
+    canvas->x = 0;
+    canvas->y = 0;
+
+    TokenSpan span;
+    while (tokens_read(&reader, &span)) {
+        if (!span.chars) {
+            canvas->y++;
+            canvas->x = 0;
+            continue;
+        }
+
+        if (canvas->y >= canvas->h || canvas->x + span.width > canvas->w)
+            return false;
+
+        draw_span(canvas, span.chars, span.len, canvas->palette[span.fg],
+                  canvas->palette[span.bg]);
+    }
+
+    return !reader.error && canvas->y == ts->header->num_lines;
+}
+
+void tokens_close(TokenStream* ts) {
+    if (ts->map)
+        munmap(ts->map, ts->map_sz);
+    free(ts->buf);
+
+    ts->map    = NULL;
+    ts->buf    = NULL;
+    ts->header = NULL;
+    ts->data   = NULL;
+}
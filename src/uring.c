@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "include/uring.h"
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+/* The kernel reads the tail we publish and writes the head we read, and the
+ * other way around for completions, so the indexes need ordering */
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static void* map_ring(int fd, size_t size, off_t offset) {
+    void* ret = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ret == MAP_FAILED ? NULL : ret;
+}
+
+bool uring_init(Uring* ring, unsigned entries) {
+    memset(ring, 0, sizeof(Uring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings with a single call */
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_sz > ring->sq_ring_sz)
+        ring->sq_ring_sz = ring->cq_ring_sz;
+
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_sz, IORING_OFF_SQ_RING);
+    if (!ring->sq_ring) {
+        uring_free(ring);
+        return false;
+    }
+
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : map_ring(ring->fd, ring->cq_ring_sz,
+                                           IORING_OFF_CQ_RING);
+    ring->sqes    = map_ring(ring->fd, ring->sqes_sz, IORING_OFF_SQES);
+    if (!ring->cq_ring || !ring->sqes) {
+        uring_free(ring);
+        return false;
+    }
+
+    uint8_t* sq = ring->sq_ring;
+    uint8_t* cq = ring->cq_ring;
+
+    ring->sq_head    = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail    = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask    = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->sq_local_tail = *ring->sq_tail;
+    return true;
+}
+
+void uring_free(Uring* ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    const unsigned head = LOAD_ACQUIRE(ring->sq_head);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+
+    const unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+    ring->sq_local_tail++;
+
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+void uring_prep_rw(struct io_uring_sqe* sqe, int opcode, int fd,
+                   const void* addr, unsigned len, uint64_t off,
+                   uint64_t user_data) {
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)addr;
+    sqe->len       = len;
+    sqe->off       = off;
+    sqe->user_data = user_data;
+}
+
+bool uring_submit(Uring* ring, unsigned wait_nr) {
+    STORE_RELEASE(ring->sq_tail, ring->sq_local_tail);
+
+    for (;;) {
+        /* The kernel consumes the entries by moving the head, so this is
+         * still right after an interrupted call */
+        const unsigned to_submit =
+          ring->sq_local_tail - LOAD_ACQUIRE(ring->sq_head);
+        if (to_submit == 0 && wait_nr == 0)
+            return true;
+
+        const unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        if (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags,
+                    NULL, 0) >= 0)
+            return true;
+
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+    }
+}
+
+bool uring_peek(Uring* ring, struct io_uring_cqe* cqe) {
+    const unsigned head = *ring->cq_head;
+    if (head == LOAD_ACQUIRE(ring->cq_tail))
+        return false;
+
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    STORE_RELEASE(ring->cq_head, head + 1);
+    return true;
+}
+
+bool uring_wait(Uring* ring, struct io_uring_cqe* cqe) {
+    while (!uring_peek(ring, cqe))
+        if (!uring_submit(ring, 1))
+            return false;
+
+    return true;
+}
+
+#else /* No io_uring system calls */
+
+bool uring_init(Uring* ring, unsigned entries) {
+    (void)entries;
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = -1;
+    return false;
+}
+
+void uring_free(Uring* ring) {
+    (void)ring;
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    (void)ring;
+    return NULL;
+}
+
+void uring_prep_rw(struct io_uring_sqe* sqe, int opcode, int fd,
+                   const void* addr, unsigned len, uint64_t off,
+                   uint64_t user_data) {
+    (void)sqe, (void)opcode, (void)fd, (void)addr, (void)len, (void)off;
+    (void)user_data;
+}
+
+bool uring_submit(Uring* ring, unsigned wait_nr) {
+    (void)ring, (void)wait_nr;
+    return false;
+}
+
+bool uring_peek(Uring* ring, struct io_uring_cqe* cqe) {
+    (void)ring, (void)cqe;
+    return false;
+}
+
+bool uring_wait(Uring* ring, struct io_uring_cqe* cqe) {
+    (void)ring, (void)cqe;
+    return false;
+}
+
+#endif
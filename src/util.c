@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "include/util.h"
+
+/* Bytes checked by is_text_data() */
+#define TEXT_CHECK_SZ 8000
+
+char* read_file(const char* filename, size_t* size) {
+    FILE* fd = fopen(filename, "rb");
+    if (!fd)
+        return NULL;
+
+    size_t cap = 0x1000, len = 0;
+    char* data = malloc(cap);
+
+    size_t read;
+    while (data && (read = fread(data + len, 1, cap - len, fd)) > 0) {
+        len += read;
+        if (len < cap)
+            continue;
+
+        cap *= 2;
+        char* tmp = realloc(data, cap);
+        if (!tmp)
+            free(data);
+        data = tmp;
+    }
+
+    if (ferror(fd)) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fd);
+    *size = len;
+    return data;
+}
+
+bool mkdir_parents(const char* path) {
+    char* copy = strdup(path);
+    if (!copy)
+        return false;
+
+    /* Create every component except the last one, ignoring the root */
+    for (char* p = copy + 1; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+
+        *p = '\0';
+        if (mkdir(copy, 0755) != 0 && errno != EEXIST) {
+            free(copy);
+            return false;
+        }
+        *p = '/';
+    }
+
+    free(copy);
+    return true;
+}
+
+char* path_join(const char* dir, const char* file, const char* ext) {
+    const size_t dir_len  = strlen(dir);
+    const bool need_slash = dir_len > 0 && dir[dir_len - 1] != '/';
+
+    const size_t sz = dir_len + need_slash + strlen(file) + strlen(ext) + 1;
+    char* ret       = malloc(sz);
+    if (!ret)
+        return NULL;
+
+    snprintf(ret, sz, "%s%s%s%s", dir, need_slash ? "/" : "", file, ext);
+    return ret;
+}
+
+const char* strip_path_prefix(const char* path) {
+    for (;;) {
+        if (path[0] == '/')
+            path++;
+        else if (path[0] == '.' && path[1] == '/')
+            path += 2;
+        else if (path[0] == '.' && path[1] == '.' && path[2] == '/')
+            path += 3;
+        else
+            return path;
+    }
+}
+
+bool is_text_data(const char* data, size_t size) {
+    if (size > TEXT_CHECK_SZ)
+        size = TEXT_CHECK_SZ;
+
+    return memchr(data, '\0', size) == NULL;
+}
+
+bool parse_size(const char* str, size_t* size) {
+    char* end;
+    const unsigned long long num = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+
+    int shift = 0;
+    switch (*end) {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        case '\0':
+            break;
+        default:
+            return false;
+    }
+
+    if (shift != 0 && end[1] != '\0')
+        return false;
+
+    *size = (size_t)num << shift;
+    return true;
+}
+
+bool path_matches(const char* path, char* const* patterns, int num_patterns) {
+    if (num_patterns <= 0)
+        return true;
+
+    for (int i = 0; i < num_patterns; i++)
+        if (fnmatch(patterns[i], path, 0) == 0)
+            return true;
+
+    return false;
+}
+
+uint64_t time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,299 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/vector.h"
+#include "include/render.h"
+#include "include/tokens.h"
+
+/* Buffer of the output file, the text is written a few bytes at a time */
+#define OUTPUT_BUF_SZ (1 << 20)
+
+/* Size of the monospace font with chars FONT_W pixels wide, for fonts whose
+ * chars are 0.6 times their size, which is the usual case */
+#define FONT_SIZE_PX (FONT_W / 0.6)
+
+/*----------------------------------------------------------------------------*/
+
+static FILE* open_output(const char* filename) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp)
+        DIE("Can't open file: \"%s\"\n", filename);
+
+    setvbuf(fp, NULL, _IOFBF, OUTPUT_BUF_SZ);
+    return fp;
+}
+
+static void write_color(FILE* fp, Color c) {
+    fprintf(fp, "#%02x%02x%02x", c.r, c.g, c.b);
+}
+
+/* CSS classes of the palette, with `fg' and `bg' as the properties of the
+ * foreground and background colors */
+static void write_classes(FILE* fp, const Color* palette, const char* fg,
+                          const char* bg) {
+    for (int i = 0; i < PALETTE_SZ; i++) {
+        fprintf(fp, ".c%d{%s:", i, fg);
+        write_color(fp, palette[i]);
+        fprintf(fp, "}.b%d{%s:", i, bg);
+        write_color(fp, palette[i]);
+        fputs("}\n", fp);
+    }
+}
+
+/* Length of the valid UTF-8 sequence of a non-ASCII char at the start of `s',
+ * or zero if it's not valid. Overlong forms and surrogates are not valid. */
+static size_t utf8_seq_len(const uint8_t* s, size_t len) {
+    size_t seq_len;
+    uint8_t lo = 0x80, hi = 0xBF;
+
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        seq_len = 2;
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        seq_len = 3;
+        if (s[0] == 0xE0)
+            lo = 0xA0;
+        else if (s[0] == 0xED)
+            hi = 0x9F;
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        seq_len = 4;
+        if (s[0] == 0xF0)
+            lo = 0x90;
+        else if (s[0] == 0xF4)
+            hi = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (seq_len > len || s[1] < lo || s[1] > hi)
+        return 0;
+
+    for (size_t i = 2; i < seq_len; i++)
+        if (s[i] < 0x80 || s[i] > 0xBF)
+            return 0;
+
+    return seq_len;
+}
+
+/* Write the chars of a span escaped for XML and HTML, with the tabs expanded,
+ * see png_putchar(). The output is UTF-8, so valid UTF-8 chars are written as
+ * they are, and other bytes as the replacement char. */
+static void write_text(FILE* fp, const char* chars, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        const uint8_t c = chars[i];
+        if (c >= 0x80) {
+            const size_t seq_len =
+              utf8_seq_len((const uint8_t*)chars + i, len - i);
+            if (seq_len > 0) {
+                fwrite(chars + i, 1, seq_len, fp);
+                i += seq_len - 1;
+            } else {
+                fputs("&#xfffd;", fp);
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '\t':
+                for (int j = 0; j < TAB_SZ; j++)
+                    putc(' ', fp);
+                break;
+            case '&':
+                fputs("&amp;", fp);
+                break;
+            case '<':
+                fputs("&lt;", fp);
+                break;
+            case '>':
+                fputs("&gt;", fp);
+                break;
+            default:
+                /* Control chars are not valid in XML */
+                if (c < 0x20 || c == 0x7F)
+                    putc(' ', fp);
+                else
+                    putc(c, fp);
+                break;
+        }
+    }
+}
+
+/* Spans with only spaces are not written, the next span has its position */
+static bool is_blank(const TokenSpan* span) {
+    for (size_t i = 0; i < span->len; i++)
+        if (span->chars[i] != ' ' && span->chars[i] != '\t')
+            return false;
+
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool vector_write_svg(const TokenStream* ts, const Color* palette,
+                      const char* filename) {
+    Canvas canvas;
+    canvas_init(&canvas);
+    tokens_get_dimensions(ts, &canvas);
+
+    FILE* fp = open_output(filename);
+    fprintf(fp,
+            "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" "
+            "height=\"%u\" viewBox=\"0 0 %u %u\">\n"
+            "<style>\n"
+            "text{font-family:monospace;font-size:%.3fpx;"
+            "white-space:pre}\n",
+            canvas.w_px, canvas.h_px, canvas.w_px, canvas.h_px,
+            FONT_SIZE_PX);
+    write_classes(fp, palette, "fill", "fill");
+    fputs("</style>\n", fp);
+
+    /* Same as draw_border(), with the background inside */
+    fprintf(fp,
+            "<rect class=\"b%d\" width=\"%u\" height=\"%u\"/>\n"
+            "<rect class=\"b%d\" x=\"%d\" y=\"%d\" width=\"%u\" "
+            "height=\"%u\"/>\n",
+            COL_BORDER, canvas.w_px, canvas.h_px, COL_BACK, BORDER_SZ,
+            BORDER_SZ, canvas.w_px - 2 * BORDER_SZ,
+            canvas.h_px - 2 * BORDER_SZ);
+
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+
+    uint32_t x = 0, y = 0;
+    bool in_line = false;
+    TokenSpan span;
+    while (tokens_read(&reader, &span)) {
+        if (!span.chars) {
+            if (in_line)
+                fputs("</text>\n", fp);
+            in_line = false;
+            x       = 0;
+            y++;
+            continue;
+        }
+
+        if (y >= canvas.h || x + span.width > canvas.w) {
+            fclose(fp);
+            return false;
+        }
+
+        const uint32_t px = CHAR_X_TO_PX(x);
+        const uint32_t py = CHAR_Y_TO_PX(y);
+        if (span.bg != COL_BACK) {
+            if (in_line)
+                fputs("</text>\n", fp);
+            in_line = false;
+
+            fprintf(fp,
+                    "<rect class=\"b%d\" x=\"%u\" y=\"%u\" width=\"%u\" "
+                    "height=\"%d\"/>\n",
+                    span.bg, px, py, (uint32_t)span.width * FONT_W,
+                    FONT_H + LINE_SPACING);
+        }
+
+        if (!is_blank(&span)) {
+            if (!in_line)
+                fprintf(fp, "<text y=\"%u\">", py + FONT_BASELINE);
+            in_line = true;
+
+            /* The length keeps the span in its cells with any font */
+            fprintf(fp,
+                    "<tspan class=\"c%d\" x=\"%u\" textLength=\"%u\" "
+                    "lengthAdjust=\"spacingAndGlyphs\">",
+                    span.fg, px, (uint32_t)span.width * FONT_W);
+            write_text(fp, span.chars, span.len);
+            fputs("</tspan>", fp);
+        }
+
+        x += span.width;
+    }
+
+    if (in_line)
+        fputs("</text>\n", fp);
+    fputs("</svg>\n", fp);
+
+    const bool ret = !reader.error && y == ts->header->num_lines;
+    if (fclose(fp) != 0)
+        DIE("Error writing file: \"%s\"\n", filename);
+
+    return ret;
+}
+
+bool vector_write_html(const TokenStream* ts, const Color* palette,
+                       const char* filename) {
+    Canvas canvas;
+    canvas_init(&canvas);
+    tokens_get_dimensions(ts, &canvas);
+
+    /* The border is inside the margin, see draw_border() */
+    FILE* fp = open_output(filename);
+    fprintf(fp,
+            "<!DOCTYPE html>\n"
+            "<html>\n"
+            "<head>\n"
+            "<meta charset=\"utf-8\">\n"
+            "<style>\n"
+            "pre{box-sizing:border-box;width:%upx;min-height:%upx;margin:0;"
+            "padding:%dpx;border:%dpx solid ",
+            canvas.w_px, canvas.h_px, MARGIN - BORDER_SZ, BORDER_SZ);
+    write_color(fp, palette[COL_BORDER]);
+    fputs(";background:", fp);
+    write_color(fp, palette[COL_BACK]);
+    fputs(";color:", fp);
+    write_color(fp, palette[COL_DEFAULT]);
+    fprintf(fp, ";font:%.3fpx/%dpx monospace;white-space:pre}\n",
+            FONT_SIZE_PX, FONT_H + LINE_SPACING);
+    write_classes(fp, palette, "color", "background");
+    fputs("</style>\n"
+          "</head>\n"
+          "<body>\n"
+          "<pre>\n", /* HTML drops the first newline of a `pre' */
+          fp);
+
+    TokenReader reader;
+    tokens_reader_init(&reader, ts);
+
+    uint32_t x = 0, y = 0;
+    TokenSpan span;
+    while (tokens_read(&reader, &span)) {
+        if (!span.chars) {
+            putc('\n', fp);
+            x = 0;
+            y++;
+            continue;
+        }
+
+        if (y >= canvas.h || x + span.width > canvas.w) {
+            fclose(fp);
+            return false;
+        }
+
+        /* The default colors are the ones of the block */
+        const bool has_class =
+          span.bg != COL_BACK || (span.fg != COL_DEFAULT && !is_blank(&span));
+
+        if (span.bg != COL_BACK)
+            fprintf(fp, "<span class=\"c%d b%d\">", span.fg, span.bg);
+        else if (has_class)
+            fprintf(fp, "<span class=\"c%d\">", span.fg);
+
+        write_text(fp, span.chars, span.len);
+        if (has_class)
+            fputs("</span>", fp);
+
+        x += span.width;
+    }
+
+    fputs("</pre>\n"
+          "</body>\n"
+          "</html>\n",
+          fp);
+
+    const bool ret = !reader.error && y == ts->header->num_lines;
+    if (fclose(fp) != 0)
+        DIE("Error writing file: \"%s\"\n", filename);
+
+    return ret;
+}
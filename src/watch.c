@@ -0,0 +1,468 @@
+#define _DEFAULT_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "include/watch.h"
+#include "include/incremental.h"
+#include "include/batch.h"
+#include "include/util.h"
+
+/* Events of the watched directories. Files are rendered once they are closed
+ * after writing them, or moved into the directory. */
+#define WATCH_EVENTS \
+    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/*----------------------------------------------------------------------------*/
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+bool watch_init(Watch* watch, uint64_t config) {
+    memset(watch, 0, sizeof(Watch));
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0)
+        return false;
+
+    watch->config = config;
+    return true;
+}
+
+/* Index of the watched directory, adding it if needed. Returns -1 on error */
+static ssize_t add_dir(Watch* watch, const char* path, const char* rel) {
+    const int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS);
+    if (wd < 0)
+        return -1;
+
+    /* The same directory always has the same descriptor */
+    for (size_t i = 0; i < watch->num_dirs; i++)
+        if (watch->dirs[i].wd == wd)
+            return i;
+
+    if (watch->num_dirs >= watch->cap_dirs) {
+        watch->cap_dirs = watch->cap_dirs ? 2 * watch->cap_dirs : 16;
+        WatchDir* dirs =
+          realloc(watch->dirs, watch->cap_dirs * sizeof(WatchDir));
+        if (!dirs)
+            return -1;
+        watch->dirs = dirs;
+    }
+
+    WatchDir* dir = &watch->dirs[watch->num_dirs];
+    dir->wd       = wd;
+    dir->path     = strdup(path);
+    dir->rel      = rel ? strdup(rel) : NULL;
+    if (!dir->path || (rel && !dir->rel))
+        return -1;
+
+    return watch->num_dirs++;
+}
+
+static WatchTarget* add_target(Watch* watch, size_t dir, const char* path,
+                               const char* out) {
+    if (watch->num_targets >= watch->cap_targets) {
+        watch->cap_targets = watch->cap_targets ? 2 * watch->cap_targets : 16;
+        WatchTarget* targets =
+          realloc(watch->targets, watch->cap_targets * sizeof(WatchTarget));
+        if (!targets)
+            return NULL;
+        watch->targets = targets;
+    }
+
+    WatchTarget* target = &watch->targets[watch->num_targets];
+    memset(target, 0, sizeof(WatchTarget));
+    target->path = strdup(path);
+    target->out  = strdup(out);
+    target->dir  = dir;
+    if (!target->path || !target->out)
+        return NULL;
+
+    const char* slash = strrchr(target->path, '/');
+    target->name      = slash ? slash + 1 : target->path;
+
+    watch->num_targets++;
+    return target;
+}
+
+bool watch_add_file(Watch* watch, const char* path, const char* out) {
+    char* copy = strdup(path);
+    if (!copy)
+        return false;
+
+    /* Directory of the file, without changing `path' */
+    char* slash = strrchr(copy, '/');
+    if (slash == copy)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+
+    const ssize_t dir = add_dir(watch, slash ? copy : ".", NULL);
+    free(copy);
+
+    return dir >= 0 && add_target(watch, dir, path, out) != NULL;
+}
+
+/* Watch the directory of the tree and the ones inside it. If `mark' is set,
+ * the files inside them are new, and they are rendered with the next
+ * changes. */
+static bool add_tree_dir(Watch* watch, const char* path, const char* rel,
+                         bool mark) {
+    /* Images written to the output would be seen as changes */
+    char real[PATH_MAX];
+    if (watch->out_real && realpath(path, real) &&
+        strcmp(real, watch->out_real) == 0)
+        return true;
+
+    if (add_dir(watch, path, rel) < 0)
+        return false;
+
+    DIR* d = opendir(path);
+    if (!d)
+        return true;
+
+    bool ret = true;
+    struct dirent* ent;
+    while (ret && (ent = readdir(d)) != NULL) {
+        char* child     = path_join(path, ent->d_name, "");
+        char* child_rel = rel[0] ? path_join(rel, ent->d_name, "")
+                                 : strdup(ent->d_name);
+
+        struct stat st;
+        if (!child || !child_rel) {
+            ret = false;
+        } else if (lstat(child, &st) != 0) {
+            /* Removed while walking */
+        } else if (S_ISDIR(st.st_mode)) {
+            /* Symbolic links are not followed, like walk_tree() does */
+            if (walk_filter_accepts(watch->filter, ent->d_name, child_rel,
+                                    true))
+                ret = add_tree_dir(watch, child, child_rel, mark);
+        } else if (mark && S_ISREG(st.st_mode) &&
+                   walk_filter_accepts(watch->filter, ent->d_name, child_rel,
+                                       false)) {
+            char* out = path_join(watch->out_dir, child_rel, ".png");
+            const ssize_t dir = add_dir(watch, path, rel);
+            WatchTarget* target =
+              (out && dir >= 0) ? add_target(watch, dir, child, out) : NULL;
+            if (target)
+                target->event_ns = time_ns();
+            ret = target != NULL;
+            free(out);
+        }
+
+        free(child);
+        free(child_rel);
+    }
+
+    closedir(d);
+    return ret;
+}
+
+bool watch_add_tree(Watch* watch, const char* root, const char* out_dir,
+                    const WalkFilter* filter) {
+    watch->filter   = filter;
+    watch->out_dir  = out_dir;
+    watch->out_real = realpath(out_dir, NULL);
+
+    return add_tree_dir(watch, root, "", false);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static WatchTarget* find_target(Watch* watch, size_t dir, const char* name) {
+    for (size_t i = 0; i < watch->num_targets; i++)
+        if (watch->targets[i].dir == dir &&
+            strcmp(watch->targets[i].name, name) == 0)
+            return &watch->targets[i];
+
+    return NULL;
+}
+
+static ssize_t find_dir(const Watch* watch, int wd) {
+    for (size_t i = 0; i < watch->num_dirs; i++)
+        if (watch->dirs[i].wd == wd)
+            return i;
+
+    return -1;
+}
+
+/* Mark the target of the file as changed, adding it if it's a new file of
+ * the tree, or watch the new directory of the tree */
+static void handle_event(Watch* watch, const struct inotify_event* ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        /* Some events were lost, render everything */
+        for (size_t i = 0; i < watch->num_targets; i++)
+            if (watch->targets[i].event_ns == 0)
+                watch->targets[i].event_ns = time_ns();
+        return;
+    }
+
+    const ssize_t dir = find_dir(watch, ev->wd);
+    if (dir < 0 || ev->len == 0)
+        return;
+
+    /* The array of directories can move when adding new ones */
+    char* dir_path = watch->dirs[dir].path;
+    char* dir_rel  = watch->dirs[dir].rel;
+
+    if (ev->mask & IN_ISDIR) {
+        if (!dir_rel || !(ev->mask & (IN_CREATE | IN_MOVED_TO)))
+            return;
+
+        char* path = path_join(dir_path, ev->name, "");
+        char* rel  = dir_rel[0] ? path_join(dir_rel, ev->name, "")
+                                : strdup(ev->name);
+        if (path && rel && walk_filter_accepts(watch->filter, ev->name, rel,
+                                               true))
+            add_tree_dir(watch, path, rel, true);
+
+        free(path);
+        free(rel);
+        return;
+    }
+
+    /* Created files are rendered once they are written and closed */
+    if (!(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+        return;
+
+    WatchTarget* target = find_target(watch, dir, ev->name);
+    if (!target && dir_rel) {
+        char* rel  = dir_rel[0] ? path_join(dir_rel, ev->name, "")
+                                : strdup(ev->name);
+        char* path = path_join(dir_path, ev->name, "");
+        char* out  = rel ? path_join(watch->out_dir, rel, ".png") : NULL;
+
+        if (path && out &&
+            walk_filter_accepts(watch->filter, ev->name, rel, false))
+            target = add_target(watch, dir, path, out);
+
+        free(rel);
+        free(path);
+        free(out);
+    }
+
+    if (target && target->event_ns == 0)
+        target->event_ns = time_ns();
+}
+
+/* Read the pending events. Returns false if there were none */
+static bool read_events(Watch* watch) {
+    char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    bool ret = false;
+    for (;;) {
+        const ssize_t len = read(watch->fd, buf, sizeof(buf));
+        if (len <= 0)
+            return ret;
+
+        for (char* p = buf; p < buf + len;) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            handle_event(watch, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+
+        ret = true;
+    }
+}
+
+static void close_target(Watch* watch, WatchTarget* target) {
+    if (!target->inc)
+        return;
+
+    if (!inc_close(target->inc))
+        fprintf(stderr, "Error writing sidecar of \"%s\"\n", target->out);
+
+    free(target->inc);
+    target->inc = NULL;
+    watch->num_open--;
+}
+
+/* Open the incremental render of the target, closing the least recently used
+ * one if there are too many */
+static bool open_target(Watch* watch, WatchTarget* target) {
+    if (watch->num_open >= WATCH_MAX_OPEN) {
+        WatchTarget* lru = NULL;
+        for (size_t i = 0; i < watch->num_targets; i++)
+            if (watch->targets[i].inc &&
+                (!lru || watch->targets[i].last_used < lru->last_used))
+                lru = &watch->targets[i];
+        close_target(watch, lru);
+    }
+
+    char* sidecar = path_join("", target->out, INC_SIDECAR_EXT);
+    target->inc   = malloc(sizeof(IncRender));
+    if (!sidecar || !target->inc || !mkdir_parents(target->out) ||
+        !inc_open(target->inc, sidecar, watch->config)) {
+        free(sidecar);
+        free(target->inc);
+        target->inc = NULL;
+        return false;
+    }
+
+    free(sidecar);
+    watch->num_open++;
+    return true;
+}
+
+static void add_latency(Watch* watch, uint64_t ns) {
+    if (watch->num_latencies >= watch->cap_latencies) {
+        watch->cap_latencies =
+          watch->cap_latencies ? 2 * watch->cap_latencies : 64;
+        uint64_t* tmp = realloc(watch->latencies,
+                                watch->cap_latencies * sizeof(uint64_t));
+        if (!tmp)
+            return;
+        watch->latencies = tmp;
+    }
+
+    watch->latencies[watch->num_latencies++] = ns;
+}
+
+static void render_target(Watch* watch, WatchTarget* target) {
+    const uint64_t event_ns = target->event_ns;
+    target->event_ns        = 0;
+
+    /* Removed after writing it, or a binary file of the tree */
+    size_t src_sz;
+    char* src = read_file(target->path, &src_sz);
+    if (!src || !is_text_data(src, src_sz)) {
+        free(src);
+        return;
+    }
+
+    if (!target->inc && !open_target(watch, target)) {
+        fprintf(stderr, "Can't open sidecar of \"%s\"\n", target->out);
+        free(src);
+        return;
+    }
+    target->last_used = ++watch->use_seq;
+
+    IncStats stats;
+    IncEncodeStats encode_stats;
+    inc_update(target->inc, src, src_sz, &stats);
+
+    /* The output can be a hard link to a cached image, don't write to it */
+    unlink(target->out);
+    const bool written = inc_write_png(target->inc, target->out, &encode_stats);
+    const uint64_t latency = time_ns() - event_ns;
+    free(src);
+
+    if (!written) {
+        fprintf(stderr, "Can't write file: \"%s\"\n", target->out);
+        return;
+    }
+
+    /* The sidecar can be used by the next run */
+    inc_sync(target->inc);
+    add_latency(watch, latency);
+
+    printf("%s: %.1f ms from save to image, drew %d lines, compressed %d of "
+           "%d bands.\n",
+           target->path, latency / 1e6, stats.lines_drawn,
+           encode_stats.bands - encode_stats.reused, encode_stats.bands);
+    fflush(stdout);
+}
+
+void watch_run(Watch* watch) {
+    struct sigaction sa, old_int, old_term;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    struct pollfd pfd = { .fd = watch->fd, .events = POLLIN };
+
+    /* New files of the tree found when adding it are rendered right away */
+    bool pending = false;
+    for (size_t i = 0; i < watch->num_targets; i++)
+        pending |= watch->targets[i].event_ns != 0;
+
+    while (!stop_requested) {
+        if (!pending) {
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                break;
+            if (!read_events(watch))
+                continue;
+        }
+
+        /* Wait until the writes stop, for a while */
+        const uint64_t burst_ns = time_ns();
+        while (!stop_requested &&
+               time_ns() - burst_ns < WATCH_DEBOUNCE_MAX_MS * 1000000ull &&
+               poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0)
+            read_events(watch);
+
+        /* Rendering a target can add new ones, don't keep pointers */
+        for (size_t i = 0; i < watch->num_targets && !stop_requested; i++)
+            if (watch->targets[i].event_ns != 0)
+                render_target(watch, &watch->targets[i]);
+
+        pending = false;
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    const uint64_t ua = *(const uint64_t*)a, ub = *(const uint64_t*)b;
+    return (ua > ub) - (ua < ub);
+}
+
+void watch_print_stats(const Watch* watch, FILE* fp) {
+    const size_t num = watch->num_latencies;
+    if (num == 0) {
+        fprintf(fp, "No changes rendered.\n");
+        return;
+    }
+
+    uint64_t* sorted = malloc(num * sizeof(uint64_t));
+    if (!sorted)
+        return;
+    memcpy(sorted, watch->latencies, num * sizeof(uint64_t));
+    qsort(sorted, num, sizeof(uint64_t), cmp_u64);
+
+    fprintf(fp,
+            "Rendered %zu changes, from save to image: median %.1f ms, 90th "
+            "percentile %.1f ms, max %.1f ms.\n",
+            num, sorted[num / 2] / 1e6, sorted[num * 9 / 10] / 1e6,
+            sorted[num - 1] / 1e6);
+    free(sorted);
+}
+
+void watch_destroy(Watch* watch) {
+    for (size_t i = 0; i < watch->num_targets; i++) {
+        close_target(watch, &watch->targets[i]);
+        free(watch->targets[i].path);
+        free(watch->targets[i].out);
+    }
+
+    for (size_t i = 0; i < watch->num_dirs; i++) {
+        free(watch->dirs[i].path);
+        free(watch->dirs[i].rel);
+    }
+
+    close(watch->fd);
+    free(watch->targets);
+    free(watch->dirs);
+    free(watch->out_real);
+    free(watch->latencies);
+}